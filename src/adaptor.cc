@@ -1,7 +1,70 @@
 #include "adaptor.h"
 
-#include <memory>
 #include <string>
-#include <unordered_map>
 
-std::unordered_map<std::string, std::shared_ptr<BaseAdaptor>> g_adaptors;
+#include "buffer_pool.h"
+
+int BaseAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  // Adaptors that can't make conditional reads check the version beforehand. This leaves a
+  // small window where a concurrent overwrite goes unnoticed.
+  int ret = getattr(path, file_status);
+  if (ret < 0)
+    return ret;
+  if (!options.if_match.empty() && file_status.etag != options.if_match)
+    return -ESTALE;
+  return read(path, buff, size, offset);
+}
+
+int BaseAdaptor::open(
+    const std::string& path, const ReadOptions& /*options*/, FileStatus& file_status)
+{
+  return getattr(path, file_status);
+}
+
+int BaseAdaptor::read_buffers(
+    const std::string& path,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<BufferSlice>& slices)
+{
+  if (size == 0)
+    return 0;
+  std::shared_ptr<Buffer> buffer = g_buffer_pool.allocate(size);
+  int ret = read_with_options(path, buffer->data(), size, offset, options, file_status);
+  if (ret <= 0)
+    return ret;
+  buffer->resize(ret);
+  BufferSlice slice;
+  slice.buffer = std::move(buffer);
+  slice.size = ret;
+  slices.emplace_back(std::move(slice));
+  return ret;
+}
+
+int BaseAdaptor::set_pinned(const std::string& /*path*/, bool /*pinned*/)
+{
+  return -ENOTSUP;
+}
+
+bool BaseAdaptor::has_pinned()
+{
+  return false;
+}
+
+int BaseAdaptor::data_ranges(
+    const std::string& /*path*/,
+    const ReadOptions& /*options*/,
+    FileStatus& /*file_status*/,
+    std::vector<DataRange>& /*ranges*/)
+{
+  return -ENOTSUP;
+}
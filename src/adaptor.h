@@ -1,18 +1,34 @@
 #pragma once
 
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
 #include <functional>
 #include <memory>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
+#ifndef ESTALE
+#define ESTALE 116
+#endif
+
 struct FileStatus
 {
   bool is_directory = false;
   size_t file_size = 0;
   std::chrono::time_point<std::chrono::system_clock> last_modified_time;
+  // Opaque version identifier of the object. Empty if the service didn't provide one.
+  std::string etag;
+  // MD5 of the whole object, 16 raw bytes, if the service has one. Objects of the same size and
+  // MD5 are taken to hold the same data.
+  std::string content_md5;
+  // Version of the object the status is of, if the service keeps versions. That version reads the
+  // same however the object changes later.
+  std::string version_id;
+  // The attributes may change before the file is next looked at, like the size of a decompressed
+  // file that's only known once the file is opened, and so may the content of a file opened with
+  // this set, like statistics. Neither may be cached by the kernel.
+  bool is_volatile = false;
 };
 
 struct DirectoryEntry
@@ -21,6 +37,39 @@ struct DirectoryEntry
   FileStatus status;
 };
 
+struct ReadOptions
+{
+  // If not empty, the read fails with -ESTALE once the object no longer has this ETag, so that
+  // an open file never mixes data from two versions of an object.
+  std::string if_match;
+  // If not empty, reads this version of the object rather than the current one. It never changes,
+  // so |if_match| is left unchecked.
+  std::string version_id;
+  // Read around caches, without filling them, for data that won't be read again soon.
+  bool bypass_cache = false;
+  // The object is growing, like a log that's appended to. The read isn't pinned to a version and
+  // goes around caches, and what it finds out about the object updates cached attributes.
+  bool follow = false;
+};
+
+// Byte range of a file that holds data. Everything outside of the data ranges of a file reads as
+// zeros.
+struct DataRange
+{
+  uint64_t offset = 0;
+  uint64_t length = 0;
+};
+
+class Buffer;
+
+// Part of a buffer holding data that has been read.
+struct BufferSlice
+{
+  std::shared_ptr<const Buffer> buffer;
+  size_t offset = 0;
+  size_t size = 0;
+};
+
 class BaseAdaptor {
 public:
   virtual int getattr(const std::string& path, FileStatus& file_status) = 0;
@@ -31,7 +80,48 @@ public:
       std::string& continuation_token)
       = 0;
 
+  // Same as read(), but honors |options|. Properties of the object that was actually read are
+  // stored in |file_status|.
+  virtual int read_with_options(
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status);
+
+  // Attributes of the file at |path|, which is about to be opened for reading as |options| say.
+  // Adaptors that cache data may fetch the first block of the file along with its attributes, in
+  // one request instead of two, unless the file is read around caches. Same as getattr() unless
+  // overridden.
+  virtual int open(const std::string& path, const ReadOptions& options, FileStatus& file_status);
+
+  // Same as read_with_options(), but the data is appended to |slices| instead of being copied to
+  // a buffer of the caller. Adaptors that already hold the data in buffers, like caches, hand out
+  // references to them, so that it's never copied. The buffers must not be written to.
+  virtual int read_buffers(
+      const std::string& path,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<BufferSlice>& slices);
+
+  // Keeps the cached data of the file at |path| from being evicted, or lets it go again. Data read
+  // after the file is pinned is pinned as well. Fails with -ENOTSUP if nothing is cached.
+  virtual int set_pinned(const std::string& path, bool pinned);
+  // Whether any file is pinned, in which case the adaptor must be kept for as long as the mount
+  // lives.
+  virtual bool has_pinned();
+
+  // Stores the data ranges of the file at |path|, sorted and not touching each other, so that
+  // holes can be skipped. Fails with -ENOTSUP if the file isn't known to be sparse, in which case
+  // it's all data.
+  virtual int data_ranges(
+      const std::string& path,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<DataRange>& ranges);
+
   virtual ~BaseAdaptor() = default;
 };
-
-extern std::unordered_map<std::string, std::shared_ptr<BaseAdaptor>> g_adaptors;
@@ -0,0 +1,196 @@
+#include "adaptor_registry.h"
+
+#include <algorithm>
+#include <sstream>
+
+AdaptorRegistry g_adaptors;
+
+namespace {
+// How often idle containers are looked for.
+constexpr std::chrono::seconds k_eviction_period(30);
+
+int64_t to_ticks(std::chrono::steady_clock::duration d)
+{
+  return static_cast<int64_t>(d.count());
+}
+} // namespace
+
+bool AdaptorRegistry::add(const std::string& name, std::shared_ptr<BaseAdaptor> adaptor)
+{
+  return m_fixed.emplace(name, std::move(adaptor)).second;
+}
+
+void AdaptorRegistry::add_account(
+    ContainerLister lister, ContainerFactory factory, const AccountOptions& options)
+{
+  auto account = std::make_unique<Account>();
+  account->lister = std::move(lister);
+  account->factory = std::move(factory);
+  account->options = options;
+  m_accounts.emplace_back(std::move(account));
+}
+
+std::shared_ptr<BaseAdaptor> AdaptorRegistry::find(const std::string& name)
+{
+  auto fixed = m_fixed.find(name);
+  if (fixed != m_fixed.end())
+    return fixed->second;
+  if (m_accounts.empty())
+    return nullptr;
+
+  const int64_t now = to_ticks(std::chrono::steady_clock::now().time_since_epoch());
+  std::shared_ptr<BaseAdaptor> adaptor;
+  {
+    std::shared_lock<std::shared_mutex> guard(m_mutex);
+    auto ite = m_containers.find(name);
+    if (ite != m_containers.end())
+    {
+      ite->second->last_used.store(now, std::memory_order_relaxed);
+      adaptor = ite->second->adaptor;
+    }
+  }
+
+  for (size_t i = 0; !adaptor && i < m_accounts.size(); ++i)
+  {
+    Account& account = *m_accounts[i];
+    const std::string& prefix = account.options.prefix;
+    if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0)
+      continue;
+    const std::string container_name = name.substr(prefix.size());
+    std::shared_ptr<const std::vector<std::string>> names;
+    if (containers(account, names) < 0
+        || !std::binary_search(names->begin(), names->end(), container_name))
+      continue;
+
+    // Built outside the lock. If another thread got there first, its adaptor wins and this one
+    // is dropped unused.
+    auto new_adaptor = account.factory(container_name, name);
+    std::unique_lock<std::shared_mutex> guard(m_mutex);
+    auto& mount = m_containers[name];
+    if (!mount)
+    {
+      mount = std::make_unique<ContainerMount>();
+      mount->adaptor = std::move(new_adaptor);
+      mount->account = &account;
+      ++m_num_created;
+    }
+    mount->last_used.store(now, std::memory_order_relaxed);
+    adaptor = mount->adaptor;
+  }
+
+  evict_idle(now);
+  return adaptor;
+}
+
+int AdaptorRegistry::list(std::vector<DirectoryEntry>& directory_entries)
+{
+  for (const auto& i : m_fixed)
+  {
+    if (i.first.empty())
+      continue;
+    DirectoryEntry e;
+    e.name = i.first;
+    e.status.is_directory = true;
+    e.status.file_size = 0;
+    directory_entries.emplace_back(std::move(e));
+  }
+  for (const auto& account : m_accounts)
+  {
+    std::shared_ptr<const std::vector<std::string>> names;
+    // An account that can't be listed doesn't hide the others.
+    if (containers(*account, names) < 0)
+    {
+      ++m_num_list_failures;
+      continue;
+    }
+    for (const std::string& container_name : *names)
+    {
+      DirectoryEntry e;
+      e.name = account->options.prefix + container_name;
+      // Fixed mounts hide containers of the same name.
+      if (m_fixed.count(e.name) != 0)
+        continue;
+      e.status.is_directory = true;
+      e.status.file_size = 0;
+      directory_entries.emplace_back(std::move(e));
+    }
+  }
+  return 0;
+}
+
+std::string AdaptorRegistry::statistics_text()
+{
+  size_t num_mounted = 0;
+  {
+    std::shared_lock<std::shared_mutex> guard(m_mutex);
+    num_mounted = m_containers.size();
+  }
+  std::ostringstream out;
+  out << "fixed " << m_fixed.size() << "\n";
+  out << "accounts " << m_accounts.size() << "\n";
+  out << "containers_mounted " << num_mounted << "\n";
+  out << "containers_created " << m_num_created.load() << "\n";
+  out << "containers_evicted " << m_num_evicted.load() << "\n";
+  out << "account_list_failures " << m_num_list_failures.load() << "\n";
+  return out.str();
+}
+
+int AdaptorRegistry::containers(
+    Account& account, std::shared_ptr<const std::vector<std::string>>& names)
+{
+  std::lock_guard<std::mutex> guard(account.list_mutex);
+  auto now = std::chrono::steady_clock::now();
+  if (account.containers && now - account.listed_at < account.options.list_interval)
+  {
+    names = account.containers;
+    return 0;
+  }
+
+  auto new_names = std::make_shared<std::vector<std::string>>();
+  std::string continuation_token;
+  do
+  {
+    int ret = account.lister(*new_names, continuation_token);
+    if (ret < 0)
+      return ret;
+  } while (!continuation_token.empty());
+  std::sort(new_names->begin(), new_names->end());
+  account.containers = new_names;
+  account.listed_at = now;
+  names = std::move(new_names);
+  return 0;
+}
+
+void AdaptorRegistry::evict_idle(int64_t now)
+{
+  int64_t next_eviction = m_next_eviction.load(std::memory_order_relaxed);
+  if (now < next_eviction
+      || !m_next_eviction.compare_exchange_strong(
+          next_eviction, now + to_ticks(k_eviction_period)))
+    return;
+
+  std::vector<std::shared_ptr<BaseAdaptor>> evicted;
+  {
+    std::unique_lock<std::shared_mutex> guard(m_mutex);
+    for (auto ite = m_containers.begin(); ite != m_containers.end();)
+    {
+      ContainerMount& mount = *ite->second;
+      int64_t idle = now - mount.last_used.load(std::memory_order_relaxed);
+      // Open files and directories, prefetches and cache loader requests hold a reference of their
+      // own. Pinned files would be unpinned with the adaptor.
+      if (idle >= to_ticks(mount.account->options.idle_timeout) && mount.adaptor.use_count() == 1
+          && !mount.adaptor->has_pinned())
+      {
+        evicted.emplace_back(std::move(mount.adaptor));
+        ite = m_containers.erase(ite);
+      }
+      else
+      {
+        ++ite;
+      }
+    }
+  }
+  m_num_evicted += evicted.size();
+  // The adaptors are destroyed on return, outside the lock, since that waits for their
+  // background threads.
+}
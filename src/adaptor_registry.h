@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "adaptor.h"
+
+// Lists the containers of a storage account a page at a time, like BaseAdaptor::list.
+using ContainerLister
+    = std::function<int(std::vector<std::string>& names, std::string& continuation_token)>;
+// Builds the adaptor of one container of an account, to be mounted at |mount_at|.
+using ContainerFactory = std::function<std::shared_ptr<BaseAdaptor>(
+    const std::string& container_name, const std::string& mount_at)>;
+
+struct AccountOptions
+{
+  // Each container shows up as a directory named |prefix| followed by the container name.
+  std::string prefix;
+  // The list of containers is trusted for this long. Containers created since show up after
+  // that.
+  std::chrono::seconds list_interval{60};
+  // The adaptor of a container is dropped once it hasn't been used for this long, no open file,
+  // directory or cache loader request refers to it, and it has no pinned files.
+  std::chrono::seconds idle_timeout{600};
+};
+
+// Maps the directories at the root of the mount point to adaptors. Fixed mounts are added before
+// the file system is mounted. Mounted accounts contribute a directory per container, whose
+// adaptor is only built when it's first accessed, so mounting an account with many containers
+// costs nothing up front. All methods are safe to call from any thread once the file system is
+// mounted.
+class AdaptorRegistry {
+public:
+  // Must be called before the file system is mounted. Returns false if |name| is taken.
+  bool add(const std::string& name, std::shared_ptr<BaseAdaptor> adaptor);
+  // Must be called before the file system is mounted.
+  void add_account(ContainerLister lister, ContainerFactory factory, const AccountOptions& options);
+
+  // Null if nothing is mounted at |name|. Containers of accounts are listed, at most once per
+  // list interval, to tell them from names that don't exist.
+  std::shared_ptr<BaseAdaptor> find(const std::string& name);
+  // Appends the names of all mounts, with a directory entry for each. Accounts whose containers
+  // can't be listed are left out.
+  int list(std::vector<DirectoryEntry>& directory_entries);
+
+  std::string statistics_text();
+
+private:
+  struct Account
+  {
+    ContainerLister lister;
+    ContainerFactory factory;
+    AccountOptions options;
+
+    // Held while listing, so that each account is listed by one thread at a time.
+    std::mutex list_mutex;
+    // Sorted. Guarded by list_mutex.
+    std::shared_ptr<const std::vector<std::string>> containers;
+    std::chrono::steady_clock::time_point listed_at;
+  };
+
+  struct ContainerMount
+  {
+    std::shared_ptr<BaseAdaptor> adaptor;
+    const Account* account = nullptr;
+    // steady_clock ticks.
+    std::atomic<int64_t> last_used{0};
+  };
+
+  // Containers of |account|, listed again if the list is older than the list interval.
+  int containers(Account& account, std::shared_ptr<const std::vector<std::string>>& names);
+  // Drops adaptors of containers that have been idle for long enough. Cheap unless it's time to
+  // look.
+  void evict_idle(int64_t now);
+
+  // Only written before the file system is mounted, so they are read without locking.
+  std::unordered_map<std::string, std::shared_ptr<BaseAdaptor>> m_fixed;
+  std::vector<std::unique_ptr<Account>> m_accounts;
+
+  std::shared_mutex m_mutex;
+  std::unordered_map<std::string, std::unique_ptr<ContainerMount>> m_containers;
+  std::atomic<int64_t> m_next_eviction{0};
+  std::atomic<uint64_t> m_num_created{0};
+  std::atomic<uint64_t> m_num_evicted{0};
+  // Accounts left out of a listing of the mount point because their containers couldn't be
+  // listed.
+  std::atomic<uint64_t> m_num_list_failures{0};
+};
+
+extern AdaptorRegistry g_adaptors;
@@ -0,0 +1,447 @@
+#include "archive_adaptor.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+constexpr size_t k_max_cached_indexes = 1024;
+constexpr size_t k_max_cached_members = 64 * 1024;
+constexpr size_t k_max_cursors = 16;
+
+bool ends_with_ignoring_case(const std::string& s, const std::string& suffix)
+{
+  if (s.size() <= suffix.size())
+    return false;
+  return std::equal(suffix.begin(), suffix.end(), s.end() - suffix.size(), [](char a, char b) {
+    return std::tolower(static_cast<unsigned char>(a))
+        == std::tolower(static_cast<unsigned char>(b));
+  });
+}
+
+bool archive_format_of(const std::string& name, ArchiveFormat& format)
+{
+  if (ends_with_ignoring_case(name, ".zip"))
+  {
+    format = ArchiveFormat::zip;
+    return true;
+  }
+  if (ends_with_ignoring_case(name, ".tar"))
+  {
+    format = ArchiveFormat::tar;
+    return true;
+  }
+  return false;
+}
+
+std::string base_name(const std::string& path)
+{
+  auto i = path.rfind('/');
+  return i == std::string::npos ? path : path.substr(i + 1);
+}
+
+FileStatus member_status(const ArchiveMember& member, const FileStatus& archive_status)
+{
+  FileStatus file_status;
+  file_status.is_directory = member.is_directory;
+  file_status.file_size = member.size;
+  file_status.last_modified_time = member.last_modified_time;
+  // Members change whenever the archive does.
+  file_status.etag = archive_status.etag;
+  return file_status;
+}
+
+// Archives of the underlying adaptor show up as directories.
+void convert_archives(std::vector<DirectoryEntry>& directory_entries, size_t first)
+{
+  for (size_t i = first; i < directory_entries.size(); ++i)
+  {
+    ArchiveFormat format;
+    DirectoryEntry& e = directory_entries[i];
+    if (!e.status.is_directory && archive_format_of(e.name, format))
+    {
+      e.status.is_directory = true;
+      e.status.file_size = 0;
+      e.status.content_md5.clear();
+    }
+  }
+}
+} // namespace
+
+ArchiveAdaptor::ArchiveAdaptor(
+    std::string name, std::shared_ptr<BaseAdaptor> adaptor, const ArchiveOptions& options)
+    : m_name(std::move(name)), m_adaptor(std::move(adaptor)), m_options(options),
+      m_cursors(k_max_cursors)
+{
+}
+
+int ArchiveAdaptor::getattr(const std::string& path, FileStatus& file_status)
+{
+  std::string archive_path;
+  std::string member_path;
+  ArchiveFormat format;
+  if (!split_path(path, archive_path, member_path, format))
+    return m_adaptor->getattr(path, file_status);
+
+  Archive archive;
+  int ret = open_archive(archive_path, std::string(), archive);
+  if (ret < 0)
+    return ret;
+  if (ret == 1)
+    return m_adaptor->getattr(path, file_status);
+  if (member_path == ".")
+  {
+    file_status = archive.status;
+    file_status.is_directory = true;
+    file_status.file_size = 0;
+    file_status.content_md5.clear();
+    return 0;
+  }
+
+  ret = get_index(archive.path, format, archive.status, archive.index);
+  if (ret < 0)
+    return ret;
+  const ArchiveMember* member = archive.index->find(member_path);
+  if (!member)
+    return -ENOENT;
+  file_status = member_status(*member, archive.status);
+  return 0;
+}
+
+int ArchiveAdaptor::read(const std::string& path, char* buff, size_t size, size_t offset)
+{
+  FileStatus file_status;
+  return read_with_options(path, buff, size, offset, ReadOptions(), file_status);
+}
+
+int ArchiveAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  std::string archive_path;
+  std::string member_path;
+  ArchiveFormat format;
+  if (!split_path(path, archive_path, member_path, format))
+    return m_adaptor->read_with_options(path, buff, size, offset, options, file_status);
+
+  Archive archive;
+  int ret = open_archive(archive_path, options.if_match, archive);
+  if (ret < 0)
+    return ret;
+  if (ret == 1)
+    return m_adaptor->read_with_options(path, buff, size, offset, options, file_status);
+  if (member_path == ".")
+    return -EISDIR;
+
+  ret = get_index(archive.path, format, archive.status, archive.index);
+  if (ret < 0)
+    return ret;
+  const ArchiveMember* member = archive.index->find(member_path);
+  if (!member)
+    return -ENOENT;
+  if (member->is_directory)
+    return -EISDIR;
+  file_status = member_status(*member, archive.status);
+  return read_member(archive, *member, buff, size, offset);
+}
+
+int ArchiveAdaptor::read_buffers(
+    const std::string& path,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<BufferSlice>& slices)
+{
+  std::string archive_path;
+  std::string member_path;
+  ArchiveFormat format;
+  if (!split_path(path, archive_path, member_path, format))
+    return m_adaptor->read_buffers(path, size, offset, options, file_status, slices);
+  return BaseAdaptor::read_buffers(path, size, offset, options, file_status, slices);
+}
+
+int ArchiveAdaptor::set_pinned(const std::string& path, bool pinned)
+{
+  std::string archive_path;
+  std::string member_path;
+  ArchiveFormat format;
+  if (!split_path(path, archive_path, member_path, format))
+    return m_adaptor->set_pinned(path, pinned);
+  Archive archive;
+  int ret = open_archive(archive_path, std::string(), archive);
+  if (ret < 0)
+    return ret;
+  if (ret == 1)
+    return m_adaptor->set_pinned(path, pinned);
+  // Members are read from ranges of the archive, so the whole archive is kept.
+  return m_adaptor->set_pinned(archive_path, pinned);
+}
+
+bool ArchiveAdaptor::has_pinned()
+{
+  return m_adaptor->has_pinned();
+}
+
+int ArchiveAdaptor::data_ranges(
+    const std::string& path,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<DataRange>& ranges)
+{
+  std::string archive_path;
+  std::string member_path;
+  ArchiveFormat format;
+  // Members are never sparse, even if the archive is.
+  if (split_path(path, archive_path, member_path, format))
+    return -ENOTSUP;
+  return m_adaptor->data_ranges(path, options, file_status, ranges);
+}
+
+int ArchiveAdaptor::list(
+    const std::string& path,
+    std::vector<DirectoryEntry>& directory_entries,
+    std::string& continuation_token)
+{
+  std::string archive_path;
+  std::string member_path;
+  ArchiveFormat format;
+  int ret = 0;
+  if (split_path(path, archive_path, member_path, format))
+  {
+    Archive archive;
+    ret = open_archive(archive_path, std::string(), archive);
+    if (ret < 0)
+      return ret;
+    if (ret == 0)
+    {
+      ret = get_index(archive.path, format, archive.status, archive.index);
+      if (ret < 0)
+        return ret;
+      if (member_path != ".")
+      {
+        const ArchiveMember* member = archive.index->find(member_path);
+        if (!member)
+          return -ENOENT;
+        if (!member->is_directory)
+          return -ENOTDIR;
+      }
+      for (size_t i : archive.index->children(member_path))
+      {
+        const ArchiveMember& member = archive.index->members()[i];
+        DirectoryEntry e;
+        e.name = base_name(member.path);
+        e.status = member_status(member, archive.status);
+        directory_entries.emplace_back(std::move(e));
+      }
+      continuation_token.clear();
+      return 0;
+    }
+  }
+
+  size_t first = directory_entries.size();
+  ret = m_adaptor->list(path, directory_entries, continuation_token);
+  if (ret < 0)
+    return ret;
+  convert_archives(directory_entries, first);
+  return 0;
+}
+
+bool ArchiveAdaptor::split_path(
+    const std::string& path,
+    std::string& archive_path,
+    std::string& member_path,
+    ArchiveFormat& format)
+{
+  size_t pos = 0;
+  while (pos < path.size())
+  {
+    size_t slash = path.find('/', pos);
+    size_t end = slash == std::string::npos ? path.size() : slash;
+    if (archive_format_of(path.substr(pos, end - pos), format))
+    {
+      archive_path = path.substr(0, end);
+      member_path = slash == std::string::npos ? "." : path.substr(slash + 1);
+      return true;
+    }
+    if (slash == std::string::npos)
+      break;
+    pos = slash + 1;
+  }
+  return false;
+}
+
+int ArchiveAdaptor::open_archive(
+    const std::string& archive_path, const std::string& if_match, Archive& archive)
+{
+  int ret = m_adaptor->getattr(archive_path, archive.status);
+  // The size of a decompressed archive is only known once it's opened.
+  if (ret == 0 && archive.status.is_volatile)
+    ret = m_adaptor->open(archive_path, ReadOptions(), archive.status);
+  if (ret < 0)
+    return ret;
+  if (archive.status.is_directory)
+    return 1;
+  if (!if_match.empty() && archive.status.etag != if_match)
+    return -ESTALE;
+  archive.path = archive_path;
+  return 0;
+}
+
+int ArchiveAdaptor::get_index(
+    const std::string& archive_path,
+    ArchiveFormat format,
+    const FileStatus& archive_status,
+    std::shared_ptr<const ArchiveIndex>& index)
+{
+  const std::string key = index_key(archive_path, archive_status.etag);
+  {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    while (true)
+    {
+      auto ite = m_indexes.find(key);
+      if (ite != m_indexes.end())
+      {
+        index = ite->second;
+        return 0;
+      }
+      if (m_building.count(key) == 0)
+        break;
+      m_cv.wait(guard);
+    }
+    m_building.emplace(key);
+  }
+
+  auto new_index = std::make_shared<ArchiveIndex>();
+  std::string filename;
+  if (!m_options.index_directory.empty() && !archive_status.etag.empty())
+    filename = m_options.index_directory + "/" + index_filename(key);
+  int ret = 0;
+  try
+  {
+    if (filename.empty() || !new_index->load(filename, key) || new_index->format() != format)
+    {
+      ret = new_index->build(
+          format, archive_reader(archive_path, archive_status.etag), archive_status.file_size);
+      if (ret == 0 && !filename.empty())
+        new_index->save(filename, key);
+    }
+  }
+  catch (...)
+  {
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_building.erase(key);
+    }
+    m_cv.notify_all();
+    throw;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_building.erase(key);
+    if (ret == 0)
+    {
+      m_indexes.emplace(key, new_index);
+      m_index_order.emplace_back(key);
+      while (m_index_order.size() > k_max_cached_indexes)
+      {
+        m_indexes.erase(m_index_order.front());
+        m_index_order.pop_front();
+      }
+    }
+  }
+  m_cv.notify_all();
+  if (ret < 0)
+    return ret;
+  index = std::move(new_index);
+  return 0;
+}
+
+int ArchiveAdaptor::read_member(
+    const Archive& archive, const ArchiveMember& member, char* buff, size_t size, size_t offset)
+{
+  if (offset >= member.size)
+    return 0;
+  size = static_cast<size_t>(std::min<uint64_t>(size, member.size - offset));
+  RangeReader reader = archive_reader(archive.path, archive.status.etag);
+  if (archive.index->format() == ArchiveFormat::tar)
+    return reader(buff, size, member.offset + offset);
+
+  if (member.method != 0 && member.method != 8)
+    return -ENOTSUP;
+  const std::string key = index_key(archive.path, archive.status.etag) + '\n' + member.path;
+  uint64_t data_offset = 0;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_data_offsets.find(key);
+    if (ite != m_data_offsets.end())
+      data_offset = ite->second;
+  }
+  if (data_offset == 0)
+  {
+    char header[k_zip_local_header_size];
+    int ret = reader(header, sizeof(header), member.offset);
+    if (ret < 0)
+      return ret;
+    if (ret != static_cast<int>(sizeof(header)))
+      return -EIO;
+    data_offset = zip_data_offset(member, header);
+    if (data_offset == 0)
+      return -EIO;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_data_offsets.size() >= k_max_cached_members)
+      m_data_offsets.clear();
+    m_data_offsets.emplace(key, data_offset);
+  }
+
+  if (member.method == 0)
+    return reader(buff, size, data_offset + offset);
+
+  std::shared_ptr<const SeekIndex> stream;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_member_streams.find(key);
+    if (ite != m_member_streams.end())
+    {
+      stream = ite->second;
+    }
+    else
+    {
+      auto new_stream = std::make_shared<SeekIndex>();
+      new_stream->format = CompressionFormat::deflate;
+      new_stream->compressed_begin = data_offset;
+      new_stream->compressed_end = data_offset + member.compressed_size;
+      new_stream->uncompressed_size = member.size;
+      new_stream->points.emplace_back();
+      new_stream->points.back().compressed_offset = data_offset;
+      if (m_member_streams.size() >= k_max_cached_members)
+        m_member_streams.clear();
+      m_member_streams.emplace(key, new_stream);
+      stream = std::move(new_stream);
+    }
+  }
+  return m_cursors.read(key, stream, reader, buff, size, offset);
+}
+
+std::string ArchiveAdaptor::index_key(
+    const std::string& archive_path, const std::string& etag) const
+{
+  return m_name + '\n' + archive_path + '\n' + etag;
+}
+
+RangeReader ArchiveAdaptor::archive_reader(
+    const std::string& archive_path, const std::string& etag)
+{
+  auto adaptor = m_adaptor;
+  return [adaptor, archive_path, etag](char* buff, size_t size, uint64_t offset) {
+    ReadOptions options;
+    options.if_match = etag;
+    FileStatus file_status;
+    return adaptor->read_with_options(
+        archive_path, buff, size, static_cast<size_t>(offset), options, file_status);
+  };
+}
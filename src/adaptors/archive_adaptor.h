@@ -0,0 +1,105 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../adaptor.h"
+#include "../archive_index.h"
+#include "../seek_index.h"
+
+struct ArchiveOptions
+{
+  // Archive indexes are saved in this directory, so that they survive restarts. Empty means
+  // they're only kept in memory.
+  std::string index_directory;
+};
+
+// Shows every "name.zip" and "name.tar" file of another adaptor as a directory of its members.
+// Only the zip central directory or the tar headers are read to list an archive, and reading a
+// member only reads the range of the archive it's stored in. Zip members must be stored or
+// deflated.
+class ArchiveAdaptor : public BaseAdaptor {
+public:
+  ArchiveAdaptor(
+      std::string name, std::shared_ptr<BaseAdaptor> adaptor, const ArchiveOptions& options);
+  ~ArchiveAdaptor() override = default;
+
+  int getattr(const std::string& path, FileStatus& file_status) override;
+  int read(const std::string& path, char* buff, size_t size, size_t offset) override;
+  int read_with_options(
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status) override;
+  int list(
+      const std::string& path,
+      std::vector<DirectoryEntry>& directory_entries,
+      std::string& continuation_token) override;
+  int read_buffers(
+      const std::string& path,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<BufferSlice>& slices) override;
+  int set_pinned(const std::string& path, bool pinned) override;
+  bool has_pinned() override;
+  int data_ranges(
+      const std::string& path,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<DataRange>& ranges) override;
+
+private:
+  struct Archive
+  {
+    std::string path;
+    FileStatus status;
+    std::shared_ptr<const ArchiveIndex> index;
+  };
+
+  // Splits |path| at its first component that looks like an archive. |member_path| is "." if
+  // |path| is the archive itself. Returns false if |path| isn't at or in an archive.
+  static bool split_path(
+      const std::string& path,
+      std::string& archive_path,
+      std::string& member_path,
+      ArchiveFormat& format);
+  // Returns 1 if |archive_path| turns out to be a real directory rather than an archive.
+  int open_archive(const std::string& archive_path, const std::string& if_match, Archive& archive);
+  int get_index(
+      const std::string& archive_path,
+      ArchiveFormat format,
+      const FileStatus& archive_status,
+      std::shared_ptr<const ArchiveIndex>& index);
+  int read_member(
+      const Archive& archive, const ArchiveMember& member, char* buff, size_t size, size_t offset);
+  std::string index_key(const std::string& archive_path, const std::string& etag) const;
+  RangeReader archive_reader(const std::string& archive_path, const std::string& etag);
+
+  const std::string m_name;
+  std::shared_ptr<BaseAdaptor> m_adaptor;
+  const ArchiveOptions m_options;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::unordered_map<std::string, std::shared_ptr<const ArchiveIndex>> m_indexes;
+  // Keys of m_indexes, oldest first.
+  std::deque<std::string> m_index_order;
+  // Keys of indexes being built, so that each is built only once.
+  std::unordered_set<std::string> m_building;
+  // Data offsets of zip members, by member key. They're only known after reading the local file
+  // header.
+  std::unordered_map<std::string, uint64_t> m_data_offsets;
+  // Seek indexes of deflated zip members. They have a single seek point at the beginning.
+  std::unordered_map<std::string, std::shared_ptr<const SeekIndex>> m_member_streams;
+  DecompressorCache m_cursors;
+};
@@ -1,10 +1,23 @@
 #include "azure_storage_blob_adaptor.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include "../crc64.h"
 #include "application_id.h"
 
 using namespace Azure::Storage::Blobs;
 
 namespace {
+// The service only returns transactional hashes for ranges up to this size.
+constexpr size_t k_max_verified_range_size = 4 * 1024 * 1024;
+// Bounds of the page blob caches. They're cleared when they get bigger than this.
+constexpr size_t k_max_page_blobs = 100000;
+constexpr size_t k_max_page_maps = 1024;
+// Holes between data ranges of page blobs that are smaller than this are read along with the data,
+// as zeros, rather than costing a request per range.
+constexpr uint64_t k_min_skipped_hole = 64 * 1024;
+
 int translate_exception(const Azure::Storage::StorageException& e)
 {
   if (e.StatusCode == Azure::Core::Http::HttpStatusCode::Forbidden)
@@ -16,15 +29,26 @@ int translate_exception(const Azure::Storage::StorageException& e)
     return -ETXTBSY;
   return 0;
 }
+
+// MD5 of the whole object, if it has one.
+std::string content_md5(const Azure::Storage::ContentHash& content_hash)
+{
+  if (content_hash.Algorithm != Azure::Storage::HashAlgorithm::Md5
+      || content_hash.Value.size() != 16)
+    return std::string();
+  return std::string(content_hash.Value.begin(), content_hash.Value.end());
+}
 } // namespace
 
 AzureStorageBlobAdaptor::AzureStorageBlobAdaptor(
     const std::string& account,
     const std::string& filesystem,
-    const std::string& account_key)
+    const std::string& account_key,
+    bool verify_integrity)
     : m_key_credential(
         std::make_shared<Azure::Storage::StorageSharedKeyCredential>(account, account_key)),
-      m_blob_container_url("https://" + account + ".blob.core.windows.net/" + filesystem)
+      m_blob_container_url("https://" + account + ".blob.core.windows.net/" + filesystem),
+      m_verify_integrity(verify_integrity)
 {
 }
 
@@ -43,6 +67,7 @@ int AzureStorageBlobAdaptor::getattr(const std::string& path, FileStatus& file_s
       file_status.file_size = 0;
       file_status.last_modified_time
           = std::chrono::system_clock::time_point(properties.LastModified);
+      file_status.etag = properties.ETag.ToString();
     }
     catch (Azure::Storage::StorageException& e)
     {
@@ -86,6 +111,11 @@ int AzureStorageBlobAdaptor::getattr(const std::string& path, FileStatus& file_s
     file_status.is_directory = false;
     file_status.file_size = properties.BlobSize;
     file_status.last_modified_time = std::chrono::system_clock::time_point(properties.LastModified);
+    file_status.etag = properties.ETag.ToString();
+    file_status.content_md5 = content_md5(properties.HttpHeaders.ContentHash);
+    if (properties.VersionId.HasValue())
+      file_status.version_id = properties.VersionId.Value();
+    remember_blob_type(path, properties.BlobType);
   }
   catch (Azure::Storage::StorageException& e)
   {
@@ -98,15 +128,48 @@ int AzureStorageBlobAdaptor::getattr(const std::string& path, FileStatus& file_s
 }
 
 int AzureStorageBlobAdaptor::read(const std::string& path, char* buff, size_t size, size_t offset)
+{
+  FileStatus file_status;
+  return read_with_options(path, buff, size, offset, ReadOptions(), file_status);
+}
+
+int AzureStorageBlobAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
 {
   BlobClientOptions clientOptions;
   clientOptions.Telemetry.ApplicationId = g_application_id;
   auto blob_client = BlobClient(m_blob_container_url + "/" + path, m_key_credential, clientOptions);
+  if (!options.version_id.empty())
+    blob_client = blob_client.WithVersionId(options.version_id);
+  // Without a version to pin to, the page ranges could belong to another version than the data.
+  if ((!options.if_match.empty() || !options.version_id.empty()) && is_page_blob(path))
+    return read_sparse(blob_client, path, buff, size, offset, options, file_status);
+  return read_range(blob_client, path, buff, size, offset, options, file_status);
+}
+
+int AzureStorageBlobAdaptor::read_range(
+    BlobClient& blob_client,
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  if (m_verify_integrity)
+    return read_verified(blob_client, path, buff, size, offset, options, file_status);
   DownloadBlobToOptions download_options;
   download_options.Range = Azure::Core::Http::HttpRange();
   download_options.Range.Value().Offset = offset;
   download_options.Range.Value().Length = size;
   download_options.TransferOptions.InitialChunkSize = 1 * 1024 * 1024;
+  if (!options.if_match.empty() && options.version_id.empty())
+    download_options.AccessConditions.IfMatch = Azure::ETag(options.if_match);
   try
   {
     auto downloadResult
@@ -116,6 +179,16 @@ int AzureStorageBlobAdaptor::read(const std::string& path, char* buff, size_t si
     {
       std::abort();
     }
+    file_status.is_directory = false;
+    file_status.file_size = downloadResult.BlobSize;
+    file_status.last_modified_time
+        = std::chrono::system_clock::time_point(downloadResult.Details.LastModified);
+    file_status.etag = downloadResult.Details.ETag.ToString();
+    file_status.content_md5 = content_md5(downloadResult.Details.HttpHeaders.ContentHash);
+    if (downloadResult.Details.VersionId.HasValue())
+      file_status.version_id = downloadResult.Details.VersionId.Value();
+    if (options.if_match.empty() && options.version_id.empty())
+      remember_blob_type(path, downloadResult.BlobType);
     return static_cast<int>(bytes_read);
   }
   catch (Azure::Storage::StorageException& e)
@@ -125,6 +198,11 @@ int AzureStorageBlobAdaptor::read(const std::string& path, char* buff, size_t si
       // offset >= file size
       return 0;
     }
+    if (e.StatusCode == Azure::Core::Http::HttpStatusCode::PreconditionFailed)
+    {
+      // The blob was overwritten since |options.if_match| was taken.
+      return -ESTALE;
+    }
     int ret = translate_exception(e);
     if (ret != 0)
       return ret;
@@ -132,6 +210,254 @@ int AzureStorageBlobAdaptor::read(const std::string& path, char* buff, size_t si
   }
 }
 
+int AzureStorageBlobAdaptor::read_sparse(
+    BlobClient& blob_client,
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  std::shared_ptr<const PageMap> page_map;
+  int ret = get_page_map(blob_client, path, options, page_map);
+  if (ret < 0)
+    return ret;
+  file_status = page_map->status;
+  if (offset >= file_status.file_size)
+    return 0;
+  size = std::min(size, file_status.file_size - offset);
+  if (size > static_cast<size_t>(std::numeric_limits<int>::max()))
+    std::abort();
+
+  std::memset(buff, 0, size);
+  const uint64_t end = offset + size;
+  const auto& ranges = page_map->ranges;
+  auto ite = std::upper_bound(
+      ranges.begin(), ranges.end(), static_cast<uint64_t>(offset),
+      [](uint64_t position, const DataRange& r) { return position < r.offset + r.length; });
+  while (ite != ranges.end() && ite->offset < end)
+  {
+    uint64_t from = std::max<uint64_t>(ite->offset, offset);
+    uint64_t to = std::min(ite->offset + ite->length, end);
+    for (++ite; ite != ranges.end() && ite->offset < end && ite->offset - to < k_min_skipped_hole;
+         ++ite)
+      to = std::min(ite->offset + ite->length, end);
+    FileStatus range_status;
+    ret = read_range(
+        blob_client, path, buff + (from - offset), static_cast<size_t>(to - from),
+        static_cast<size_t>(from), options, range_status);
+    if (ret < 0)
+      return ret;
+    // Pages are always within the blob, and the version is pinned, so they can't come up short.
+    if (static_cast<uint64_t>(ret) != to - from)
+      return -EIO;
+  }
+  return static_cast<int>(size);
+}
+
+int AzureStorageBlobAdaptor::get_page_map(
+    BlobClient& blob_client,
+    const std::string& path,
+    const ReadOptions& options,
+    std::shared_ptr<const PageMap>& page_map)
+{
+  const std::string if_match = options.version_id.empty() ? options.if_match : std::string();
+  if (!if_match.empty() || !options.version_id.empty())
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_page_maps.find(path);
+    if (ite != m_page_maps.end()
+        && (options.version_id.empty() ? ite->second->status.etag == if_match
+                                       : ite->second->status.version_id == options.version_id))
+    {
+      page_map = ite->second;
+      return 0;
+    }
+  }
+
+  auto new_page_map = std::make_shared<PageMap>();
+  GetPageRangesOptions page_ranges_options;
+  if (!if_match.empty())
+    page_ranges_options.AccessConditions.IfMatch = Azure::ETag(if_match);
+  auto page_blob_client = blob_client.AsPageBlobClient();
+  try
+  {
+    std::string continuation_token;
+    do
+    {
+      if (!continuation_token.empty())
+        page_ranges_options.ContinuationToken = continuation_token;
+      auto page = page_blob_client.GetPageRanges(page_ranges_options);
+      // Later pages must come from the same version as the first.
+      page_ranges_options.AccessConditions.IfMatch = page.ETag;
+      new_page_map->status.is_directory = false;
+      new_page_map->status.file_size = page.BlobSize;
+      new_page_map->status.last_modified_time
+          = std::chrono::system_clock::time_point(page.LastModified);
+      new_page_map->status.etag = page.ETag.ToString();
+      new_page_map->status.version_id = options.version_id;
+      auto& ranges = new_page_map->ranges;
+      for (const auto& r : page.PageRanges)
+      {
+        uint64_t range_offset = static_cast<uint64_t>(r.Offset);
+        uint64_t range_length = static_cast<uint64_t>(r.Length.Value());
+        if (!ranges.empty() && ranges.back().offset + ranges.back().length == range_offset)
+        {
+          ranges.back().length += range_length;
+          continue;
+        }
+        DataRange range;
+        range.offset = range_offset;
+        range.length = range_length;
+        ranges.emplace_back(range);
+      }
+      continuation_token
+          = page.NextPageToken.HasValue() ? page.NextPageToken.Value() : std::string();
+    } while (!continuation_token.empty());
+  }
+  catch (Azure::Storage::StorageException& e)
+  {
+    if (e.StatusCode == Azure::Core::Http::HttpStatusCode::PreconditionFailed)
+      return -ESTALE;
+    int ret = translate_exception(e);
+    if (ret != 0)
+      return ret;
+    throw;
+  }
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_page_maps.size() >= k_max_page_maps)
+    m_page_maps.clear();
+  m_page_maps[path] = new_page_map;
+  page_map = std::move(new_page_map);
+  return 0;
+}
+
+void AzureStorageBlobAdaptor::remember_blob_type(
+    const std::string& path, const Models::BlobType& blob_type)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (blob_type != Models::BlobType::PageBlob)
+  {
+    if (m_page_blobs.erase(path) != 0)
+      m_page_maps.erase(path);
+    return;
+  }
+  if (m_page_blobs.size() >= k_max_page_blobs)
+    m_page_blobs.clear();
+  m_page_blobs.insert(path);
+}
+
+bool AzureStorageBlobAdaptor::is_page_blob(const std::string& path)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  return m_page_blobs.count(path) != 0;
+}
+
+int AzureStorageBlobAdaptor::data_ranges(
+    const std::string& path,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<DataRange>& ranges)
+{
+  if (!is_page_blob(path))
+    return -ENOTSUP;
+  BlobClientOptions clientOptions;
+  clientOptions.Telemetry.ApplicationId = g_application_id;
+  auto blob_client = BlobClient(m_blob_container_url + "/" + path, m_key_credential, clientOptions);
+  if (!options.version_id.empty())
+    blob_client = blob_client.WithVersionId(options.version_id);
+  std::shared_ptr<const PageMap> page_map;
+  int ret = get_page_map(blob_client, path, options, page_map);
+  if (ret < 0)
+    return ret;
+  file_status = page_map->status;
+  ranges = page_map->ranges;
+  return 0;
+}
+
+int AzureStorageBlobAdaptor::read_verified(
+    BlobClient& blob_client,
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  size_t bytes_read = 0;
+  int attempts = 0;
+  while (bytes_read < size)
+  {
+    size_t length = std::min(size - bytes_read, k_max_verified_range_size);
+    DownloadBlobOptions download_options;
+    download_options.Range = Azure::Core::Http::HttpRange();
+    download_options.Range.Value().Offset = offset + bytes_read;
+    download_options.Range.Value().Length = length;
+    download_options.RangeHashAlgorithm = Azure::Storage::HashAlgorithm::Crc64;
+    // Later ranges must come from the same version as the first.
+    std::string etag = bytes_read == 0 ? options.if_match : file_status.etag;
+    if (!etag.empty() && options.version_id.empty())
+      download_options.AccessConditions.IfMatch = Azure::ETag(etag);
+    try
+    {
+      auto downloadResult = blob_client.Download(download_options).Value;
+      size_t n = static_cast<size_t>(downloadResult.ContentRange.Length.Value());
+      if (n > length)
+        return -EIO;
+      uint8_t* data = reinterpret_cast<uint8_t*>(buff + bytes_read);
+      bool valid = downloadResult.BodyStream->ReadToCount(data, n) == n
+          && downloadResult.TransactionalContentHash.HasValue()
+          && downloadResult.TransactionalContentHash.Value().Algorithm
+              == Azure::Storage::HashAlgorithm::Crc64
+          && downloadResult.TransactionalContentHash.Value().Value
+              == crc64_bytes(crc64(0, data, n));
+      if (!valid)
+      {
+        // Corruption in transit is worth one more try.
+        if (++attempts == 2)
+          return -EIO;
+        continue;
+      }
+      attempts = 0;
+      file_status.is_directory = false;
+      file_status.file_size = downloadResult.BlobSize;
+      file_status.last_modified_time
+          = std::chrono::system_clock::time_point(downloadResult.Details.LastModified);
+      file_status.etag = downloadResult.Details.ETag.ToString();
+      file_status.content_md5 = content_md5(downloadResult.Details.HttpHeaders.ContentHash);
+      if (downloadResult.Details.VersionId.HasValue())
+        file_status.version_id = downloadResult.Details.VersionId.Value();
+      if (bytes_read == 0 && options.if_match.empty() && options.version_id.empty())
+        remember_blob_type(path, downloadResult.BlobType);
+      bytes_read += n;
+      if (n < length || offset + bytes_read >= file_status.file_size)
+        break;
+    }
+    catch (Azure::Storage::StorageException& e)
+    {
+      if (e.StatusCode == Azure::Core::Http::HttpStatusCode::RangeNotSatisfiable)
+      {
+        // offset >= file size
+        break;
+      }
+      if (e.StatusCode == Azure::Core::Http::HttpStatusCode::PreconditionFailed)
+      {
+        // The blob was overwritten since |options.if_match| was taken.
+        return -ESTALE;
+      }
+      int ret = translate_exception(e);
+      if (ret != 0)
+        return ret;
+      throw;
+    }
+  }
+  if (bytes_read > static_cast<size_t>(std::numeric_limits<int>::max()))
+    std::abort();
+  return static_cast<int>(bytes_read);
+}
+
 int AzureStorageBlobAdaptor::list(
     const std::string& path,
     std::vector<DirectoryEntry>& directory_entries,
@@ -159,6 +485,11 @@ int AzureStorageBlobAdaptor::list(
       e.status.is_directory = false;
       e.status.file_size = p.BlobSize;
       e.status.last_modified_time = std::chrono::system_clock::time_point(p.Details.LastModified);
+      e.status.etag = p.Details.ETag.ToString();
+      e.status.content_md5 = content_md5(p.Details.HttpHeaders.ContentHash);
+      if (p.VersionId.HasValue())
+        e.status.version_id = p.VersionId.Value();
+      remember_blob_type(path == "." ? e.name : path + "/" + e.name, p.BlobType);
       directory_entries.emplace_back(std::move(e));
     }
     for (auto& p : paths_page.BlobPrefixes)
@@ -187,3 +518,37 @@ int AzureStorageBlobAdaptor::list(
   }
   return 0;
 }
+
+int AzureStorageBlobAdaptor::list_containers(
+    const std::string& account,
+    const std::string& account_key,
+    std::vector<std::string>& names,
+    std::string& continuation_token)
+{
+  BlobClientOptions clientOptions;
+  clientOptions.Telemetry.ApplicationId = g_application_id;
+  auto service_client = BlobServiceClient(
+      "https://" + account + ".blob.core.windows.net",
+      std::make_shared<Azure::Storage::StorageSharedKeyCredential>(account, account_key),
+      clientOptions);
+  ListBlobContainersOptions list_options;
+  if (!continuation_token.empty())
+    list_options.ContinuationToken = continuation_token;
+  try
+  {
+    auto containers_page = service_client.ListBlobContainers(list_options);
+    for (auto& c : containers_page.BlobContainers)
+      names.emplace_back(std::move(c.Name));
+    continuation_token = containers_page.NextPageToken.HasValue()
+        ? containers_page.NextPageToken.Value()
+        : std::string();
+  }
+  catch (Azure::Storage::StorageException& e)
+  {
+    int ret = translate_exception(e);
+    if (ret != 0)
+      return ret;
+    throw;
+  }
+  return 0;
+}
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <azure/storage/blobs.hpp>
@@ -12,17 +16,92 @@ struct AzureStorageBlobAdaptor : public BaseAdaptor
   AzureStorageBlobAdaptor(
       const std::string& account,
       const std::string& blob_container,
-      const std::string& account_key);
+      const std::string& account_key,
+      bool verify_integrity);
   ~AzureStorageBlobAdaptor() override = default;
 
   int getattr(const std::string& path, FileStatus& file_status) override;
   int read(const std::string& path, char* buff, size_t size, size_t offset) override;
+  int read_with_options(
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status) override;
   int list(
       const std::string& path,
       std::vector<DirectoryEntry>& directory_entries,
       std::string& continuation_token);
+  // Page blobs only. Their page ranges are cached for each version.
+  int data_ranges(
+      const std::string& path,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<DataRange>& ranges) override;
+
+  // Lists the containers of |account| a page at a time, for mounting all of them.
+  static int list_containers(
+      const std::string& account,
+      const std::string& account_key,
+      std::vector<std::string>& names,
+      std::string& continuation_token);
 
 private:
+  // Pages of a version of a page blob that have been written.
+  struct PageMap
+  {
+    FileStatus status;
+    std::vector<DataRange> ranges;
+  };
+
+  // Downloads a range of the blob, verified if m_verify_integrity is set. Reads that aren't pinned
+  // to a version, like the first read of a blob when it's opened, also learn its type.
+  int read_range(
+      Azure::Storage::Blobs::BlobClient& blob_client,
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status);
+  // Only downloads the pages of a page blob that have been written, and fills the rest with zeros.
+  int read_sparse(
+      Azure::Storage::Blobs::BlobClient& blob_client,
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status);
+  // Page ranges of the version of the blob that |options| pin to, or of the current version if
+  // they pin to none.
+  int get_page_map(
+      Azure::Storage::Blobs::BlobClient& blob_client,
+      const std::string& path,
+      const ReadOptions& options,
+      std::shared_ptr<const PageMap>& page_map);
+  void remember_blob_type(
+      const std::string& path, const Azure::Storage::Blobs::Models::BlobType& blob_type);
+  bool is_page_blob(const std::string& path);
+
+  // Reads up to 4 MiB at a time with a transactional hash, and fails with -EIO if the data doesn't
+  // match it.
+  int read_verified(
+      Azure::Storage::Blobs::BlobClient& blob_client,
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status);
+
   std::shared_ptr<Azure::Storage::StorageSharedKeyCredential> m_key_credential;
   std::string m_blob_container_url;
+  bool m_verify_integrity;
+
+  std::mutex m_mutex;
+  // Page blobs seen by getattr or list. Reads of other blobs don't look for holes.
+  std::unordered_set<std::string> m_page_blobs;
+  std::unordered_map<std::string, std::shared_ptr<const PageMap>> m_page_maps;
 };
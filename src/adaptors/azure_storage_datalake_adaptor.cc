@@ -1,10 +1,16 @@
 #include "azure_storage_datalake_adaptor.h"
 
+#include <algorithm>
+
+#include "../crc64.h"
 #include "application_id.h"
 
 using namespace Azure::Storage::Files::DataLake;
 
 namespace {
+// The service only returns transactional hashes for ranges up to this size.
+constexpr size_t k_max_verified_range_size = 4 * 1024 * 1024;
+
 int translate_exception(const Azure::Storage::StorageException& e)
 {
   if (e.StatusCode == Azure::Core::Http::HttpStatusCode::Forbidden)
@@ -16,16 +22,27 @@ int translate_exception(const Azure::Storage::StorageException& e)
     return -ETXTBSY;
   return 0;
 }
+
+// MD5 of the whole object, if it has one.
+std::string content_md5(const Azure::Storage::ContentHash& content_hash)
+{
+  if (content_hash.Algorithm != Azure::Storage::HashAlgorithm::Md5
+      || content_hash.Value.size() != 16)
+    return std::string();
+  return std::string(content_hash.Value.begin(), content_hash.Value.end());
+}
 } // namespace
 
 AzureStorageDataLakeAdaptor::AzureStorageDataLakeAdaptor(
     const std::string& account,
     const std::string& filesystem,
-    const std::string& account_key)
+    const std::string& account_key,
+    bool verify_integrity)
     : m_key_credential(
         std::make_shared<Azure::Storage::StorageSharedKeyCredential>(account, account_key)),
       m_blob_container_url("https://" + account + ".blob.core.windows.net/" + filesystem),
-      m_filesystem_url("https://" + account + ".dfs.core.windows.net/" + filesystem)
+      m_filesystem_url("https://" + account + ".dfs.core.windows.net/" + filesystem),
+      m_verify_integrity(verify_integrity)
 {
 }
 
@@ -43,6 +60,7 @@ int AzureStorageDataLakeAdaptor::getattr(const std::string& path, FileStatus& fi
       file_status.file_size = 0;
       file_status.last_modified_time
           = std::chrono::system_clock::time_point(properties.LastModified);
+      file_status.etag = properties.ETag.ToString();
     }
     catch (Azure::Storage::StorageException& e)
     {
@@ -61,6 +79,9 @@ int AzureStorageDataLakeAdaptor::getattr(const std::string& path, FileStatus& fi
     file_status.is_directory = properties.IsDirectory;
     file_status.file_size = properties.FileSize;
     file_status.last_modified_time = std::chrono::system_clock::time_point(properties.LastModified);
+    file_status.etag = properties.ETag.ToString();
+    if (!properties.IsDirectory)
+      file_status.content_md5 = content_md5(properties.HttpHeaders.ContentHash);
   }
   catch (Azure::Storage::StorageException& e)
   {
@@ -77,16 +98,32 @@ int AzureStorageDataLakeAdaptor::read(
     char* buff,
     size_t size,
     size_t offset)
+{
+  FileStatus file_status;
+  return read_with_options(path, buff, size, offset, ReadOptions(), file_status);
+}
+
+int AzureStorageDataLakeAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
 {
   DataLakeClientOptions clientOptions;
   clientOptions.Telemetry.ApplicationId = g_application_id;
   auto file_client
       = DataLakeFileClient(m_filesystem_url + "/" + path, m_key_credential, clientOptions);
+  if (m_verify_integrity)
+    return read_verified(file_client, buff, size, offset, options, file_status);
   DownloadFileToOptions download_options;
   download_options.Range = Azure::Core::Http::HttpRange();
   download_options.Range.Value().Offset = offset;
   download_options.Range.Value().Length = size;
   download_options.TransferOptions.InitialChunkSize = 1 * 1024 * 1024;
+  if (!options.if_match.empty())
+    download_options.AccessConditions.IfMatch = Azure::ETag(options.if_match);
   try
   {
     auto downloadResult
@@ -96,6 +133,12 @@ int AzureStorageDataLakeAdaptor::read(
     {
       std::abort();
     }
+    file_status.is_directory = false;
+    file_status.file_size = downloadResult.FileSize;
+    file_status.last_modified_time
+        = std::chrono::system_clock::time_point(downloadResult.Details.LastModified);
+    file_status.etag = downloadResult.Details.ETag.ToString();
+    file_status.content_md5 = content_md5(downloadResult.Details.HttpHeaders.ContentHash);
     return static_cast<int>(bytes_read);
   }
   catch (Azure::Storage::StorageException& e)
@@ -105,6 +148,11 @@ int AzureStorageDataLakeAdaptor::read(
       // offset >= file size
       return 0;
     }
+    if (e.StatusCode == Azure::Core::Http::HttpStatusCode::PreconditionFailed)
+    {
+      // The file was overwritten since |options.if_match| was taken.
+      return -ESTALE;
+    }
     int ret = translate_exception(e);
     if (ret != 0)
       return ret;
@@ -112,6 +160,82 @@ int AzureStorageDataLakeAdaptor::read(
   }
 }
 
+int AzureStorageDataLakeAdaptor::read_verified(
+    DataLakeFileClient& file_client,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  size_t bytes_read = 0;
+  int attempts = 0;
+  while (bytes_read < size)
+  {
+    size_t length = std::min(size - bytes_read, k_max_verified_range_size);
+    DownloadFileOptions download_options;
+    download_options.Range = Azure::Core::Http::HttpRange();
+    download_options.Range.Value().Offset = offset + bytes_read;
+    download_options.Range.Value().Length = length;
+    download_options.RangeHashAlgorithm = Azure::Storage::HashAlgorithm::Crc64;
+    // Later ranges must come from the same version as the first.
+    std::string etag = bytes_read == 0 ? options.if_match : file_status.etag;
+    if (!etag.empty())
+      download_options.AccessConditions.IfMatch = Azure::ETag(etag);
+    try
+    {
+      auto downloadResult = file_client.Download(download_options).Value;
+      size_t n = static_cast<size_t>(downloadResult.ContentRange.Length.Value());
+      if (n > length)
+        return -EIO;
+      uint8_t* data = reinterpret_cast<uint8_t*>(buff + bytes_read);
+      bool valid = downloadResult.Body->ReadToCount(data, n) == n
+          && downloadResult.TransactionalContentHash.HasValue()
+          && downloadResult.TransactionalContentHash.Value().Algorithm
+              == Azure::Storage::HashAlgorithm::Crc64
+          && downloadResult.TransactionalContentHash.Value().Value
+              == crc64_bytes(crc64(0, data, n));
+      if (!valid)
+      {
+        // Corruption in transit is worth one more try.
+        if (++attempts == 2)
+          return -EIO;
+        continue;
+      }
+      attempts = 0;
+      file_status.is_directory = false;
+      file_status.file_size = downloadResult.FileSize;
+      file_status.last_modified_time
+          = std::chrono::system_clock::time_point(downloadResult.Details.LastModified);
+      file_status.etag = downloadResult.Details.ETag.ToString();
+      file_status.content_md5 = content_md5(downloadResult.Details.HttpHeaders.ContentHash);
+      bytes_read += n;
+      if (n < length || offset + bytes_read >= file_status.file_size)
+        break;
+    }
+    catch (Azure::Storage::StorageException& e)
+    {
+      if (e.StatusCode == Azure::Core::Http::HttpStatusCode::RangeNotSatisfiable)
+      {
+        // offset >= file size
+        break;
+      }
+      if (e.StatusCode == Azure::Core::Http::HttpStatusCode::PreconditionFailed)
+      {
+        // The file was overwritten since |options.if_match| was taken.
+        return -ESTALE;
+      }
+      int ret = translate_exception(e);
+      if (ret != 0)
+        return ret;
+      throw;
+    }
+  }
+  if (bytes_read > static_cast<size_t>(std::numeric_limits<int>::max()))
+    std::abort();
+  return static_cast<int>(bytes_read);
+}
+
 int AzureStorageDataLakeAdaptor::list(
     const std::string& path,
     std::vector<DirectoryEntry>& directory_entries,
@@ -139,6 +263,8 @@ int AzureStorageDataLakeAdaptor::list(
       e.status.is_directory = false;
       e.status.file_size = p.BlobSize;
       e.status.last_modified_time = std::chrono::system_clock::time_point(p.Details.LastModified);
+      e.status.etag = p.Details.ETag.ToString();
+      e.status.content_md5 = content_md5(p.Details.HttpHeaders.ContentHash);
       directory_entries.emplace_back(std::move(e));
     }
     for (auto& p : paths_page.BlobPrefixes)
@@ -165,3 +291,37 @@ int AzureStorageDataLakeAdaptor::list(
   }
   return 0;
 }
+
+int AzureStorageDataLakeAdaptor::list_containers(
+    const std::string& account,
+    const std::string& account_key,
+    std::vector<std::string>& names,
+    std::string& continuation_token)
+{
+  DataLakeClientOptions clientOptions;
+  clientOptions.Telemetry.ApplicationId = g_application_id;
+  auto service_client = DataLakeServiceClient(
+      "https://" + account + ".dfs.core.windows.net",
+      std::make_shared<Azure::Storage::StorageSharedKeyCredential>(account, account_key),
+      clientOptions);
+  ListFileSystemsOptions list_options;
+  if (!continuation_token.empty())
+    list_options.ContinuationToken = continuation_token;
+  try
+  {
+    auto filesystems_page = service_client.ListFileSystems(list_options);
+    for (auto& f : filesystems_page.FileSystems)
+      names.emplace_back(std::move(f.Name));
+    continuation_token = filesystems_page.NextPageToken.HasValue()
+        ? filesystems_page.NextPageToken.Value()
+        : std::string();
+  }
+  catch (Azure::Storage::StorageException& e)
+  {
+    int ret = translate_exception(e);
+    if (ret != 0)
+      return ret;
+    throw;
+  }
+  return 0;
+}
@@ -1,10 +1,17 @@
 #include "azure_storage_file_adaptor.h"
 
+#include <algorithm>
+
+#include <azure/core/cryptography/hash.hpp>
+
 #include "application_id.h"
 
 using namespace Azure::Storage::Files::Shares;
 
 namespace {
+// The service only returns transactional hashes for ranges up to this size.
+constexpr size_t k_max_verified_range_size = 4 * 1024 * 1024;
+
 int translate_exception(const Azure::Storage::StorageException& e)
 {
   if (e.StatusCode == Azure::Core::Http::HttpStatusCode::Forbidden)
@@ -16,15 +23,28 @@ int translate_exception(const Azure::Storage::StorageException& e)
     return -ETXTBSY;
   return 0;
 }
+
+// MD5 of the whole object, if it has one.
+std::string content_md5(const Azure::Storage::ContentHash& content_hash)
+{
+  if (content_hash.Algorithm != Azure::Storage::HashAlgorithm::Md5
+      || content_hash.Value.size() != 16)
+    return std::string();
+  return std::string(content_hash.Value.begin(), content_hash.Value.end());
+}
 } // namespace
 
 AzureStorageFileAdaptor::AzureStorageFileAdaptor(
     const std::string& account,
     const std::string& filesystem,
-    const std::string& account_key)
+    const std::string& account_key,
+    bool verify_integrity,
+    const std::string& snapshot)
     : m_key_credential(
         std::make_shared<Azure::Storage::StorageSharedKeyCredential>(account, account_key)),
-      m_share_url("https://" + account + ".file.core.windows.net/" + filesystem)
+      m_share_url("https://" + account + ".file.core.windows.net/" + filesystem),
+      m_verify_integrity(verify_integrity),
+      m_snapshot(snapshot)
 {
 }
 
@@ -35,6 +55,8 @@ int AzureStorageFileAdaptor::getattr(const std::string& path, FileStatus& file_s
   if (path == ".")
   {
     auto fs_client = ShareClient(m_share_url, m_key_credential, clientOptions);
+    if (!m_snapshot.empty())
+      fs_client = fs_client.WithSnapshot(m_snapshot);
     try
     {
       auto properties = fs_client.GetProperties().Value;
@@ -42,6 +64,7 @@ int AzureStorageFileAdaptor::getattr(const std::string& path, FileStatus& file_s
       file_status.file_size = 0;
       file_status.last_modified_time
           = std::chrono::system_clock::time_point(properties.LastModified);
+      file_status.etag = properties.ETag.ToString();
     }
     catch (Azure::Storage::StorageException& e)
     {
@@ -55,10 +78,14 @@ int AzureStorageFileAdaptor::getattr(const std::string& path, FileStatus& file_s
   try
   {
     auto file_client = ShareFileClient(m_share_url + "/" + path, m_key_credential, clientOptions);
+    if (!m_snapshot.empty())
+      file_client = file_client.WithShareSnapshot(m_snapshot);
     auto properties = file_client.GetProperties().Value;
     file_status.is_directory = false;
     file_status.file_size = properties.FileSize;
     file_status.last_modified_time = std::chrono::system_clock::time_point(properties.LastModified);
+    file_status.etag = properties.ETag.ToString();
+    file_status.content_md5 = content_md5(properties.HttpHeaders.ContentHash);
     return 0;
   }
   catch (Azure::Storage::StorageException& e)
@@ -75,10 +102,13 @@ int AzureStorageFileAdaptor::getattr(const std::string& path, FileStatus& file_s
   {
     auto directory_client
         = ShareDirectoryClient(m_share_url + "/" + path, m_key_credential, clientOptions);
+    if (!m_snapshot.empty())
+      directory_client = directory_client.WithShareSnapshot(m_snapshot);
     auto properties = directory_client.GetProperties().Value;
     file_status.is_directory = true;
     file_status.file_size = 0;
     file_status.last_modified_time = std::chrono::system_clock::time_point(properties.LastModified);
+    file_status.etag = properties.ETag.ToString();
     return 0;
   }
   catch (Azure::Storage::StorageException& e)
@@ -91,10 +121,26 @@ int AzureStorageFileAdaptor::getattr(const std::string& path, FileStatus& file_s
 }
 
 int AzureStorageFileAdaptor::read(const std::string& path, char* buff, size_t size, size_t offset)
+{
+  FileStatus file_status;
+  return read_with_options(path, buff, size, offset, ReadOptions(), file_status);
+}
+
+int AzureStorageFileAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
 {
   ShareClientOptions clientOptions;
   clientOptions.Telemetry.ApplicationId = g_application_id;
   auto file_client = ShareFileClient(m_share_url + "/" + path, m_key_credential, clientOptions);
+  if (!m_snapshot.empty())
+    file_client = file_client.WithShareSnapshot(m_snapshot);
+  if (m_verify_integrity)
+    return read_verified(file_client, buff, size, offset, options, file_status);
   DownloadFileToOptions download_options;
   download_options.Range = Azure::Core::Http::HttpRange();
   download_options.Range.Value().Offset = offset;
@@ -109,6 +155,16 @@ int AzureStorageFileAdaptor::read(const std::string& path, char* buff, size_t si
     {
       std::abort();
     }
+    file_status.is_directory = false;
+    file_status.file_size = downloadResult.FileSize;
+    file_status.last_modified_time
+        = std::chrono::system_clock::time_point(downloadResult.Details.LastModified);
+    file_status.etag = downloadResult.Details.ETag.ToString();
+    file_status.content_md5 = content_md5(downloadResult.Details.HttpHeaders.ContentHash);
+    // File service doesn't support If-Match on downloads, so the version can only be checked
+    // after the fact.
+    if (!options.if_match.empty() && file_status.etag != options.if_match)
+      return -ESTALE;
     return static_cast<int>(bytes_read);
   }
   catch (Azure::Storage::StorageException& e)
@@ -125,6 +181,82 @@ int AzureStorageFileAdaptor::read(const std::string& path, char* buff, size_t si
   }
 }
 
+int AzureStorageFileAdaptor::read_verified(
+    ShareFileClient& file_client,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  size_t bytes_read = 0;
+  int attempts = 0;
+  std::string etag_of_first_range;
+  while (bytes_read < size)
+  {
+    size_t length = std::min(size - bytes_read, k_max_verified_range_size);
+    DownloadFileOptions download_options;
+    download_options.Range = Azure::Core::Http::HttpRange();
+    download_options.Range.Value().Offset = offset + bytes_read;
+    download_options.Range.Value().Length = length;
+    // File service only has MD5 for ranges.
+    download_options.RangeHashAlgorithm = Azure::Storage::HashAlgorithm::Md5;
+    try
+    {
+      auto downloadResult = file_client.Download(download_options).Value;
+      size_t n = static_cast<size_t>(downloadResult.ContentRange.Length.Value());
+      if (n > length)
+        return -EIO;
+      uint8_t* data = reinterpret_cast<uint8_t*>(buff + bytes_read);
+      bool valid = downloadResult.BodyStream->ReadToCount(data, n) == n
+          && downloadResult.TransactionalContentHash.HasValue()
+          && downloadResult.TransactionalContentHash.Value().Algorithm
+              == Azure::Storage::HashAlgorithm::Md5
+          && downloadResult.TransactionalContentHash.Value().Value
+              == Azure::Core::Cryptography::Md5Hash().Final(data, n);
+      if (!valid)
+      {
+        // Corruption in transit is worth one more try.
+        if (++attempts == 2)
+          return -EIO;
+        continue;
+      }
+      attempts = 0;
+      file_status.is_directory = false;
+      file_status.file_size = downloadResult.FileSize;
+      file_status.last_modified_time
+          = std::chrono::system_clock::time_point(downloadResult.Details.LastModified);
+      file_status.etag = downloadResult.Details.ETag.ToString();
+      file_status.content_md5 = content_md5(downloadResult.Details.HttpHeaders.ContentHash);
+      // File service doesn't support If-Match on downloads, so the version can only be checked
+      // after the fact.
+      std::string etag = bytes_read == 0 ? options.if_match : etag_of_first_range;
+      if (!etag.empty() && file_status.etag != etag)
+        return -ESTALE;
+      if (bytes_read == 0)
+        etag_of_first_range = file_status.etag;
+      bytes_read += n;
+      if (n < length || offset + bytes_read >= file_status.file_size)
+        break;
+    }
+    catch (Azure::Storage::StorageException& e)
+    {
+      if (e.StatusCode == Azure::Core::Http::HttpStatusCode::RangeNotSatisfiable)
+      {
+        // offset >= file size
+        break;
+      }
+      int ret = translate_exception(e);
+      if (ret != 0)
+        return ret;
+      throw;
+    }
+  }
+  if (bytes_read > static_cast<size_t>(std::numeric_limits<int>::max()))
+    std::abort();
+  return static_cast<int>(bytes_read);
+}
+
 int AzureStorageFileAdaptor::list(
     const std::string& path,
     std::vector<DirectoryEntry>& directory_entries,
@@ -136,6 +268,8 @@ int AzureStorageFileAdaptor::list(
   ShareClientOptions clientOptions;
   clientOptions.Telemetry.ApplicationId = g_application_id;
   auto directory_client = ShareDirectoryClient(url, m_key_credential, clientOptions);
+  if (!m_snapshot.empty())
+    directory_client = directory_client.WithShareSnapshot(m_snapshot);
 
   ListFilesAndDirectoriesOptions list_options;
   if (!continuation_token.empty())
@@ -171,3 +305,36 @@ int AzureStorageFileAdaptor::list(
     throw;
   }
 }
+
+int AzureStorageFileAdaptor::list_containers(
+    const std::string& account,
+    const std::string& account_key,
+    std::vector<std::string>& names,
+    std::string& continuation_token)
+{
+  ShareClientOptions clientOptions;
+  clientOptions.Telemetry.ApplicationId = g_application_id;
+  auto service_client = ShareServiceClient(
+      "https://" + account + ".file.core.windows.net",
+      std::make_shared<Azure::Storage::StorageSharedKeyCredential>(account, account_key),
+      clientOptions);
+  ListSharesOptions list_options;
+  if (!continuation_token.empty())
+    list_options.ContinuationToken = continuation_token;
+  try
+  {
+    auto shares_page = service_client.ListShares(list_options);
+    for (auto& s : shares_page.Shares)
+      names.emplace_back(std::move(s.Name));
+    continuation_token
+        = shares_page.NextPageToken.HasValue() ? shares_page.NextPageToken.Value() : std::string();
+  }
+  catch (Azure::Storage::StorageException& e)
+  {
+    int ret = translate_exception(e);
+    if (ret != 0)
+      return ret;
+    throw;
+  }
+  return 0;
+}
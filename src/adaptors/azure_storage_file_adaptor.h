@@ -9,20 +9,49 @@
 
 struct AzureStorageFileAdaptor : public BaseAdaptor
 {
+  // If |snapshot| isn't empty, the share is read as it was in that snapshot, which never changes.
   AzureStorageFileAdaptor(
       const std::string& account,
       const std::string& filesystem,
-      const std::string& account_key);
+      const std::string& account_key,
+      bool verify_integrity,
+      const std::string& snapshot);
   ~AzureStorageFileAdaptor() = default;
 
   int getattr(const std::string& path, FileStatus& file_status) override;
   int read(const std::string& path, char* buff, size_t size, size_t offset) override;
+  int read_with_options(
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status) override;
   int list(
       const std::string& path,
       std::vector<DirectoryEntry>& directory_entries,
       std::string& continuation_token);
 
+  // Lists the shares of |account| a page at a time, for mounting all of them.
+  static int list_containers(
+      const std::string& account,
+      const std::string& account_key,
+      std::vector<std::string>& names,
+      std::string& continuation_token);
+
 private:
+  // Reads up to 4 MiB at a time with a transactional hash, and fails with -EIO if the data doesn't
+  // match it.
+  int read_verified(
+      Azure::Storage::Files::Shares::ShareFileClient& file_client,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status);
+
   std::shared_ptr<Azure::Storage::StorageSharedKeyCredential> m_key_credential;
   std::string m_share_url;
+  bool m_verify_integrity;
+  std::string m_snapshot;
 };
@@ -0,0 +1,810 @@
+#include "caching_adaptor.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "../scheduler.h"
+
+namespace {
+// Upper bound of cached attributes and listings per mount, so that walking a huge tree doesn't
+// grow the caches without limit.
+constexpr size_t k_max_cached_items = 1024 * 1024;
+// What's left once the limit is hit, so that trimming happens in batches rather than on every new
+// item.
+constexpr size_t k_trimmed_cached_items = k_max_cached_items / 8 * 7;
+// Attributes are charged against the memory budget this much at a time, rather than one by one.
+constexpr size_t k_attribute_charge_size = 1024 * 1024;
+// Memory of a cached attribute besides its strings: the map entry, the order list node and the
+// status.
+constexpr size_t k_attribute_overhead = 256;
+
+std::string child_path(const std::string& path, const std::string& name)
+{
+  return path == "." ? name : path + "/" + name;
+}
+
+std::string parent_path(const std::string& path)
+{
+  auto i = path.rfind('/');
+  return i == std::string::npos ? "." : path.substr(0, i);
+}
+
+std::string base_name(const std::string& path)
+{
+  auto i = path.rfind('/');
+  return i == std::string::npos ? path : path.substr(i + 1);
+}
+
+size_t attribute_usage(const std::string& path, const FileStatus& status)
+{
+  return k_attribute_overhead + path.size() + status.etag.size() + status.content_md5.size()
+      + status.version_id.size();
+}
+
+bool same_version(const FileStatus& a, const FileStatus& b)
+{
+  if (!a.etag.empty() && !b.etag.empty())
+    return a.etag == b.etag;
+  return a.is_directory == b.is_directory && a.file_size == b.file_size
+      && a.last_modified_time == b.last_modified_time;
+}
+} // namespace
+
+CachingAdaptor::CachingAdaptor(
+    std::string name,
+    std::shared_ptr<BaseAdaptor> adaptor,
+    std::shared_ptr<BlockCache> block_cache,
+    const CacheOptions& options,
+    std::function<void(const std::string& path)> on_change)
+    : m_name(std::move(name)), m_adaptor(std::move(adaptor)),
+      m_block_cache(std::move(block_cache)), m_options(options), m_on_change(std::move(on_change))
+{
+  m_reclaimer_id = g_buffer_pool.add_reclaimer([this](size_t bytes) { return reclaim(bytes); });
+  if (m_options.poll_interval.count() > 0 && !m_options.pin_versions)
+  {
+    m_poll_thread = std::thread([this]() {
+      std::unique_lock<std::mutex> guard(m_poll_mutex);
+      while (!m_poll_cv.wait_for(guard, m_options.poll_interval, [this]() { return m_stopping; }))
+      {
+        guard.unlock();
+        poll_changes();
+        guard.lock();
+      }
+    });
+  }
+}
+
+CachingAdaptor::~CachingAdaptor()
+{
+  g_buffer_pool.remove_reclaimer(m_reclaimer_id);
+  {
+    std::lock_guard<std::mutex> guard(m_poll_mutex);
+    m_stopping = true;
+  }
+  m_poll_cv.notify_all();
+  if (m_poll_thread.joinable())
+    m_poll_thread.join();
+}
+
+int CachingAdaptor::getattr(const std::string& path, FileStatus& file_status)
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    int ret;
+    if (find_cached(path, file_status, ret))
+      return ret;
+  }
+
+  // Either never seen or expired. A HEAD tells whether the cached data is still valid.
+  int ret = m_adaptor->getattr(path, file_status);
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (ret < 0)
+    {
+      if (ret == -ENOENT)
+        forget(path);
+      return ret;
+    }
+    remember(path, file_status);
+  }
+  charge_attributes();
+  return 0;
+}
+
+int CachingAdaptor::open(
+    const std::string& path, const ReadOptions& options, FileStatus& file_status)
+{
+  // What's read around the cache mustn't be left in it.
+  if (options.bypass_cache || options.follow)
+    return getattr(path, file_status);
+
+  bool seen = false;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    int ret;
+    if (find_cached(path, file_status, ret))
+      return ret;
+    seen = m_attributes.count(path) != 0;
+  }
+  // Revalidating an object that was seen before only takes a HEAD, and its first block is likely
+  // cached already.
+  if (seen)
+    return getattr(path, file_status);
+
+  // A read tells as much as a HEAD does, and the first block is about to be read anyway.
+  const size_t block_size = m_block_cache->block_size();
+  std::shared_ptr<Buffer> data = g_buffer_pool.allocate(block_size);
+  int ret;
+  try
+  {
+    ret = m_adaptor->read_with_options(
+        path, data->data(), block_size, 0, ReadOptions(), file_status);
+  }
+  catch (std::exception&)
+  {
+    ret = -EIO;
+  }
+  // Directories, empty files, objects without versions and errors are left to getattr().
+  if (ret <= 0 || file_status.etag.empty())
+  {
+    file_status = FileStatus();
+    return getattr(path, file_status);
+  }
+  data->resize(ret);
+
+  bool pinned = false;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    remember(path, file_status);
+    pinned = m_pinned.count(path) != 0;
+  }
+  charge_attributes();
+  BlockCache::Checksums checksums;
+  if (m_options.verify_blocks)
+    checksums = BlockCache::compute_checksums(*data);
+  // Cached as if it was loaded by a read, so that the tiers get it too.
+  auto load = [&](BlockCache::Block& loaded, BlockCache::Checksums& loaded_checksums) {
+    loaded = data;
+    loaded_checksums = checksums;
+    return ret;
+  };
+  BlockCache::Block block;
+  m_block_cache->get_or_load(object_key(path, file_status), 0, load, pinned, block, checksums);
+  return 0;
+}
+
+int CachingAdaptor::read(const std::string& path, char* buff, size_t size, size_t offset)
+{
+  FileStatus file_status;
+  return read_with_options(path, buff, size, offset, ReadOptions(), file_status);
+}
+
+int CachingAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  if (options.follow)
+  {
+    int ret = m_adaptor->read_with_options(path, buff, size, offset, options, file_status);
+    follow(path, ret, file_status);
+    return ret;
+  }
+  FileStatus version;
+  int ret = version_to_read(path, options, version);
+  if (ret < 0)
+    return ret;
+  file_status = version;
+  // Without a version there's no way to tell whether cached data is still valid.
+  if (version.etag.empty() || options.bypass_cache)
+  {
+    ReadOptions direct_options = options;
+    direct_options.if_match = version.etag;
+    if (m_options.pin_versions)
+      direct_options.version_id = version.version_id;
+    return m_adaptor->read_with_options(path, buff, size, offset, direct_options, file_status);
+  }
+
+  std::vector<BufferSlice> slices;
+  ret = read_blocks(path, version, size, offset, file_status, slices);
+  if (ret < 0)
+    return ret;
+  size_t bytes_read = 0;
+  for (const BufferSlice& slice : slices)
+  {
+    std::memcpy(buff + bytes_read, slice.buffer->data() + slice.offset, slice.size);
+    bytes_read += slice.size;
+  }
+  return ret;
+}
+
+int CachingAdaptor::read_buffers(
+    const std::string& path,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<BufferSlice>& slices)
+{
+  if (options.follow)
+  {
+    int ret = m_adaptor->read_buffers(path, size, offset, options, file_status, slices);
+    follow(path, ret, file_status);
+    return ret;
+  }
+  FileStatus version;
+  int ret = version_to_read(path, options, version);
+  if (ret < 0)
+    return ret;
+  file_status = version;
+  if (version.etag.empty() || options.bypass_cache)
+  {
+    ReadOptions direct_options = options;
+    direct_options.if_match = version.etag;
+    if (m_options.pin_versions)
+      direct_options.version_id = version.version_id;
+    return m_adaptor->read_buffers(path, size, offset, direct_options, file_status, slices);
+  }
+  return read_blocks(path, version, size, offset, file_status, slices);
+}
+
+int CachingAdaptor::set_pinned(const std::string& path, bool pinned)
+{
+  FileStatus file_status;
+  int ret = getattr(path, file_status);
+  if (ret < 0)
+    return ret;
+  if (file_status.is_directory)
+    return -EISDIR;
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (pinned)
+    m_pinned.insert(path);
+  else
+    m_pinned.erase(path);
+  m_block_cache->set_pinned(object_key(path, file_status), pinned);
+  return 0;
+}
+
+bool CachingAdaptor::has_pinned()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  return !m_pinned.empty();
+}
+
+int CachingAdaptor::data_ranges(
+    const std::string& path,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<DataRange>& ranges)
+{
+  // Adaptors that know data ranges cache them themselves.
+  return m_adaptor->data_ranges(path, options, file_status, ranges);
+}
+
+int CachingAdaptor::list(
+    const std::string& path,
+    std::vector<DirectoryEntry>& directory_entries,
+    std::string& continuation_token)
+{
+  // Cached listings are always complete, so a continuation token can only come from elsewhere.
+  if (!continuation_token.empty())
+    return m_adaptor->list(path, directory_entries, continuation_token);
+
+  std::shared_ptr<const DirectoryIndex> index;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_listings.find(path);
+    if (ite != m_listings.end() && is_fresh(ite->second.validated_time))
+      index = ite->second.index;
+  }
+  // Unpacked without the lock, since a huge directory takes a while.
+  if (index)
+  {
+    index->copy_to(directory_entries);
+    return 0;
+  }
+
+  return refresh_listing(path, &directory_entries);
+}
+
+int CachingAdaptor::refresh_listing(
+    const std::string& path,
+    std::vector<DirectoryEntry>* directory_entries)
+{
+  auto index = std::make_shared<DirectoryIndex>();
+  std::vector<DirectoryEntry> page;
+  std::string token;
+  do
+  {
+    page.clear();
+    int ret = m_adaptor->list(path, page, token);
+    if (ret < 0)
+      return ret;
+    index->append(page);
+  } while (!token.empty());
+  index->sort();
+  index->shrink_to_fit();
+  if (directory_entries)
+    index->copy_to(*directory_entries);
+  // Charged before taking the lock, since charging may reclaim cached items.
+  BufferPool::Reservation reservation;
+  if (!m_options.pin_versions)
+    reservation = g_buffer_pool.try_reserve(index->memory_usage());
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  // Diff against the previous listing. Children that disappeared or whose ETag changed are
+  // invalidated, everything else keeps its cached data.
+  auto previous = m_listings.find(path);
+  if (previous != m_listings.end())
+  {
+    // Kept alive, since forgetting a child may drop it from m_listings.
+    std::shared_ptr<const DirectoryIndex> old_index = previous->second.index;
+    bool changed = old_index->size() != index->size();
+    for (size_t i = 0; i < old_index->size(); ++i)
+    {
+      size_t j = index->find(old_index->name(i));
+      FileStatus old_status = old_index->status(i);
+      if (j != DirectoryIndex::npos && same_version(old_status, index->status(j)))
+        continue;
+      std::string child = child_path(path, std::string(old_index->name(i)));
+      // Children with cached attributes are taken care of by forget() or remember() below.
+      if (m_attributes.count(child) == 0)
+      {
+        drop_blocks(child, old_status);
+        if (m_on_change)
+          m_on_change(child);
+      }
+      if (j == DirectoryIndex::npos)
+      {
+        forget(child);
+        changed = true;
+      }
+    }
+    if (changed && m_on_change)
+      m_on_change(path);
+  }
+  // Children already seen stay as they were when pinned to versions.
+  if (!m_attributes.empty() && !m_options.pin_versions)
+  {
+    for (size_t i = 0; i < index->size(); ++i)
+    {
+      // A listing is as good as a HEAD for the attributes of versioned children.
+      FileStatus status = index->status(i);
+      std::string child = child_path(path, std::string(index->name(i)));
+      if (!status.etag.empty() && m_attributes.count(child) != 0)
+        remember(child, status);
+    }
+  }
+
+  CachedListing listing;
+  if (m_options.pin_versions)
+  {
+    // A listing pinned to versions can't be dropped, or the next listing would show the current
+    // state, so it fails instead.
+    const size_t usage = index->memory_usage();
+    auto ite = m_listings.find(path);
+    const size_t replaced = ite != m_listings.end() ? ite->second.pinned_bytes : 0;
+    if (m_pinned_listing_bytes - replaced + usage > m_options.pinned_listing_budget)
+      return -ENOMEM;
+    listing.pinned_bytes = usage;
+  }
+  else
+  {
+    listing.reservation = std::move(reservation);
+    if (listing.reservation.size() == 0)
+    {
+      // No memory to spare for keeping the listing around.
+      auto ite = m_listings.find(path);
+      if (ite != m_listings.end())
+        erase_listing(ite);
+      return 0;
+    }
+  }
+  listing.index = std::move(index);
+  keep_listing(path, std::move(listing));
+  return 0;
+}
+
+void CachingAdaptor::poll_changes()
+{
+  // Relisting a directory revalidates all its children at once, so only objects whose parent
+  // isn't cached are checked one by one.
+  IoPriorityScope priority_scope(IoPriority::warm_up, true);
+  std::vector<std::string> directories;
+  std::vector<std::string> files;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (const auto& i : m_listings)
+      directories.emplace_back(i.first);
+    for (const auto& i : m_attributes)
+      if (!i.second.status.is_directory && m_listings.count(parent_path(i.first)) == 0)
+        files.emplace_back(i.first);
+  }
+
+  for (const auto& path : directories)
+  {
+    try
+    {
+      if (refresh_listing(path, nullptr) == -ENOENT)
+      {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        forget(path);
+      }
+    }
+    catch (std::exception&)
+    {
+      // Try again next time.
+    }
+  }
+  for (const auto& path : files)
+  {
+    FileStatus file_status;
+    try
+    {
+      int ret = m_adaptor->getattr(path, file_status);
+      std::lock_guard<std::mutex> guard(m_mutex);
+      if (ret == 0)
+        remember(path, file_status);
+      else if (ret == -ENOENT)
+        forget(path);
+    }
+    catch (std::exception&)
+    {
+    }
+  }
+  charge_attributes();
+}
+
+int CachingAdaptor::version_to_read(
+    const std::string& path, const ReadOptions& options, FileStatus& version)
+{
+  if (options.if_match.empty())
+    return getattr(path, version);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  auto ite = m_attributes.find(path);
+  if (ite != m_attributes.end() && ite->second.status.etag == options.if_match)
+    version = ite->second.status;
+  else
+    version.etag = options.if_match;
+  return 0;
+}
+
+int CachingAdaptor::read_blocks(
+    const std::string& path,
+    const FileStatus& version,
+    size_t size,
+    size_t offset,
+    FileStatus& file_status,
+    std::vector<BufferSlice>& slices)
+{
+  const size_t block_size = m_block_cache->block_size();
+  const std::string key = object_key(path, version);
+  ReadOptions block_options;
+  block_options.if_match = version.etag;
+  if (m_options.pin_versions)
+    block_options.version_id = version.version_id;
+  bool pinned = false;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    pinned = m_pinned.count(path) != 0;
+  }
+
+  size_t bytes_read = 0;
+  while (bytes_read < size)
+  {
+    size_t position = offset + bytes_read;
+    size_t block_index = position / block_size;
+    size_t block_offset = position - block_index * block_size;
+    BlockCache::Checksums checksums;
+    BlockCache::Block block = m_block_cache->get(key, block_index, &checksums);
+    if (block && m_options.verify_blocks
+        && !BlockCache::verify(*block, checksums, block_offset, size - bytes_read))
+    {
+      m_block_cache->erase(key, block_index);
+      block = nullptr;
+    }
+    if (!block)
+    {
+      auto load = [&](BlockCache::Block& loaded, BlockCache::Checksums& loaded_checksums) {
+        std::shared_ptr<Buffer> data = g_buffer_pool.allocate(block_size);
+        int ret = m_adaptor->read_with_options(
+            path, data->data(), block_size, block_index * block_size, block_options, file_status);
+        if (ret < 0)
+          return ret;
+        data->resize(ret);
+        if (m_options.verify_blocks)
+          loaded_checksums = BlockCache::compute_checksums(*data);
+        loaded = std::move(data);
+        return ret;
+      };
+      // Other readers of the same block, in this mount or another one with the same content,
+      // wait for this download rather than starting their own.
+      int ret = m_block_cache->get_or_load(key, block_index, load, pinned, block, checksums);
+      if (ret < 0)
+      {
+        // A pinned version that's gone stays gone, rather than giving way to the current one.
+        if (ret == -ESTALE && !m_options.pin_versions)
+        {
+          std::lock_guard<std::mutex> guard(m_mutex);
+          forget(path);
+        }
+        return ret;
+      }
+    }
+
+    if (block_offset >= block->size())
+      break;
+    BufferSlice slice;
+    slice.offset = block_offset;
+    slice.size = std::min(block->size() - block_offset, size - bytes_read);
+    bytes_read += slice.size;
+    bool last = block->size() < block_size;
+    slice.buffer = std::move(block);
+    slices.emplace_back(std::move(slice));
+    if (last)
+      break;
+  }
+  return static_cast<int>(bytes_read);
+}
+
+void CachingAdaptor::follow(const std::string& path, int ret, const FileStatus& file_status)
+{
+  // Reads past the end of the object don't see its attributes.
+  if (ret <= 0 || file_status.etag.empty())
+    return;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_attributes.find(path);
+    if (ite != m_attributes.end() && same_version(ite->second.status, file_status))
+      return;
+    remember(path, file_status);
+  }
+  charge_attributes();
+}
+
+std::string CachingAdaptor::object_key(const std::string& path, const FileStatus& version) const
+{
+  // Objects of the same size and MD5 are the same wherever they are in the content namespace, so
+  // they share their blocks. Mount names and namespaces never start with a newline, so these keys
+  // can't be mistaken for the others.
+  if (!version.content_md5.empty() && !m_options.content_namespace.empty())
+  {
+    return "\nmd5\n" + m_options.content_namespace + '\n' + version.content_md5 + '\n'
+        + std::to_string(version.file_size);
+  }
+  const std::string& name
+      = m_options.object_namespace.empty() ? m_name : m_options.object_namespace;
+  return name + '\n' + path + '\n' + version.etag;
+}
+
+void CachingAdaptor::drop_blocks(const std::string& path, const FileStatus& version)
+{
+  // Blocks keyed by content may be read through other paths. They're left to the LRU, though no
+  // longer pinned by this path, which pins its new version instead.
+  if (version.content_md5.empty() || m_options.content_namespace.empty())
+    m_block_cache->erase(object_key(path, version));
+  else if (m_pinned.count(path) != 0)
+    m_block_cache->set_pinned(object_key(path, version), false);
+}
+
+bool CachingAdaptor::find_cached(const std::string& path, FileStatus& file_status, int& ret)
+{
+  auto ite = m_attributes.find(path);
+  if (ite != m_attributes.end() && is_fresh(ite->second.validated_time))
+  {
+    file_status = ite->second.status;
+    ret = 0;
+    return true;
+  }
+  // A fresh listing of the parent knows about all of its children, including which don't exist.
+  auto listing = path == "." ? m_listings.end() : m_listings.find(parent_path(path));
+  if (listing == m_listings.end() || !is_fresh(listing->second.validated_time))
+    return false;
+  size_t i = listing->second.index->find(base_name(path));
+  if (i == DirectoryIndex::npos)
+  {
+    ret = -ENOENT;
+    return true;
+  }
+  // Some listings leave things out, like the ETag and modification time of File service entries.
+  // Those are only good for telling what doesn't exist.
+  FileStatus listed = listing->second.index->status(i);
+  if (listed.etag.empty())
+    return false;
+  file_status = std::move(listed);
+  ret = 0;
+  return true;
+}
+
+bool CachingAdaptor::is_fresh(std::chrono::steady_clock::time_point validated_time) const
+{
+  if (m_options.pin_versions)
+    return true;
+  return std::chrono::steady_clock::now() - validated_time < m_options.revalidate_interval;
+}
+
+void CachingAdaptor::charge_attributes()
+{
+  // Attributes pinned to versions can't be given back.
+  if (m_options.pin_versions)
+    return;
+  size_t missing = 0;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    const size_t charged = m_attribute_charge.size() * k_attribute_charge_size;
+    if (m_attribute_bytes <= charged)
+      return;
+    missing = m_attribute_bytes - charged;
+  }
+  std::vector<BufferPool::Reservation> charge;
+  bool refused = false;
+  for (size_t bytes = 0; bytes < missing && !refused; bytes += k_attribute_charge_size)
+  {
+    BufferPool::Reservation reservation = g_buffer_pool.try_reserve(k_attribute_charge_size);
+    refused = reservation.size() == 0;
+    if (!refused)
+      charge.emplace_back(std::move(reservation));
+  }
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  for (BufferPool::Reservation& reservation : charge)
+    m_attribute_charge.emplace_back(std::move(reservation));
+  if (refused)
+  {
+    // What doesn't fit the budget isn't kept, oldest first.
+    const size_t charged = m_attribute_charge.size() * k_attribute_charge_size;
+    auto order = m_attribute_order.begin();
+    while (m_attribute_bytes > charged && order != m_attribute_order.end())
+    {
+      auto ite = m_attributes.find(**order);
+      ++order;
+      if (m_pinned.count(ite->first) == 0)
+        erase_attribute(ite);
+    }
+  }
+  release_attribute_charge();
+}
+
+size_t CachingAdaptor::reclaim(size_t bytes)
+{
+  // Dropping what was seen would let the current version of an object show up.
+  if (m_options.pin_versions)
+    return 0;
+  std::lock_guard<std::mutex> guard(m_mutex);
+  // Listings first, since one of them takes as much as many attributes, and least recently
+  // validated first, since those are the next to be revalidated anyway.
+  size_t released = 0;
+  while (released < bytes && !m_listing_order.empty())
+  {
+    auto ite = m_listings.find(*m_listing_order.front());
+    released += ite->second.reservation.size();
+    erase_listing(ite);
+  }
+  const size_t charged = m_attribute_charge.size() * k_attribute_charge_size;
+  auto order = m_attribute_order.begin();
+  while (released + charged - m_attribute_charge.size() * k_attribute_charge_size < bytes
+         && order != m_attribute_order.end())
+  {
+    auto ite = m_attributes.find(**order);
+    ++order;
+    if (m_pinned.count(ite->first) == 0)
+      erase_attribute(ite);
+  }
+  return released + charged - m_attribute_charge.size() * k_attribute_charge_size;
+}
+
+void CachingAdaptor::remember(const std::string& path, const FileStatus& file_status)
+{
+  auto ite = m_attributes.find(path);
+  if (ite != m_attributes.end() && !same_version(ite->second.status, file_status))
+  {
+    drop_blocks(path, ite->second.status);
+    if (m_on_change)
+      m_on_change(path);
+  }
+
+  auto inserted = m_attributes.emplace(path, CachedAttribute());
+  CachedAttribute& attribute = inserted.first->second;
+  if (inserted.second)
+    attribute.order = m_attribute_order.insert(m_attribute_order.end(), &inserted.first->first);
+  else
+    m_attribute_order.splice(m_attribute_order.end(), m_attribute_order, attribute.order);
+  attribute.status = file_status;
+  attribute.validated_time = std::chrono::steady_clock::now();
+  m_attribute_bytes -= attribute.memory_usage;
+  attribute.memory_usage = attribute_usage(path, file_status);
+  m_attribute_bytes += attribute.memory_usage;
+  trim(path);
+}
+
+void CachingAdaptor::forget(const std::string& path)
+{
+  auto ite = m_attributes.find(path);
+  if (ite != m_attributes.end())
+  {
+    drop_blocks(path, ite->second.status);
+    erase_attribute(ite);
+    if (m_on_change)
+      m_on_change(path);
+  }
+  auto listing = m_listings.find(path);
+  if (listing != m_listings.end())
+    erase_listing(listing);
+}
+
+void CachingAdaptor::keep_listing(const std::string& path, CachedListing listing)
+{
+  auto inserted = m_listings.emplace(path, CachedListing());
+  CachedListing& cached = inserted.first->second;
+  if (inserted.second)
+  {
+    listing.order = m_listing_order.insert(m_listing_order.end(), &inserted.first->first);
+  }
+  else
+  {
+    listing.order = cached.order;
+    m_listing_order.splice(m_listing_order.end(), m_listing_order, listing.order);
+  }
+  listing.validated_time = std::chrono::steady_clock::now();
+  m_pinned_listing_bytes += listing.pinned_bytes - cached.pinned_bytes;
+  cached = std::move(listing);
+  trim(path);
+}
+
+void CachingAdaptor::erase_attribute(std::unordered_map<std::string, CachedAttribute>::iterator ite)
+{
+  m_attribute_order.erase(ite->second.order);
+  m_attribute_bytes -= ite->second.memory_usage;
+  m_attributes.erase(ite);
+  release_attribute_charge();
+}
+
+void CachingAdaptor::release_attribute_charge()
+{
+  while (!m_attribute_charge.empty()
+         && (m_attribute_charge.size() - 1) * k_attribute_charge_size >= m_attribute_bytes)
+    m_attribute_charge.pop_back();
+}
+
+void CachingAdaptor::erase_listing(std::unordered_map<std::string, CachedListing>::iterator ite)
+{
+  m_listing_order.erase(ite->second.order);
+  m_pinned_listing_bytes -= ite->second.pinned_bytes;
+  m_listings.erase(ite);
+}
+
+void CachingAdaptor::trim(const std::string& keep)
+{
+  // Dropping what was seen would let the current version of an object show up.
+  if (m_options.pin_versions)
+    return;
+  // Oldest first, and only down to the low-water mark, so that a full cache doesn't drop
+  // everything and have every open file revalidate at once.
+  if (m_attributes.size() > k_max_cached_items)
+  {
+    auto order = m_attribute_order.begin();
+    while (m_attributes.size() > k_trimmed_cached_items && order != m_attribute_order.end())
+    {
+      auto ite = m_attributes.find(**order);
+      ++order;
+      // Pinned files keep theirs, so that their blocks can be unpinned once they change.
+      if (ite->first != keep && m_pinned.count(ite->first) == 0)
+        erase_attribute(ite);
+    }
+  }
+  if (m_listings.size() > k_max_cached_items)
+  {
+    auto order = m_listing_order.begin();
+    while (m_listings.size() > k_trimmed_cached_items && order != m_listing_order.end())
+    {
+      auto ite = m_listings.find(**order);
+      ++order;
+      if (ite->first != keep)
+        erase_listing(ite);
+    }
+  }
+}
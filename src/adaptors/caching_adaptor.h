@@ -0,0 +1,191 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../adaptor.h"
+#include "../block_cache.h"
+#include "../directory_index.h"
+
+struct CacheOptions
+{
+  // Cached attributes and listings are trusted for this long. After that they are revalidated
+  // against the service, and cached data is kept as long as the ETag didn't change.
+  std::chrono::seconds revalidate_interval{60};
+  // If not zero, cached listings and attributes are polled for remote changes at this interval,
+  // even if nobody asks for them.
+  std::chrono::seconds poll_interval{0};
+  // Check cached blocks against checksums taken when they were downloaded, each time they're
+  // read. A corrupted block is downloaded again.
+  bool verify_blocks = false;
+  // Names the container the same way in every mount and process that reads it, so that they share
+  // its cached blocks. Blocks are keyed by the name of the mount if it's empty.
+  std::string object_namespace;
+  // Objects of the same size and Content-MD5 in this namespace share their cached blocks, wherever
+  // they are. Content-MD5 is set by whoever writes an object, so the namespace must only hold
+  // objects that every reader of it may read, like the containers of one account. Blocks are
+  // only keyed by content if it's set.
+  std::string content_namespace;
+  // Show every object as it was when it was first seen, for as long as the mount lives. Cached
+  // attributes and listings are never revalidated or dropped, and data is read from the version
+  // that was seen, if the service keeps versions. Without versions, reading an object that has
+  // changed since fails with ESTALE. Memory grows with the number of objects seen.
+  bool pin_versions = false;
+  // Memory listings may take when pinned to versions. They can't be given back, so they're
+  // kept out of the global memory budget, and listing a directory fails with ENOMEM once this is
+  // used up.
+  size_t pinned_listing_budget = 256 * 1024 * 1024;
+};
+
+// Caches attributes, listings and data of another adaptor. Every cached item records the ETag
+// of the object it came from, so that expiring an item only costs a cheap revalidation and only
+// objects that really changed are dropped.
+class CachingAdaptor : public BaseAdaptor {
+public:
+  // |on_change| is called with the path of every object found to be changed or removed, and of
+  // every directory whose entries changed. It's called with internal locks held, so it must not
+  // block or call back into the adaptor.
+  CachingAdaptor(
+      std::string name,
+      std::shared_ptr<BaseAdaptor> adaptor,
+      std::shared_ptr<BlockCache> block_cache,
+      const CacheOptions& options,
+      std::function<void(const std::string& path)> on_change);
+  ~CachingAdaptor() override;
+
+  int getattr(const std::string& path, FileStatus& file_status) override;
+  int read(const std::string& path, char* buff, size_t size, size_t offset) override;
+  int read_with_options(
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status) override;
+  int list(
+      const std::string& path,
+      std::vector<DirectoryEntry>& directory_entries,
+      std::string& continuation_token) override;
+  // Objects that were never seen are fetched with a read of their first block rather than a HEAD,
+  // which caches both their attributes and the block, unless they're read around the cache.
+  int open(const std::string& path, const ReadOptions& options, FileStatus& file_status) override;
+  int read_buffers(
+      const std::string& path,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<BufferSlice>& slices) override;
+  int set_pinned(const std::string& path, bool pinned) override;
+  bool has_pinned() override;
+  int data_ranges(
+      const std::string& path,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<DataRange>& ranges) override;
+
+private:
+  // Paths of cached items, least recently validated first. They point to the keys of the map the
+  // items are in.
+  using ItemOrder = std::list<const std::string*>;
+
+  struct CachedAttribute
+  {
+    FileStatus status;
+    std::chrono::steady_clock::time_point validated_time;
+    ItemOrder::iterator order;
+    // Roughly, with the path and the nodes holding it.
+    size_t memory_usage = 0;
+  };
+
+  struct CachedListing
+  {
+    // Sorted, so that it also answers getattr of the children.
+    std::shared_ptr<const DirectoryIndex> index;
+    // Charges the listing against the global memory budget, unless it's pinned to versions.
+    BufferPool::Reservation reservation;
+    // What it takes of the pinned listing budget otherwise.
+    size_t pinned_bytes = 0;
+    std::chrono::steady_clock::time_point validated_time;
+    ItemOrder::iterator order;
+  };
+
+  // Answers from cached attributes, or from a fresh listing of the parent if it has an ETag for
+  // |path| or doesn't have |path|. Returns false if neither can tell, and sets |ret| otherwise.
+  // Must be called with m_mutex held.
+  bool find_cached(const std::string& path, FileStatus& file_status, int& ret);
+  // The version reads are pinned to. Its ETag is empty if the object has no version, and only the
+  // ETag is known if the object's attributes aren't cached.
+  int version_to_read(const std::string& path, const ReadOptions& options, FileStatus& version);
+  // Reads through the block cache. |slices| refer to cached blocks.
+  int read_blocks(
+      const std::string& path,
+      const FileStatus& version,
+      size_t size,
+      size_t offset,
+      FileStatus& file_status,
+      std::vector<BufferSlice>& slices);
+  // Updates the cached attributes of |path| with what a follow read returning |ret| found.
+  void follow(const std::string& path, int ret, const FileStatus& file_status);
+  std::string object_key(const std::string& path, const FileStatus& version) const;
+  // Drops the cached blocks of a version of |path| that has changed or gone, or unpins them if
+  // they're shared with other objects of the same content.
+  void drop_blocks(const std::string& path, const FileStatus& version);
+  bool is_fresh(std::chrono::steady_clock::time_point validated_time) const;
+  // Charges cached attributes against the global memory budget, in chunks, and drops the oldest
+  // ones that don't fit. Must be called without m_mutex held, since charging may reclaim.
+  void charge_attributes();
+  // Reclaimer of the global memory budget. Drops the least recently validated listings, then
+  // attributes, and returns the bytes that were charged for them.
+  size_t reclaim(size_t bytes);
+  // Appends the new listing to |directory_entries| unless it's null.
+  int refresh_listing(const std::string& path, std::vector<DirectoryEntry>* directory_entries);
+  void poll_changes();
+
+  // These must be called with m_mutex held.
+  void remember(const std::string& path, const FileStatus& file_status);
+  void forget(const std::string& path);
+  // Caches |listing| for |path|, as the most recently validated listing.
+  void keep_listing(const std::string& path, CachedListing listing);
+  void erase_attribute(std::unordered_map<std::string, CachedAttribute>::iterator ite);
+  void erase_listing(std::unordered_map<std::string, CachedListing>::iterator ite);
+  // Gives back chunks charged for attributes that are no longer cached.
+  void release_attribute_charge();
+  // Drops the least recently validated items beyond the limit, except those of |keep|.
+  void trim(const std::string& keep);
+
+  const std::string m_name;
+  std::shared_ptr<BaseAdaptor> m_adaptor;
+  std::shared_ptr<BlockCache> m_block_cache;
+  const CacheOptions m_options;
+  std::function<void(const std::string& path)> m_on_change;
+
+  std::mutex m_mutex;
+  std::unordered_map<std::string, CachedAttribute> m_attributes;
+  std::unordered_map<std::string, CachedListing> m_listings;
+  ItemOrder m_attribute_order;
+  ItemOrder m_listing_order;
+  // Memory taken by listings pinned to versions.
+  size_t m_pinned_listing_bytes = 0;
+  // Memory taken by cached attributes, and what's charged for it. Attributes pinned to versions
+  // aren't charged, since they can't be given back.
+  size_t m_attribute_bytes = 0;
+  std::vector<BufferPool::Reservation> m_attribute_charge;
+  size_t m_reclaimer_id = 0;
+  // Paths whose blocks are pinned, whatever version of them gets cached.
+  std::unordered_set<std::string> m_pinned;
+
+  std::mutex m_poll_mutex;
+  std::condition_variable m_poll_cv;
+  bool m_stopping = false;
+  std::thread m_poll_thread;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+
+#include "../adaptor.h"
+
+// Exposes internal state of the file system, like statistics, as read-only text files. The
+// content of a file is generated every time it's read.
+class ControlAdaptor : public BaseAdaptor {
+public:
+  ControlAdaptor() : m_last_modified_time(std::chrono::system_clock::now()) {}
+
+  ~ControlAdaptor() override = default;
+
+  // Must be called before the file system is mounted.
+  void add_file(const std::string& name, std::function<std::string()> generator)
+  {
+    m_files.emplace(name, std::move(generator));
+  }
+
+  int getattr(const std::string& path, FileStatus& file_status) override
+  {
+    if (path == ".")
+    {
+      file_status.is_directory = true;
+      file_status.file_size = 0;
+      file_status.last_modified_time = m_last_modified_time;
+      return 0;
+    }
+    auto ite = m_files.find(path);
+    if (ite == m_files.end())
+      return -ENOENT;
+    file_status.is_directory = false;
+    file_status.is_volatile = true;
+    file_status.file_size = ite->second().size();
+    // Content changes all the time. A new modification time on every getattr makes sure the
+    // kernel doesn't serve stale content from its page cache.
+    file_status.last_modified_time = std::chrono::system_clock::now();
+    return 0;
+  }
+
+  int read(const std::string& path, char* buff, size_t size, size_t offset) override
+  {
+    auto ite = m_files.find(path);
+    if (ite == m_files.end())
+      return -ENOENT;
+    std::string content = ite->second();
+    if (offset >= content.size())
+      return 0;
+    size = std::min(size, content.size() - offset);
+    std::memcpy(buff, content.data() + offset, size);
+    return static_cast<int>(size);
+  }
+
+  int list(
+      const std::string& path,
+      std::vector<DirectoryEntry>& directory_entries,
+      std::string& continuation_token) override
+  {
+    if (path != ".")
+      return -ENOTDIR;
+    for (const auto& i : m_files)
+    {
+      DirectoryEntry e;
+      e.name = i.first;
+      e.status.is_directory = false;
+      e.status.file_size = 0;
+      e.status.last_modified_time = std::chrono::system_clock::now();
+      directory_entries.emplace_back(std::move(e));
+    }
+    continuation_token.clear();
+    return 0;
+  }
+
+private:
+  std::chrono::system_clock::time_point m_last_modified_time;
+  std::map<std::string, std::function<std::string()>> m_files;
+};
@@ -0,0 +1,387 @@
+#include "decompressing_adaptor.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+constexpr size_t k_max_cached_indexes = 4096;
+constexpr size_t k_max_virtual_files = 64 * 1024;
+constexpr size_t k_max_cursors = 16;
+
+struct CompressedSuffix
+{
+  const char* suffix;
+  CompressionFormat format;
+};
+
+const CompressedSuffix k_compressed_suffixes[] = {
+    {".gz", CompressionFormat::gzip},
+    {".zst", CompressionFormat::zstd},
+};
+
+std::string child_path(const std::string& path, const std::string& name)
+{
+  return path == "." ? name : path + "/" + name;
+}
+
+bool ends_with(const std::string& s, const std::string& suffix)
+{
+  return s.size() > suffix.size()
+      && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+DecompressingAdaptor::DecompressingAdaptor(
+    std::string name, std::shared_ptr<BaseAdaptor> adaptor, const DecompressOptions& options)
+    : m_name(std::move(name)), m_adaptor(std::move(adaptor)), m_options(options),
+      m_cursors(k_max_cursors)
+{
+}
+
+int DecompressingAdaptor::getattr(const std::string& path, FileStatus& file_status)
+{
+  int ret = m_adaptor->getattr(path, file_status);
+  if (ret != -ENOENT)
+    return ret;
+  // Building the index would download and decompress the whole object, just for ls -l.
+  return virtual_getattr(path, false, file_status);
+}
+
+int DecompressingAdaptor::open(
+    const std::string& path, const ReadOptions& options, FileStatus& file_status)
+{
+  int ret = m_adaptor->open(path, options, file_status);
+  if (ret != -ENOENT)
+    return ret;
+  return virtual_getattr(path, true, file_status);
+}
+
+int DecompressingAdaptor::virtual_getattr(
+    const std::string& path, bool build, FileStatus& file_status)
+{
+  std::string compressed_path;
+  CompressionFormat format;
+  FileStatus compressed_status;
+  int ret = resolve(path, compressed_path, format, compressed_status);
+  if (ret < 0)
+    return ret;
+  std::shared_ptr<const SeekIndex> index;
+  ret = get_index(compressed_path, format, compressed_status, build, index);
+  if (ret < 0 && ret != -EAGAIN)
+    return ret;
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_virtual_files.size() >= k_max_virtual_files)
+      m_virtual_files.clear();
+    VirtualFile& file = m_virtual_files[path];
+    file.compressed_path = compressed_path;
+    file.format = format;
+    file.compressed_status = compressed_status;
+  }
+  // The decompressed file is a version of the compressed object, so it shares its ETag, but not
+  // its MD5. Until its index is built, its size is unknown, and the kernel mustn't keep it.
+  file_status = compressed_status;
+  file_status.file_size = index ? index->uncompressed_size : 0;
+  file_status.is_volatile = !index;
+  file_status.content_md5.clear();
+  return 0;
+}
+
+int DecompressingAdaptor::read(const std::string& path, char* buff, size_t size, size_t offset)
+{
+  FileStatus file_status;
+  return read_with_options(path, buff, size, offset, ReadOptions(), file_status);
+}
+
+int DecompressingAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  std::string compressed_path;
+  CompressionFormat format = CompressionFormat::gzip;
+  FileStatus compressed_status;
+  bool is_virtual = false;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_virtual_files.find(path);
+    if (ite != m_virtual_files.end())
+    {
+      compressed_path = ite->second.compressed_path;
+      format = ite->second.format;
+      compressed_status = ite->second.compressed_status;
+      is_virtual = true;
+    }
+  }
+
+  if (!is_virtual)
+  {
+    int ret = m_adaptor->read_with_options(path, buff, size, offset, options, file_status);
+    if (ret != -ENOENT)
+      return ret;
+    ret = resolve(path, compressed_path, format, compressed_status);
+    if (ret < 0)
+      return ret;
+  }
+  else if (options.if_match.empty() || compressed_status.etag != options.if_match)
+  {
+    // Reads pinned to the version getattr saw don't need to check again, since compressed data
+    // is read with the same pin.
+    int ret = m_adaptor->getattr(compressed_path, compressed_status);
+    if (ret < 0)
+      return ret;
+  }
+  if (!options.if_match.empty() && compressed_status.etag != options.if_match)
+    return -ESTALE;
+
+  std::shared_ptr<const SeekIndex> index;
+  int ret = get_index(compressed_path, format, compressed_status, true, index);
+  if (ret < 0)
+    return ret;
+  file_status = compressed_status;
+  file_status.file_size = index->uncompressed_size;
+  file_status.content_md5.clear();
+  return m_cursors.read(
+      index_key(compressed_path, compressed_status.etag), index,
+      compressed_reader(compressed_path, compressed_status.etag), buff, size, offset);
+}
+
+int DecompressingAdaptor::read_buffers(
+    const std::string& path,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<BufferSlice>& slices)
+{
+  bool is_virtual = false;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    is_virtual = m_virtual_files.count(path) != 0;
+  }
+  // Decompressed data is produced in a buffer of the caller anyway.
+  if (!is_virtual)
+  {
+    int ret = m_adaptor->read_buffers(path, size, offset, options, file_status, slices);
+    if (ret != -ENOENT)
+      return ret;
+  }
+  return BaseAdaptor::read_buffers(path, size, offset, options, file_status, slices);
+}
+
+int DecompressingAdaptor::set_pinned(const std::string& path, bool pinned)
+{
+  int ret = m_adaptor->set_pinned(path, pinned);
+  if (ret != -ENOENT)
+    return ret;
+  // A decompressed file keeps the compressed object it's read from.
+  std::string compressed_path;
+  CompressionFormat format = CompressionFormat::gzip;
+  FileStatus compressed_status;
+  ret = resolve(path, compressed_path, format, compressed_status);
+  if (ret < 0)
+    return ret;
+  return m_adaptor->set_pinned(compressed_path, pinned);
+}
+
+bool DecompressingAdaptor::has_pinned()
+{
+  return m_adaptor->has_pinned();
+}
+
+int DecompressingAdaptor::data_ranges(
+    const std::string& path,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<DataRange>& ranges)
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_virtual_files.count(path) != 0)
+      return -ENOTSUP;
+  }
+  int ret = m_adaptor->data_ranges(path, options, file_status, ranges);
+  // Decompressed files that aren't known yet.
+  return ret == -ENOENT ? -ENOTSUP : ret;
+}
+
+int DecompressingAdaptor::list(
+    const std::string& path,
+    std::vector<DirectoryEntry>& directory_entries,
+    std::string& continuation_token)
+{
+  size_t first = directory_entries.size();
+  int ret = m_adaptor->list(path, directory_entries, continuation_token);
+  if (ret < 0)
+    return ret;
+
+  // Real objects hide decompressed files of the same name. Only objects on the same page can be
+  // told apart this way, which covers the usual case of "name" and "name.gz" listed together.
+  std::unordered_set<std::string> names;
+  size_t last = directory_entries.size();
+  for (size_t i = first; i < last; ++i)
+    names.emplace(directory_entries[i].name);
+  for (size_t i = first; i < last; ++i)
+  {
+    if (directory_entries[i].status.is_directory)
+      continue;
+    for (const auto& s : k_compressed_suffixes)
+    {
+      const std::string& name = directory_entries[i].name;
+      if (!compression_format_supported(s.format) || !ends_with(name, s.suffix))
+        continue;
+      std::string base_name = name.substr(0, name.size() - std::strlen(s.suffix));
+      if (!names.emplace(base_name).second)
+        continue;
+
+      DirectoryEntry e;
+      e.name = std::move(base_name);
+      e.status = directory_entries[i].status;
+      // The size isn't known before the index is built, which opening the file does.
+      e.status.file_size = 0;
+      e.status.content_md5.clear();
+      {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto ite = m_indexes.find(index_key(child_path(path, name), e.status.etag));
+        if (ite != m_indexes.end())
+          e.status.file_size = ite->second->uncompressed_size;
+      }
+      directory_entries.emplace_back(std::move(e));
+    }
+  }
+  return 0;
+}
+
+int DecompressingAdaptor::resolve(
+    const std::string& path,
+    std::string& compressed_path,
+    CompressionFormat& format,
+    FileStatus& compressed_status)
+{
+  for (const auto& s : k_compressed_suffixes)
+  {
+    if (!compression_format_supported(s.format))
+      continue;
+    std::string candidate = path + s.suffix;
+    int ret = m_adaptor->getattr(candidate, compressed_status);
+    if (ret == -ENOENT || (ret == 0 && compressed_status.is_directory))
+      continue;
+    if (ret < 0)
+      return ret;
+    compressed_path = std::move(candidate);
+    format = s.format;
+    return 0;
+  }
+  return -ENOENT;
+}
+
+int DecompressingAdaptor::get_index(
+    const std::string& compressed_path,
+    CompressionFormat format,
+    const FileStatus& compressed_status,
+    bool build,
+    std::shared_ptr<const SeekIndex>& index)
+{
+  const std::string key = index_key(compressed_path, compressed_status.etag);
+  {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    while (true)
+    {
+      auto ite = m_indexes.find(key);
+      if (ite != m_indexes.end())
+      {
+        index = ite->second;
+        return 0;
+      }
+      if (m_building.count(key) == 0)
+        break;
+      if (!build)
+        return -EAGAIN;
+      m_cv.wait(guard);
+    }
+    m_building.emplace(key);
+  }
+
+  auto new_index = std::make_shared<SeekIndex>();
+  new_index->format = format;
+  std::string filename;
+  if (!m_options.index_directory.empty() && !compressed_status.etag.empty())
+    filename = m_options.index_directory + "/" + index_filename(key);
+  int ret = 0;
+  try
+  {
+    // A saved index costs nothing to load, so that's done even when nothing may be built.
+    if (filename.empty() || !new_index->load(filename, key))
+    {
+      if (!build)
+        ret = -EAGAIN;
+    }
+    else
+    {
+      build = false;
+    }
+    if (build)
+    {
+      new_index->compressed_begin = 0;
+      new_index->compressed_end = compressed_status.file_size;
+      ret = build_seek_index(
+          compressed_reader(compressed_path, compressed_status.etag),
+          m_options.checkpoint_interval, *new_index);
+      if (ret == 0 && !filename.empty())
+        new_index->save(filename, key);
+    }
+  }
+  catch (...)
+  {
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_building.erase(key);
+    }
+    m_cv.notify_all();
+    throw;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_building.erase(key);
+    if (ret == 0)
+    {
+      m_indexes.emplace(key, new_index);
+      m_index_order.emplace_back(key);
+      while (m_index_order.size() > k_max_cached_indexes)
+      {
+        m_indexes.erase(m_index_order.front());
+        m_index_order.pop_front();
+      }
+    }
+  }
+  m_cv.notify_all();
+  if (ret < 0)
+    return ret;
+  index = std::move(new_index);
+  return 0;
+}
+
+std::string DecompressingAdaptor::index_key(
+    const std::string& compressed_path, const std::string& etag) const
+{
+  return m_name + '\n' + compressed_path + '\n' + etag;
+}
+
+RangeReader DecompressingAdaptor::compressed_reader(
+    const std::string& compressed_path, const std::string& etag)
+{
+  auto adaptor = m_adaptor;
+  return [adaptor, compressed_path, etag](char* buff, size_t size, uint64_t offset) {
+    ReadOptions options;
+    options.if_match = etag;
+    FileStatus file_status;
+    return adaptor->read_with_options(
+        compressed_path, buff, size, static_cast<size_t>(offset), options, file_status);
+  };
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "../adaptor.h"
+#include "../seek_index.h"
+
+struct DecompressOptions
+{
+  // Seek points are placed about this many uncompressed bytes apart. A random read decompresses
+  // half of this on average before it gets to its data.
+  uint64_t checkpoint_interval = 16 * 1024 * 1024;
+  // Seek indexes are saved in this directory, so that they survive restarts. Empty means they're
+  // only kept in memory.
+  std::string index_directory;
+};
+
+// Shows every "name.gz" and "name.zst" file of another adaptor as a decompressed "name" file too,
+// unless there's already an object of that name. The first time a version of a compressed file is
+// opened it's decompressed once to build a seek index, which lets reads at any offset start
+// decompressing close to where they are. Until then, its size shows up as 0.
+class DecompressingAdaptor : public BaseAdaptor {
+public:
+  DecompressingAdaptor(
+      std::string name, std::shared_ptr<BaseAdaptor> adaptor, const DecompressOptions& options);
+  ~DecompressingAdaptor() override = default;
+
+  int getattr(const std::string& path, FileStatus& file_status) override;
+  // Builds the seek index of decompressed files, which tells their size.
+  int open(const std::string& path, const ReadOptions& options, FileStatus& file_status) override;
+  int read(const std::string& path, char* buff, size_t size, size_t offset) override;
+  int read_with_options(
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status) override;
+  int list(
+      const std::string& path,
+      std::vector<DirectoryEntry>& directory_entries,
+      std::string& continuation_token) override;
+  int read_buffers(
+      const std::string& path,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<BufferSlice>& slices) override;
+  int set_pinned(const std::string& path, bool pinned) override;
+  bool has_pinned() override;
+  int data_ranges(
+      const std::string& path,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<DataRange>& ranges) override;
+
+private:
+  struct VirtualFile
+  {
+    std::string compressed_path;
+    CompressionFormat format;
+    FileStatus compressed_status;
+  };
+
+  // Finds the compressed object behind the decompressed file |path|. Returns -ENOENT if there
+  // isn't one.
+  int resolve(
+      const std::string& path,
+      std::string& compressed_path,
+      CompressionFormat& format,
+      FileStatus& compressed_status);
+  // Attributes of the decompressed file |path|. Its size is only looked up if the seek index is
+  // at hand or |build| says to build it.
+  int virtual_getattr(const std::string& path, bool build, FileStatus& file_status);
+  // Looks up the seek index of one version of a compressed object. If it has to be built, which
+  // decompresses the whole object, that's done if |build| is set, and -EAGAIN is returned
+  // otherwise.
+  int get_index(
+      const std::string& compressed_path,
+      CompressionFormat format,
+      const FileStatus& compressed_status,
+      bool build,
+      std::shared_ptr<const SeekIndex>& index);
+  std::string index_key(const std::string& compressed_path, const std::string& etag) const;
+  RangeReader compressed_reader(const std::string& compressed_path, const std::string& etag);
+
+  const std::string m_name;
+  std::shared_ptr<BaseAdaptor> m_adaptor;
+  const DecompressOptions m_options;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::unordered_map<std::string, std::shared_ptr<const SeekIndex>> m_indexes;
+  // Keys of m_indexes, oldest first.
+  std::deque<std::string> m_index_order;
+  // Keys of indexes being built, so that each is built only once.
+  std::unordered_set<std::string> m_building;
+  // Decompressed paths that getattr found, and the compressed objects behind them.
+  std::unordered_map<std::string, VirtualFile> m_virtual_files;
+  DecompressorCache m_cursors;
+};
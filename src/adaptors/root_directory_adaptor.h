@@ -2,9 +2,9 @@
 
 #include <cstdlib>
 #include <cstring>
-#include <map>
 
 #include "../adaptor.h"
+#include "../adaptor_registry.h"
 
 class RootDirectoryAdaptor : public BaseAdaptor {
 public:
@@ -43,18 +43,8 @@ public:
     if (path == ".")
     {
       directory_entries.clear();
-      for (auto i : g_adaptors)
-      {
-        if (i.first.empty())
-          continue;
-        DirectoryEntry e;
-        e.name = i.first;
-        e.status.is_directory = true;
-        e.status.file_size = 0;
-        directory_entries.emplace_back(std::move(e));
-      }
       continuation_token.clear();
-      return 0;
+      return g_adaptors.list(directory_entries);
     }
     std::abort();
   }
@@ -0,0 +1,71 @@
+#include "scheduling_adaptor.h"
+
+#include <algorithm>
+
+namespace {
+IoPriority effective_priority(IoPriority request_priority)
+{
+  return std::max(request_priority, IoPriorityScope::current());
+}
+} // namespace
+
+SchedulingAdaptor::SchedulingAdaptor(
+    std::shared_ptr<BaseAdaptor> adaptor, std::shared_ptr<Scheduler> scheduler)
+    : m_adaptor(std::move(adaptor)), m_scheduler(std::move(scheduler))
+{
+}
+
+int SchedulingAdaptor::getattr(const std::string& path, FileStatus& file_status)
+{
+  auto permit = m_scheduler->admit(
+      effective_priority(IoPriority::metadata), 0, IoPriorityScope::internal());
+  if (!permit.admitted())
+    return -EAGAIN;
+  return m_adaptor->getattr(path, file_status);
+}
+
+int SchedulingAdaptor::read(const std::string& path, char* buff, size_t size, size_t offset)
+{
+  FileStatus file_status;
+  return read_with_options(path, buff, size, offset, ReadOptions(), file_status);
+}
+
+int SchedulingAdaptor::read_with_options(
+    const std::string& path,
+    char* buff,
+    size_t size,
+    size_t offset,
+    const ReadOptions& options,
+    FileStatus& file_status)
+{
+  auto permit = m_scheduler->admit(
+      effective_priority(IoPriority::foreground_read), size, IoPriorityScope::internal());
+  if (!permit.admitted())
+    return -EAGAIN;
+  return m_adaptor->read_with_options(path, buff, size, offset, options, file_status);
+}
+
+int SchedulingAdaptor::list(
+    const std::string& path,
+    std::vector<DirectoryEntry>& directory_entries,
+    std::string& continuation_token)
+{
+  auto permit = m_scheduler->admit(
+      effective_priority(IoPriority::metadata), 0, IoPriorityScope::internal());
+  if (!permit.admitted())
+    return -EAGAIN;
+  return m_adaptor->list(path, directory_entries, continuation_token);
+}
+
+int SchedulingAdaptor::data_ranges(
+    const std::string& path,
+    const ReadOptions& options,
+    FileStatus& file_status,
+    std::vector<DataRange>& ranges)
+{
+  auto permit = m_scheduler->admit(
+      effective_priority(IoPriority::metadata), 0, IoPriorityScope::internal());
+  if (!permit.admitted())
+    return -EAGAIN;
+  return m_adaptor->data_ranges(path, options, file_status, ranges);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../adaptor.h"
+#include "../scheduler.h"
+
+// Passes requests to another adaptor once the scheduler of the mount admits them. Reads are
+// foreground reads and getattr and list are metadata requests, unless the calling thread is in a
+// lower priority IoPriorityScope. Internal prefetch and warm-up requests the scheduler turns away
+// fail with -EAGAIN.
+class SchedulingAdaptor : public BaseAdaptor {
+public:
+  SchedulingAdaptor(std::shared_ptr<BaseAdaptor> adaptor, std::shared_ptr<Scheduler> scheduler);
+  ~SchedulingAdaptor() override = default;
+
+  int getattr(const std::string& path, FileStatus& file_status) override;
+  int read(const std::string& path, char* buff, size_t size, size_t offset) override;
+  int read_with_options(
+      const std::string& path,
+      char* buff,
+      size_t size,
+      size_t offset,
+      const ReadOptions& options,
+      FileStatus& file_status) override;
+  int list(
+      const std::string& path,
+      std::vector<DirectoryEntry>& directory_entries,
+      std::string& continuation_token) override;
+  int data_ranges(
+      const std::string& path,
+      const ReadOptions& options,
+      FileStatus& file_status,
+      std::vector<DataRange>& ranges) override;
+
+private:
+  std::shared_ptr<BaseAdaptor> m_adaptor;
+  std::shared_ptr<Scheduler> m_scheduler;
+};
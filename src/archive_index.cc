@@ -0,0 +1,583 @@
+#include "archive_index.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#include "index_file.h"
+
+namespace {
+constexpr char k_index_magic[8] = {'A', 'Z', 'F', 'S', 'A', 'R', 'C', '1'};
+constexpr size_t k_max_member_path = 64 * 1024;
+// Tar headers are read in windows, so that the headers of small members come in a few reads
+// rather than one read per member. Windows grow while headers follow each other closely, and
+// shrink again after skipping a large member.
+constexpr size_t k_min_tar_scan_window = 4 * 1024;
+constexpr size_t k_max_tar_scan_window = 256 * 1024;
+constexpr size_t k_tar_block_size = 512;
+// Upper bound of the central directory of a zip archive, so that a corrupt size doesn't run the
+// process out of memory.
+constexpr uint64_t k_max_zip_central_directory = 1024ULL * 1024 * 1024;
+
+constexpr uint32_t k_zip_eocd_signature = 0x06054b50;
+constexpr size_t k_zip_eocd_size = 22;
+constexpr uint32_t k_zip64_eocd_locator_signature = 0x07064b50;
+constexpr size_t k_zip64_eocd_locator_size = 20;
+constexpr uint32_t k_zip64_eocd_signature = 0x06064b50;
+constexpr size_t k_zip64_eocd_size = 56;
+constexpr uint32_t k_zip_central_header_signature = 0x02014b50;
+constexpr size_t k_zip_central_header_size = 46;
+constexpr uint32_t k_zip_local_header_signature = 0x04034b50;
+
+uint16_t le16(const char* p)
+{
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return static_cast<uint16_t>(u[0] | (u[1] << 8));
+}
+
+uint32_t le32(const char* p)
+{
+  return static_cast<uint32_t>(le16(p)) | (static_cast<uint32_t>(le16(p + 2)) << 16);
+}
+
+uint64_t le64(const char* p)
+{
+  return static_cast<uint64_t>(le32(p)) | (static_cast<uint64_t>(le32(p + 4)) << 32);
+}
+
+// Reads exactly |size| bytes, or fails with -EIO if the object ends before that.
+int read_fully(const RangeReader& reader, char* buff, size_t size, uint64_t offset)
+{
+  size_t done = 0;
+  while (done < size)
+  {
+    size_t n_wanted = std::min<size_t>(size - done, 16 * 1024 * 1024);
+    int ret = reader(buff + done, n_wanted, offset + done);
+    if (ret < 0)
+      return ret;
+    if (ret == 0)
+      return -EIO;
+    done += ret;
+  }
+  return 0;
+}
+
+std::chrono::system_clock::time_point from_time_t(int64_t t)
+{
+  return std::chrono::system_clock::time_point(std::chrono::seconds(t));
+}
+
+// Zip timestamps are in local time.
+std::chrono::system_clock::time_point from_dos_time(uint16_t date, uint16_t time)
+{
+  std::tm tm;
+  std::memset(&tm, 0, sizeof(tm));
+  tm.tm_year = ((date >> 9) & 0x7f) + 80;
+  tm.tm_mon = ((date >> 5) & 0x0f) - 1;
+  tm.tm_mday = date & 0x1f;
+  tm.tm_hour = (time >> 11) & 0x1f;
+  tm.tm_min = (time >> 5) & 0x3f;
+  tm.tm_sec = (time & 0x1f) * 2;
+  tm.tm_isdst = -1;
+  std::time_t t = std::mktime(&tm);
+  return from_time_t(t == -1 ? 0 : t);
+}
+
+// Numeric fields of tar headers are octal text, or big-endian binary if the top bit is set.
+uint64_t parse_tar_number(const char* field, size_t size)
+{
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(field);
+  uint64_t value = 0;
+  if (u[0] & 0x80)
+  {
+    value = u[0] & 0x7f;
+    for (size_t i = 1; i < size; ++i)
+      value = (value << 8) | u[i];
+    return value;
+  }
+  size_t i = 0;
+  while (i < size && (field[i] == ' ' || field[i] == '\0'))
+    ++i;
+  for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i)
+    value = value * 8 + (field[i] - '0');
+  return value;
+}
+
+std::string tar_string(const char* field, size_t size)
+{
+  return std::string(field, strnlen(field, size));
+}
+
+bool tar_checksum_ok(const char* header)
+{
+  uint64_t expected = parse_tar_number(header + 148, 8);
+  uint64_t sum = 0;
+  for (size_t i = 0; i < k_tar_block_size; ++i)
+    sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+  return sum == expected;
+}
+
+// Records of pax extended headers look like "30 path=some/long/file/name\n".
+void parse_pax_records(const std::string& data, std::string& path, uint64_t& size, bool& has_size)
+{
+  size_t pos = 0;
+  while (pos < data.size())
+  {
+    size_t space = data.find(' ', pos);
+    if (space == std::string::npos)
+      return;
+    size_t length = std::strtoull(data.data() + pos, nullptr, 10);
+    if (length == 0 || pos + length > data.size())
+      return;
+    std::string record = data.substr(space + 1, pos + length - space - 2);
+    size_t equals = record.find('=');
+    if (equals != std::string::npos)
+    {
+      std::string key = record.substr(0, equals);
+      std::string value = record.substr(equals + 1);
+      if (key == "path")
+      {
+        path = value;
+      }
+      else if (key == "size")
+      {
+        size = std::strtoull(value.data(), nullptr, 10);
+        has_size = true;
+      }
+    }
+    pos += length;
+  }
+}
+
+// Returns false if |path| has no components, or would escape the archive.
+bool normalize_member_path(std::string& path)
+{
+  std::string normalized;
+  size_t pos = 0;
+  while (pos <= path.size())
+  {
+    size_t slash = path.find('/', pos);
+    if (slash == std::string::npos)
+      slash = path.size();
+    std::string component = path.substr(pos, slash - pos);
+    pos = slash + 1;
+    if (component.empty() || component == ".")
+      continue;
+    if (component == "..")
+      return false;
+    if (!normalized.empty())
+      normalized += '/';
+    normalized += component;
+  }
+  path = std::move(normalized);
+  return !path.empty();
+}
+
+std::string parent_path(const std::string& path)
+{
+  auto i = path.rfind('/');
+  return i == std::string::npos ? "." : path.substr(0, i);
+}
+} // namespace
+
+const ArchiveMember* ArchiveIndex::find(const std::string& path) const
+{
+  auto ite = m_by_path.find(path);
+  return ite == m_by_path.end() ? nullptr : &m_members[ite->second];
+}
+
+const std::vector<size_t>& ArchiveIndex::children(const std::string& path) const
+{
+  static const std::vector<size_t> k_no_children;
+  auto ite = m_children.find(path);
+  return ite == m_children.end() ? k_no_children : ite->second;
+}
+
+size_t ArchiveIndex::memory_usage() const
+{
+  size_t usage = sizeof(*this) + m_members.capacity() * sizeof(ArchiveMember);
+  for (const auto& m : m_members)
+    usage += m.path.capacity();
+  // Lookup tables hold about as much as the members again.
+  return usage * 2;
+}
+
+int ArchiveIndex::build(ArchiveFormat format, const RangeReader& reader, uint64_t archive_size)
+{
+  m_format = format;
+  m_members.clear();
+  int ret = format == ArchiveFormat::zip ? build_zip(reader, archive_size)
+                                         : build_tar(reader, archive_size);
+  if (ret < 0)
+    return ret;
+  finish();
+  return 0;
+}
+
+int ArchiveIndex::build_zip(const RangeReader& reader, uint64_t archive_size)
+{
+  // The end of central directory record is at the end, followed only by a comment of up to 64 KiB.
+  // A zip64 locator may come right before it.
+  size_t tail_size = static_cast<size_t>(std::min<uint64_t>(
+      archive_size, k_zip_eocd_size + 0xffff + k_zip64_eocd_locator_size));
+  if (tail_size < k_zip_eocd_size)
+    return -EIO;
+  uint64_t tail_offset = archive_size - tail_size;
+  std::string tail(tail_size, '\0');
+  int ret = read_fully(reader, &tail[0], tail_size, tail_offset);
+  if (ret < 0)
+    return ret;
+
+  size_t eocd = std::string::npos;
+  for (size_t i = tail_size - k_zip_eocd_size + 1; i-- > 0;)
+  {
+    if (le32(&tail[i]) == k_zip_eocd_signature
+        && i + k_zip_eocd_size + le16(&tail[i + 20]) <= tail_size)
+    {
+      eocd = i;
+      break;
+    }
+  }
+  if (eocd == std::string::npos)
+    return -EIO;
+
+  uint64_t num_entries = le16(&tail[eocd + 10]);
+  uint64_t directory_size = le32(&tail[eocd + 12]);
+  uint64_t directory_offset = le32(&tail[eocd + 16]);
+  if (num_entries == 0xffff || directory_size == 0xffffffff || directory_offset == 0xffffffff)
+  {
+    if (eocd < k_zip64_eocd_locator_size)
+      return -EIO;
+    const char* locator = &tail[eocd - k_zip64_eocd_locator_size];
+    if (le32(locator) != k_zip64_eocd_locator_signature)
+      return -EIO;
+    char zip64_eocd[k_zip64_eocd_size];
+    ret = read_fully(reader, zip64_eocd, sizeof(zip64_eocd), le64(locator + 8));
+    if (ret < 0)
+      return ret;
+    if (le32(zip64_eocd) != k_zip64_eocd_signature)
+      return -EIO;
+    num_entries = le64(zip64_eocd + 32);
+    directory_size = le64(zip64_eocd + 40);
+    directory_offset = le64(zip64_eocd + 48);
+  }
+  if (directory_size > k_max_zip_central_directory || directory_offset > archive_size
+      || directory_size > archive_size - directory_offset)
+    return -EIO;
+
+  std::string directory(static_cast<size_t>(directory_size), '\0');
+  ret = read_fully(reader, &directory[0], directory.size(), directory_offset);
+  if (ret < 0)
+    return ret;
+
+  size_t pos = 0;
+  for (uint64_t i = 0; i < num_entries; ++i)
+  {
+    if (pos + k_zip_central_header_size > directory.size())
+      return -EIO;
+    const char* h = &directory[pos];
+    if (le32(h) != k_zip_central_header_signature)
+      return -EIO;
+    uint16_t flags = le16(h + 8);
+    uint16_t method = le16(h + 10);
+    uint16_t dos_time = le16(h + 12);
+    uint16_t dos_date = le16(h + 14);
+    uint64_t compressed_size = le32(h + 20);
+    uint64_t size = le32(h + 24);
+    size_t name_length = le16(h + 28);
+    size_t extra_length = le16(h + 30);
+    size_t comment_length = le16(h + 32);
+    uint64_t offset = le32(h + 42);
+    size_t entry_size = k_zip_central_header_size + name_length + extra_length + comment_length;
+    if (pos + entry_size > directory.size())
+      return -EIO;
+
+    ArchiveMember member;
+    member.path = directory.substr(pos + k_zip_central_header_size, name_length);
+    member.is_directory = !member.path.empty() && member.path.back() == '/';
+    member.method = method;
+    member.last_modified_time = from_dos_time(dos_date, dos_time);
+
+    const char* extra = h + k_zip_central_header_size + name_length;
+    size_t extra_pos = 0;
+    while (extra_pos + 4 <= extra_length)
+    {
+      uint16_t id = le16(extra + extra_pos);
+      size_t length = le16(extra + extra_pos + 2);
+      const char* data = extra + extra_pos + 4;
+      if (extra_pos + 4 + length > extra_length)
+        break;
+      if (id == 0x0001)
+      {
+        // Zip64 extended information has the 64-bit values of exactly those fields that are
+        // saturated, in this order.
+        size_t field = 0;
+        if (size == 0xffffffff && field + 8 <= length)
+        {
+          size = le64(data + field);
+          field += 8;
+        }
+        if (compressed_size == 0xffffffff && field + 8 <= length)
+        {
+          compressed_size = le64(data + field);
+          field += 8;
+        }
+        if (offset == 0xffffffff && field + 8 <= length)
+          offset = le64(data + field);
+      }
+      else if (id == 0x5455 && length >= 5 && (data[0] & 1))
+      {
+        // Extended timestamp, in UTC.
+        member.last_modified_time = from_time_t(static_cast<int32_t>(le32(data + 1)));
+      }
+      extra_pos += 4 + length;
+    }
+    pos += entry_size;
+
+    // Encrypted members can't be read. Let them show up anyway, reading fails.
+    if (flags & 1)
+      member.method = 0xffff;
+    member.offset = offset;
+    member.compressed_size = compressed_size;
+    member.size = size;
+    if (!member.is_directory && offset >= archive_size)
+      return -EIO;
+    m_members.emplace_back(std::move(member));
+  }
+  return 0;
+}
+
+int ArchiveIndex::build_tar(const RangeReader& reader, uint64_t archive_size)
+{
+  std::string window;
+  uint64_t window_offset = 0;
+  size_t window_size = k_min_tar_scan_window;
+  // Makes [offset, offset + k_tar_block_size) available in |window|.
+  auto fetch_header = [&](uint64_t offset) -> const char* {
+    if (offset >= window_offset && offset + k_tar_block_size <= window_offset + window.size())
+      return &window[offset - window_offset];
+    if (offset == window_offset + window.size())
+      window_size = std::min(window_size * 2, k_max_tar_scan_window);
+    else
+      window_size = k_min_tar_scan_window;
+    size_t size = static_cast<size_t>(std::min<uint64_t>(window_size, archive_size - offset));
+    window.resize(size);
+    window_offset = offset;
+    if (size < k_tar_block_size || read_fully(reader, &window[0], size, offset) < 0)
+    {
+      window.clear();
+      return nullptr;
+    }
+    return window.data();
+  };
+
+  std::string long_name;
+  std::string pax_path;
+  uint64_t pax_size = 0;
+  bool has_pax_size = false;
+  uint64_t offset = 0;
+  while (offset + k_tar_block_size <= archive_size)
+  {
+    const char* header = fetch_header(offset);
+    if (!header)
+      return -EIO;
+    // The archive ends with zero blocks.
+    if (std::all_of(header, header + k_tar_block_size, [](char c) { return c == '\0'; }))
+      break;
+    if (!tar_checksum_ok(header))
+      return -EIO;
+
+    char type = header[156];
+    uint64_t size = parse_tar_number(header + 124, 12);
+    bool is_member = type == '0' || type == '\0' || type == '7' || type == '5';
+    if (is_member && has_pax_size)
+      size = pax_size;
+    uint64_t data_offset = offset + k_tar_block_size;
+    if (size > archive_size - std::min(archive_size, data_offset))
+      return -EIO;
+
+    if (type == 'L' || type == 'x')
+    {
+      // GNU long name, or pax extended header, for the next member.
+      if (size > k_max_member_path)
+        return -EIO;
+      std::string data(static_cast<size_t>(size), '\0');
+      int ret = read_fully(reader, &data[0], data.size(), data_offset);
+      if (ret < 0)
+        return ret;
+      if (type == 'L')
+        long_name = data.substr(0, strnlen(data.data(), data.size()));
+      else
+        parse_pax_records(data, pax_path, pax_size, has_pax_size);
+    }
+    else if (type != 'g' && type != 'K')
+    {
+      if (is_member)
+      {
+        ArchiveMember member;
+        if (!pax_path.empty())
+        {
+          member.path = pax_path;
+        }
+        else if (!long_name.empty())
+        {
+          member.path = long_name;
+        }
+        else
+        {
+          member.path = tar_string(header, 100);
+          std::string prefix = tar_string(header + 345, 155);
+          if (std::memcmp(header + 257, "ustar", 5) == 0 && !prefix.empty())
+            member.path = prefix + "/" + member.path;
+        }
+        member.is_directory = type == '5' || (!member.path.empty() && member.path.back() == '/');
+        member.offset = data_offset;
+        member.size = member.is_directory ? 0 : size;
+        member.compressed_size = member.size;
+        member.last_modified_time = from_time_t(
+            static_cast<int64_t>(parse_tar_number(header + 136, 12)));
+        m_members.emplace_back(std::move(member));
+      }
+      // Links, devices and such are skipped.
+      long_name.clear();
+      pax_path.clear();
+      has_pax_size = false;
+    }
+    offset = data_offset + (size + k_tar_block_size - 1) / k_tar_block_size * k_tar_block_size;
+  }
+  return 0;
+}
+
+void ArchiveIndex::finish()
+{
+  std::vector<ArchiveMember> members;
+  members.reserve(m_members.size());
+  std::unordered_map<std::string, size_t> by_path;
+  for (auto& m : m_members)
+  {
+    if (!normalize_member_path(m.path))
+      continue;
+    // Later members replace earlier ones of the same path, like extracting the archive would.
+    auto ite = by_path.find(m.path);
+    if (ite != by_path.end())
+    {
+      members[ite->second] = std::move(m);
+      continue;
+    }
+    by_path.emplace(m.path, members.size());
+    members.emplace_back(std::move(m));
+  }
+
+  // Archives don't need to have members for directories.
+  for (size_t i = 0; i < members.size(); ++i)
+  {
+    std::string parent = parent_path(members[i].path);
+    while (parent != "." && by_path.count(parent) == 0)
+    {
+      ArchiveMember directory;
+      directory.path = parent;
+      directory.is_directory = true;
+      directory.last_modified_time = members[i].last_modified_time;
+      by_path.emplace(parent, members.size());
+      members.emplace_back(std::move(directory));
+      parent = parent_path(members.back().path);
+    }
+  }
+  m_members = std::move(members);
+  build_lookup();
+}
+
+void ArchiveIndex::build_lookup()
+{
+  m_by_path.clear();
+  m_children.clear();
+  for (size_t i = 0; i < m_members.size(); ++i)
+  {
+    m_by_path.emplace(m_members[i].path, i);
+    m_children[parent_path(m_members[i].path)].emplace_back(i);
+  }
+}
+
+bool ArchiveIndex::load(const std::string& filename, const std::string& key)
+{
+  std::ifstream fin(filename, std::ios::binary);
+  if (!fin.is_open())
+    return false;
+  char magic[sizeof(k_index_magic)];
+  if (!fin.read(magic, sizeof(magic)) || std::memcmp(magic, k_index_magic, sizeof(magic)) != 0)
+    return false;
+  std::string saved_key;
+  if (!read_string(fin, saved_key, key.size()) || saved_key != key)
+    return false;
+
+  uint8_t format;
+  uint64_t num_members;
+  if (!read_value(fin, format) || !read_value(fin, num_members))
+    return false;
+  m_format = static_cast<ArchiveFormat>(format);
+  m_members.clear();
+  for (uint64_t i = 0; i < num_members; ++i)
+  {
+    ArchiveMember m;
+    uint8_t is_directory;
+    int64_t last_modified_time;
+    if (!read_string(fin, m.path, k_max_member_path) || !read_value(fin, is_directory)
+        || !read_value(fin, m.offset) || !read_value(fin, m.compressed_size)
+        || !read_value(fin, m.size) || !read_value(fin, m.method)
+        || !read_value(fin, last_modified_time))
+      return false;
+    m.is_directory = is_directory != 0;
+    m.last_modified_time = from_time_t(last_modified_time);
+    m_members.emplace_back(std::move(m));
+  }
+  build_lookup();
+  return true;
+}
+
+void ArchiveIndex::save(const std::string& filename, const std::string& key) const
+{
+  // Written aside and renamed into place, so that readers never see a partial index.
+  const std::string temp = temp_filename(filename);
+  {
+    std::ofstream fout(temp, std::ios::binary | std::ios::trunc);
+    if (!fout.is_open())
+      return;
+    fout.write(k_index_magic, sizeof(k_index_magic));
+    write_string(fout, key);
+    write_value(fout, static_cast<uint8_t>(m_format));
+    write_value(fout, static_cast<uint64_t>(m_members.size()));
+    for (const auto& m : m_members)
+    {
+      write_string(fout, m.path);
+      write_value(fout, static_cast<uint8_t>(m.is_directory));
+      write_value(fout, m.offset);
+      write_value(fout, m.compressed_size);
+      write_value(fout, m.size);
+      write_value(fout, m.method);
+      write_value(
+          fout,
+          static_cast<int64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                                   m.last_modified_time.time_since_epoch())
+                                   .count()));
+    }
+    if (!fout.flush())
+    {
+      fout.close();
+      std::remove(temp.data());
+      return;
+    }
+  }
+  if (std::rename(temp.data(), filename.data()) != 0)
+    std::remove(temp.data());
+}
+
+uint64_t zip_data_offset(const ArchiveMember& member, const char* header)
+{
+  if (le32(header) != k_zip_local_header_signature)
+    return 0;
+  return member.offset + k_zip_local_header_size + le16(header + 26) + le16(header + 28);
+}
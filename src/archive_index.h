@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "seek_index.h"
+
+enum class ArchiveFormat : uint8_t
+{
+  zip = 1,
+  tar = 2,
+};
+
+struct ArchiveMember
+{
+  // Relative to the root of the archive, without leading or trailing slashes.
+  std::string path;
+  bool is_directory = false;
+  // Tar: offset of the data. Zip: offset of the local file header, which comes before the data
+  // and whose size is only known after reading it.
+  uint64_t offset = 0;
+  uint64_t compressed_size = 0;
+  uint64_t size = 0;
+  // Zip compression method. 0 is stored and 8 is deflate. Always 0 for tar.
+  uint16_t method = 0;
+  std::chrono::system_clock::time_point last_modified_time;
+};
+
+// The members of a zip or tar archive, read from the zip central directory or by skipping from
+// one tar header to the next. Neither needs more than a few ranged reads for an archive of large
+// members.
+class ArchiveIndex {
+public:
+  ArchiveFormat format() const { return m_format; }
+  const std::vector<ArchiveMember>& members() const { return m_members; }
+
+  // Returns nullptr if there's no member at |path|. The root directory isn't a member.
+  const ArchiveMember* find(const std::string& path) const;
+  // Indexes of the members right inside the directory |path|, which is "." for the root.
+  const std::vector<size_t>& children(const std::string& path) const;
+  size_t memory_usage() const;
+
+  // Returns 0, -EIO if the archive is corrupt, or the error of |reader|.
+  int build(ArchiveFormat format, const RangeReader& reader, uint64_t archive_size);
+
+  // |key| identifies the archive and its version. Returns false if the file doesn't exist, is
+  // corrupt or belongs to another key.
+  bool load(const std::string& filename, const std::string& key);
+  // Failing to save isn't an error, the index is simply built again next time.
+  void save(const std::string& filename, const std::string& key) const;
+
+private:
+  int build_zip(const RangeReader& reader, uint64_t archive_size);
+  int build_tar(const RangeReader& reader, uint64_t archive_size);
+  // Normalizes member paths, drops members that would escape the archive, makes up missing parent
+  // directories and builds the lookup tables.
+  void finish();
+  void build_lookup();
+
+  ArchiveFormat m_format = ArchiveFormat::zip;
+  std::vector<ArchiveMember> m_members;
+  std::unordered_map<std::string, size_t> m_by_path;
+  std::unordered_map<std::string, std::vector<size_t>> m_children;
+};
+
+constexpr size_t k_zip_local_header_size = 30;
+
+// Offset of the data of a zip member, from the first k_zip_local_header_size bytes at its offset.
+// Returns 0 if the header is corrupt.
+uint64_t zip_data_offset(const ArchiveMember& member, const char* header);
@@ -0,0 +1,313 @@
+#include "block_cache.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "crc64.h"
+
+BlockCache::BlockCache(size_t block_size, size_t capacity)
+    : m_block_size(block_size), m_capacity(capacity)
+{
+}
+
+void BlockCache::add_tier(std::shared_ptr<Tier> tier) { m_tiers.emplace_back(std::move(tier)); }
+
+BlockCache::Block BlockCache::get(
+    const std::string& object_key, size_t block_index, Checksums* checksums)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  Block block = find(object_key, block_index, checksums);
+  if (block)
+    ++m_num_hits;
+  return block;
+}
+
+void BlockCache::put(
+    const std::string& object_key,
+    size_t block_index,
+    Block block,
+    Checksums checksums,
+    bool pinned)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  insert(object_key, block_index, std::move(block), std::move(checksums), pinned);
+}
+
+int BlockCache::get_or_load(
+    const std::string& object_key,
+    size_t block_index,
+    const Loader& load,
+    bool pinned,
+    Block& block,
+    Checksums& checksums)
+{
+  const auto loading_key = std::make_pair(object_key, block_index);
+  auto loading = std::make_shared<Loading>();
+  {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    while (true)
+    {
+      block = find(object_key, block_index, &checksums);
+      if (block)
+      {
+        ++m_num_hits;
+        return 0;
+      }
+      auto ite = m_loading.find(loading_key);
+      if (ite == m_loading.end())
+        break;
+      std::shared_ptr<Loading> other = ite->second;
+      other->cv.wait(guard, [&other]() { return other->done; });
+      if (other->error >= 0)
+      {
+        ++m_num_shared_loads;
+        block = other->block;
+        checksums = other->checksums;
+        return 0;
+      }
+      // The failure may be particular to the other reader, like a mount that lost access to a
+      // copy of the same content, so this one tries for itself.
+    }
+    m_loading.emplace(loading_key, loading);
+  }
+
+  int ret = 0;
+  try
+  {
+    size_t tier = 0;
+    while (tier < m_tiers.size() && !m_tiers[tier]->get(object_key, block_index, block, checksums))
+      ++tier;
+    if (tier < m_tiers.size())
+    {
+      ++m_num_tier_hits;
+      ret = static_cast<int>(block->size());
+    }
+    else
+    {
+      ret = load(block, checksums);
+    }
+    // Closer tiers get what a farther one had.
+    for (size_t i = 0; ret >= 0 && i < tier; ++i)
+      m_tiers[i]->put(object_key, block_index, block, checksums);
+  }
+  catch (...)
+  {
+    finish_loading(loading_key, *loading, -EIO, nullptr, nullptr, false);
+    throw;
+  }
+  finish_loading(loading_key, *loading, ret, block, checksums, pinned);
+  return ret;
+}
+
+void BlockCache::finish_loading(
+    const std::pair<std::string, size_t>& loading_key,
+    Loading& loading,
+    int error,
+    Block block,
+    Checksums checksums,
+    bool pinned)
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    ++m_num_loads;
+    if (error >= 0)
+      insert(loading_key.first, loading_key.second, block, checksums, pinned);
+    loading.error = error;
+    loading.block = std::move(block);
+    loading.checksums = std::move(checksums);
+    loading.done = true;
+    m_loading.erase(loading_key);
+  }
+  loading.cv.notify_all();
+}
+
+BlockCache::Block BlockCache::find(
+    const std::string& object_key, size_t block_index, Checksums* checksums)
+{
+  auto object = m_objects.find(object_key);
+  if (object == m_objects.end())
+    return nullptr;
+  auto ite = object->second.find(block_index);
+  if (ite == object->second.end())
+    return nullptr;
+  if (!ite->second.pinned)
+    m_lru.splice(m_lru.begin(), m_lru, ite->second.lru_position);
+  if (checksums)
+    *checksums = ite->second.checksums;
+  return ite->second.block;
+}
+
+void BlockCache::insert(
+    const std::string& object_key,
+    size_t block_index,
+    Block block,
+    Checksums checksums,
+    bool pinned)
+{
+  erase_block(object_key, block_index);
+
+  m_size += block->size();
+  CachedBlock& cached = m_objects[object_key][block_index];
+  cached.pinned = pinned && can_pin(block->size());
+  if (cached.pinned)
+  {
+    m_pinned_size += block->size();
+  }
+  else
+  {
+    m_lru.emplace_front(object_key, block_index);
+    cached.lru_position = m_lru.begin();
+  }
+  cached.block = std::move(block);
+  cached.checksums = std::move(checksums);
+
+  while (m_size > m_capacity && !m_lru.empty())
+  {
+    auto victim = m_lru.back();
+    erase_block(victim.first, victim.second);
+  }
+}
+
+void BlockCache::set_pinned(const std::string& object_key, bool pinned)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  auto object = m_objects.find(object_key);
+  if (object == m_objects.end())
+    return;
+  for (auto& i : object->second)
+  {
+    CachedBlock& cached = i.second;
+    if (cached.pinned == pinned || (pinned && !can_pin(cached.block->size())))
+      continue;
+    cached.pinned = pinned;
+    if (pinned)
+    {
+      m_pinned_size += cached.block->size();
+      m_lru.erase(cached.lru_position);
+    }
+    else
+    {
+      m_pinned_size -= cached.block->size();
+      m_lru.emplace_front(object_key, i.first);
+      cached.lru_position = m_lru.begin();
+    }
+  }
+}
+
+void BlockCache::erase(const std::string& object_key)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  auto object = m_objects.find(object_key);
+  if (object == m_objects.end())
+    return;
+  for (auto& i : object->second)
+  {
+    m_size -= i.second.block->size();
+    if (i.second.pinned)
+      m_pinned_size -= i.second.block->size();
+    else
+      m_lru.erase(i.second.lru_position);
+  }
+  m_objects.erase(object);
+}
+
+void BlockCache::erase(const std::string& object_key, size_t block_index)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  erase_block(object_key, block_index);
+}
+
+size_t BlockCache::pinned_size()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  return m_pinned_size;
+}
+
+std::string BlockCache::statistics_text()
+{
+  size_t size = 0;
+  size_t pinned_size = 0;
+  size_t num_objects = 0;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    size = m_size;
+    pinned_size = m_pinned_size;
+    num_objects = m_objects.size();
+  }
+  std::ostringstream out;
+  out << "capacity " << m_capacity << "\n";
+  out << "size " << size << "\n";
+  out << "pinned_size " << pinned_size << "\n";
+  out << "objects " << num_objects << "\n";
+  out << "hits " << m_num_hits.load() << "\n";
+  out << "loads " << m_num_loads.load() << "\n";
+  out << "shared_loads " << m_num_shared_loads.load() << "\n";
+  out << "tier_hits " << m_num_tier_hits.load() << "\n";
+  return out.str();
+}
+
+size_t BlockCache::shrink(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  size_t released = 0;
+  while (released < bytes && !m_lru.empty())
+  {
+    auto victim = m_lru.back();
+    released += m_objects[victim.first][victim.second].block->capacity();
+    erase_block(victim.first, victim.second);
+  }
+  return released;
+}
+
+BlockCache::Checksums BlockCache::compute_checksums(const Buffer& block)
+{
+  auto checksums = std::make_shared<std::vector<uint64_t>>();
+  for (size_t offset = 0; offset < block.size(); offset += k_checksum_segment_size)
+  {
+    size_t n = std::min(k_checksum_segment_size, block.size() - offset);
+    checksums->emplace_back(crc64(0, block.data() + offset, n));
+  }
+  return checksums;
+}
+
+bool BlockCache::verify(
+    const Buffer& block, const Checksums& checksums, size_t offset, size_t size)
+{
+  if (!checksums)
+    return false;
+  size_t end = std::min(block.size(), offset + size);
+  for (size_t segment = offset / k_checksum_segment_size;
+       segment * k_checksum_segment_size < end;
+       ++segment)
+  {
+    size_t segment_offset = segment * k_checksum_segment_size;
+    size_t n = std::min(k_checksum_segment_size, block.size() - segment_offset);
+    if (segment >= checksums->size()
+        || crc64(0, block.data() + segment_offset, n) != (*checksums)[segment])
+      return false;
+  }
+  return true;
+}
+
+void BlockCache::erase_block(const std::string& object_key, size_t block_index)
+{
+  auto object = m_objects.find(object_key);
+  if (object == m_objects.end())
+    return;
+  auto ite = object->second.find(block_index);
+  if (ite == object->second.end())
+    return;
+  m_size -= ite->second.block->size();
+  if (ite->second.pinned)
+    m_pinned_size -= ite->second.block->size();
+  else
+    m_lru.erase(ite->second.lru_position);
+  object->second.erase(ite);
+  if (object->second.empty())
+    m_objects.erase(object);
+}
+
+bool BlockCache::can_pin(size_t size) const
+{
+  return m_pinned_size + size <= static_cast<size_t>(m_capacity * k_max_pinned_fraction);
+}
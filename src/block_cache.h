@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "buffer_pool.h"
+
+// An in-memory LRU cache of fixed-size blocks shared by all mounts. A block is identified by an
+// object key, which must name exactly one version of one object, or content that's known to be
+// the same wherever it's found, and its index in that object.
+class BlockCache {
+public:
+  using Block = std::shared_ptr<const Buffer>;
+  // CRC64s of consecutive k_checksum_segment_size byte segments of a block, so that reading part
+  // of a block only costs checking that part.
+  using Checksums = std::shared_ptr<const std::vector<uint64_t>>;
+  // Downloads a block. Returns a negative errno on failure.
+  using Loader = std::function<int(Block& block, Checksums& checksums)>;
+
+  static constexpr size_t k_checksum_segment_size = 64 * 1024;
+  // Pinned blocks leave at least a quarter of the cache to everything else.
+  static constexpr double k_max_pinned_fraction = 0.75;
+
+  // A slower cache behind this one, like one shared with other processes or other hosts.
+  class Tier {
+  public:
+    virtual ~Tier() = default;
+    // Returns false if the block isn't there.
+    virtual bool get(
+        const std::string& object_key, size_t block_index, Block& block, Checksums& checksums)
+        = 0;
+    // |checksums| may be null.
+    virtual void put(
+        const std::string& object_key,
+        size_t block_index,
+        const Block& block,
+        const Checksums& checksums)
+        = 0;
+  };
+
+  BlockCache(size_t block_size, size_t capacity);
+
+  // Blocks that aren't cached are looked for in the tiers, in the order they were added, before
+  // they're loaded, and then put in the tiers that didn't have them. Tiers must be added before
+  // the cache is used.
+  void add_tier(std::shared_ptr<Tier> tier);
+
+  size_t block_size() const { return m_block_size; }
+
+  // |checksums| is set to what was put with the block, if not null.
+  Block get(const std::string& object_key, size_t block_index, Checksums* checksums = nullptr);
+  // A pinned block is never evicted, as long as pinned blocks fit in k_max_pinned_fraction of the
+  // capacity. Beyond that blocks are cached as usual.
+  void put(
+      const std::string& object_key,
+      size_t block_index,
+      Block block,
+      Checksums checksums = nullptr,
+      bool pinned = false);
+  // Same as get(), but a block that isn't cached is loaded with |load| and put, with |pinned|.
+  // Callers that want a block while another one is loading it wait for that instead of loading it
+  // again, so that it's downloaded once however many readers want it at the same time.
+  int get_or_load(
+      const std::string& object_key,
+      size_t block_index,
+      const Loader& load,
+      bool pinned,
+      Block& block,
+      Checksums& checksums);
+  // Pins or unpins the cached blocks of an object.
+  void set_pinned(const std::string& object_key, bool pinned);
+  // Drops all cached blocks of an object.
+  void erase(const std::string& object_key);
+  void erase(const std::string& object_key, size_t block_index);
+  size_t pinned_size();
+  std::string statistics_text();
+  // Drops least recently used blocks totalling at least |bytes|, for BufferPool reclaiming.
+  // Returns how many bytes were dropped.
+  size_t shrink(size_t bytes);
+
+  static Checksums compute_checksums(const Buffer& block);
+  // Whether [offset, offset + size) of |block|, clamped to its size, matches |checksums|.
+  static bool verify(const Buffer& block, const Checksums& checksums, size_t offset, size_t size);
+
+private:
+  using LruList = std::list<std::pair<std::string, size_t>>;
+
+  struct CachedBlock
+  {
+    Block block;
+    Checksums checksums;
+    // Pinned blocks aren't in the LRU list, so that they're never evicted.
+    bool pinned = false;
+    LruList::iterator lru_position;
+  };
+
+  // A block being loaded by get_or_load().
+  struct Loading
+  {
+    std::condition_variable cv;
+    bool done = false;
+    int error = 0;
+    Block block;
+    Checksums checksums;
+  };
+
+  // Puts a block loaded by get_or_load(), or not if |error| is negative, and wakes up the readers
+  // waiting for it.
+  void finish_loading(
+      const std::pair<std::string, size_t>& loading_key,
+      Loading& loading,
+      int error,
+      Block block,
+      Checksums checksums,
+      bool pinned);
+
+  // These must be called with m_mutex held.
+  Block find(const std::string& object_key, size_t block_index, Checksums* checksums);
+  void insert(
+      const std::string& object_key,
+      size_t block_index,
+      Block block,
+      Checksums checksums,
+      bool pinned);
+  void erase_block(const std::string& object_key, size_t block_index);
+  // Whether a block of |size| bytes can be pinned.
+  bool can_pin(size_t size) const;
+
+  const size_t m_block_size;
+  const size_t m_capacity;
+  std::vector<std::shared_ptr<Tier>> m_tiers;
+
+  std::mutex m_mutex;
+  size_t m_size = 0;
+  size_t m_pinned_size = 0;
+  // Most recently used blocks are at the front.
+  LruList m_lru;
+  std::unordered_map<std::string, std::unordered_map<size_t, CachedBlock>> m_objects;
+  std::map<std::pair<std::string, size_t>, std::shared_ptr<Loading>> m_loading;
+
+  std::atomic<uint64_t> m_num_hits{0};
+  std::atomic<uint64_t> m_num_loads{0};
+  // Blocks another reader was already loading.
+  std::atomic<uint64_t> m_num_shared_loads{0};
+  // Blocks found in a tier instead of being loaded.
+  std::atomic<uint64_t> m_num_tier_hits{0};
+};
@@ -0,0 +1,528 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <tuple>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+struct BufferSlab
+{
+  char* memory = nullptr;
+  size_t size = 0;
+  // Memory file the slab is mapped from, or -1.
+  int fd = -1;
+  size_t buffer_size = 0;
+  // Index of the size class, or k_num_classes for an oversized buffer with a slab of its own.
+  size_t class_index = 0;
+  size_t num_buffers = 0;
+  // Guarded by the mutex of the size class.
+  std::vector<char*> free_buffers;
+};
+
+namespace {
+constexpr size_t k_page_size = 4096;
+// Per-thread freelists only hold small buffers and are kept short, so that memory parked in idle
+// threads, out of reach of reclaiming, stays small. Large buffers are rare enough for the shared
+// freelists.
+constexpr size_t k_thread_cache_max_buffer_size = 256 * 1024;
+constexpr size_t k_thread_cache_buffers = 8;
+constexpr size_t k_thread_cache_bytes = 1024 * 1024;
+
+char* allocate_pages(size_t size)
+{
+#ifdef _WIN32
+  void* p = _aligned_malloc(size, k_page_size);
+#else
+  void* p = nullptr;
+  if (posix_memalign(&p, k_page_size, size) != 0)
+    p = nullptr;
+#endif
+  if (!p)
+    throw std::bad_alloc();
+  return static_cast<char*>(p);
+}
+
+// Maps |size| bytes of a new memory file, or returns nullptr if that isn't possible here.
+char* map_memory_file(size_t size, int& fd)
+{
+#ifdef __linux__
+  fd = memfd_create("azfuse-buffers", MFD_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  void* p = MAP_FAILED;
+  if (ftruncate(fd, static_cast<off_t>(size)) == 0)
+    p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    close(fd);
+    fd = -1;
+    return nullptr;
+  }
+  return static_cast<char*>(p);
+#else
+  (void)size;
+  fd = -1;
+  return nullptr;
+#endif
+}
+
+void free_pages(char* p, size_t size, int fd)
+{
+#ifdef __linux__
+  if (fd >= 0)
+  {
+    munmap(p, size);
+    close(fd);
+    return;
+  }
+#else
+  (void)size;
+  (void)fd;
+#endif
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  std::free(p);
+#endif
+}
+} // namespace
+
+BufferPool& g_buffer_pool = *new BufferPool(1024ULL * 1024 * 1024);
+
+thread_local BufferPool::ThreadCache BufferPool::t_thread_cache;
+thread_local bool BufferPool::t_thread_cache_destroyed = false;
+
+Buffer::Buffer(char* data, size_t capacity, BufferSlab* slab)
+    : m_data(data), m_size(capacity), m_capacity(capacity), m_slab(slab)
+{
+}
+
+int Buffer::fd() const { return m_slab->fd; }
+
+uint64_t Buffer::fd_offset() const { return static_cast<uint64_t>(m_data - m_slab->memory); }
+
+void Buffer::resize(size_t size)
+{
+  if (size > m_capacity)
+    std::abort();
+  m_size = size;
+}
+
+BufferPool::Reservation::Reservation(Reservation&& other) noexcept
+    : m_pool(other.m_pool), m_size(other.m_size)
+{
+  other.m_pool = nullptr;
+  other.m_size = 0;
+}
+
+BufferPool::Reservation& BufferPool::Reservation::operator=(Reservation&& other) noexcept
+{
+  if (this != &other)
+  {
+    if (m_pool)
+      m_pool->uncharge(m_size, true);
+    m_pool = other.m_pool;
+    m_size = other.m_size;
+    other.m_pool = nullptr;
+    other.m_size = 0;
+  }
+  return *this;
+}
+
+BufferPool::Reservation::~Reservation()
+{
+  if (m_pool)
+    m_pool->uncharge(m_size, true);
+}
+
+BufferPool::ThreadCache::~ThreadCache()
+{
+  t_thread_cache_destroyed = true;
+  flush();
+}
+
+void BufferPool::ThreadCache::flush()
+{
+  if (!pool)
+    return;
+  for (auto& buffers : this->buffers)
+  {
+    for (auto& b : buffers)
+      pool->give_back(b.first, b.second);
+    buffers.clear();
+  }
+  bytes = 0;
+}
+
+BufferPool::BufferPool(size_t budget) : m_budget(budget) {}
+
+std::shared_ptr<Buffer> BufferPool::allocate(size_t size) { return allocate(size, true); }
+
+std::shared_ptr<Buffer> BufferPool::try_allocate(size_t size) { return allocate(size, false); }
+
+std::shared_ptr<Buffer> BufferPool::allocate(size_t size, bool wait)
+{
+  size_t class_index = 0;
+  while (class_index < k_num_classes && (k_min_class_size << class_index) < size)
+    ++class_index;
+
+  char* data = nullptr;
+  BufferSlab* slab = nullptr;
+  size_t capacity = 0;
+  if (class_index < k_num_classes)
+  {
+    capacity = k_min_class_size << class_index;
+    if (!t_thread_cache_destroyed)
+    {
+      ThreadCache& cache = t_thread_cache;
+      if (cache.pool == nullptr)
+        cache.pool = this;
+      if (cache.pool == this && !cache.buffers[class_index].empty())
+      {
+        std::tie(data, slab) = cache.buffers[class_index].back();
+        cache.buffers[class_index].pop_back();
+        cache.bytes -= capacity;
+        ++m_thread_cache_hits;
+      }
+    }
+    if (!data)
+      data = take_from_class(class_index, slab);
+  }
+  else
+  {
+    capacity = (size + k_page_size - 1) / k_page_size * k_page_size;
+  }
+
+  if (!data)
+  {
+    size_t slab_size = std::max(capacity, k_min_slab_size);
+    if (!charge(slab_size, false, wait))
+    {
+      ++m_refusals;
+      return nullptr;
+    }
+    slab = new BufferSlab;
+    try
+    {
+      if (m_fd_backed.load(std::memory_order_relaxed))
+        slab->memory = map_memory_file(slab_size, slab->fd);
+      if (!slab->memory)
+        slab->memory = allocate_pages(slab_size);
+    }
+    catch (std::bad_alloc&)
+    {
+      delete slab;
+      uncharge(slab_size, false);
+      throw;
+    }
+    slab->size = slab_size;
+    slab->buffer_size = capacity;
+    slab->class_index = class_index;
+    slab->num_buffers = slab_size / capacity;
+    ++m_slab_allocations;
+    data = slab->memory;
+    if (slab->num_buffers > 1)
+    {
+      for (size_t i = slab->num_buffers - 1; i > 0; --i)
+        slab->free_buffers.emplace_back(slab->memory + i * capacity);
+      SizeClass& size_class = m_classes[class_index];
+      std::lock_guard<std::mutex> guard(size_class.mutex);
+      size_class.partial_slabs.emplace_back(slab);
+    }
+  }
+
+  ++m_allocations;
+  m_in_use_bytes += capacity;
+  Buffer* buffer = new Buffer(data, capacity, slab);
+  buffer->resize(size);
+  return std::shared_ptr<Buffer>(buffer, [this](Buffer* b) { release(b); });
+}
+
+BufferPool::Reservation BufferPool::reserve(size_t size)
+{
+  charge(size, true, true);
+  return Reservation(this, size);
+}
+
+BufferPool::Reservation BufferPool::try_reserve(size_t size)
+{
+  if (!charge(size, true, false))
+  {
+    ++m_refusals;
+    return Reservation();
+  }
+  return Reservation(this, size);
+}
+
+size_t BufferPool::add_reclaimer(std::function<size_t(size_t bytes)> reclaimer)
+{
+  auto r = std::make_shared<Reclaimer>();
+  r->reclaim = std::move(reclaimer);
+  std::lock_guard<std::mutex> guard(m_reclaimers_mutex);
+  r->id = m_next_reclaimer_id++;
+  m_reclaimers.emplace_back(std::move(r));
+  return m_reclaimers.back()->id;
+}
+
+void BufferPool::remove_reclaimer(size_t id)
+{
+  std::shared_ptr<Reclaimer> removed;
+  {
+    std::lock_guard<std::mutex> guard(m_reclaimers_mutex);
+    auto ite = std::find_if(m_reclaimers.begin(), m_reclaimers.end(), [id](const auto& r) {
+      return r->id == id;
+    });
+    if (ite == m_reclaimers.end())
+      return;
+    removed = std::move(*ite);
+    m_reclaimers.erase(ite);
+  }
+  // reclaim() may have taken it just before.
+  std::lock_guard<std::mutex> guard(removed->mutex);
+  removed->removed = true;
+}
+
+void BufferPool::set_budget(size_t budget)
+{
+  {
+    std::lock_guard<std::mutex> guard(m_budget_mutex);
+    m_budget = budget;
+  }
+  m_budget_cv.notify_all();
+}
+
+void BufferPool::set_fd_backed(bool fd_backed)
+{
+  m_fd_backed.store(fd_backed, std::memory_order_relaxed);
+}
+
+void BufferPool::shrink_to_budget()
+{
+  size_t excess = 0;
+  {
+    std::lock_guard<std::mutex> guard(m_budget_mutex);
+    size_t used = m_allocated_bytes + m_reserved_bytes;
+    if (used <= m_budget)
+      return;
+    excess = used - m_budget;
+  }
+  reclaim(excess);
+}
+
+size_t BufferPool::budget() const
+{
+  std::lock_guard<std::mutex> guard(m_budget_mutex);
+  return m_budget;
+}
+
+BufferPoolStatistics BufferPool::statistics() const
+{
+  BufferPoolStatistics statistics;
+  {
+    std::lock_guard<std::mutex> guard(m_budget_mutex);
+    statistics.budget = m_budget;
+    statistics.allocated_bytes = m_allocated_bytes;
+    statistics.reserved_bytes = m_reserved_bytes;
+  }
+  statistics.in_use_bytes = m_in_use_bytes;
+  statistics.allocations = m_allocations;
+  statistics.thread_cache_hits = m_thread_cache_hits;
+  statistics.slab_allocations = m_slab_allocations;
+  statistics.slab_releases = m_slab_releases;
+  statistics.reclaims = m_reclaims;
+  statistics.waits = m_waits;
+  statistics.refusals = m_refusals;
+  return statistics;
+}
+
+std::string BufferPool::statistics_text() const
+{
+  BufferPoolStatistics statistics = this->statistics();
+  std::ostringstream out;
+  out << "budget " << statistics.budget << "\n";
+  out << "allocated_bytes " << statistics.allocated_bytes << "\n";
+  out << "in_use_bytes " << statistics.in_use_bytes << "\n";
+  out << "reserved_bytes " << statistics.reserved_bytes << "\n";
+  out << "allocations " << statistics.allocations << "\n";
+  out << "thread_cache_hits " << statistics.thread_cache_hits << "\n";
+  out << "slab_allocations " << statistics.slab_allocations << "\n";
+  out << "slab_releases " << statistics.slab_releases << "\n";
+  out << "reclaims " << statistics.reclaims << "\n";
+  out << "waits " << statistics.waits << "\n";
+  out << "refusals " << statistics.refusals << "\n";
+  return out.str();
+}
+
+char* BufferPool::take_from_class(size_t class_index, BufferSlab*& slab)
+{
+  SizeClass& size_class = m_classes[class_index];
+  std::lock_guard<std::mutex> guard(size_class.mutex);
+  if (size_class.partial_slabs.empty())
+    return nullptr;
+  slab = size_class.partial_slabs.back();
+  if (slab->free_buffers.size() == slab->num_buffers)
+    --size_class.num_empty_slabs;
+  char* data = slab->free_buffers.back();
+  slab->free_buffers.pop_back();
+  if (slab->free_buffers.empty())
+    size_class.partial_slabs.pop_back();
+  return data;
+}
+
+void BufferPool::give_back(char* data, BufferSlab* slab)
+{
+  if (slab->class_index == k_num_classes)
+  {
+    free_slab(slab);
+    return;
+  }
+
+  SizeClass& size_class = m_classes[slab->class_index];
+  {
+    std::lock_guard<std::mutex> guard(size_class.mutex);
+    if (slab->free_buffers.empty())
+      size_class.partial_slabs.emplace_back(slab);
+    slab->free_buffers.emplace_back(data);
+    if (slab->free_buffers.size() < slab->num_buffers)
+      return;
+    if (size_class.num_empty_slabs == 0)
+    {
+      ++size_class.num_empty_slabs;
+      return;
+    }
+    size_class.partial_slabs.erase(
+        std::find(size_class.partial_slabs.begin(), size_class.partial_slabs.end(), slab));
+  }
+  free_slab(slab);
+}
+
+void BufferPool::release(Buffer* buffer)
+{
+  size_t capacity = buffer->m_capacity;
+  BufferSlab* slab = buffer->m_slab;
+  char* data = buffer->m_data;
+  delete buffer;
+  m_in_use_bytes -= capacity;
+
+  if (capacity <= k_thread_cache_max_buffer_size && !t_thread_cache_destroyed)
+  {
+    ThreadCache& cache = t_thread_cache;
+    if (cache.pool == this && cache.buffers[slab->class_index].size() < k_thread_cache_buffers
+        && cache.bytes + capacity <= k_thread_cache_bytes)
+    {
+      cache.buffers[slab->class_index].emplace_back(data, slab);
+      cache.bytes += capacity;
+      return;
+    }
+  }
+  give_back(data, slab);
+}
+
+void BufferPool::release_empty_slabs()
+{
+  for (auto& size_class : m_classes)
+  {
+    std::vector<BufferSlab*> empty_slabs;
+    {
+      std::lock_guard<std::mutex> guard(size_class.mutex);
+      if (size_class.num_empty_slabs == 0)
+        continue;
+      auto& slabs = size_class.partial_slabs;
+      auto ite = std::partition(slabs.begin(), slabs.end(), [](const BufferSlab* slab) {
+        return slab->free_buffers.size() < slab->num_buffers;
+      });
+      empty_slabs.assign(ite, slabs.end());
+      slabs.erase(ite, slabs.end());
+      size_class.num_empty_slabs = 0;
+    }
+    for (auto slab : empty_slabs)
+      free_slab(slab);
+  }
+}
+
+void BufferPool::free_slab(BufferSlab* slab)
+{
+  size_t size = slab->size;
+  free_pages(slab->memory, size, slab->fd);
+  delete slab;
+  ++m_slab_releases;
+  uncharge(size, false);
+}
+
+bool BufferPool::charge(size_t size, bool reservation, bool wait)
+{
+  std::unique_lock<std::mutex> guard(m_budget_mutex);
+  bool waited = false;
+  while (true)
+  {
+    size_t used = m_allocated_bytes + m_reserved_bytes;
+    // A request larger than the whole budget is let through when nothing else is charged, so that
+    // it can't wait forever.
+    if (used + size <= m_budget || used == 0)
+      break;
+    size_t needed = used + size - m_budget;
+    guard.unlock();
+    reclaim(needed);
+    guard.lock();
+    used = m_allocated_bytes + m_reserved_bytes;
+    if (used + size <= m_budget || used == 0)
+      break;
+    if (!wait)
+      return false;
+    if (!waited)
+    {
+      ++m_waits;
+      waited = true;
+    }
+    // Memory comes back when buffers are released, which notifies. The timeout makes sure
+    // reclaimers get asked again in case memory freed up some other way.
+    m_budget_cv.wait_for(guard, std::chrono::milliseconds(100));
+  }
+  (reservation ? m_reserved_bytes : m_allocated_bytes) += size;
+  return true;
+}
+
+void BufferPool::reclaim(size_t bytes)
+{
+  if (!t_thread_cache_destroyed)
+    t_thread_cache.flush();
+  release_empty_slabs();
+  std::vector<std::shared_ptr<Reclaimer>> reclaimers;
+  {
+    std::lock_guard<std::mutex> reclaimers_guard(m_reclaimers_mutex);
+    reclaimers = m_reclaimers;
+  }
+  size_t reclaimed = 0;
+  for (auto& reclaimer : reclaimers)
+  {
+    if (reclaimed >= bytes)
+      break;
+    std::lock_guard<std::mutex> guard(reclaimer->mutex);
+    if (!reclaimer->removed)
+      reclaimed += reclaimer->reclaim(bytes - reclaimed);
+  }
+  ++m_reclaims;
+  // Whatever the reclaimers released on this thread may have been parked in its freelist.
+  if (!t_thread_cache_destroyed)
+    t_thread_cache.flush();
+  release_empty_slabs();
+}
+
+void BufferPool::uncharge(size_t size, bool reservation)
+{
+  {
+    std::lock_guard<std::mutex> guard(m_budget_mutex);
+    (reservation ? m_reserved_bytes : m_allocated_bytes) -= size;
+  }
+  m_budget_cv.notify_all();
+}
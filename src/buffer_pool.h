@@ -0,0 +1,194 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class BufferPool;
+struct BufferSlab;
+
+// A page-aligned buffer handed out by BufferPool. Its memory goes back to the pool when the last
+// reference is dropped.
+class Buffer {
+public:
+  Buffer(const Buffer&) = delete;
+  Buffer& operator=(const Buffer&) = delete;
+
+  char* data() { return m_data; }
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+  size_t capacity() const { return m_capacity; }
+  // |size| must not exceed capacity().
+  void resize(size_t size);
+  // Memory file the buffer lives in and where in it, so that it can be spliced without being
+  // copied. -1 unless the pool is backed by memory files.
+  int fd() const;
+  uint64_t fd_offset() const;
+
+private:
+  friend class BufferPool;
+
+  Buffer(char* data, size_t capacity, BufferSlab* slab);
+
+  char* m_data;
+  size_t m_size;
+  size_t m_capacity;
+  BufferSlab* m_slab;
+};
+
+struct BufferPoolStatistics
+{
+  size_t budget = 0;
+  // Memory taken from the system, whether handed out or sitting in freelists.
+  size_t allocated_bytes = 0;
+  size_t in_use_bytes = 0;
+  // Memory charged with reserve() that doesn't live in pool buffers.
+  size_t reserved_bytes = 0;
+  uint64_t allocations = 0;
+  uint64_t thread_cache_hits = 0;
+  uint64_t slab_allocations = 0;
+  uint64_t slab_releases = 0;
+  uint64_t reclaims = 0;
+  // Allocations that had to wait because the budget was exhausted.
+  uint64_t waits = 0;
+  // try_ allocations and reservations refused because the budget was exhausted.
+  uint64_t refusals = 0;
+};
+
+// Process-wide pool of I/O buffers. Buffers are carved out of page-aligned slabs in power-of-two
+// size classes and recycled through per-thread and shared freelists. All slabs, plus memory
+// charged with reserve(), are held within one budget. When the budget is exhausted the pool first
+// asks the registered reclaimers, usually caches, to give memory back, then makes callers wait
+// rather than growing without bound.
+class BufferPool {
+public:
+  // Memory charged against the budget for as long as this object lives.
+  class Reservation {
+  public:
+    Reservation() = default;
+    Reservation(Reservation&& other) noexcept;
+    Reservation& operator=(Reservation&& other) noexcept;
+    ~Reservation();
+
+    size_t size() const { return m_size; }
+
+  private:
+    friend class BufferPool;
+    Reservation(BufferPool* pool, size_t size) : m_pool(pool), m_size(size) {}
+
+    BufferPool* m_pool = nullptr;
+    size_t m_size = 0;
+  };
+
+  explicit BufferPool(size_t budget);
+
+  // Waits while the budget is exhausted.
+  std::shared_ptr<Buffer> allocate(size_t size);
+  // Returns nullptr if the budget is exhausted, for callers that can do without, like prefetch.
+  std::shared_ptr<Buffer> try_allocate(size_t size);
+
+  Reservation reserve(size_t size);
+  // Returns an empty reservation if the budget is exhausted.
+  Reservation try_reserve(size_t size);
+
+  // |reclaimer| is asked to release about the given number of bytes when the budget is
+  // exhausted, and returns how many bytes it released. It's called without any pool lock held,
+  // and mustn't charge memory itself. Returns an id for remove_reclaimer().
+  size_t add_reclaimer(std::function<size_t(size_t bytes)> reclaimer);
+  // Waits for calls to the reclaimer that are under way, so that what it uses can go away after.
+  void remove_reclaimer(size_t id);
+
+  // Lowering the budget doesn't release anything until memory is next charged. Call
+  // shrink_to_budget() to give memory back right away.
+  void set_budget(size_t budget);
+  // Asks the reclaimers to release what's charged beyond the budget. Memory still in use by
+  // buffers that are referenced stays charged.
+  void shrink_to_budget();
+  // Back slabs allocated from now on by memory files, where the system has them. It costs a file
+  // descriptor per slab.
+  void set_fd_backed(bool fd_backed);
+  size_t budget() const;
+  BufferPoolStatistics statistics() const;
+  std::string statistics_text() const;
+
+private:
+  static constexpr size_t k_min_class_size = 4096;
+  static constexpr size_t k_max_class_size = 16 * 1024 * 1024;
+  static constexpr size_t k_num_classes = 13;
+  static constexpr size_t k_min_slab_size = 1024 * 1024;
+
+  struct SizeClass
+  {
+    std::mutex mutex;
+    // Slabs with at least one free buffer.
+    std::vector<BufferSlab*> partial_slabs;
+    // Slabs with all buffers free. One is kept around to absorb alloc/free churn.
+    size_t num_empty_slabs = 0;
+  };
+
+  struct Reclaimer
+  {
+    size_t id = 0;
+    std::function<size_t(size_t)> reclaim;
+    // Held while it's called.
+    std::mutex mutex;
+    bool removed = false;
+  };
+
+  struct ThreadCache
+  {
+    ~ThreadCache();
+    void flush();
+
+    BufferPool* pool = nullptr;
+    std::array<std::vector<std::pair<char*, BufferSlab*>>, k_num_classes> buffers;
+    size_t bytes = 0;
+  };
+
+  std::shared_ptr<Buffer> allocate(size_t size, bool wait);
+  char* take_from_class(size_t class_index, BufferSlab*& slab);
+  void give_back(char* data, BufferSlab* slab);
+  void release(Buffer* buffer);
+  void release_empty_slabs();
+  void free_slab(BufferSlab* slab);
+  bool charge(size_t size, bool reservation, bool wait);
+  // Flushes freelists and asks the reclaimers for about |bytes|.
+  void reclaim(size_t bytes);
+  void uncharge(size_t size, bool reservation);
+
+  static thread_local ThreadCache t_thread_cache;
+  // Set once t_thread_cache is destroyed, for buffers released late in thread or process exit.
+  static thread_local bool t_thread_cache_destroyed;
+
+  std::array<SizeClass, k_num_classes> m_classes;
+
+  mutable std::mutex m_budget_mutex;
+  std::condition_variable m_budget_cv;
+  size_t m_budget;
+  size_t m_allocated_bytes = 0;
+  size_t m_reserved_bytes = 0;
+
+  std::mutex m_reclaimers_mutex;
+  std::vector<std::shared_ptr<Reclaimer>> m_reclaimers;
+  size_t m_next_reclaimer_id = 0;
+
+  std::atomic<bool> m_fd_backed{false};
+  std::atomic<size_t> m_in_use_bytes{0};
+  std::atomic<uint64_t> m_allocations{0};
+  std::atomic<uint64_t> m_thread_cache_hits{0};
+  std::atomic<uint64_t> m_slab_allocations{0};
+  std::atomic<uint64_t> m_slab_releases{0};
+  std::atomic<uint64_t> m_reclaims{0};
+  std::atomic<uint64_t> m_waits{0};
+  std::atomic<uint64_t> m_refusals{0};
+};
+
+// Never destroyed, so that buffers released during static destruction still have somewhere to go.
+extern BufferPool& g_buffer_pool;
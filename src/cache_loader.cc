@@ -0,0 +1,318 @@
+#include "cache_loader.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "scheduler.h"
+
+namespace {
+constexpr size_t k_max_read_size = 4 * 1024 * 1024;
+// Files queued per loading thread before the walk waits.
+constexpr size_t k_queued_files_per_thread = 4;
+// Requests kept around for their status. Older ones are forgotten, and cancelled if they're still
+// running.
+constexpr size_t k_max_requests = 64;
+// How long to wait before trying again a request the scheduler turned away.
+constexpr std::chrono::milliseconds k_busy_retry_interval{100};
+
+// Loading was asked for, so what the scheduler turns away is tried again until |cancelled|.
+template <typename F>
+int retry_while_busy(const std::atomic<bool>& cancelled, F request)
+{
+  int ret;
+  while ((ret = request()) == -EAGAIN && !cancelled)
+    std::this_thread::sleep_for(k_busy_retry_interval);
+  return ret;
+}
+
+const char* action_name(CacheLoadAction action)
+{
+  switch (action)
+  {
+    case CacheLoadAction::load:
+      return "load";
+    case CacheLoadAction::pin:
+      return "pin";
+    case CacheLoadAction::unpin:
+      return "unpin";
+  }
+  return "";
+}
+} // namespace
+
+std::shared_ptr<CacheLoader> g_cache_loader;
+
+CacheLoader::Request::~Request()
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    cancelled = true;
+  }
+  cv.notify_all();
+  if (walker.joinable())
+    walker.join();
+}
+
+CacheLoader::CacheLoader(size_t default_concurrency)
+    : m_default_concurrency(std::max<size_t>(default_concurrency, 1))
+{
+}
+
+CacheLoader::~CacheLoader()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_requests.clear();
+}
+
+void CacheLoader::start(
+    const std::string& path,
+    std::shared_ptr<BaseAdaptor> adaptor,
+    const std::string& object_name,
+    CacheLoadAction action,
+    size_t concurrency)
+{
+  if (concurrency == 0)
+    concurrency = m_default_concurrency;
+  auto request = std::make_unique<Request>(concurrency);
+  request->path = path;
+  request->adaptor = std::move(adaptor);
+  request->object_name = object_name;
+  request->action = action;
+  request->concurrency = concurrency;
+  request->start_time = std::chrono::steady_clock::now();
+
+  // Destroyed outside the lock, since that waits for them to stop.
+  std::vector<std::unique_ptr<Request>> dropped;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_requests.find(path);
+    if (ite != m_requests.end())
+    {
+      dropped.emplace_back(std::move(ite->second));
+      m_requests.erase(ite);
+      m_order.erase(std::find(m_order.begin(), m_order.end(), path));
+    }
+    while (m_order.size() >= k_max_requests)
+    {
+      dropped.emplace_back(std::move(m_requests[m_order.front()]));
+      m_requests.erase(m_order.front());
+      m_order.pop_front();
+    }
+    Request* r = request.get();
+    r->walker = std::thread([r]() { walk(*r); });
+    m_requests.emplace(path, std::move(request));
+    m_order.emplace_back(path);
+  }
+}
+
+void CacheLoader::cancel(const std::string& path)
+{
+  std::unique_ptr<Request> request;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto ite = m_requests.find(path);
+    if (ite == m_requests.end())
+      return;
+    request = std::move(ite->second);
+    m_requests.erase(ite);
+    m_order.erase(std::find(m_order.begin(), m_order.end(), path));
+  }
+}
+
+std::string CacheLoader::status_text(const std::string& path) const
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  auto ite = m_requests.find(path);
+  return ite == m_requests.end() ? std::string() : request_text(*ite->second);
+}
+
+std::string CacheLoader::statistics_text() const
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  std::string text;
+  for (const std::string& path : m_order)
+    text += request_text(*m_requests.at(path)) + "\n";
+  return text;
+}
+
+void CacheLoader::walk(Request& request)
+{
+  IoPriorityScope priority_scope(IoPriority::prefetch, true);
+  std::vector<std::string> directories;
+  try
+  {
+    FileStatus file_status;
+    int ret = retry_while_busy(request.cancelled, [&]() {
+      return request.adaptor->getattr(request.object_name, file_status);
+    });
+    if (ret < 0)
+      ++request.failures;
+    else if (file_status.is_directory)
+      directories.emplace_back(request.object_name);
+    else
+      submit(request, request.object_name, file_status);
+
+    std::vector<DirectoryEntry> directory_entries;
+    while (!directories.empty() && !request.cancelled)
+    {
+      std::string directory = std::move(directories.back());
+      directories.pop_back();
+      std::string continuation_token;
+      do
+      {
+        directory_entries.clear();
+        ret = retry_while_busy(request.cancelled, [&]() {
+          return request.adaptor->list(directory, directory_entries, continuation_token);
+        });
+        if (ret < 0)
+        {
+          ++request.failures;
+          break;
+        }
+        for (DirectoryEntry& e : directory_entries)
+        {
+          std::string child = directory == "." ? e.name : directory + "/" + e.name;
+          if (e.status.is_directory)
+            directories.emplace_back(std::move(child));
+          else
+            submit(request, std::move(child), e.status);
+        }
+      } while (!continuation_token.empty() && !request.cancelled);
+    }
+  }
+  catch (...)
+  {
+    ++request.failures;
+  }
+
+  std::lock_guard<std::mutex> guard(request.mutex);
+  request.walked = true;
+  if (request.in_flight == 0)
+    request.end_time = std::chrono::steady_clock::now();
+}
+
+void CacheLoader::submit(Request& request, std::string object_name, FileStatus file_status)
+{
+  {
+    std::unique_lock<std::mutex> guard(request.mutex);
+    request.cv.wait(guard, [&request]() {
+      return request.cancelled
+          || request.in_flight < request.concurrency * k_queued_files_per_thread;
+    });
+    if (request.cancelled)
+      return;
+    ++request.in_flight;
+  }
+  ++request.files;
+  // Unpinning reads nothing.
+  if (request.action != CacheLoadAction::unpin)
+    request.bytes += file_status.file_size;
+
+  Request* r = &request;
+  request.thread_pool.submit([r, object_name, file_status]() mutable {
+    IoPriorityScope priority_scope(IoPriority::prefetch, true);
+    try
+    {
+      load_file(*r, object_name, file_status);
+    }
+    catch (...)
+    {
+      ++r->failures;
+    }
+    {
+      std::lock_guard<std::mutex> guard(r->mutex);
+      --r->in_flight;
+      if (r->walked && r->in_flight == 0)
+        r->end_time = std::chrono::steady_clock::now();
+    }
+    r->cv.notify_all();
+  });
+}
+
+void CacheLoader::load_file(
+    Request& request, const std::string& object_name, FileStatus& file_status)
+{
+  if (request.action != CacheLoadAction::load)
+  {
+    int ret = retry_while_busy(request.cancelled, [&]() {
+      return request.adaptor->set_pinned(object_name, request.action == CacheLoadAction::pin);
+    });
+    if (ret < 0)
+    {
+      ++request.failures;
+      return;
+    }
+    if (request.action == CacheLoadAction::unpin)
+    {
+      ++request.files_done;
+      return;
+    }
+  }
+
+  // Some listings have no ETag, like those of the File service, and reads without one go around
+  // the cache.
+  if (file_status.etag.empty())
+  {
+    int ret = retry_while_busy(request.cancelled, [&]() {
+      return request.adaptor->getattr(object_name, file_status);
+    });
+    if (ret < 0 || file_status.etag.empty())
+    {
+      ++request.failures;
+      return;
+    }
+  }
+
+  // Pinned to the version that was listed or looked up, like reads of an open file.
+  ReadOptions options;
+  options.if_match = file_status.etag;
+  const uint64_t file_size = file_status.file_size;
+  std::shared_ptr<Buffer> buffer;
+  uint64_t offset = 0;
+  while (offset < file_size && !request.cancelled)
+  {
+    size_t size = static_cast<size_t>(std::min<uint64_t>(file_size - offset, k_max_read_size));
+    if (!buffer)
+      buffer = g_buffer_pool.allocate(size);
+    int ret = retry_while_busy(request.cancelled, [&]() {
+      return request.adaptor->read_with_options(
+          object_name, buffer->data(), size, static_cast<size_t>(offset), options, file_status);
+    });
+    if (ret < 0)
+    {
+      ++request.failures;
+      return;
+    }
+    if (ret == 0)
+      break;
+    offset += ret;
+    request.bytes_done += ret;
+  }
+  if (!request.cancelled)
+    ++request.files_done;
+}
+
+std::string CacheLoader::request_text(const Request& request)
+{
+  std::lock_guard<std::mutex> guard(request.mutex);
+  const char* state = "done";
+  auto end_time = request.end_time;
+  if (request.cancelled || !request.walked || request.in_flight != 0)
+  {
+    state = request.cancelled ? "cancelled" : !request.walked ? "listing" : "loading";
+    end_time = std::chrono::steady_clock::now();
+  }
+  std::ostringstream out;
+  out << "path " << request.path << "\n";
+  out << "action " << action_name(request.action) << "\n";
+  out << "state " << state << "\n";
+  out << "files " << request.files_done << "/" << request.files << "\n";
+  out << "bytes " << request.bytes_done << "/" << request.bytes << "\n";
+  out << "failures " << request.failures << "\n";
+  out << "seconds "
+      << std::chrono::duration_cast<std::chrono::seconds>(end_time - request.start_time).count()
+      << "\n";
+  return out.str();
+}
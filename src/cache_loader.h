@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "adaptor.h"
+#include "thread_pool.h"
+
+enum class CacheLoadAction
+{
+  // Read everything into the block cache.
+  load,
+  // Same, and keep it there until it's unpinned.
+  pin,
+  unpin,
+};
+
+// Loads files or whole directory trees into the block cache on request, so that a job can warm
+// the cache with its data set before it starts instead of stalling on its first pass. Each request
+// walks its tree on a thread of its own and reads files with as many threads as it asks for.
+class CacheLoader {
+public:
+  // |default_concurrency| is the number of threads of requests that don't ask for a number.
+  explicit CacheLoader(size_t default_concurrency);
+  // Cancels all requests.
+  ~CacheLoader();
+
+  CacheLoader(const CacheLoader&) = delete;
+  CacheLoader& operator=(const CacheLoader&) = delete;
+
+  // Starts loading |object_name| of |adaptor|, a file or a directory, which is at |path| relative
+  // to the mount point. A request already running for |path| is cancelled first. Zero
+  // |concurrency| means the default.
+  void start(
+      const std::string& path,
+      std::shared_ptr<BaseAdaptor> adaptor,
+      const std::string& object_name,
+      CacheLoadAction action,
+      size_t concurrency);
+  void cancel(const std::string& path);
+
+  // Progress of the last request for |path|, or an empty string if there's none.
+  std::string status_text(const std::string& path) const;
+  // Progress of all requests.
+  std::string statistics_text() const;
+
+private:
+  struct Request
+  {
+    explicit Request(size_t concurrency) : thread_pool(concurrency) {}
+    // Cancels loading and waits for it to stop.
+    ~Request();
+
+    std::string path;
+    std::shared_ptr<BaseAdaptor> adaptor;
+    std::string object_name;
+    CacheLoadAction action = CacheLoadAction::load;
+    size_t concurrency = 0;
+    std::chrono::steady_clock::time_point start_time;
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> walked{false};
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> files_done{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> bytes_done{0};
+    std::atomic<uint64_t> failures{0};
+
+    // Files submitted to the thread pool and not done yet. The walk waits while there are too many,
+    // so that a huge tree doesn't queue a task for every file at once.
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    size_t in_flight = 0;
+    std::chrono::steady_clock::time_point end_time;
+
+    std::thread walker;
+    // Last, so that running tasks are done before anything they use goes away.
+    ThreadPool thread_pool;
+  };
+
+  static void walk(Request& request);
+  static void submit(Request& request, std::string object_name, FileStatus file_status);
+  static void load_file(
+      Request& request, const std::string& object_name, FileStatus& file_status);
+  static std::string request_text(const Request& request);
+
+  const size_t m_default_concurrency;
+  mutable std::mutex m_mutex;
+  std::map<std::string, std::unique_ptr<Request>> m_requests;
+  // Paths of m_requests, oldest first.
+  std::deque<std::string> m_order;
+};
+
+// Null unless the block cache is enabled.
+extern std::shared_ptr<CacheLoader> g_cache_loader;
@@ -0,0 +1,337 @@
+#include "crc64.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define AZFUSE_CRC64_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define AZFUSE_TARGET(features)
+#else
+#define AZFUSE_TARGET(features) __attribute__((target(features)))
+#endif
+#endif
+
+namespace {
+constexpr uint64_t k_polynomial = 0x9a6c9329ac4bc9b5ULL;
+
+using Tables = std::array<std::array<uint64_t, 256>, 8>;
+
+constexpr Tables make_tables()
+{
+  Tables tables{};
+  for (uint64_t i = 0; i < 256; ++i)
+  {
+    uint64_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc >> 1) ^ ((crc & 1) ? k_polynomial : 0);
+    tables[0][i] = crc;
+  }
+  for (size_t t = 1; t < tables.size(); ++t)
+  {
+    for (size_t i = 0; i < 256; ++i)
+      tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xff];
+  }
+  return tables;
+}
+
+constexpr Tables k_tables = make_tables();
+
+uint64_t load_le64(const uint8_t* p)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i)
+    v = (v << 8) | p[i];
+  return v;
+#else
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+#endif
+}
+
+// The kernels work on the CRC before the final inversion, and take it before the initial one.
+
+// Slicing-by-8.
+uint64_t crc64_scalar(uint64_t crc, const uint8_t* p, size_t size)
+{
+  for (; size >= 8; p += 8, size -= 8)
+  {
+    crc ^= load_le64(p);
+    crc = k_tables[7][crc & 0xff] ^ k_tables[6][(crc >> 8) & 0xff]
+        ^ k_tables[5][(crc >> 16) & 0xff] ^ k_tables[4][(crc >> 24) & 0xff]
+        ^ k_tables[3][(crc >> 32) & 0xff] ^ k_tables[2][(crc >> 40) & 0xff]
+        ^ k_tables[1][(crc >> 48) & 0xff] ^ k_tables[0][crc >> 56];
+  }
+  for (; size > 0; ++p, --size)
+    crc = k_tables[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef AZFUSE_CRC64_X86
+// Folding constants, bit-reflected. A 128-bit lane is folded over a distance of D bits by
+// multiplying its first half by x^(D+63) mod P and its second half by x^(D-1) mod P. The first
+// of each pair goes in the low half of the register.
+constexpr uint64_t k_fold_128[2] = {0xeadc41fd2ba3d420ULL, 0x21e9761e252621acULL};
+constexpr uint64_t k_fold_512[2] = {0x0c32cdb31e18a84aULL, 0x62242240ace5045aULL};
+constexpr uint64_t k_fold_1024[2] = {0xa1ca681e733f9c40ULL, 0x5f852fb61e8d92dcULL};
+constexpr uint64_t k_fold_2048[2] = {0x37ccd3e14069cabcULL, 0xa043808c0f782663ULL};
+
+AZFUSE_TARGET("sse4.1,pclmul")
+__m128i fold_128(__m128i x, __m128i constants)
+{
+  return _mm_xor_si128(
+      _mm_clmulepi64_si128(x, constants, 0x00), _mm_clmulepi64_si128(x, constants, 0x11));
+}
+
+AZFUSE_TARGET("sse4.1,pclmul")
+__m128i load_constants(const uint64_t (&constants)[2])
+{
+  const long long low = static_cast<long long>(constants[0]);
+  const long long high = static_cast<long long>(constants[1]);
+  return _mm_set_epi64x(high, low);
+}
+
+// The folded 128 bits are congruent to all the data before them, so the scalar kernel finishes
+// from there as if they were the data.
+AZFUSE_TARGET("sse4.1,pclmul")
+uint64_t finish_128(__m128i x, const uint8_t* p, size_t size)
+{
+  const __m128i k128 = load_constants(k_fold_128);
+  for (; size >= 16; p += 16, size -= 16)
+    x = _mm_xor_si128(fold_128(x, k128), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+  uint8_t folded[16];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(folded), x);
+  return crc64_scalar(crc64_scalar(0, folded, sizeof(folded)), p, size);
+}
+
+AZFUSE_TARGET("sse4.1,pclmul")
+uint64_t crc64_pclmulqdq(uint64_t crc, const uint8_t* p, size_t size)
+{
+  if (size < 256)
+    return crc64_scalar(crc, p, size);
+
+  __m128i x[8];
+  for (int i = 0; i < 8; ++i)
+    x[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+  // The CRC so far is absorbed by adding it to the first 64 bits.
+  x[0] = _mm_xor_si128(x[0], _mm_cvtsi64_si128(static_cast<long long>(crc)));
+  p += 128;
+  size -= 128;
+
+  const __m128i k1024 = load_constants(k_fold_1024);
+  for (; size >= 128; p += 128, size -= 128)
+  {
+    for (int i = 0; i < 8; ++i)
+    {
+      x[i] = _mm_xor_si128(
+          fold_128(x[i], k1024), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i)));
+    }
+  }
+
+  const __m128i k128 = load_constants(k_fold_128);
+  __m128i folded = x[0];
+  for (int i = 1; i < 8; ++i)
+    folded = _mm_xor_si128(fold_128(folded, k128), x[i]);
+  return finish_128(folded, p, size);
+}
+
+AZFUSE_TARGET("sse4.1,pclmul,avx512f,avx512vl,vpclmulqdq")
+__m512i fold_512(__m512i x, __m512i constants)
+{
+  return _mm512_xor_si512(
+      _mm512_clmulepi64_epi128(x, constants, 0x00), _mm512_clmulepi64_epi128(x, constants, 0x11));
+}
+
+AZFUSE_TARGET("sse4.1,pclmul,avx512f,avx512vl,vpclmulqdq")
+__m512i load_constants_512(const uint64_t (&constants)[2])
+{
+  const long long low = static_cast<long long>(constants[0]);
+  const long long high = static_cast<long long>(constants[1]);
+  return _mm512_set_epi64(high, low, high, low, high, low, high, low);
+}
+
+AZFUSE_TARGET("sse4.1,pclmul,avx512f,avx512vl,vpclmulqdq")
+uint64_t crc64_vpclmulqdq(uint64_t crc, const uint8_t* p, size_t size)
+{
+  if (size < 1024)
+    return crc64_pclmulqdq(crc, p, size);
+
+  __m512i x[4];
+  for (int i = 0; i < 4; ++i)
+    x[i] = _mm512_loadu_si512(p + 64 * i);
+  x[0] = _mm512_xor_si512(
+      x[0], _mm512_zextsi128_si512(_mm_cvtsi64_si128(static_cast<long long>(crc))));
+  p += 256;
+  size -= 256;
+
+  const __m512i k2048 = load_constants_512(k_fold_2048);
+  for (; size >= 256; p += 256, size -= 256)
+  {
+    for (int i = 0; i < 4; ++i)
+    {
+      // 0x96 is a ^ b ^ c.
+      x[i] = _mm512_ternarylogic_epi64(
+          _mm512_clmulepi64_epi128(x[i], k2048, 0x00),
+          _mm512_clmulepi64_epi128(x[i], k2048, 0x11),
+          _mm512_loadu_si512(p + 64 * i),
+          0x96);
+    }
+  }
+
+  const __m512i k512 = load_constants_512(k_fold_512);
+  __m512i folded = x[0];
+  for (int i = 1; i < 4; ++i)
+    folded = _mm512_xor_si512(fold_512(folded, k512), x[i]);
+
+  // Each lane is 128 bits ahead of the one before.
+  uint8_t lanes[64];
+  _mm512_storeu_si512(lanes, folded);
+  const __m128i k128 = load_constants(k_fold_128);
+  __m128i lane = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+  for (int i = 1; i < 4; ++i)
+  {
+    lane = _mm_xor_si128(
+        fold_128(lane, k128), _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes + 16 * i)));
+  }
+  return finish_128(lane, p, size);
+}
+
+bool cpu_supports(Crc64Kernel kernel)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  int regs[4];
+  __cpuid(regs, 1);
+  const bool sse41 = (regs[2] & (1 << 19)) != 0;
+  const bool pclmul = (regs[2] & (1 << 1)) != 0;
+  const bool osxsave = (regs[2] & (1 << 27)) != 0;
+  if (kernel == Crc64Kernel::pclmulqdq)
+    return sse41 && pclmul;
+  // ZMM, YMM and XMM state must all be enabled by the OS.
+  if (!sse41 || !pclmul || !osxsave || (_xgetbv(0) & 0xe6) != 0xe6)
+    return false;
+  __cpuidex(regs, 7, 0);
+  const bool avx512f = (regs[1] & (1 << 16)) != 0;
+  const bool avx512vl = (regs[1] & (1 << 31)) != 0;
+  const bool vpclmulqdq = (regs[2] & (1 << 10)) != 0;
+  return avx512f && avx512vl && vpclmulqdq;
+#else
+  __builtin_cpu_init();
+  const bool pclmul = __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("pclmul");
+  if (kernel == Crc64Kernel::pclmulqdq)
+    return pclmul;
+  return pclmul && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+      && __builtin_cpu_supports("vpclmulqdq");
+#endif
+}
+#endif
+
+uint64_t run_kernel(Crc64Kernel kernel, uint64_t crc, const uint8_t* p, size_t size)
+{
+  switch (kernel)
+  {
+#ifdef AZFUSE_CRC64_X86
+    case Crc64Kernel::vpclmulqdq:
+      return crc64_vpclmulqdq(crc, p, size);
+    case Crc64Kernel::pclmulqdq:
+      return crc64_pclmulqdq(crc, p, size);
+#endif
+    default:
+      return crc64_scalar(crc, p, size);
+  }
+}
+
+Crc64Kernel choose_kernel()
+{
+  for (Crc64Kernel kernel : {Crc64Kernel::vpclmulqdq, Crc64Kernel::pclmulqdq})
+  {
+    if (crc64_kernel_supported(kernel) && crc64_self_test(kernel))
+      return kernel;
+  }
+  return Crc64Kernel::scalar;
+}
+} // namespace
+
+const char* crc64_kernel_name(Crc64Kernel kernel)
+{
+  switch (kernel)
+  {
+    case Crc64Kernel::pclmulqdq:
+      return "pclmulqdq";
+    case Crc64Kernel::vpclmulqdq:
+      return "vpclmulqdq";
+    default:
+      return "scalar";
+  }
+}
+
+bool crc64_kernel_supported(Crc64Kernel kernel)
+{
+  if (kernel == Crc64Kernel::scalar)
+    return true;
+#ifdef AZFUSE_CRC64_X86
+  return cpu_supports(kernel);
+#else
+  return false;
+#endif
+}
+
+Crc64Kernel crc64_kernel()
+{
+  static const Crc64Kernel kernel = choose_kernel();
+  return kernel;
+}
+
+uint64_t crc64(uint64_t crc, const void* data, size_t size)
+{
+  return crc64(crc64_kernel(), crc, data, size);
+}
+
+uint64_t crc64(Crc64Kernel kernel, uint64_t crc, const void* data, size_t size)
+{
+  return ~run_kernel(kernel, ~crc, static_cast<const uint8_t*>(data), size);
+}
+
+bool crc64_self_test(Crc64Kernel kernel)
+{
+  if (!crc64_kernel_supported(kernel))
+    return false;
+
+  const char* check = "123456789";
+  if (crc64(kernel, 0, check, std::strlen(check)) != 0xae8b14860a799888ULL)
+    return false;
+  // Reference values computed bit by bit.
+  std::vector<uint8_t> data(4096 + 64);
+  if (crc64(kernel, 0, data.data(), 32) != 0xcf3473434d4ecf3bULL)
+    return false;
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = static_cast<uint8_t>(i * 2654435761U >> 13);
+
+  // Lengths around every block size of the kernels, at every alignment within a vector.
+  for (size_t length : {0, 1, 15, 16, 17, 255, 256, 257, 383, 1023, 1024, 1025, 1280, 4096})
+  {
+    for (size_t align = 0; align < 64; align += 7)
+    {
+      const uint8_t* p = data.data() + align;
+      uint64_t expected = crc64(Crc64Kernel::scalar, 0, p, length);
+      if (crc64(kernel, 0, p, length) != expected)
+        return false;
+      // Continuing a CRC must give the same result as computing it in one go.
+      size_t split = length / 3;
+      if (crc64(kernel, crc64(kernel, 0, p, split), p + split, length - split) != expected)
+        return false;
+    }
+  }
+  return true;
+}
+
+std::vector<uint8_t> crc64_bytes(uint64_t crc)
+{
+  std::vector<uint8_t> bytes(8);
+  for (size_t i = 0; i < bytes.size(); ++i)
+    bytes[i] = static_cast<uint8_t>(crc >> (8 * i));
+  return bytes;
+}
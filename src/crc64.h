@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// CRC-64/NVME, the CRC64 Azure Storage returns for ranged reads: reflected polynomial
+// 0x9A6C9329AC4BC9B5, initial value and final xor all ones. The CRC64 of "123456789" is
+// 0xAE8B14860A799888.
+
+enum class Crc64Kernel
+{
+  scalar,
+  // 128-bit carry-less multiplication, SSE4.1 + PCLMULQDQ.
+  pclmulqdq,
+  // 512-bit carry-less multiplication, AVX-512 + VPCLMULQDQ.
+  vpclmulqdq,
+};
+
+const char* crc64_kernel_name(Crc64Kernel kernel);
+bool crc64_kernel_supported(Crc64Kernel kernel);
+// The fastest kernel this CPU supports that passed the self test.
+Crc64Kernel crc64_kernel();
+
+// Continues |crc|, the CRC64 of the data before |data|, or 0 at the start.
+uint64_t crc64(uint64_t crc, const void* data, size_t size);
+uint64_t crc64(Crc64Kernel kernel, uint64_t crc, const void* data, size_t size);
+
+// Checks |kernel| against known CRCs and against the scalar kernel, for lengths and alignments
+// that take every path through it.
+bool crc64_self_test(Crc64Kernel kernel);
+
+// The 8 bytes of |crc| in the order Azure Storage sends them, least significant first.
+std::vector<uint8_t> crc64_bytes(uint64_t crc);
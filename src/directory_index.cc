@@ -0,0 +1,188 @@
+#include "directory_index.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+namespace {
+bool fits_in_arena(const std::string& arena, const std::string& s)
+{
+  return arena.size() + s.size() <= std::numeric_limits<uint32_t>::max();
+}
+
+void append_to_arena(std::string& arena, std::vector<uint32_t>& offsets, const std::string& s)
+{
+  arena += s;
+  offsets.emplace_back(static_cast<uint32_t>(arena.size()));
+}
+} // namespace
+
+std::string_view DirectoryIndex::name(size_t i) const
+{
+  return std::string_view(m_names).substr(
+      m_name_offsets[i], m_name_offsets[i + 1] - m_name_offsets[i]);
+}
+
+std::string_view DirectoryIndex::etag(size_t i) const
+{
+  return std::string_view(m_etags).substr(
+      m_etag_offsets[i], m_etag_offsets[i + 1] - m_etag_offsets[i]);
+}
+
+std::string_view DirectoryIndex::content_md5(size_t i) const
+{
+  return std::string_view(m_content_md5s)
+      .substr(m_content_md5_offsets[i], m_content_md5_offsets[i + 1] - m_content_md5_offsets[i]);
+}
+
+std::string_view DirectoryIndex::version_id(size_t i) const
+{
+  return std::string_view(m_version_ids)
+      .substr(m_version_id_offsets[i], m_version_id_offsets[i + 1] - m_version_id_offsets[i]);
+}
+
+FileStatus DirectoryIndex::status(size_t i) const
+{
+  FileStatus file_status;
+  file_status.is_directory = m_is_directory[i] != 0;
+  file_status.file_size = static_cast<size_t>(m_sizes[i]);
+  file_status.last_modified_time = std::chrono::system_clock::time_point(
+      std::chrono::system_clock::duration(m_modified_times[i]));
+  file_status.etag = std::string(etag(i));
+  file_status.content_md5 = std::string(content_md5(i));
+  file_status.version_id = std::string(version_id(i));
+  return file_status;
+}
+
+DirectoryEntry DirectoryIndex::entry(size_t i) const
+{
+  DirectoryEntry e;
+  e.name = std::string(name(i));
+  e.status = status(i);
+  return e;
+}
+
+void DirectoryIndex::append(const DirectoryEntry& entry)
+{
+  if (!fits_in_arena(m_names, entry.name) || !fits_in_arena(m_etags, entry.status.etag)
+      || !fits_in_arena(m_content_md5s, entry.status.content_md5)
+      || !fits_in_arena(m_version_ids, entry.status.version_id))
+    throw std::length_error("directory too large");
+  if (m_sorted && !empty() && std::string_view(entry.name) < name(size() - 1))
+    m_sorted = false;
+  append_to_arena(m_names, m_name_offsets, entry.name);
+  append_to_arena(m_etags, m_etag_offsets, entry.status.etag);
+  append_to_arena(m_content_md5s, m_content_md5_offsets, entry.status.content_md5);
+  append_to_arena(m_version_ids, m_version_id_offsets, entry.status.version_id);
+  m_sizes.emplace_back(entry.status.file_size);
+  m_modified_times.emplace_back(entry.status.last_modified_time.time_since_epoch().count());
+  m_is_directory.emplace_back(entry.status.is_directory ? 1 : 0);
+}
+
+void DirectoryIndex::append(const std::vector<DirectoryEntry>& entries)
+{
+  m_sizes.reserve(m_sizes.size() + entries.size());
+  m_modified_times.reserve(m_modified_times.size() + entries.size());
+  m_is_directory.reserve(m_is_directory.size() + entries.size());
+  m_name_offsets.reserve(m_name_offsets.size() + entries.size());
+  m_etag_offsets.reserve(m_etag_offsets.size() + entries.size());
+  m_content_md5_offsets.reserve(m_content_md5_offsets.size() + entries.size());
+  m_version_id_offsets.reserve(m_version_id_offsets.size() + entries.size());
+  for (const auto& e : entries)
+    append(e);
+}
+
+void DirectoryIndex::copy_to(std::vector<DirectoryEntry>& directory_entries) const
+{
+  directory_entries.reserve(directory_entries.size() + size());
+  for (size_t i = 0; i < size(); ++i)
+    directory_entries.emplace_back(entry(i));
+}
+
+void DirectoryIndex::sort()
+{
+  if (m_sorted)
+    return;
+  std::vector<uint32_t> order(size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(
+      order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return name(a) < name(b); });
+
+  DirectoryIndex sorted;
+  sorted.m_names.reserve(m_names.size());
+  sorted.m_etags.reserve(m_etags.size());
+  sorted.m_content_md5s.reserve(m_content_md5s.size());
+  sorted.m_version_ids.reserve(m_version_ids.size());
+  sorted.m_name_offsets.reserve(m_name_offsets.size());
+  sorted.m_etag_offsets.reserve(m_etag_offsets.size());
+  sorted.m_content_md5_offsets.reserve(m_content_md5_offsets.size());
+  sorted.m_version_id_offsets.reserve(m_version_id_offsets.size());
+  sorted.m_sizes.reserve(size());
+  sorted.m_modified_times.reserve(size());
+  sorted.m_is_directory.reserve(size());
+  for (uint32_t i : order)
+  {
+    sorted.m_names.append(name(i));
+    sorted.m_name_offsets.emplace_back(static_cast<uint32_t>(sorted.m_names.size()));
+    sorted.m_etags.append(etag(i));
+    sorted.m_etag_offsets.emplace_back(static_cast<uint32_t>(sorted.m_etags.size()));
+    sorted.m_content_md5s.append(content_md5(i));
+    sorted.m_content_md5_offsets.emplace_back(
+        static_cast<uint32_t>(sorted.m_content_md5s.size()));
+    sorted.m_version_ids.append(version_id(i));
+    sorted.m_version_id_offsets.emplace_back(static_cast<uint32_t>(sorted.m_version_ids.size()));
+    sorted.m_sizes.emplace_back(m_sizes[i]);
+    sorted.m_modified_times.emplace_back(m_modified_times[i]);
+    sorted.m_is_directory.emplace_back(m_is_directory[i]);
+  }
+  *this = std::move(sorted);
+}
+
+size_t DirectoryIndex::find(std::string_view name) const
+{
+  if (!m_sorted)
+  {
+    for (size_t i = 0; i < size(); ++i)
+      if (this->name(i) == name)
+        return i;
+    return npos;
+  }
+  size_t low = 0;
+  size_t high = size();
+  while (low < high)
+  {
+    size_t middle = low + (high - low) / 2;
+    if (this->name(middle) < name)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low < size() && this->name(low) == name ? low : npos;
+}
+
+size_t DirectoryIndex::memory_usage() const
+{
+  return sizeof(*this) + m_names.capacity() + m_etags.capacity() + m_content_md5s.capacity()
+      + m_version_ids.capacity()
+      + (m_name_offsets.capacity() + m_etag_offsets.capacity() + m_content_md5_offsets.capacity()
+         + m_version_id_offsets.capacity())
+          * sizeof(uint32_t)
+      + m_sizes.capacity() * sizeof(uint64_t) + m_modified_times.capacity() * sizeof(int64_t)
+      + m_is_directory.capacity();
+}
+
+void DirectoryIndex::shrink_to_fit()
+{
+  m_names.shrink_to_fit();
+  m_etags.shrink_to_fit();
+  m_content_md5s.shrink_to_fit();
+  m_version_ids.shrink_to_fit();
+  m_name_offsets.shrink_to_fit();
+  m_etag_offsets.shrink_to_fit();
+  m_content_md5_offsets.shrink_to_fit();
+  m_version_id_offsets.shrink_to_fit();
+  m_sizes.shrink_to_fit();
+  m_modified_times.shrink_to_fit();
+  m_is_directory.shrink_to_fit();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "adaptor.h"
+
+// The entries of one directory, packed so that directories of millions of entries stay
+// affordable. Names, ETags, MD5s and version IDs live in arenas and the other fields in parallel
+// arrays, which comes to about 38 bytes per entry plus the strings themselves. Entries keep the
+// order they were appended in, so a listing can grow page by page while being read, until sort()
+// orders them by name for find().
+class DirectoryIndex {
+public:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  size_t size() const { return m_sizes.size(); }
+  bool empty() const { return m_sizes.empty(); }
+  std::string_view name(size_t i) const;
+  bool is_directory(size_t i) const { return m_is_directory[i] != 0; }
+  uint64_t file_size(size_t i) const { return m_sizes[i]; }
+  std::string_view etag(size_t i) const;
+  std::string_view content_md5(size_t i) const;
+  std::string_view version_id(size_t i) const;
+  FileStatus status(size_t i) const;
+  DirectoryEntry entry(size_t i) const;
+
+  void append(const DirectoryEntry& entry);
+  void append(const std::vector<DirectoryEntry>& entries);
+  // Appends all entries to |directory_entries|.
+  void copy_to(std::vector<DirectoryEntry>& directory_entries) const;
+
+  // Orders entries by name. Entries of the same name, like a blob and a directory prefix, keep
+  // their order.
+  void sort();
+  // First entry named |name|, or npos. Binary search once sorted, a linear scan before.
+  size_t find(std::string_view name) const;
+
+  size_t memory_usage() const;
+  void shrink_to_fit();
+
+private:
+  std::string m_names;
+  std::string m_etags;
+  std::string m_content_md5s;
+  std::string m_version_ids;
+  // Entry i's name is m_names[m_name_offsets[i], m_name_offsets[i + 1]), and likewise its ETag,
+  // MD5 and version ID.
+  std::vector<uint32_t> m_name_offsets{0};
+  std::vector<uint32_t> m_etag_offsets{0};
+  std::vector<uint32_t> m_content_md5_offsets{0};
+  std::vector<uint32_t> m_version_id_offsets{0};
+  std::vector<uint64_t> m_sizes;
+  // In ticks of std::chrono::system_clock.
+  std::vector<int64_t> m_modified_times;
+  std::vector<uint8_t> m_is_directory;
+  bool m_sorted = true;
+};
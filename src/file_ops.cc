@@ -5,16 +5,43 @@
 #endif
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
 #include <tuple>
 
+#include "adaptor_registry.h"
+#include "buffer_pool.h"
+#include "cache_loader.h"
+#include "directory_index.h"
+#include "prefetcher.h"
+
 namespace {
 struct file_context
 {
   std::string container_name;
   std::string object_name;
   std::shared_ptr<BaseAdaptor> adaptor;
+  // Version of the object when it was opened. All reads are pinned to it.
+  std::string etag;
+  // Null unless the prefetcher learns from reads of this file.
+  std::shared_ptr<AccessRecord> access_record;
+  uint64_t file_size = 0;
+  bool bypass_cache = false;
+  // Reads follow the file as it grows. Largest size they've seen so far.
+  bool follow = false;
+  std::atomic<uint64_t> followed_size{0};
+  // Bytes to keep read ahead of sequential reads, or zero.
+  uint64_t readahead = 0;
+  std::mutex readahead_mutex;
+  // Where the next read starts if reads are sequential, and where readahead has got to.
+  uint64_t next_offset = 0;
+  uint64_t readahead_end = 0;
 };
 
 struct directory_context
@@ -23,8 +50,9 @@ struct directory_context
   std::string object_name;
   std::shared_ptr<BaseAdaptor> adaptor;
 
-  std::vector<DirectoryEntry> directory_entries;
-  size_t pos = 0;
+  // Everything listed so far, in the order it was listed, so that readdir can resume at any
+  // offset handed out before.
+  DirectoryIndex entries;
   std::string continuation_token;
   bool new_listing = true;
 };
@@ -77,46 +105,308 @@ std::tuple<std::string, std::string> parse_path(const std::string& path)
 
 std::shared_ptr<BaseAdaptor> resolve_path(const std::string& container_name)
 {
-  auto ite = g_adaptors.find(container_name);
-  return ite == g_adaptors.end() ? nullptr : ite->second;
+  return g_adaptors.find(container_name);
+}
+
+#ifndef _WIN32
+std::mutex process_name_mutex;
+// Reading /proc on every request would be too slow. Entries of exited processes linger until the
+// map is reset, and a recycled pid may be misclassified until then.
+std::unordered_map<pid_t, std::string> process_name_cache;
+constexpr size_t k_max_process_name_cache_size = 4096;
+#endif
+
+// Name of the process making the current FUSE request, as in /proc/[pid]/comm.
+std::string request_process_name()
+{
+#ifdef _WIN32
+  return std::string();
+#else
+  pid_t pid = fuse_get_context()->pid;
+  {
+    std::lock_guard<std::mutex> guard(process_name_mutex);
+    auto ite = process_name_cache.find(pid);
+    if (ite != process_name_cache.end())
+      return ite->second;
+  }
+
+  std::string comm;
+  {
+    std::ifstream fin("/proc/" + std::to_string(pid) + "/comm");
+    std::getline(fin, comm);
+  }
+
+  std::lock_guard<std::mutex> guard(process_name_mutex);
+  if (process_name_cache.size() >= k_max_process_name_cache_size)
+    process_name_cache.clear();
+  process_name_cache[pid] = comm;
+  return comm;
+#endif
+}
+
+// Priority of the process making the current FUSE request.
+IoPriority request_priority()
+{
+  if (g_process_priorities.empty())
+    return IoPriority::foreground_read;
+  auto ite = g_process_priorities.find(request_process_name());
+  return ite == g_process_priorities.end() ? IoPriority::foreground_read : ite->second;
+}
+
+// Keeps the block cache up to |readahead| bytes ahead of sequential reads. More is read once
+// less than half of it is left, so that readahead is issued in large requests.
+void read_ahead(file_context& context, uint64_t offset, uint64_t size)
+{
+  uint64_t begin;
+  uint64_t end;
+  {
+    std::lock_guard<std::mutex> guard(context.readahead_mutex);
+    bool sequential = offset == context.next_offset;
+    context.next_offset = offset + size;
+    if (!sequential)
+    {
+      context.readahead_end = 0;
+      return;
+    }
+    begin = std::max(context.readahead_end, offset + size);
+    end = std::min(context.file_size, offset + size + context.readahead);
+    if (begin >= end || context.readahead_end >= offset + size + context.readahead / 2)
+      return;
+    context.readahead_end = end;
+  }
+  g_prefetcher->read_ahead(context.adaptor, context.object_name, context.etag, begin, end - begin);
+}
+
+// Records the read for the prefetcher and keeps readahead going. Returns the options to read with.
+ReadOptions start_read(file_context& context, uint64_t offset, uint64_t size)
+{
+  if (context.access_record)
+    context.access_record->add(offset, size);
+  if (context.readahead != 0 && g_prefetcher)
+    read_ahead(context, offset, size);
+  ReadOptions options;
+  options.if_match = context.etag;
+  options.bypass_cache = context.bypass_cache;
+  options.follow = context.follow;
+  return options;
+}
+
+// Returns true if |file_status| shows that a followed file has grown.
+bool follow_size(file_context& context, const FileStatus& file_status)
+{
+  if (!context.follow || file_status.etag.empty())
+    return false;
+  uint64_t followed_size = context.followed_size.load();
+  while (file_status.file_size > followed_size)
+  {
+    if (context.followed_size.compare_exchange_weak(followed_size, file_status.file_size))
+      return true;
+  }
+  return false;
+}
+
+// The kernel doesn't read past the size it knows, so it's told to look again when a read finds
+// that a followed file has grown.
+void end_read(file_context& context, const char* path, const FileStatus& file_status)
+{
+  if (follow_size(context, file_status))
+    invalidate_kernel_cache(path);
+}
+
+// Reading the last byte of a followed file tells its current size as cheaply as a HEAD, and
+// cached attributes would be stale anyway.
+int followed_getattr(file_context& context, fuse_stat* stbuf)
+{
+  const uint64_t followed_size = context.followed_size.load();
+  ReadOptions options;
+  options.follow = true;
+  FileStatus file_status;
+  if (followed_size != 0)
+  {
+    char last_byte;
+    int ret = context.adaptor->read_with_options(
+        context.object_name, &last_byte, 1, followed_size - 1, options, file_status);
+    if (ret < 0)
+      return ret;
+  }
+  // Still empty, or truncated.
+  if (file_status.etag.empty())
+  {
+    int ret = context.adaptor->getattr(context.object_name, file_status);
+    if (ret < 0)
+      return ret;
+  }
+  follow_size(context, file_status);
+  file_status_to_fuse_stat(file_status, stbuf);
+  return 0;
+}
+
+#ifndef _WIN32
+// Buffers the last read_buf of this thread handed to libfuse by descriptor. libfuse sends the
+// reply before the thread takes another request, so holding on to them until then keeps their
+// memory from being reused while it's spliced.
+thread_local std::vector<BufferSlice> t_replied_slices;
+#endif
+
+// Invalidating from inside a FUSE request may deadlock the kernel, so invalidations are queued
+// and sent from a thread of their own.
+std::mutex invalidation_mutex;
+std::condition_variable invalidation_cv;
+std::deque<std::string> invalidation_queue;
+bool invalidation_running = false;
+std::thread invalidation_thread;
+
+void invalidation_loop(struct fuse* fuse)
+{
+  std::unique_lock<std::mutex> guard(invalidation_mutex);
+  while (true)
+  {
+    invalidation_cv.wait(
+        guard, []() { return !invalidation_running || !invalidation_queue.empty(); });
+    if (!invalidation_running)
+      break;
+    std::string path = std::move(invalidation_queue.front());
+    invalidation_queue.pop_front();
+    guard.unlock();
+    // Fails harmlessly if the kernel doesn't know about the path.
+    fuse_invalidate_path(fuse, path.data());
+    guard.lock();
+  }
+}
+// Extended attributes that control the cache loader.
+const char k_prefetch_xattr[] = "user.azfuse.prefetch";
+const char k_pin_xattr[] = "user.azfuse.pin";
+const char k_status_xattr[] = "user.azfuse.status";
+
+// Parses the value of a control attribute, a number of threads. An empty value is zero.
+bool parse_xattr_count(const char* value, size_t size, size_t& count)
+{
+  count = 0;
+  for (size_t i = 0; i < size; ++i)
+  {
+    // Values written with echo end with a newline, and C strings with a null.
+    if ((value[i] == '\n' || value[i] == '\0') && i + 1 == size)
+      break;
+    if (value[i] < '0' || value[i] > '9' || count > 1000000)
+      return false;
+    count = count * 10 + (value[i] - '0');
+  }
+  return true;
 }
 } // namespace
 
 double g_entry_timeout = 0.0;
 double g_attr_timeout = 0.0;
 int g_auto_cache = 1;
-int g_kernel_cache = 0;
+int g_kernel_cache = 1;
+std::unordered_map<std::string, IoPriority> g_process_priorities;
+std::vector<IoPolicyRule> g_io_policy_rules;
+bool g_zero_copy_reads = false;
 
 void* fs_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
 {
-  (void)conn;
   cfg->entry_timeout = g_entry_timeout;
   cfg->attr_timeout = g_attr_timeout;
   cfg->auto_cache = g_auto_cache;
   cfg->kernel_cache = g_kernel_cache;
+  // Lets libfuse splice buffers handed out by read_buf into the FUSE device instead of copying.
+  if (g_zero_copy_reads && (conn->capable & FUSE_CAP_SPLICE_WRITE))
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+#ifndef _WIN32
+  std::lock_guard<std::mutex> guard(invalidation_mutex);
+  invalidation_running = true;
+  invalidation_thread = std::thread(invalidation_loop, fuse_get_context()->fuse);
+#endif
   return nullptr;
 }
 
+void fs_destroy(void* private_data)
+{
+  (void)private_data;
+  {
+    std::lock_guard<std::mutex> guard(invalidation_mutex);
+    invalidation_running = false;
+    invalidation_queue.clear();
+  }
+  invalidation_cv.notify_all();
+  if (invalidation_thread.joinable())
+    invalidation_thread.join();
+  // Stops prefetching before the adaptors go away, and saves what has been learned.
+  g_prefetcher.reset();
+  g_cache_loader.reset();
+}
+
+void invalidate_kernel_cache(const std::string& path)
+{
+  {
+    std::lock_guard<std::mutex> guard(invalidation_mutex);
+    // Nothing can be cached by the kernel before the file system is up.
+    if (!invalidation_running)
+      return;
+    invalidation_queue.emplace_back(path);
+  }
+  invalidation_cv.notify_one();
+}
+
 int fs_open(const char* path, fuse_file_info* fi)
 {
+  IoPriorityScope priority_scope(request_priority());
   auto [container_name, object_name] = parse_path(path);
 
   auto adaptor = resolve_path(container_name);
   if (!adaptor)
     return -EACCES;
 
+  std::string process;
+  if (!g_io_policy_rules.empty() && io_policy_needs_process(g_io_policy_rules))
+    process = request_process_name();
+  // Opening may fetch the first block into the cache, which files read around it mustn't leave
+  // behind. Their size isn't known yet, so that's decided from the rules that may apply.
+  ReadOptions open_options;
+  open_options.bypass_cache = !g_io_policy_rules.empty()
+      && io_policy_may_bypass_cache(g_io_policy_rules, container_name, object_name, process);
   FileStatus file_status;
-  int ret = adaptor->getattr(object_name, file_status);
+  int ret = adaptor->open(object_name, open_options, file_status);
   if (ret < 0)
     return ret;
 
   if (file_status.is_directory)
     return -EISDIR;
 
+  IoPolicy policy;
+  if (!g_io_policy_rules.empty())
+  {
+    policy = match_io_policy(
+        g_io_policy_rules, container_name, object_name, file_status.file_size, process);
+  }
+  // Page cache reads stop at the size the kernel knows, so they'd miss what's appended, or what a
+  // volatile file has grown to since.
+  fi->direct_io = policy.direct_io || policy.follow || file_status.is_volatile;
+  // Only ever turned on here. The kernel_cache setting turns it on for every file.
+  if (policy.keep_cache && !file_status.is_volatile)
+    fi->keep_cache = 1;
+
   file_context* context = new file_context;
   context->container_name = container_name;
   context->object_name = object_name;
   context->adaptor = adaptor;
+  context->file_size = file_status.file_size;
+  context->bypass_cache = !policy.use_cache;
+  context->follow = policy.follow;
+  context->followed_size = file_status.file_size;
+  // Appending changes the version, so reads of a followed file can't be pinned to one.
+  if (!policy.follow)
+    context->etag = file_status.etag;
+  // Read ahead into a cache the reads go around would be wasted, and without a version the cache
+  // can't keep what's read.
+  if (policy.use_cache && !context->etag.empty())
+    context->readahead = policy.readahead;
+  if (g_prefetcher && policy.prefetch && !policy.follow)
+  {
+    context->access_record
+        = g_prefetcher->on_open(std::string(path + 1), adaptor, object_name, file_status);
+  }
   fi->fh = reinterpret_cast<uint64_t>(context);
 
   return 0;
@@ -125,12 +415,15 @@ int fs_open(const char* path, fuse_file_info* fi)
 int fs_getattr(const char* path, fuse_stat* stbuf, fuse_file_info* fi)
 {
   (void)path;
+  IoPriorityScope priority_scope(request_priority());
   std::shared_ptr<BaseAdaptor> adaptor;
   std::string container_name;
   std::string object_name;
   if (fi)
   {
     file_context* context = reinterpret_cast<file_context*>(fi->fh);
+    if (context->follow)
+      return followed_getattr(*context, stbuf);
     adaptor = context->adaptor;
     container_name = context->container_name;
     object_name = context->object_name;
@@ -149,28 +442,133 @@ int fs_getattr(const char* path, fuse_stat* stbuf, fuse_file_info* fi)
   if (ret < 0)
     return ret;
 
+  // The attribute timeout is the same for every file, so attributes that mustn't be kept are
+  // dropped as soon as they're given.
+  if (file_status.is_volatile && path)
+    invalidate_kernel_cache(path);
   file_status_to_fuse_stat(file_status, stbuf);
   return 0;
 }
 
 int fs_read(const char* path, char* buff, size_t size, fuse_off_t offset, fuse_file_info* fi)
 {
-  (void)path;
+  IoPriorityScope priority_scope(request_priority());
   file_context* context = reinterpret_cast<file_context*>(fi->fh);
-  int ret = context->adaptor->read(context->object_name, buff, size, offset);
+  ReadOptions options = start_read(*context, offset, size);
+  FileStatus file_status;
+  int ret = context->adaptor->read_with_options(
+      context->object_name, buff, size, offset, options, file_status);
+  if (ret >= 0)
+    end_read(*context, path, file_status);
   return ret;
 }
 
+#ifndef _WIN32
+int fs_read_buf(
+    const char* path, fuse_bufvec** bufp, size_t size, fuse_off_t offset, fuse_file_info* fi)
+{
+  IoPriorityScope priority_scope(request_priority());
+  file_context* context = reinterpret_cast<file_context*>(fi->fh);
+  ReadOptions options = start_read(*context, offset, size);
+  FileStatus file_status;
+  std::vector<BufferSlice>& slices = t_replied_slices;
+  slices.clear();
+  int ret = context->adaptor->read_buffers(
+      context->object_name, size, offset, options, file_status, slices);
+  if (ret < 0)
+  {
+    slices.clear();
+    return ret;
+  }
+  end_read(*context, path, file_status);
+
+  // libfuse frees the vector and every buffer in memory with free().
+  size_t count = std::max<size_t>(slices.size(), 1);
+  auto bufv = static_cast<fuse_bufvec*>(
+      std::calloc(1, sizeof(fuse_bufvec) + (count - 1) * sizeof(fuse_buf)));
+  if (!bufv)
+    return -ENOMEM;
+  bufv->count = count;
+  for (size_t i = 0; i < slices.size(); ++i)
+  {
+    const BufferSlice& slice = slices[i];
+    fuse_buf& buf = bufv->buf[i];
+    buf.size = slice.size;
+    buf.fd = slice.buffer->fd();
+    if (buf.fd >= 0)
+    {
+      buf.flags = fuse_buf_flags(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+      buf.pos = static_cast<off_t>(slice.buffer->fd_offset() + slice.offset);
+      continue;
+    }
+    buf.mem = std::malloc(slice.size);
+    if (!buf.mem)
+    {
+      for (size_t j = 0; j < i; ++j)
+        std::free(bufv->buf[j].mem);
+      std::free(bufv);
+      slices.clear();
+      return -ENOMEM;
+    }
+    std::memcpy(buf.mem, slice.buffer->data() + slice.offset, slice.size);
+  }
+  *bufp = bufv;
+  return 0;
+}
+
+fuse_off_t fs_lseek(const char* path, fuse_off_t offset, int whence, fuse_file_info* fi)
+{
+  (void)path;
+  // The kernel takes care of the other kinds of seeks.
+  if (whence != SEEK_DATA && whence != SEEK_HOLE)
+    return -EINVAL;
+  IoPriorityScope priority_scope(request_priority());
+  file_context* context = reinterpret_cast<file_context*>(fi->fh);
+  if (offset < 0 || static_cast<uint64_t>(offset) >= context->file_size)
+    return -ENXIO;
+  const uint64_t position = static_cast<uint64_t>(offset);
+
+  ReadOptions options;
+  options.if_match = context->etag;
+  FileStatus file_status;
+  std::vector<DataRange> ranges;
+  int ret = context->adaptor->data_ranges(context->object_name, options, file_status, ranges);
+  if (ret == -ENOTSUP)
+    return whence == SEEK_DATA ? offset : static_cast<fuse_off_t>(context->file_size);
+  if (ret < 0)
+    return ret;
+
+  // The first range that doesn't end before |position|.
+  auto ite = std::upper_bound(
+      ranges.begin(), ranges.end(), position,
+      [](uint64_t p, const DataRange& r) { return p < r.offset + r.length; });
+  if (whence == SEEK_DATA)
+  {
+    if (ite == ranges.end() || ite->offset >= context->file_size)
+      return -ENXIO;
+    return static_cast<fuse_off_t>(std::max(ite->offset, position));
+  }
+  if (ite == ranges.end() || ite->offset > position)
+    return offset;
+  // Ranges don't touch, so every one of them is followed by a hole, or the end of the file.
+  return static_cast<fuse_off_t>(std::min(ite->offset + ite->length, context->file_size));
+}
+#endif
+
 int fs_release(const char* path, fuse_file_info* fi)
 {
   (void)path;
-  delete reinterpret_cast<file_context*>(fi->fh);
+  file_context* context = reinterpret_cast<file_context*>(fi->fh);
+  if (context->access_record)
+    g_prefetcher->on_close(*context->access_record);
+  delete context;
   return 0;
 }
 
 int fs_opendir(const char* path, fuse_file_info* fi)
 {
   (void)path;
+  IoPriorityScope priority_scope(request_priority());
   auto [container_name, object_name] = parse_path(path);
 
   auto adaptor = resolve_path(container_name);
@@ -205,6 +603,7 @@ int fs_readdir(
 {
   (void)path;
   (void)flags;
+  IoPriorityScope priority_scope(request_priority());
 
   directory_context* context = reinterpret_cast<directory_context*>(fi->fh);
   auto& adaptor = context->adaptor;
@@ -234,33 +633,36 @@ int fs_readdir(
     offset++;
   }
 
-  do
+  while (true)
   {
-    for (; context->pos < context->directory_entries.size(); context->pos++)
+    size_t i = static_cast<size_t>(offset - 2);
+    if (i >= context->entries.size())
     {
-      fuse_stat stbuf;
-      file_status_to_fuse_stat(context->directory_entries[context->pos].status, &stbuf);
-      int ret = filler(
-          buff,
-          context->directory_entries[context->pos].name.data(),
-          &stbuf,
-          offset + 1,
-          fuse_fill_dir_flags(0));
-      if (ret != 0)
-        return 0;
-      ++offset;
-    }
-    context->directory_entries.clear();
-    context->pos = 0;
-    if (!context->continuation_token.empty() || context->new_listing)
-    {
-      int ret = adaptor->list(
-          context->object_name, context->directory_entries, context->continuation_token);
+      if (context->continuation_token.empty() && !context->new_listing)
+        break;
+      std::vector<DirectoryEntry> page;
+      int ret = adaptor->list(context->object_name, page, context->continuation_token);
       if (ret < 0)
         return ret;
       context->new_listing = false;
+      context->entries.append(page);
+      if (g_prefetcher)
+      {
+        std::string directory_path = context->object_name == "."
+            ? context->container_name
+            : context->container_name + "/" + context->object_name;
+        g_prefetcher->on_list(directory_path, adaptor, context->object_name, page);
+      }
+      continue;
     }
-  } while (!context->directory_entries.empty() || !context->continuation_token.empty());
+    fuse_stat stbuf;
+    file_status_to_fuse_stat(context->entries.status(i), &stbuf);
+    std::string name(context->entries.name(i));
+    int ret = filler(buff, name.data(), &stbuf, offset + 1, fuse_fill_dir_flags(0));
+    if (ret != 0)
+      return 0;
+    ++offset;
+  }
 
   return 0;
 }
@@ -271,3 +673,71 @@ int fs_releasedir(const char* path, fuse_file_info* fi)
   delete reinterpret_cast<directory_context*>(fi->fh);
   return 0;
 }
+
+int fs_setxattr(const char* path, const char* name, const char* value, size_t size, int flags)
+{
+  (void)flags;
+  const bool prefetch = std::strcmp(name, k_prefetch_xattr) == 0;
+  const bool pin = std::strcmp(name, k_pin_xattr) == 0;
+  if (!prefetch && !pin)
+    return -ENOTSUP;
+  if (!g_cache_loader)
+    return -ENOTSUP;
+  size_t concurrency = 0;
+  if (!parse_xattr_count(value, size, concurrency))
+    return -EINVAL;
+
+  auto [container_name, object_name] = parse_path(path);
+  // Loading everything that's mounted isn't allowed.
+  if (container_name.empty())
+    return -ENOTSUP;
+  auto adaptor = resolve_path(container_name);
+  if (!adaptor)
+    return -EACCES;
+  FileStatus file_status;
+  int ret = adaptor->getattr(object_name, file_status);
+  if (ret < 0)
+    return ret;
+
+  // "0" cancels prefetching and unpins, empty or another number starts with that many threads.
+  const bool zero = size != 0 && value[0] == '0' && concurrency == 0;
+  if (prefetch && zero)
+  {
+    g_cache_loader->cancel(path + 1);
+    return 0;
+  }
+  CacheLoadAction action = CacheLoadAction::load;
+  if (pin)
+    action = zero ? CacheLoadAction::unpin : CacheLoadAction::pin;
+  g_cache_loader->start(path + 1, adaptor, object_name, action, concurrency);
+  return 0;
+}
+
+int fs_getxattr(const char* path, const char* name, char* value, size_t size)
+{
+  if (std::strcmp(name, k_status_xattr) != 0 || !g_cache_loader)
+    return -ENODATA;
+  std::string status = g_cache_loader->status_text(path + 1);
+  if (status.empty())
+    return -ENODATA;
+  if (size == 0)
+    return static_cast<int>(status.size());
+  if (size < status.size())
+    return -ERANGE;
+  std::memcpy(value, status.data(), status.size());
+  return static_cast<int>(status.size());
+}
+
+int fs_listxattr(const char* path, char* list, size_t size)
+{
+  if (!g_cache_loader || g_cache_loader->status_text(path + 1).empty())
+    return 0;
+  // Names are listed null-terminated, one after another.
+  const size_t length = sizeof(k_status_xattr);
+  if (size == 0)
+    return static_cast<int>(length);
+  if (size < length)
+    return -ERANGE;
+  std::memcpy(list, k_status_xattr, length);
+  return static_cast<int>(length);
+}
@@ -8,7 +8,13 @@
 #include <fuse3/fuse.h>
 #undef FUSE_USE_VERSION
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include "adaptor.h"
+#include "io_policy.h"
+#include "scheduler.h"
 
 #ifndef _WIN32
 using fuse_off_t = off_t;
@@ -19,12 +25,30 @@ extern double g_entry_timeout;
 extern double g_attr_timeout;
 extern int g_auto_cache;
 extern int g_kernel_cache;
+// Priorities of requests by name of the requesting process, as in /proc/[pid]/comm. Requests of
+// other processes are foreground requests.
+extern std::unordered_map<std::string, IoPriority> g_process_priorities;
+// Applied to every file when it's opened.
+extern std::vector<IoPolicyRule> g_io_policy_rules;
+// Serve reads with read_buf, so that cached data is spliced rather than copied.
+extern bool g_zero_copy_reads;
 
 void* fs_init(struct fuse_conn_info* conn, struct fuse_config* cfg);
+void fs_destroy(void* private_data);
+
+// Asks the kernel to drop cached attributes and data of |path|, which is relative to the mount
+// point. It's safe to call from any thread, including FUSE worker threads.
+void invalidate_kernel_cache(const std::string& path);
 
 int fs_open(const char* path, fuse_file_info* fi);
 int fs_getattr(const char* path, fuse_stat* stbuf, fuse_file_info* fi);
 int fs_read(const char* path, char* buff, size_t size, fuse_off_t offset, fuse_file_info* fi);
+#ifndef _WIN32
+int fs_read_buf(
+    const char* path, fuse_bufvec** bufp, size_t size, fuse_off_t offset, fuse_file_info* fi);
+// SEEK_DATA and SEEK_HOLE, for files whose adaptor knows where their holes are.
+fuse_off_t fs_lseek(const char* path, fuse_off_t offset, int whence, fuse_file_info* fi);
+#endif
 int fs_release(const char* path, fuse_file_info* fi);
 
 int fs_opendir(const char* path, fuse_file_info* fi);
@@ -36,3 +60,10 @@ int fs_readdir(
     fuse_file_info* fi,
     fuse_readdir_flags flags);
 int fs_releasedir(const char* path, fuse_file_info* fi);
+
+// Setting "user.azfuse.prefetch" on a file or directory loads it into the block cache with as many
+// threads as the value says, and "user.azfuse.pin" also keeps it there. "0" cancels loading or
+// unpins. "user.azfuse.status" reports the progress of the last request.
+int fs_setxattr(const char* path, const char* name, const char* value, size_t size, int flags);
+int fs_getxattr(const char* path, const char* name, char* value, size_t size);
+int fs_listxattr(const char* path, char* list, size_t size);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+// Helpers for the binary files indexes are saved in. These files are only read by the machine that
+// wrote them, so values are stored in native byte order.
+
+template <class T> void write_value(std::ofstream& fout, const T& value)
+{
+  static_assert(std::is_trivially_copyable<T>::value, "");
+  fout.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <class T> bool read_value(std::ifstream& fin, T& value)
+{
+  static_assert(std::is_trivially_copyable<T>::value, "");
+  return static_cast<bool>(fin.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+inline void write_string(std::ofstream& fout, const std::string& s)
+{
+  write_value(fout, static_cast<uint32_t>(s.size()));
+  fout.write(s.data(), s.size());
+}
+
+// Fails on strings longer than |max_size|, so that a corrupt length doesn't allocate gigabytes.
+inline bool read_string(std::ifstream& fin, std::string& s, size_t max_size)
+{
+  uint32_t size;
+  if (!read_value(fin, size) || size > max_size)
+    return false;
+  s.resize(size);
+  return static_cast<bool>(fin.read(&s[0], size));
+}
+
+// Name to write |filename| under before it's renamed into place. Every call gets a name of its own,
+// so that processes sharing a directory never write into the same file.
+inline std::string temp_filename(const std::string& filename)
+{
+  static const uint64_t process_nonce
+      = (static_cast<uint64_t>(std::random_device()()) << 32) | std::random_device()();
+  static std::atomic<uint64_t> counter{0};
+  std::ostringstream out;
+  out << filename << ".tmp." << std::hex << process_nonce << "." << counter++;
+  return out.str();
+}
@@ -0,0 +1,89 @@
+#include "io_policy.h"
+
+namespace {
+bool glob_match_from(const std::string& pattern, size_t p, const std::string& text, size_t t)
+{
+  while (p < pattern.size())
+  {
+    if (pattern[p] == '*')
+    {
+      bool crosses_slash = p + 1 < pattern.size() && pattern[p + 1] == '*';
+      size_t next = p + (crosses_slash ? 2 : 1);
+      // Patterns come from the configuration and have few stars, so plain backtracking is fine.
+      for (size_t i = t;; ++i)
+      {
+        if (glob_match_from(pattern, next, text, i))
+          return true;
+        if (i == text.size() || (!crosses_slash && text[i] == '/'))
+          return false;
+      }
+    }
+    if (t == text.size() || (pattern[p] == '?' ? text[t] == '/' : pattern[p] != text[t]))
+      return false;
+    ++p;
+    ++t;
+  }
+  return t == text.size();
+}
+} // namespace
+
+bool glob_match(const std::string& pattern, const std::string& text)
+{
+  return glob_match_from(pattern, 0, text, 0);
+}
+
+IoPolicy match_io_policy(
+    const std::vector<IoPolicyRule>& rules,
+    const std::string& mount,
+    const std::string& path,
+    uint64_t file_size,
+    const std::string& process)
+{
+  IoPolicy policy;
+  for (const IoPolicyRule& rule : rules)
+  {
+    if ((!rule.mount.empty() && rule.mount != mount) || file_size < rule.min_size
+        || file_size > rule.max_size || (!rule.process.empty() && rule.process != process)
+        || (!rule.path.empty() && !glob_match(rule.path, path)))
+      continue;
+    if (rule.direct_io)
+      policy.direct_io = *rule.direct_io;
+    if (rule.keep_cache)
+      policy.keep_cache = *rule.keep_cache;
+    if (rule.use_cache)
+      policy.use_cache = *rule.use_cache;
+    if (rule.prefetch)
+      policy.prefetch = *rule.prefetch;
+    if (rule.readahead)
+      policy.readahead = *rule.readahead;
+    if (rule.follow)
+      policy.follow = *rule.follow;
+  }
+  return policy;
+}
+
+bool io_policy_may_bypass_cache(
+    const std::vector<IoPolicyRule>& rules,
+    const std::string& mount,
+    const std::string& path,
+    const std::string& process)
+{
+  for (const IoPolicyRule& rule : rules)
+  {
+    if ((!rule.mount.empty() && rule.mount != mount)
+        || (!rule.process.empty() && rule.process != process)
+        || (!rule.path.empty() && !glob_match(rule.path, path)))
+      continue;
+    if ((rule.use_cache && !*rule.use_cache) || (rule.follow && *rule.follow))
+      return true;
+  }
+  return false;
+}
+
+bool io_policy_needs_process(const std::vector<IoPolicyRule>& rules)
+{
+  for (const IoPolicyRule& rule : rules)
+    if (!rule.process.empty())
+      return true;
+  return false;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+
+// How one open file is read.
+struct IoPolicy
+{
+  // Bypass the kernel page cache, so that every read comes to the file system. Suits huge files
+  // read once, which would otherwise push everything else out of the page cache.
+  bool direct_io = false;
+  // Keep what the kernel cached of the file when it's opened again, even if kernel_cache is off.
+  bool keep_cache = false;
+  // Read through the block cache. If false, reads go straight to the service and leave nothing
+  // behind in the cache.
+  bool use_cache = true;
+  // Prefetch the ranges of the file's profile when it's opened, and learn from its reads.
+  bool prefetch = true;
+  // Bytes to read into the block cache ahead of sequential reads. Zero leaves readahead to the
+  // kernel.
+  uint64_t readahead = 0;
+  // Follow a file that's being appended to, like tail -f does. Reads aren't pinned to the version
+  // the file had when it was opened, and reads at the end of the file pick up what has been
+  // appended since.
+  bool follow = false;
+};
+
+// Rules match open files by where they are, how big they are and who opens them. Every matching
+// rule overrides the settings it has, in the order of the rules.
+struct IoPolicyRule
+{
+  // Directory at the root of the mount point, or empty to match all of them.
+  std::string mount;
+  // Glob on the path relative to the mount, or empty to match all paths. "*" and "?" don't match
+  // "/", "**" matches anything, so "datasets/**" matches everything under "datasets".
+  std::string path;
+  uint64_t min_size = 0;
+  uint64_t max_size = std::numeric_limits<uint64_t>::max();
+  // Name of the process opening the file, as in /proc/[pid]/comm, or empty to match all of them.
+  std::string process;
+
+  std::optional<bool> direct_io;
+  std::optional<bool> keep_cache;
+  std::optional<bool> use_cache;
+  std::optional<bool> prefetch;
+  std::optional<uint64_t> readahead;
+  std::optional<bool> follow;
+};
+
+bool glob_match(const std::string& pattern, const std::string& text);
+
+// |process| is only looked at if some rule names a process.
+IoPolicy match_io_policy(
+    const std::vector<IoPolicyRule>& rules,
+    const std::string& mount,
+    const std::string& path,
+    uint64_t file_size,
+    const std::string& process);
+
+// Whether a file could be read around the block cache, or followed, as far as can be told before
+// its size is known. Rules that match on size are taken to match.
+bool io_policy_may_bypass_cache(
+    const std::vector<IoPolicyRule>& rules,
+    const std::string& mount,
+    const std::string& path,
+    const std::string& process);
+
+// Whether matching |rules| needs the name of the requesting process.
+bool io_policy_needs_process(const std::vector<IoPolicyRule>& rules);
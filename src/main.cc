@@ -1,17 +1,37 @@
 #include <cctype>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <string>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 #include <nlohmann/json.hpp>
 
+#include "adaptor_registry.h"
+#include "adaptors/archive_adaptor.h"
 #include "adaptors/azure_storage_blob_adaptor.h"
 #include "adaptors/azure_storage_datalake_adaptor.h"
 #include "adaptors/azure_storage_file_adaptor.h"
+#include "adaptors/caching_adaptor.h"
+#include "adaptors/control_adaptor.h"
+#include "adaptors/decompressing_adaptor.h"
 #include "adaptors/root_directory_adaptor.h"
+#include "adaptors/scheduling_adaptor.h"
+#include "buffer_pool.h"
+#include "cache_loader.h"
+#include "crc64.h"
 #include "file_ops.h"
+#include "memory_governor.h"
+#include "peer_cache.h"
+#include "prefetcher.h"
+#include "scheduler.h"
+#include "shared_block_cache.h"
 
 namespace {
 bool file_exists(const std::string& filename)
@@ -54,7 +74,7 @@ int main(int argc, char** argv)
     return 0;
   }
 
-  g_adaptors.emplace("", std::make_shared<RootDirectoryAdaptor>());
+  g_adaptors.add("", std::make_shared<RootDirectoryAdaptor>());
 
   nlohmann::json j;
   {
@@ -65,57 +85,442 @@ int main(int argc, char** argv)
   g_attr_timeout = j["attr_timeout"];
   g_auto_cache = j["auto_cache"];
   g_kernel_cache = j["kernel_cache"];
-  for (const auto& container : j["cloud_services"])
+  if (j.contains("memory_budget"))
   {
-    std::string mount_at;
-    std::shared_ptr<BaseAdaptor> adaptor;
+    size_t memory_budget = j["memory_budget"];
+    g_buffer_pool.set_budget(memory_budget);
+  }
 
-    if (container.contains("enabled") && container["enabled"] == false)
-      continue;
+#ifndef _WIN32
+  if (j.contains("zero_copy_reads") && j["zero_copy_reads"] == true)
+  {
+    g_zero_copy_reads = true;
+    g_buffer_pool.set_fd_backed(true);
+    // Every slab of the buffer pool holds a descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+  }
+#endif
+
+  // Statistics and other internal state show up under this directory of the mount point.
+  auto control_adaptor = std::make_shared<ControlAdaptor>();
+  control_adaptor->add_file("buffer_pool", []() { return g_buffer_pool.statistics_text(); });
+  control_adaptor->add_file(
+      "crc64", []() { return std::string("kernel ") + crc64_kernel_name(crc64_kernel()) + "\n"; });
+  control_adaptor->add_file("mounts", []() { return g_adaptors.statistics_text(); });
+  g_adaptors.add(".azfuse", control_adaptor);
+
+  // Resizes the budget set above to fit the memory the workload leaves.
+  std::shared_ptr<MemoryGovernor> memory_governor;
+  if (j.contains("memory_governor") && j["memory_governor"]["enabled"] == true)
+  {
+    const auto& governor = j["memory_governor"];
+    MemoryGovernorOptions governor_options;
+    governor_options.max_budget = g_buffer_pool.budget();
+    if (governor.contains("min_budget"))
+      governor_options.min_budget = governor["min_budget"];
+    if (governor.contains("max_budget"))
+      governor_options.max_budget = governor["max_budget"];
+    if (governor.contains("headroom"))
+      governor_options.headroom = governor["headroom"];
+    if (governor.contains("pressure_threshold"))
+      governor_options.pressure_threshold = governor["pressure_threshold"];
+    if (governor.contains("interval_ms"))
+    {
+      int64_t interval = governor["interval_ms"];
+      governor_options.interval = std::chrono::milliseconds(interval);
+    }
+    if (governor.contains("cgroup"))
+      governor_options.cgroup = governor["cgroup"];
+    std::string error;
+    memory_governor = MemoryGovernor::start(governor_options, error);
+    if (!memory_governor)
+    {
+      std::cout << "failed to start the memory governor: " << error << std::endl;
+      return 1;
+    }
+    control_adaptor->add_file(
+        "memory_governor", [memory_governor]() { return memory_governor->statistics_text(); });
+  }
+
+  std::shared_ptr<BlockCache> block_cache;
+  CacheOptions cache_options;
+  if (j.contains("cache") && j["cache"]["enabled"] == true)
+  {
+    const auto& cache = j["cache"];
+    size_t block_size = cache["block_size"];
+    size_t capacity = cache["capacity"];
+    int64_t revalidate_interval = cache["revalidate_interval"];
+    std::shared_ptr<SharedBlockCache> shared_cache;
+    if (cache.contains("shared_file"))
+    {
+      std::string shared_file = cache["shared_file"];
+      size_t shared_capacity = cache["shared_capacity"];
+      std::string error;
+      shared_cache = SharedBlockCache::open(shared_file, block_size, shared_capacity, error);
+      if (!shared_cache)
+      {
+        std::cout << "failed to open " << shared_file << ": " << error << std::endl;
+        return 1;
+      }
+      control_adaptor->add_file(
+          "shared_cache", [shared_cache]() { return shared_cache->statistics_text(); });
+    }
+    block_cache = std::make_shared<BlockCache>(block_size, capacity);
+    if (shared_cache)
+      block_cache->add_tier(shared_cache);
+    g_buffer_pool.add_reclaimer(
+        [block_cache](size_t bytes) { return block_cache->shrink(bytes); });
+    control_adaptor->add_file(
+        "block_cache", [block_cache]() { return block_cache->statistics_text(); });
+    cache_options.revalidate_interval = std::chrono::seconds(revalidate_interval);
+    if (cache.contains("poll_interval"))
+    {
+      int64_t poll_interval = cache["poll_interval"];
+      cache_options.poll_interval = std::chrono::seconds(poll_interval);
+    }
+    if (cache.contains("pinned_listing_budget"))
+      cache_options.pinned_listing_budget = cache["pinned_listing_budget"];
+  }
+
+  if (block_cache && j.contains("peer_cache"))
+  {
+    const auto& peer_cache = j["peer_cache"];
+    PeerCacheOptions peer_options;
+    if (peer_cache.contains("listen"))
+      peer_options.listen = peer_cache["listen"];
+    if (peer_cache.contains("self"))
+      peer_options.self = peer_cache["self"];
+    for (const auto& peer : peer_cache["peers"])
+      peer_options.peers.emplace_back(peer);
+    if (peer_cache.contains("replicas"))
+      peer_options.replicas = peer_cache["replicas"];
+    if (peer_cache.contains("timeout_ms"))
+    {
+      int64_t timeout = peer_cache["timeout_ms"];
+      peer_options.timeout = std::chrono::milliseconds(timeout);
+    }
+    if (peer_cache.contains("load_wait_ms"))
+    {
+      int64_t load_wait = peer_cache["load_wait_ms"];
+      peer_options.load_wait = std::chrono::milliseconds(load_wait);
+    }
+    std::string error;
+    auto peers = PeerCache::start(block_cache, peer_options, error);
+    if (!peers)
+    {
+      std::cout << "failed to start the peer cache: " << error << std::endl;
+      return 1;
+    }
+    block_cache->add_tier(peers);
+    control_adaptor->add_file("peer_cache", [peers]() { return peers->statistics_text(); });
+  }
+
+  if (block_cache)
+  {
+    size_t num_threads = 8;
+    if (j.contains("cache_loader") && j["cache_loader"].contains("threads"))
+      num_threads = j["cache_loader"]["threads"];
+    g_cache_loader = std::make_shared<CacheLoader>(num_threads);
+    control_adaptor->add_file("cache_loader", []() {
+      return g_cache_loader ? g_cache_loader->statistics_text() : std::string();
+    });
+  }
+
+  std::string cache_dir;
+  if (j.contains("cache_dir"))
+    cache_dir = j["cache_dir"];
+
+  DecompressOptions decompress_options;
+  if (j.contains("decompress_checkpoint_interval"))
+    decompress_options.checkpoint_interval = j["decompress_checkpoint_interval"];
+  ArchiveOptions archive_options;
+  if (!cache_dir.empty())
+  {
+    decompress_options.index_directory = cache_dir + "/seek_indexes";
+    archive_options.index_directory = cache_dir + "/archive_indexes";
+    for (const auto& directory :
+         {decompress_options.index_directory, archive_options.index_directory})
+    {
+      std::error_code ec;
+      std::filesystem::create_directories(directory, ec);
+      if (ec)
+      {
+        std::cout << "failed to create " << directory << ": " << ec.message() << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  if (j.contains("process_priorities"))
+  {
+    for (const auto& i : j["process_priorities"].items())
+    {
+      IoPriority priority;
+      if (!parse_io_priority(i.value(), priority))
+      {
+        std::cout << "invalid priority for process " << i.key() << std::endl;
+        return 1;
+      }
+      g_process_priorities.emplace(i.key(), priority);
+    }
+  }
+
+  if (j.contains("io_policies"))
+  {
+    for (const auto& r : j["io_policies"])
+    {
+      IoPolicyRule rule;
+      if (r.contains("mount"))
+        rule.mount = r["mount"];
+      if (r.contains("path"))
+        rule.path = r["path"];
+      if (r.contains("min_size"))
+        rule.min_size = r["min_size"];
+      if (r.contains("max_size"))
+        rule.max_size = r["max_size"];
+      if (r.contains("process"))
+        rule.process = r["process"];
+      if (r.contains("direct_io"))
+        rule.direct_io = r["direct_io"].get<bool>();
+      if (r.contains("keep_cache"))
+        rule.keep_cache = r["keep_cache"].get<bool>();
+      if (r.contains("use_cache"))
+        rule.use_cache = r["use_cache"].get<bool>();
+      if (r.contains("prefetch"))
+        rule.prefetch = r["prefetch"].get<bool>();
+      if (r.contains("readahead"))
+        rule.readahead = r["readahead"].get<uint64_t>();
+      if (r.contains("follow"))
+        rule.follow = r["follow"].get<bool>();
+      g_io_policy_rules.emplace_back(std::move(rule));
+    }
+  }
+
+  // Prefetched data is only kept in the block cache, so prefetching is pointless without it.
+  if (j.contains("prefetch") && j["prefetch"]["enabled"] == true && block_cache)
+  {
+    const auto& prefetch = j["prefetch"];
+    PrefetchOptions prefetch_options;
+    if (prefetch.contains("threads"))
+      prefetch_options.num_threads = prefetch["threads"];
+    if (prefetch.contains("learn"))
+      prefetch_options.learn = prefetch["learn"];
+    if (prefetch.contains("small_file_size"))
+      prefetch_options.small_file_size = prefetch["small_file_size"];
+    if (prefetch.contains("small_file_window"))
+      prefetch_options.small_file_window = prefetch["small_file_window"];
+    if (!cache_dir.empty())
+      prefetch_options.profile_file = cache_dir + "/prefetch_profiles";
+    g_prefetcher = std::make_shared<Prefetcher>(prefetch_options);
+    if (prefetch.contains("profiles"))
+    {
+      for (const auto& i : prefetch["profiles"].items())
+      {
+        std::vector<PrefetchRange> ranges;
+        for (const auto& r : i.value())
+        {
+          PrefetchRange range;
+          if (r.contains("from_end"))
+            range.from_end = r["from_end"];
+          range.offset = r["offset"];
+          range.length = r["length"];
+          ranges.emplace_back(range);
+        }
+        g_prefetcher->add_profile(i.key(), std::move(ranges));
+      }
+    }
+    control_adaptor->add_file("prefetch", []() {
+      return g_prefetcher ? g_prefetcher->statistics_text() : std::string();
+    });
+  }
 
+  // Builds the adaptors of a container, outermost first: archives, decompression, cache,
+  // scheduler and the service itself. Only copies are captured, since accounts call it long after
+  // the configuration is read.
+  auto make_adaptor = [block_cache, cache_options, decompress_options, archive_options](
+                          const nlohmann::json& container,
+                          const std::string& container_name,
+                          const std::string& mount_at,
+                          std::shared_ptr<Scheduler> scheduler) {
+    std::shared_ptr<BaseAdaptor> adaptor;
     std::string type = container["type"];
+    std::string account_name = container["account_name"];
+    std::string account_key = container["account_key"];
+    bool verify_integrity
+        = container.contains("verify_integrity") && container["verify_integrity"] == true;
     if (type == "azure storage datalake")
     {
-      std::string account_name = container["account_name"];
-      std::string container_name = container["container_name"];
-      std::string account_key = container["account_key"];
-      mount_at = account_name + "_" + container_name;
-      if (container.contains("mount_at"))
-        mount_at = container["mount_at"];
       adaptor = std::make_shared<AzureStorageDataLakeAdaptor>(
-          account_name, container_name, account_key);
+          account_name, container_name, account_key, verify_integrity);
     }
     else if (type == "azure storage blob")
     {
-      std::string account_name = container["account_name"];
-      std::string container_name = container["container_name"];
-      std::string account_key = container["account_key"];
-      mount_at = account_name + "_" + container_name;
-      if (container.contains("mount_at"))
-        mount_at = container["mount_at"];
-      adaptor
-          = std::make_shared<AzureStorageBlobAdaptor>(account_name, container_name, account_key);
+      adaptor = std::make_shared<AzureStorageBlobAdaptor>(
+          account_name, container_name, account_key, verify_integrity);
+    }
+    else if (type == "azure storage file")
+    {
+      std::string snapshot;
+      if (container.contains("snapshot"))
+        snapshot = container["snapshot"];
+      adaptor = std::make_shared<AzureStorageFileAdaptor>(
+          account_name, container_name, account_key, verify_integrity, snapshot);
+    }
+
+    // Below the cache, so that only requests that really go to the service are scheduled.
+    if (adaptor && scheduler)
+      adaptor = std::make_shared<SchedulingAdaptor>(std::move(adaptor), std::move(scheduler));
+
+    bool decompress = container.contains("decompress") && container["decompress"] == true;
+    if (adaptor && block_cache)
+    {
+      auto on_change = [mount_at, decompress](const std::string& path) {
+        std::string mount_path = path == "." ? "/" + mount_at : "/" + mount_at + "/" + path;
+        invalidate_kernel_cache(mount_path);
+        if (!decompress)
+          return;
+        // The decompressed view of a compressed object changes with it.
+        for (const std::string suffix : {".gz", ".zst"})
+        {
+          if (mount_path.size() > suffix.size()
+              && mount_path.compare(mount_path.size() - suffix.size(), suffix.size(), suffix) == 0)
+            invalidate_kernel_cache(mount_path.substr(0, mount_path.size() - suffix.size()));
+        }
+      };
+      CacheOptions mount_cache_options = cache_options;
+      mount_cache_options.verify_blocks = verify_integrity;
+      // The same container is the same data in every mount and process.
+      mount_cache_options.object_namespace = type + ':' + account_name + '/' + container_name;
+      // Mounts reach the whole account with its key, so any of its objects may serve another's
+      // content, but other accounts' objects mustn't.
+      mount_cache_options.content_namespace = account_name;
+      // A snapshot never changes, so there's nothing to revalidate.
+      mount_cache_options.pin_versions
+          = (container.contains("pin_versions") && container["pin_versions"] == true)
+          || container.contains("snapshot");
+      adaptor = std::make_shared<CachingAdaptor>(
+          mount_at, std::move(adaptor), block_cache, mount_cache_options, on_change);
+    }
+
+    if (adaptor && decompress)
+    {
+      adaptor = std::make_shared<DecompressingAdaptor>(
+          mount_at, std::move(adaptor), decompress_options);
     }
+
+    if (adaptor && container.contains("archives") && container["archives"] == true)
+      adaptor = std::make_shared<ArchiveAdaptor>(mount_at, std::move(adaptor), archive_options);
+    return adaptor;
+  };
+
+  std::map<std::string, std::shared_ptr<Scheduler>> schedulers;
+  for (const auto& container : j["cloud_services"])
+  {
+    if (container.contains("enabled") && container["enabled"] == false)
+      continue;
+
+    std::string type = container["type"];
+    std::string account_name = container["account_name"];
+    std::string account_key = container["account_key"];
+    int (*list_containers)(
+        const std::string&, const std::string&, std::vector<std::string>&, std::string&)
+        = nullptr;
+    if (type == "azure storage datalake")
+      list_containers = AzureStorageDataLakeAdaptor::list_containers;
+    else if (type == "azure storage blob")
+      list_containers = AzureStorageBlobAdaptor::list_containers;
     else if (type == "azure storage file")
+      list_containers = AzureStorageFileAdaptor::list_containers;
+    if (!list_containers)
+    {
+      std::cout << "unknown type: " << type << std::endl;
+      return 1;
+    }
+
+    // Without a container name, every container of the account is mounted, each on first access.
+    bool whole_account = !container.contains("container_name");
+    std::string container_name;
+    if (!whole_account)
+      container_name = container["container_name"];
+    // For an account, this is the prefix of the names its containers are mounted at.
+    std::string mount_at = account_name + "_" + container_name;
+    if (container.contains("mount_at"))
+      mount_at = container["mount_at"];
+    if (container.contains("snapshot") && (type != "azure storage file" || whole_account))
+    {
+      std::cout << "snapshot is only supported for a share of azure storage file: " << mount_at
+                << std::endl;
+      return 1;
+    }
+
+    // Containers of an account share their limits, like the service does.
+    std::shared_ptr<Scheduler> scheduler;
+    if (container.contains("max_concurrency") || container.contains("requests_per_second")
+        || container.contains("bytes_per_second"))
+    {
+      SchedulerOptions scheduler_options;
+      if (container.contains("max_concurrency"))
+        scheduler_options.max_concurrency = container["max_concurrency"];
+      if (container.contains("requests_per_second"))
+        scheduler_options.requests_per_second = container["requests_per_second"];
+      if (container.contains("bytes_per_second"))
+        scheduler_options.bytes_per_second = container["bytes_per_second"];
+      if (container.contains("max_background_waiting"))
+        scheduler_options.max_background_waiting = container["max_background_waiting"];
+      scheduler = std::make_shared<Scheduler>(scheduler_options);
+      schedulers.emplace(whole_account ? mount_at + "*" : mount_at, scheduler);
+    }
+
+    if (whole_account)
     {
-      std::string account_name = container["account_name"];
-      std::string container_name = container["container_name"];
-      std::string account_key = container["account_key"];
-      mount_at = account_name + "_" + container_name;
-      if (container.contains("mount_at"))
-        mount_at = container["mount_at"];
-      adaptor
-          = std::make_shared<AzureStorageFileAdaptor>(account_name, container_name, account_key);
+      AccountOptions account_options;
+      account_options.prefix = mount_at;
+      if (container.contains("list_interval"))
+      {
+        int64_t list_interval = container["list_interval"];
+        account_options.list_interval = std::chrono::seconds(list_interval);
+      }
+      if (container.contains("idle_timeout"))
+      {
+        int64_t idle_timeout = container["idle_timeout"];
+        account_options.idle_timeout = std::chrono::seconds(idle_timeout);
+      }
+      g_adaptors.add_account(
+          [list_containers, account_name, account_key](
+              std::vector<std::string>& names, std::string& continuation_token) {
+            return list_containers(account_name, account_key, names, continuation_token);
+          },
+          [make_adaptor, container, scheduler](
+              const std::string& container_name, const std::string& mount_at) {
+            return make_adaptor(container, container_name, mount_at, scheduler);
+          },
+          account_options);
+      continue;
     }
 
-    auto inserted = g_adaptors.emplace(mount_at, std::move(adaptor)).second;
-    if (!inserted)
+    auto adaptor = make_adaptor(container, container_name, mount_at, std::move(scheduler));
+    if (!g_adaptors.add(mount_at, std::move(adaptor)))
     {
       std::cout << "duplicate container name: " << mount_at << std::endl;
       return 1;
     }
   }
 
+  if (!schedulers.empty())
+  {
+    control_adaptor->add_file("scheduler", [&schedulers]() {
+      std::string text;
+      for (const auto& i : schedulers)
+        text += "[" + i.first + "]\n" + i.second->statistics_text();
+      return text;
+    });
+  }
+
   std::vector<char*> fuse_args;
   fuse_args.emplace_back(argv[0]);
   std::string fuse_f = "-f";
@@ -127,13 +532,22 @@ int main(int argc, char** argv)
   struct fuse_operations vrfs_operations;
   std::memset(&vrfs_operations, 0, sizeof(vrfs_operations));
   vrfs_operations.init = fs_init;
+  vrfs_operations.destroy = fs_destroy;
   vrfs_operations.open = fs_open;
   vrfs_operations.getattr = fs_getattr;
   vrfs_operations.read = fs_read;
+#ifndef _WIN32
+  if (g_zero_copy_reads)
+    vrfs_operations.read_buf = fs_read_buf;
+  vrfs_operations.lseek = fs_lseek;
+#endif
   vrfs_operations.release = fs_release;
   vrfs_operations.opendir = fs_opendir;
   vrfs_operations.readdir = fs_readdir;
   vrfs_operations.releasedir = fs_releasedir;
+  vrfs_operations.setxattr = fs_setxattr;
+  vrfs_operations.getxattr = fs_getxattr;
+  vrfs_operations.listxattr = fs_listxattr;
 
   return fuse_main(static_cast<int>(fuse_args.size()), fuse_args.data(), &vrfs_operations, nullptr);
 }
@@ -0,0 +1,265 @@
+#include "memory_governor.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "buffer_pool.h"
+
+namespace {
+// Resizes kept for statistics.
+constexpr size_t k_max_decisions = 32;
+// Smallest step the budget grows by.
+constexpr size_t k_min_growth = 16 * 1024 * 1024;
+
+bool read_file(const std::string& filename, std::string& text)
+{
+  std::ifstream fin(filename);
+  if (!fin.is_open())
+    return false;
+  std::ostringstream out;
+  out << fin.rdbuf();
+  text = out.str();
+  return true;
+}
+
+// Value of the line of |text| that starts with |key|, in files like memory.stat and meminfo.
+bool find_value(const std::string& text, const std::string& key, uint64_t& value)
+{
+  std::istringstream in(text);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (line.compare(0, key.size(), key) != 0)
+      continue;
+    std::istringstream fields(line.substr(key.size()));
+    return static_cast<bool>(fields >> value);
+  }
+  return false;
+}
+
+// avg10 of the "some" line of a pressure file, like "some avg10=1.25 avg60=0.50 ...".
+bool parse_pressure(const std::string& text, double& pressure)
+{
+  const std::string key = "some avg10=";
+  size_t position = text.find(key);
+  if (position == std::string::npos)
+    return false;
+  std::istringstream in(text.substr(position + key.size()));
+  return static_cast<bool>(in >> pressure);
+}
+
+// Directory of the cgroup v2 of this process, or empty if it has none with a memory controller.
+std::string own_cgroup()
+{
+  std::string text;
+  if (!read_file("/proc/self/cgroup", text))
+    return std::string();
+  std::istringstream in(text);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    // The unified hierarchy is the line "0::/path".
+    if (line.compare(0, 3, "0::") != 0)
+      continue;
+    std::string directory = "/sys/fs/cgroup" + line.substr(3);
+    if (!directory.empty() && directory.back() == '/')
+      directory.pop_back();
+    // The root cgroup has no limit and no memory.current.
+    std::string current;
+    if (read_file(directory + "/memory.current", current))
+      return directory;
+  }
+  return std::string();
+}
+} // namespace
+
+std::shared_ptr<MemoryGovernor> MemoryGovernor::start(
+    const MemoryGovernorOptions& options, std::string& error)
+{
+  std::string cgroup = options.cgroup.empty() ? own_cgroup() : options.cgroup;
+  std::shared_ptr<MemoryGovernor> governor(new MemoryGovernor(options, cgroup));
+  if (!governor->adjust())
+  {
+    error = cgroup.empty() ? "can't read /proc/meminfo" : "can't read the memory of " + cgroup;
+    return nullptr;
+  }
+  governor->m_thread = std::thread([g = governor.get()]() {
+    std::unique_lock<std::mutex> guard(g->m_thread_mutex);
+    while (!g->m_thread_cv.wait_for(guard, g->m_options.interval, [g]() { return g->m_stopping; }))
+    {
+      guard.unlock();
+      g->adjust();
+      guard.lock();
+    }
+  });
+  return governor;
+}
+
+MemoryGovernor::MemoryGovernor(const MemoryGovernorOptions& options, std::string cgroup)
+    : m_options(options), m_cgroup(std::move(cgroup))
+{
+}
+
+MemoryGovernor::~MemoryGovernor()
+{
+  {
+    std::lock_guard<std::mutex> guard(m_thread_mutex);
+    m_stopping = true;
+  }
+  m_thread_cv.notify_all();
+  if (m_thread.joinable())
+    m_thread.join();
+}
+
+bool MemoryGovernor::sample(MemorySample& sample) const
+{
+  std::string meminfo;
+  uint64_t total = 0;
+  uint64_t available = 0;
+  bool has_meminfo = read_file("/proc/meminfo", meminfo) && find_value(meminfo, "MemTotal:", total)
+      && find_value(meminfo, "MemAvailable:", available);
+  // In kB.
+  total *= 1024;
+  available *= 1024;
+
+  std::string text;
+  sample.limit = 0;
+  if (!m_cgroup.empty())
+  {
+    for (const char* name : {"/memory.max", "/memory.high"})
+    {
+      uint64_t limit = 0;
+      // "max" means no limit.
+      if (read_file(m_cgroup + name, text) && std::istringstream(text) >> limit)
+        sample.limit = sample.limit == 0 ? limit : std::min(sample.limit, limit);
+    }
+  }
+
+  if (sample.limit != 0)
+  {
+    uint64_t current = 0;
+    uint64_t inactive_file = 0;
+    if (!read_file(m_cgroup + "/memory.current", text) || !(std::istringstream(text) >> current))
+      return false;
+    if (read_file(m_cgroup + "/memory.stat", text))
+      find_value(text, "inactive_file ", inactive_file);
+    sample.working_set = current - std::min(current, inactive_file);
+    if (has_meminfo)
+      sample.limit = std::min(sample.limit, total);
+  }
+  else
+  {
+    if (!has_meminfo)
+      return false;
+    sample.limit = total;
+    sample.working_set = total - std::min(total, available);
+  }
+
+  // The pressure of the cgroup, or else of the host.
+  bool has_pressure = !m_cgroup.empty() && read_file(m_cgroup + "/memory.pressure", text)
+      && parse_pressure(text, sample.pressure);
+  if (!has_pressure
+      && (!read_file("/proc/pressure/memory", text) || !parse_pressure(text, sample.pressure)))
+    sample.pressure = -1;
+  return true;
+}
+
+size_t MemoryGovernor::next_budget(
+    const MemoryGovernorOptions& options,
+    const MemorySample& sample,
+    size_t pool_bytes,
+    size_t budget,
+    std::string& reason)
+{
+  // Everything in the cgroup that isn't the pool is taken as is, and the pool gets the rest.
+  uint64_t others = sample.working_set - std::min<uint64_t>(sample.working_set, pool_bytes);
+  uint64_t room = static_cast<uint64_t>(static_cast<double>(sample.limit) * (1 - options.headroom));
+  uint64_t target = room > others ? room - others : 0;
+  target = std::max<uint64_t>(std::min<uint64_t>(target, options.max_budget), options.min_budget);
+
+  if (sample.pressure >= options.pressure_threshold)
+  {
+    reason = "pressure";
+    return std::max<size_t>(std::min<uint64_t>(target, budget - budget / 8), options.min_budget);
+  }
+  if (target < budget)
+  {
+    reason = "limit";
+    return static_cast<size_t>(target);
+  }
+  // Some pressure, though not enough to shrink, is no time to grow.
+  if (target > budget && sample.pressure < options.pressure_threshold / 2)
+  {
+    reason = "headroom";
+    uint64_t step = std::max(budget / 16, k_min_growth);
+    return static_cast<size_t>(std::min<uint64_t>(target, budget + step));
+  }
+  reason.clear();
+  return budget;
+}
+
+bool MemoryGovernor::adjust()
+{
+  MemorySample sample;
+  if (!this->sample(sample))
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    ++m_num_failures;
+    return false;
+  }
+  BufferPoolStatistics pool = g_buffer_pool.statistics();
+  std::string reason;
+  size_t budget = next_budget(
+      m_options, sample, pool.allocated_bytes + pool.reserved_bytes, pool.budget, reason);
+  if (budget != pool.budget)
+  {
+    g_buffer_pool.set_budget(budget);
+    if (budget < pool.budget)
+    {
+      g_buffer_pool.shrink_to_budget();
+      // Reservations the reclaimers couldn't give back stay charged, and buffers still need the
+      // smallest budget next to them, or every allocation would wait for memory that never comes.
+      const size_t floor = g_buffer_pool.statistics().reserved_bytes + m_options.min_budget;
+      if (budget < floor)
+      {
+        budget = std::min(floor, pool.budget);
+        reason += ", reserved";
+        g_buffer_pool.set_budget(budget);
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_sample = sample;
+  if (budget == pool.budget)
+    return true;
+  ++(budget < pool.budget ? m_num_shrinks : m_num_grows);
+  std::ostringstream decision;
+  decision << std::chrono::duration_cast<std::chrono::seconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count()
+           << " " << pool.budget << " -> " << budget << " " << reason << " (limit " << sample.limit
+           << ", working_set " << sample.working_set << ", pressure " << sample.pressure << ")";
+  if (m_decisions.size() == k_max_decisions)
+    m_decisions.pop_front();
+  m_decisions.emplace_back(decision.str());
+  return true;
+}
+
+std::string MemoryGovernor::statistics_text()
+{
+  std::ostringstream out;
+  out << "cgroup " << (m_cgroup.empty() ? "none" : m_cgroup) << "\n";
+  out << "budget " << g_buffer_pool.budget() << "\n";
+  std::lock_guard<std::mutex> guard(m_mutex);
+  out << "limit " << m_sample.limit << "\n";
+  out << "working_set " << m_sample.working_set << "\n";
+  out << "pressure " << m_sample.pressure << "\n";
+  out << "grows " << m_num_grows << "\n";
+  out << "shrinks " << m_num_shrinks << "\n";
+  out << "failures " << m_num_failures << "\n";
+  for (const std::string& decision : m_decisions)
+    out << "resize " << decision << "\n";
+  return out.str();
+}
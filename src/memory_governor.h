@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct MemoryGovernorOptions
+{
+  // Bounds of the budget of the buffer pool, which holds cached blocks, listings and prefetched
+  // data.
+  size_t min_budget = 64 * 1024 * 1024;
+  size_t max_budget = 2048ull * 1024 * 1024;
+  // Share of the memory limit left for the workload to grow into before the budget gives way.
+  double headroom = 0.1;
+  // Percentage of time some task stalled on memory over the last 10 seconds, as reported by
+  // pressure stall information, above which the budget shrinks whatever the limit says.
+  double pressure_threshold = 10;
+  std::chrono::milliseconds interval{1000};
+  // Directory of the cgroup v2 whose limit to keep within, or empty for the cgroup of this
+  // process.
+  std::string cgroup;
+};
+
+// What the governor last found out about memory.
+struct MemorySample
+{
+  // Bytes the cgroup may use, or all the memory of the host if nothing limits the cgroup.
+  uint64_t limit = 0;
+  // Bytes in use, leaving out inactive page cache, which the kernel reclaims before anything else.
+  uint64_t working_set = 0;
+  // Percentage of the last 10 seconds some task stalled on memory, or -1 if the kernel doesn't
+  // say.
+  double pressure = -1;
+};
+
+// Sizes the budget of g_buffer_pool against the memory limit of the cgroup the process runs in,
+// so that caches take what the workload leaves and no more. Every interval, the budget is set to
+// what fits under the limit, less the headroom, next to everything else in the cgroup. It shrinks
+// at once, and caches give memory back right away rather than when they're next used, and it
+// grows a step at a time while there's room. Memory pressure shrinks it by an eighth each interval
+// until it goes away. It never shrinks below min_budget more than what's reserved and can't be
+// given back. Without a cgroup v2 memory controller, the memory of the host is used instead.
+class MemoryGovernor {
+public:
+  // Returns nullptr with |error| set if neither a cgroup nor the memory of the host can be read.
+  static std::shared_ptr<MemoryGovernor> start(
+      const MemoryGovernorOptions& options, std::string& error);
+  ~MemoryGovernor();
+
+  MemoryGovernor(const MemoryGovernor&) = delete;
+  MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+  // Budget for a buffer pool of which |pool_bytes| are charged, given |sample|. |reason| tells
+  // why it differs from |budget|.
+  static size_t next_budget(
+      const MemoryGovernorOptions& options,
+      const MemorySample& sample,
+      size_t pool_bytes,
+      size_t budget,
+      std::string& reason);
+
+  std::string statistics_text();
+
+private:
+  MemoryGovernor(const MemoryGovernorOptions& options, std::string cgroup);
+
+  bool sample(MemorySample& sample) const;
+  // Returns false if memory can't be sampled.
+  bool adjust();
+
+  const MemoryGovernorOptions m_options;
+  // Directory of the cgroup, or empty to go by the memory of the host.
+  const std::string m_cgroup;
+
+  std::mutex m_mutex;
+  MemorySample m_sample;
+  uint64_t m_num_grows = 0;
+  uint64_t m_num_shrinks = 0;
+  uint64_t m_num_failures = 0;
+  // Latest resizes, oldest first.
+  std::deque<std::string> m_decisions;
+
+  std::mutex m_thread_mutex;
+  std::condition_variable m_thread_cv;
+  bool m_stopping = false;
+  std::thread m_thread;
+};
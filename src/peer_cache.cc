@@ -0,0 +1,713 @@
+#include "peer_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "crc64.h"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// "AZP2", at the start of every request. Changes with the format of requests.
+constexpr uint32_t k_magic = 0x32505A41;
+constexpr uint32_t k_get = 1;
+constexpr uint32_t k_put = 2;
+// Answers to k_get. k_miss tells the asking node to download the block, k_busy that another node
+// is downloading it.
+constexpr uint32_t k_hit = 0;
+constexpr uint32_t k_miss = 1;
+constexpr uint32_t k_busy = 2;
+
+constexpr size_t k_virtual_nodes = 64;
+constexpr size_t k_max_key_size = 4096;
+constexpr size_t k_server_threads = 16;
+constexpr size_t k_sender_threads = 4;
+// Connections waiting for a server thread, and blocks waiting to be sent, beyond which more are
+// turned away.
+constexpr size_t k_max_queued_requests = 256;
+constexpr size_t k_max_queued_puts = 256;
+constexpr size_t k_max_loading = 65536;
+// How often a node waiting for another one to download a block asks again.
+constexpr std::chrono::milliseconds k_poll_interval(25);
+// How long a peer that failed is left alone.
+constexpr std::chrono::seconds k_down_time(10);
+
+int64_t to_milliseconds(Clock::time_point t)
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+// The finalizer of SplitMix64, since CRC64s of similar strings are too alike to place on a ring.
+uint64_t mix(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+uint64_t block_hash(const std::string& object_key, size_t block_index)
+{
+  const uint64_t index = block_index;
+  return mix(crc64(crc64(0, object_key.data(), object_key.size()), &index, sizeof(index)));
+}
+
+size_t num_segments(size_t size)
+{
+  return (size + BlockCache::k_checksum_segment_size - 1) / BlockCache::k_checksum_segment_size;
+}
+
+// Integers go over the wire least significant byte first.
+void append_u32(std::string& out, uint32_t v)
+{
+  for (int i = 0; i < 4; ++i)
+    out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+void append_u64(std::string& out, uint64_t v)
+{
+  for (int i = 0; i < 8; ++i)
+    out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+uint32_t read_u32(const char* p)
+{
+  uint32_t v = 0;
+  for (int i = 0; i < 4; ++i)
+    v |= static_cast<uint32_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+  return v;
+}
+
+uint64_t read_u64(const char* p)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < 8; ++i)
+    v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (8 * i);
+  return v;
+}
+
+// Splits "host:port", where host may be a bracketed IPv6 address.
+bool split_address(const std::string& address, std::string& host, std::string& port)
+{
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+    return false;
+  host = address.substr(0, colon);
+  port = address.substr(colon + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+  return true;
+}
+
+#ifdef __linux__
+constexpr size_t k_request_header_size = 24;
+
+class Socket {
+public:
+  explicit Socket(int fd) : m_fd(fd) {}
+  ~Socket()
+  {
+    if (m_fd >= 0)
+      close(m_fd);
+  }
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+
+  int fd() const { return m_fd; }
+
+private:
+  int m_fd;
+};
+
+bool set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Waits for |events| on a non-blocking socket until |deadline|.
+bool wait_for(int fd, short events, Clock::time_point deadline)
+{
+  while (true)
+  {
+    auto remaining
+        = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+    if (remaining <= 0)
+      return false;
+    struct pollfd p;
+    p.fd = fd;
+    p.events = events;
+    p.revents = 0;
+    int ret = poll(&p, 1, static_cast<int>(remaining));
+    if (ret > 0)
+      return true;
+    if (ret < 0 && errno != EINTR)
+      return false;
+  }
+}
+
+bool send_all(int fd, const void* data, size_t size, Clock::time_point deadline)
+{
+  const char* p = static_cast<const char*>(data);
+  while (size > 0)
+  {
+    ssize_t ret = send(fd, p, size, MSG_NOSIGNAL);
+    if (ret > 0)
+    {
+      p += ret;
+      size -= static_cast<size_t>(ret);
+    }
+    else if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      if (!wait_for(fd, POLLOUT, deadline))
+        return false;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool recv_all(int fd, void* data, size_t size, Clock::time_point deadline)
+{
+  char* p = static_cast<char*>(data);
+  while (size > 0)
+  {
+    ssize_t ret = recv(fd, p, size, 0);
+    if (ret > 0)
+    {
+      p += ret;
+      size -= static_cast<size_t>(ret);
+    }
+    else if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      if (!wait_for(fd, POLLIN, deadline))
+        return false;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns a connected non-blocking socket, or -1.
+int connect_to(const sockaddr_storage& address, socklen_t length, Clock::time_point deadline)
+{
+  int fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  int socket_error = 0;
+  socklen_t error_length = sizeof(socket_error);
+  bool connected = set_nonblocking(fd)
+      && (connect(fd, reinterpret_cast<const sockaddr*>(&address), length) == 0
+          || (errno == EINPROGRESS && wait_for(fd, POLLOUT, deadline)
+              && getsockopt(fd, SOL_SOCKET, SO_ERROR, &socket_error, &error_length) == 0
+              && socket_error == 0));
+  if (!connected)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// IPv4 clients of a dual-stack socket show up as IPv4-mapped IPv6 addresses, which are turned back
+// into IPv4 ones.
+std::string address_text(const sockaddr* address)
+{
+  char text[INET6_ADDRSTRLEN] = {};
+  if (address->sa_family == AF_INET)
+  {
+    const in_addr& a = reinterpret_cast<const sockaddr_in*>(address)->sin_addr;
+    inet_ntop(AF_INET, &a, text, sizeof(text));
+  }
+  else if (address->sa_family == AF_INET6)
+  {
+    const in6_addr& a = reinterpret_cast<const sockaddr_in6*>(address)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&a))
+      inet_ntop(AF_INET, a.s6_addr + 12, text, sizeof(text));
+    else
+      inet_ntop(AF_INET6, &a, text, sizeof(text));
+  }
+  return text;
+}
+
+// Blocks are only the same between nodes that split files into blocks of the same size, so that's
+// part of every request.
+std::string request_header(
+    uint32_t op, size_t block_size, const std::string& object_key, size_t block_index)
+{
+  std::string header;
+  append_u32(header, k_magic);
+  append_u32(header, op);
+  append_u32(header, static_cast<uint32_t>(block_size));
+  append_u64(header, block_index);
+  append_u32(header, static_cast<uint32_t>(object_key.size()));
+  return header + object_key;
+}
+
+// Checksums followed by the data of a block, after a header saying how big they are.
+bool send_block(
+    int fd,
+    std::string header,
+    const Buffer& block,
+    const BlockCache::Checksums& checksums,
+    Clock::time_point deadline)
+{
+  append_u32(header, static_cast<uint32_t>(block.size()));
+  append_u32(header, static_cast<uint32_t>(checksums->size()));
+  for (uint64_t checksum : *checksums)
+    append_u64(header, checksum);
+  return send_all(fd, header.data(), header.size(), deadline)
+      && send_all(fd, block.data(), block.size(), deadline);
+}
+
+// Receives what send_block() sent after the header. |block| is null if memory is short.
+bool receive_block(
+    int fd,
+    size_t block_size,
+    BlockCache::Block& block,
+    BlockCache::Checksums& checksums,
+    Clock::time_point deadline,
+    bool wait_for_memory)
+{
+  char sizes[8];
+  if (!recv_all(fd, sizes, sizeof(sizes), deadline))
+    return false;
+  const size_t size = read_u32(sizes);
+  const size_t n = read_u32(sizes + 4);
+  if (size > block_size || n != num_segments(size))
+    return false;
+  std::string encoded(n * sizeof(uint64_t), '\0');
+  if (!recv_all(fd, &encoded[0], encoded.size(), deadline))
+    return false;
+  auto received_checksums = std::make_shared<std::vector<uint64_t>>(n);
+  for (size_t i = 0; i < n; ++i)
+    (*received_checksums)[i] = read_u64(encoded.data() + i * sizeof(uint64_t));
+  std::shared_ptr<Buffer> buffer = wait_for_memory ? g_buffer_pool.allocate(block_size)
+                                                   : g_buffer_pool.try_allocate(block_size);
+  if (!buffer)
+    return false;
+  buffer->resize(size);
+  if (!recv_all(fd, buffer->data(), size, deadline)
+      || !BlockCache::verify(*buffer, received_checksums, 0, size))
+    return false;
+  block = std::move(buffer);
+  checksums = std::move(received_checksums);
+  return true;
+}
+#endif
+} // namespace
+
+struct PeerCache::Peer
+{
+  std::string name;
+#ifdef __linux__
+  sockaddr_storage address{};
+  socklen_t address_length = 0;
+#endif
+  // Until when the peer is left alone after failing, in milliseconds of the steady clock.
+  std::atomic<int64_t> down_until{0};
+};
+
+std::shared_ptr<PeerCache> PeerCache::start(
+    std::weak_ptr<BlockCache> block_cache, const PeerCacheOptions& options, std::string& error)
+{
+#ifdef __linux__
+  std::shared_ptr<PeerCache> cache(new PeerCache(std::move(block_cache), options));
+  if (!options.self.empty()
+      && std::find(options.peers.begin(), options.peers.end(), options.self)
+          == options.peers.end())
+  {
+    error = options.self + " isn't one of the peers";
+    return nullptr;
+  }
+
+  for (const std::string& name : options.peers)
+  {
+    std::string host;
+    std::string port;
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses = nullptr;
+    if (!split_address(name, host, port)
+        || getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    {
+      error = "can't resolve " + name;
+      return nullptr;
+    }
+    auto peer = std::make_unique<Peer>();
+    peer->name = name;
+    std::memcpy(&peer->address, addresses->ai_addr, addresses->ai_addrlen);
+    peer->address_length = addresses->ai_addrlen;
+    for (struct addrinfo* a = addresses; a; a = a->ai_next)
+      cache->m_peer_addresses.insert(address_text(a->ai_addr));
+    freeaddrinfo(addresses);
+    for (size_t i = 0; i < k_virtual_nodes; ++i)
+    {
+      std::string virtual_node = name + "#" + std::to_string(i);
+      cache->m_ring.emplace_back(
+          mix(crc64(0, virtual_node.data(), virtual_node.size())), peer.get());
+    }
+    cache->m_peers.emplace_back(std::move(peer));
+  }
+  std::sort(cache->m_ring.begin(), cache->m_ring.end());
+
+  if (!options.listen.empty())
+  {
+    std::string host;
+    std::string port;
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* addresses = nullptr;
+    if (!split_address(options.listen, host, port)
+        || getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    {
+      error = "can't resolve " + options.listen;
+      return nullptr;
+    }
+    int fd = socket(addresses->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd >= 0)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bool listening = fd >= 0 && bind(fd, addresses->ai_addr, addresses->ai_addrlen) == 0
+        && listen(fd, SOMAXCONN) == 0 && set_nonblocking(fd);
+    freeaddrinfo(addresses);
+    if (!listening)
+    {
+      error = "can't listen on " + options.listen + ": " + std::strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return nullptr;
+    }
+    cache->m_listen_fd = fd;
+    PeerCache* c = cache.get();
+    cache->m_acceptor = std::thread([c]() { c->accept_loop(); });
+  }
+  return cache;
+#else
+  (void)block_cache;
+  (void)options;
+  error = "not supported on this system";
+  return nullptr;
+#endif
+}
+
+PeerCache::PeerCache(std::weak_ptr<BlockCache> block_cache, const PeerCacheOptions& options)
+    : m_block_cache(std::move(block_cache)), m_options(options), m_senders(k_sender_threads),
+      m_servers(k_server_threads)
+{
+}
+
+PeerCache::~PeerCache()
+{
+  m_stopping = true;
+  if (m_acceptor.joinable())
+    m_acceptor.join();
+#ifdef __linux__
+  if (m_listen_fd >= 0)
+    close(m_listen_fd);
+#endif
+}
+
+bool PeerCache::get(
+    const std::string& object_key,
+    size_t block_index,
+    BlockCache::Block& block,
+    BlockCache::Checksums& checksums)
+{
+#ifdef __linux__
+  auto block_cache = m_block_cache.lock();
+  if (!block_cache)
+    return false;
+  const size_t block_size = block_cache->block_size();
+  const auto wait_deadline = Clock::now() + m_options.load_wait;
+  bool waited = false;
+  for (Peer* peer : owners(object_key, block_index))
+  {
+    while (peer->down_until.load(std::memory_order_relaxed) <= to_milliseconds(Clock::now()))
+    {
+      const auto deadline = Clock::now() + m_options.timeout;
+      Socket socket(connect_to(peer->address, peer->address_length, deadline));
+      const std::string request = request_header(k_get, block_size, object_key, block_index);
+      char header[4];
+      if (socket.fd() < 0 || !send_all(socket.fd(), request.data(), request.size(), deadline)
+          || !recv_all(socket.fd(), header, sizeof(header), deadline))
+      {
+        mark_down(*peer);
+        break;
+      }
+      const uint32_t status = read_u32(header);
+      if (status == k_hit)
+      {
+        if (!receive_block(socket.fd(), block_size, block, checksums, deadline, true))
+        {
+          mark_down(*peer);
+          break;
+        }
+        ++m_num_hits;
+        return true;
+      }
+      if (status != k_busy || Clock::now() + k_poll_interval > wait_deadline)
+        break;
+      if (!waited)
+        ++m_num_waits;
+      waited = true;
+      std::this_thread::sleep_for(k_poll_interval);
+    }
+  }
+#else
+  (void)object_key;
+  (void)block_index;
+  (void)block;
+  (void)checksums;
+#endif
+  ++m_num_misses;
+  return false;
+}
+
+void PeerCache::put(
+    const std::string& object_key,
+    size_t block_index,
+    const BlockCache::Block& block,
+    const BlockCache::Checksums& checksums)
+{
+#ifdef __linux__
+  std::vector<Peer*> peers = owners(object_key, block_index);
+  auto block_cache = m_block_cache.lock();
+  if (peers.empty() || !block_cache)
+    return;
+  const size_t block_size = block_cache->block_size();
+  if (m_senders.queue_size() >= k_max_queued_puts)
+  {
+    ++m_num_dropped_puts;
+    return;
+  }
+  m_senders.submit([this, peers, block_size, object_key, block_index, block, checksums]() {
+    BlockCache::Checksums block_checksums = checksums;
+    if (!block_checksums || block_checksums->size() != num_segments(block->size()))
+      block_checksums = BlockCache::compute_checksums(*block);
+    for (Peer* peer : peers)
+    {
+      if (peer->down_until.load(std::memory_order_relaxed) > to_milliseconds(Clock::now()))
+        continue;
+      const auto deadline = Clock::now() + m_options.timeout;
+      Socket socket(connect_to(peer->address, peer->address_length, deadline));
+      if (socket.fd() < 0
+          || !send_block(
+              socket.fd(),
+              request_header(k_put, block_size, object_key, block_index),
+              *block,
+              block_checksums,
+              deadline))
+      {
+        mark_down(*peer);
+        continue;
+      }
+      ++m_num_puts;
+    }
+  });
+#else
+  (void)object_key;
+  (void)block_index;
+  (void)block;
+  (void)checksums;
+#endif
+}
+
+std::string PeerCache::statistics_text()
+{
+  const int64_t now = to_milliseconds(Clock::now());
+  size_t num_down = 0;
+  for (const auto& peer : m_peers)
+    if (peer->down_until.load(std::memory_order_relaxed) > now)
+      ++num_down;
+  std::ostringstream out;
+  out << "peers " << m_peers.size() << "\n";
+  out << "peers_down " << num_down << "\n";
+  out << "hits " << m_num_hits.load() << "\n";
+  out << "misses " << m_num_misses.load() << "\n";
+  out << "waits " << m_num_waits.load() << "\n";
+  out << "failures " << m_num_failures.load() << "\n";
+  out << "puts " << m_num_puts.load() << "\n";
+  out << "dropped_puts " << m_num_dropped_puts.load() << "\n";
+  out << "served " << m_num_served.load() << "\n";
+  out << "received " << m_num_received.load() << "\n";
+  out << "rejected " << m_num_rejected.load() << "\n";
+  out << "block_size_mismatches " << m_num_mismatched.load() << "\n";
+  return out.str();
+}
+
+std::vector<PeerCache::Peer*> PeerCache::owners(const std::string& object_key, size_t block_index)
+{
+  std::vector<Peer*> peers;
+  if (m_ring.empty())
+    return peers;
+  const size_t replicas = std::min(std::max<size_t>(m_options.replicas, 1), m_peers.size());
+  auto ite = std::lower_bound(
+      m_ring.begin(),
+      m_ring.end(),
+      std::make_pair(block_hash(object_key, block_index), static_cast<Peer*>(nullptr)));
+  for (size_t i = 0; i < m_ring.size() && peers.size() < replicas; ++i, ++ite)
+  {
+    if (ite == m_ring.end())
+      ite = m_ring.begin();
+    if (std::find(peers.begin(), peers.end(), ite->second) == peers.end())
+      peers.emplace_back(ite->second);
+  }
+  // This node already missed the block in its own cache.
+  peers.erase(
+      std::remove_if(
+          peers.begin(), peers.end(), [this](Peer* p) { return p->name == m_options.self; }),
+      peers.end());
+  return peers;
+}
+
+void PeerCache::mark_down(Peer& peer)
+{
+  ++m_num_failures;
+  peer.down_until.store(
+      to_milliseconds(Clock::now() + k_down_time), std::memory_order_relaxed);
+}
+
+void PeerCache::accept_loop()
+{
+#ifdef __linux__
+  while (!m_stopping)
+  {
+    // Wakes up now and then to see if it should stop.
+    if (!wait_for(m_listen_fd, POLLIN, Clock::now() + std::chrono::milliseconds(200)))
+      continue;
+    sockaddr_storage address{};
+    socklen_t address_length = sizeof(address);
+    int fd = accept(m_listen_fd, reinterpret_cast<sockaddr*>(&address), &address_length);
+    if (fd < 0)
+      continue;
+    auto socket = std::make_shared<Socket>(fd);
+    if (m_peer_addresses.count(address_text(reinterpret_cast<sockaddr*>(&address))) == 0
+        || m_servers.queue_size() >= k_max_queued_requests || !set_nonblocking(fd))
+    {
+      ++m_num_rejected;
+      continue;
+    }
+    m_servers.submit([this, socket]() { serve(socket->fd()); });
+  }
+#endif
+}
+
+void PeerCache::serve(int fd)
+{
+#ifdef __linux__
+  auto block_cache = m_block_cache.lock();
+  if (!block_cache)
+    return;
+  const auto deadline = Clock::now() + m_options.timeout;
+  char header[k_request_header_size];
+  if (!recv_all(fd, header, sizeof(header), deadline) || read_u32(header) != k_magic)
+    return;
+  const uint32_t op = read_u32(header + 4);
+  const size_t block_size = read_u32(header + 8);
+  const size_t block_index = static_cast<size_t>(read_u64(header + 12));
+  const size_t key_size = read_u32(header + 20);
+  if (key_size > k_max_key_size)
+    return;
+  std::string object_key(key_size, '\0');
+  if (!recv_all(fd, &object_key[0], key_size, deadline))
+    return;
+
+  // Block n of a file isn't the same data with another block size. The asking node downloads the
+  // block itself, and what it's giving is dropped.
+  if (block_size != block_cache->block_size())
+  {
+    ++m_num_mismatched;
+    if (op == k_get)
+    {
+      std::string response;
+      append_u32(response, k_miss);
+      send_all(fd, response.data(), response.size(), deadline);
+    }
+    return;
+  }
+
+  if (op == k_get)
+  {
+    BlockCache::Checksums checksums;
+    BlockCache::Block block = block_cache->get(object_key, block_index, &checksums);
+    std::string response;
+    if (!block)
+    {
+      append_u32(response, start_loading(object_key, block_index) ? k_miss : k_busy);
+      send_all(fd, response.data(), response.size(), deadline);
+      return;
+    }
+    if (!checksums || checksums->size() != num_segments(block->size()))
+      checksums = BlockCache::compute_checksums(*block);
+    append_u32(response, k_hit);
+    if (send_block(fd, response, *block, checksums, deadline))
+      ++m_num_served;
+  }
+  else if (op == k_put)
+  {
+    BlockCache::Block block;
+    BlockCache::Checksums checksums;
+    // Given blocks are dropped rather than waiting for memory.
+    if (!receive_block(fd, block_cache->block_size(), block, checksums, deadline, false))
+      return;
+    block_cache->put(object_key, block_index, std::move(block), std::move(checksums));
+    ++m_num_received;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_loading.erase(std::make_pair(object_key, block_index));
+  }
+#else
+  (void)fd;
+#endif
+}
+
+bool PeerCache::start_loading(const std::string& object_key, size_t block_index)
+{
+  const auto now = Clock::now();
+  std::lock_guard<std::mutex> guard(m_mutex);
+  auto key = std::make_pair(object_key, block_index);
+  auto ite = m_loading.find(key);
+  if (ite != m_loading.end() && now - ite->second < m_options.load_wait)
+    return false;
+  if (m_loading.size() >= k_max_loading)
+  {
+    for (auto i = m_loading.begin(); i != m_loading.end();)
+      i = now - i->second < m_options.load_wait ? std::next(i) : m_loading.erase(i);
+    // Too many to keep track of. The block may be downloaded more than once.
+    if (m_loading.size() >= k_max_loading)
+      return true;
+  }
+  m_loading[key] = now;
+  return true;
+}
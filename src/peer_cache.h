@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "block_cache.h"
+#include "thread_pool.h"
+
+struct PeerCacheOptions
+{
+  // Address to serve peers on, like "0.0.0.0:7070". If empty, this node only asks the others.
+  std::string listen;
+  // Host and port of every node, this one included, as the others reach them. Every node must
+  // have the same list, so that they agree on which node holds which block.
+  std::vector<std::string> peers;
+  // Which of |peers| is this node, or empty if it's none of them.
+  std::string self;
+  // Nodes a block is asked for and given to, one after the other around the ring.
+  size_t replicas = 1;
+  // Longest a request to a peer may take, connecting included.
+  std::chrono::milliseconds timeout{1000};
+  // How long to wait for a block that another node is downloading before downloading it too.
+  std::chrono::milliseconds load_wait{2000};
+};
+
+// A tier of BlockCache made of the block caches of other nodes, so that a cluster reading the same
+// data downloads each block from the service once rather than once per node. Blocks are assigned
+// to nodes by consistent hashing of their keys. A node that misses a block asks the node that
+// holds it. If that one doesn't have it either, it tells the first node to ask to download it and
+// the others to wait for that, and the block is given to it when it's downloaded.
+//
+// Peers that fail or take too long are left alone for a while, and reads go to the service as if
+// there were no peers. Only the addresses of |peers| may connect, but blocks go over the network
+// as they are, so the network must be trusted.
+class PeerCache : public BlockCache::Tier {
+public:
+  // Serves blocks of |block_cache| to peers if |options| has an address to listen on. Returns
+  // nullptr with |error| set if that address or a peer can't be resolved, or the address can't be
+  // listened on.
+  static std::shared_ptr<PeerCache> start(
+      std::weak_ptr<BlockCache> block_cache, const PeerCacheOptions& options, std::string& error);
+  // Stops serving and waits for requests being served.
+  ~PeerCache() override;
+
+  PeerCache(const PeerCache&) = delete;
+  PeerCache& operator=(const PeerCache&) = delete;
+
+  bool get(
+      const std::string& object_key,
+      size_t block_index,
+      BlockCache::Block& block,
+      BlockCache::Checksums& checksums) override;
+  // Gives the block to the nodes that hold it in the background. It's dropped if too many blocks
+  // are waiting to be sent.
+  void put(
+      const std::string& object_key,
+      size_t block_index,
+      const BlockCache::Block& block,
+      const BlockCache::Checksums& checksums) override;
+  std::string statistics_text();
+
+private:
+  struct Peer;
+
+  PeerCache(std::weak_ptr<BlockCache> block_cache, const PeerCacheOptions& options);
+
+  // Peers holding a block, closest first, this node left out.
+  std::vector<Peer*> owners(const std::string& object_key, size_t block_index);
+  void mark_down(Peer& peer);
+  void accept_loop();
+  void serve(int fd);
+  // Whether a peer that misses a block should download it, rather than wait for another one
+  // that's downloading it.
+  bool start_loading(const std::string& object_key, size_t block_index);
+
+  std::weak_ptr<BlockCache> m_block_cache;
+  const PeerCacheOptions m_options;
+  std::vector<std::unique_ptr<Peer>> m_peers;
+  // Hashes of the virtual nodes of every peer and the peer, sorted by hash.
+  std::vector<std::pair<uint64_t, Peer*>> m_ring;
+  // Addresses peers connect from.
+  std::set<std::string> m_peer_addresses;
+
+  int m_listen_fd = -1;
+  std::atomic<bool> m_stopping{false};
+  std::mutex m_mutex;
+  // Blocks a peer was told to download, and when.
+  std::map<std::pair<std::string, size_t>, std::chrono::steady_clock::time_point> m_loading;
+
+  std::atomic<uint64_t> m_num_hits{0};
+  std::atomic<uint64_t> m_num_misses{0};
+  // Times a block was waited for because another node was downloading it.
+  std::atomic<uint64_t> m_num_waits{0};
+  std::atomic<uint64_t> m_num_failures{0};
+  std::atomic<uint64_t> m_num_puts{0};
+  std::atomic<uint64_t> m_num_dropped_puts{0};
+  std::atomic<uint64_t> m_num_served{0};
+  std::atomic<uint64_t> m_num_received{0};
+  std::atomic<uint64_t> m_num_rejected{0};
+  // Requests from peers that use another block size.
+  std::atomic<uint64_t> m_num_mismatched{0};
+
+  // Last, so that nothing they use goes away while they run.
+  ThreadPool m_senders;
+  ThreadPool m_servers;
+  std::thread m_acceptor;
+};
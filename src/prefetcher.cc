@@ -0,0 +1,583 @@
+#include "prefetcher.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include "buffer_pool.h"
+#include "index_file.h"
+#include "scheduler.h"
+
+namespace {
+// Reads after the first few are usually sequential, which kernel readahead takes care of.
+constexpr size_t k_recorded_reads = 8;
+// Learned ranges are rounded to this, so that reads of slightly different offsets count as the
+// same range.
+constexpr uint64_t k_granularity = 64 * 1024;
+// Smaller files are read whole by the first read or two anyway.
+constexpr uint64_t k_min_file_size = 256 * 1024;
+// A range is only learned once files of its type have been opened this many times, and is only
+// part of the profile if at least half of them read it.
+constexpr uint64_t k_min_opens = 4;
+// Counts are halved at this many opens, so that profiles follow changing access patterns.
+constexpr uint64_t k_max_opens = 64;
+constexpr size_t k_max_learned_profiles = 1024;
+constexpr size_t k_max_profile_ranges = 8;
+constexpr uint64_t k_max_profile_bytes = 16 * 1024 * 1024;
+constexpr size_t k_max_read_size = 4 * 1024 * 1024;
+constexpr size_t k_max_queued_prefetches = 256;
+// Small files of a directory opened one after another before it's listed to read the next ones.
+constexpr size_t k_small_file_opens = 2;
+constexpr size_t k_max_small_file_directories = 64;
+constexpr size_t k_max_small_files = 256 * 1024;
+
+uint64_t round_down(uint64_t n) { return n / k_granularity * k_granularity; }
+
+uint64_t round_up(uint64_t n) { return (n + k_granularity - 1) / k_granularity * k_granularity; }
+
+// Lower-cased extension of the file name of |path|, including the dot, or an empty string.
+std::string extension_of(const std::string& path)
+{
+  size_t name_begin = path.rfind('/');
+  name_begin = name_begin == std::string::npos ? 0 : name_begin + 1;
+  size_t dot = path.rfind('.');
+  // A leading dot marks a hidden file rather than an extension.
+  if (dot == std::string::npos || dot <= name_begin || dot + 1 == path.size())
+    return std::string();
+  std::string extension = path.substr(dot);
+  for (char& c : extension)
+    c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  return extension;
+}
+
+std::string range_text(const PrefetchRange& range)
+{
+  return std::string(range.from_end ? "end" : "start") + " " + std::to_string(range.offset) + " "
+      + std::to_string(range.length);
+}
+} // namespace
+
+std::shared_ptr<Prefetcher> g_prefetcher;
+
+void AccessRecord::add(uint64_t offset, uint64_t size)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_reads.size() < k_recorded_reads)
+    m_reads.emplace_back(offset, size);
+}
+
+Prefetcher::Prefetcher(const PrefetchOptions& options)
+    : m_options(options), m_thread_pool(options.num_threads)
+{
+  if (!m_options.profile_file.empty())
+    load();
+}
+
+Prefetcher::~Prefetcher()
+{
+  if (!m_options.profile_file.empty())
+    save();
+}
+
+void Prefetcher::add_profile(const std::string& pattern, std::vector<PrefetchRange> ranges)
+{
+  std::string key = pattern;
+  if (key.empty() || key.back() != '/')
+  {
+    for (char& c : key)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  }
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_configured_profiles[key] = std::move(ranges);
+}
+
+std::shared_ptr<AccessRecord> Prefetcher::on_open(
+    const std::string& path,
+    const std::shared_ptr<BaseAdaptor>& adaptor,
+    const std::string& object_name,
+    const FileStatus& file_status)
+{
+  const uint64_t file_size = file_status.file_size;
+  if (m_options.small_file_size != 0 && file_size <= m_options.small_file_size)
+  {
+    // Paths relative to the mount point always start with the directory of the mount.
+    size_t slash = path.rfind('/');
+    size_t object_slash = object_name.rfind('/');
+    if (slash != std::string::npos)
+    {
+      on_open_small_file(
+          path.substr(0, slash), adaptor,
+          object_slash == std::string::npos ? "." : object_name.substr(0, object_slash),
+          path.substr(slash + 1));
+    }
+  }
+  if (file_size < k_min_file_size)
+    return nullptr;
+
+  std::string learn_key;
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (const PrefetchRange& range : find_profile(path, learn_key))
+  {
+    uint64_t begin = range.offset;
+    if (range.from_end)
+      begin = range.offset < file_size ? file_size - range.offset : 0;
+    uint64_t end = std::min(file_size, begin + range.length);
+    if (begin < end)
+      ranges.emplace_back(begin, end);
+  }
+  std::sort(ranges.begin(), ranges.end());
+  size_t num_merged = 0;
+  for (const auto& range : ranges)
+  {
+    if (num_merged != 0 && range.first <= ranges[num_merged - 1].second)
+      ranges[num_merged - 1].second = std::max(ranges[num_merged - 1].second, range.second);
+    else
+      ranges[num_merged++] = range;
+  }
+  ranges.resize(num_merged);
+
+  for (const auto& range : ranges)
+  {
+    if (submit(adaptor, object_name, file_status.etag, range.first, range.second - range.first))
+      ++m_prefetches;
+  }
+
+  if (learn_key.empty())
+    return nullptr;
+  return std::make_shared<AccessRecord>(learn_key, file_size);
+}
+
+void Prefetcher::on_list(
+    const std::string& path,
+    const std::shared_ptr<BaseAdaptor>& adaptor,
+    const std::string& object_name,
+    const std::vector<DirectoryEntry>& entries)
+{
+  if (m_options.small_file_size == 0)
+    return;
+  std::lock_guard<std::mutex> guard(m_mutex);
+  SmallFileDirectory& directory = small_file_directory(path, adaptor, object_name);
+  if (!directory.listing)
+  {
+    directory.listing = true;
+    // Listed before anything was opened, so reading starts at the first file.
+    if (directory.opens == 0)
+      directory.window_end = m_options.small_file_window;
+  }
+  // Files already known, from an earlier listing or another page of this one, are skipped.
+  for (const DirectoryEntry& e : entries)
+  {
+    if (e.status.is_directory || e.status.file_size == 0
+        || e.status.file_size > m_options.small_file_size)
+      continue;
+    if (directory.files.size() >= k_max_small_files)
+      break;
+    if (directory.positions.emplace(e.name, directory.files.size()).second)
+      directory.files.emplace_back(e);
+  }
+  auto ite = directory.positions.find(directory.last_opened);
+  if (!directory.last_opened.empty() && ite != directory.positions.end())
+  {
+    directory.queued = std::max(directory.queued, ite->second + 1);
+    directory.window_end
+        = std::max(directory.window_end, ite->second + 1 + m_options.small_file_window);
+    directory.last_opened.clear();
+  }
+  queue_small_files(directory);
+}
+
+void Prefetcher::on_close(AccessRecord& record)
+{
+  std::set<PrefetchRange> ranges;
+  {
+    std::lock_guard<std::mutex> guard(record.m_mutex);
+    for (const auto& read : record.m_reads)
+    {
+      uint64_t begin = std::min(read.first, record.m_file_size);
+      uint64_t end = std::min(read.first + read.second, record.m_file_size);
+      if (begin >= end)
+        continue;
+      PrefetchRange range;
+      // Reads in the second half are taken to be relative to the end, like footers.
+      if (begin >= record.m_file_size / 2)
+      {
+        range.from_end = true;
+        range.offset = round_up(record.m_file_size - begin);
+        range.length = range.offset - round_down(record.m_file_size - end);
+      }
+      else
+      {
+        range.offset = round_down(begin);
+        range.length = round_up(end) - range.offset;
+      }
+      ranges.emplace(range);
+    }
+  }
+  if (ranges.empty())
+    return;
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  auto ite = m_learned_profiles.find(record.m_profile_key);
+  if (ite == m_learned_profiles.end())
+  {
+    if (m_learned_profiles.size() >= k_max_learned_profiles)
+      return;
+    ite = m_learned_profiles.emplace(record.m_profile_key, LearnedProfile()).first;
+  }
+  LearnedProfile& profile = ite->second;
+  ++profile.opens;
+  for (const PrefetchRange& range : ranges)
+    ++profile.hits[range];
+  if (profile.opens >= k_max_opens)
+  {
+    profile.opens /= 2;
+    for (auto i = profile.hits.begin(); i != profile.hits.end();)
+    {
+      i->second /= 2;
+      i = i->second == 0 ? profile.hits.erase(i) : std::next(i);
+    }
+  }
+}
+
+void Prefetcher::read_ahead(
+    const std::shared_ptr<BaseAdaptor>& adaptor,
+    const std::string& object_name,
+    const std::string& etag,
+    uint64_t offset,
+    uint64_t length)
+{
+  if (submit(adaptor, object_name, etag, offset, length))
+    ++m_readaheads;
+}
+
+void Prefetcher::on_open_small_file(
+    const std::string& path,
+    const std::shared_ptr<BaseAdaptor>& adaptor,
+    const std::string& object_name,
+    const std::string& name)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  SmallFileDirectory& directory = small_file_directory(path, adaptor, object_name);
+  auto ite = directory.positions.find(name);
+  if (ite == directory.positions.end())
+  {
+    // Not listed yet. Once a few files have been opened, the directory is worth listing.
+    directory.last_opened = name;
+    if (++directory.opens >= k_small_file_opens && !directory.listing)
+    {
+      directory.listing = true;
+      m_thread_pool.submit([this, path, adaptor, object_name]() {
+        list_small_files(path, adaptor, object_name);
+      });
+    }
+    return;
+  }
+  // Files before the one opened are taken to be read already.
+  directory.queued = std::max(directory.queued, ite->second + 1);
+  directory.window_end
+      = std::max(directory.window_end, ite->second + 1 + m_options.small_file_window);
+  queue_small_files(directory);
+}
+
+Prefetcher::SmallFileDirectory& Prefetcher::small_file_directory(
+    const std::string& path,
+    const std::shared_ptr<BaseAdaptor>& adaptor,
+    const std::string& object_name)
+{
+  auto ite = m_small_file_directories.find(path);
+  if (ite == m_small_file_directories.end())
+  {
+    if (m_small_file_directories.size() >= k_max_small_file_directories)
+    {
+      auto oldest = std::min_element(
+          m_small_file_directories.begin(), m_small_file_directories.end(),
+          [](const auto& a, const auto& b) { return a.second.last_used < b.second.last_used; });
+      m_small_file_directories.erase(oldest);
+    }
+    ite = m_small_file_directories.emplace(path, SmallFileDirectory()).first;
+    ite->second.object_name = object_name;
+  }
+  // The mount may have been dropped and made again since.
+  ite->second.adaptor = adaptor;
+  ite->second.last_used = ++m_small_file_clock;
+  return ite->second;
+}
+
+void Prefetcher::queue_small_files(SmallFileDirectory& directory)
+{
+  std::shared_ptr<BaseAdaptor> adaptor = directory.adaptor.lock();
+  if (!adaptor)
+    return;
+  size_t end = std::min(directory.window_end, directory.files.size());
+  for (; directory.queued < end; ++directory.queued)
+  {
+    const DirectoryEntry& file = directory.files[directory.queued];
+    std::string object_name
+        = directory.object_name == "." ? file.name : directory.object_name + "/" + file.name;
+    // Files that don't fit in the queue are tried again when the next file is opened.
+    if (!submit(adaptor, object_name, file.status.etag, 0, file.status.file_size))
+      break;
+    ++m_small_files;
+  }
+}
+
+void Prefetcher::list_small_files(
+    const std::string& path,
+    std::shared_ptr<BaseAdaptor> adaptor,
+    const std::string& object_name)
+{
+  IoPriorityScope priority_scope(IoPriority::prefetch, true);
+  ++m_small_file_listings;
+  std::string continuation_token;
+  do
+  {
+    std::vector<DirectoryEntry> page;
+    int ret;
+    try
+    {
+      ret = adaptor->list(object_name, page, continuation_token);
+    }
+    catch (...)
+    {
+      ret = -EIO;
+    }
+    if (ret < 0)
+    {
+      ++m_failures;
+      return;
+    }
+    on_list(path, adaptor, object_name, page);
+  } while (!continuation_token.empty());
+}
+
+std::vector<PrefetchRange> Prefetcher::find_profile(
+    const std::string& path, std::string& learn_key) const
+{
+  learn_key.clear();
+  const std::string extension = extension_of(path);
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  const std::vector<PrefetchRange>* prefix_profile = nullptr;
+  size_t prefix_size = 0;
+  for (const auto& i : m_configured_profiles)
+  {
+    const std::string& pattern = i.first;
+    if (!pattern.empty() && pattern.back() == '/' && pattern.size() > prefix_size
+        && path.compare(0, pattern.size(), pattern) == 0)
+    {
+      prefix_profile = &i.second;
+      prefix_size = pattern.size();
+    }
+  }
+  if (prefix_profile)
+    return *prefix_profile;
+  if (extension.empty())
+    return {};
+  auto configured = m_configured_profiles.find(extension);
+  if (configured != m_configured_profiles.end())
+    return configured->second;
+
+  if (m_options.learn)
+    learn_key = extension;
+  auto learned = m_learned_profiles.find(extension);
+  if (learned == m_learned_profiles.end())
+    return {};
+  return learned_ranges(learned->second);
+}
+
+std::vector<PrefetchRange> Prefetcher::learned_ranges(const LearnedProfile& profile)
+{
+  if (profile.opens < k_min_opens)
+    return {};
+  std::vector<std::pair<uint64_t, PrefetchRange>> candidates;
+  for (const auto& i : profile.hits)
+  {
+    if (i.second * 2 >= profile.opens)
+      candidates.emplace_back(i.second, i.first);
+  }
+  std::stable_sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
+    return a.first > b.first;
+  });
+
+  std::vector<PrefetchRange> ranges;
+  uint64_t total_length = 0;
+  for (const auto& candidate : candidates)
+  {
+    if (ranges.size() == k_max_profile_ranges
+        || total_length + candidate.second.length > k_max_profile_bytes)
+      break;
+    ranges.emplace_back(candidate.second);
+    total_length += candidate.second.length;
+  }
+  return ranges;
+}
+
+bool Prefetcher::submit(
+    const std::shared_ptr<BaseAdaptor>& adaptor,
+    const std::string& object_name,
+    const std::string& etag,
+    uint64_t offset,
+    uint64_t length)
+{
+  if (m_thread_pool.queue_size() >= k_max_queued_prefetches)
+  {
+    ++m_dropped;
+    return false;
+  }
+  m_thread_pool.submit([this, adaptor, object_name, etag, offset, length]() {
+    prefetch(adaptor, object_name, etag, offset, length);
+  });
+  return true;
+}
+
+void Prefetcher::prefetch(
+    std::shared_ptr<BaseAdaptor> adaptor,
+    const std::string& object_name,
+    const std::string& etag,
+    uint64_t offset,
+    uint64_t length)
+{
+  IoPriorityScope priority_scope(IoPriority::prefetch, true);
+  // Only the side effect of filling the cache matters, so this is skipped rather than waiting
+  // for memory.
+  auto buffer = g_buffer_pool.try_allocate(
+      static_cast<size_t>(std::min<uint64_t>(length, k_max_read_size)));
+  if (!buffer)
+  {
+    ++m_dropped;
+    return;
+  }
+  ReadOptions options;
+  options.if_match = etag;
+  while (length > 0)
+  {
+    size_t size = static_cast<size_t>(std::min<uint64_t>(length, buffer->capacity()));
+    FileStatus file_status;
+    int ret;
+    try
+    {
+      ret = adaptor->read_with_options(
+          object_name, buffer->data(), size, static_cast<size_t>(offset), options, file_status);
+    }
+    catch (...)
+    {
+      ret = -EIO;
+    }
+    // The scheduler turns prefetches away when too many are waiting already.
+    if (ret == -EAGAIN)
+    {
+      ++m_dropped;
+      return;
+    }
+    if (ret < 0)
+    {
+      ++m_failures;
+      return;
+    }
+    if (ret == 0)
+      return;
+    m_prefetched_bytes += ret;
+    offset += ret;
+    length -= std::min<uint64_t>(length, ret);
+  }
+}
+
+void Prefetcher::save() const
+{
+  std::ostringstream out;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (const auto& i : m_learned_profiles)
+    {
+      out << "profile " << i.first << " " << i.second.opens << "\n";
+      for (const auto& hit : i.second.hits)
+        out << "range " << range_text(hit.first) << " " << hit.second << "\n";
+    }
+  }
+  const std::string& filename = m_options.profile_file;
+  const std::string temp = temp_filename(filename);
+  {
+    std::ofstream fout(temp, std::ios::trunc);
+    fout << out.str();
+    if (!fout)
+    {
+      fout.close();
+      std::remove(temp.data());
+      return;
+    }
+  }
+  if (std::rename(temp.data(), filename.data()) != 0)
+    std::remove(temp.data());
+}
+
+void Prefetcher::load()
+{
+  std::ifstream fin(m_options.profile_file);
+  std::map<std::string, LearnedProfile> profiles;
+  LearnedProfile* profile = nullptr;
+  std::string line;
+  while (std::getline(fin, line))
+  {
+    std::istringstream in(line);
+    std::string kind;
+    in >> kind;
+    if (kind == "profile")
+    {
+      std::string key;
+      uint64_t opens = 0;
+      if (!(in >> key >> opens) || profiles.size() >= k_max_learned_profiles)
+        return;
+      profile = &profiles[key];
+      profile->opens = opens;
+    }
+    else if (kind == "range" && profile)
+    {
+      std::string anchor;
+      PrefetchRange range;
+      uint64_t hits = 0;
+      if (!(in >> anchor >> range.offset >> range.length >> hits))
+        return;
+      range.from_end = anchor == "end";
+      profile->hits[range] = hits;
+    }
+    else
+    {
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_learned_profiles = std::move(profiles);
+}
+
+std::string Prefetcher::statistics_text() const
+{
+  std::ostringstream out;
+  out << "prefetches " << m_prefetches << "\n";
+  out << "readaheads " << m_readaheads << "\n";
+  out << "small_files " << m_small_files << "\n";
+  out << "small_file_listings " << m_small_file_listings << "\n";
+  out << "prefetched_bytes " << m_prefetched_bytes << "\n";
+  out << "failures " << m_failures << "\n";
+  out << "dropped " << m_dropped << "\n";
+  out << "queued " << m_thread_pool.queue_size() << "\n";
+  std::lock_guard<std::mutex> guard(m_mutex);
+  for (const auto& i : m_configured_profiles)
+  {
+    out << "configured " << i.first << ":";
+    for (const PrefetchRange& range : i.second)
+      out << " [" << range_text(range) << "]";
+    out << "\n";
+  }
+  for (const auto& i : m_learned_profiles)
+  {
+    out << "learned " << i.first << " opens " << i.second.opens << ":";
+    for (const PrefetchRange& range : learned_ranges(i.second))
+      out << " [" << range_text(range) << "]";
+    out << "\n";
+  }
+  return out.str();
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "adaptor.h"
+#include "thread_pool.h"
+
+// A range of a file to read ahead of time. Ranges from the end are counted backwards, so that
+// footers are found in files of any size.
+struct PrefetchRange
+{
+  bool from_end = false;
+  // From the beginning, or from the end to the start of the range if from_end.
+  uint64_t offset = 0;
+  uint64_t length = 0;
+
+  bool operator<(const PrefetchRange& other) const
+  {
+    return std::tie(from_end, offset, length)
+        < std::tie(other.from_end, other.offset, other.length);
+  }
+};
+
+struct PrefetchOptions
+{
+  size_t num_threads = 8;
+  // Learn profiles of file types from the reads of files that have been opened.
+  bool learn = true;
+  // Learned profiles are loaded from and saved to this file, so that they survive restarts.
+  // Empty means they're only kept in memory.
+  std::string profile_file;
+  // Files up to this size are read whole ahead of time, in listing order, when their directory is
+  // listed or a few of its files are opened one after another. Zero turns this off.
+  uint64_t small_file_size = 0;
+  // Small files of a directory kept read ahead of the last one opened.
+  size_t small_file_window = 64;
+};
+
+// The first few reads of one open file.
+class AccessRecord {
+public:
+  AccessRecord(std::string profile_key, uint64_t file_size)
+      : m_profile_key(std::move(profile_key)), m_file_size(file_size)
+  {
+  }
+
+  void add(uint64_t offset, uint64_t size);
+
+private:
+  friend class Prefetcher;
+
+  const std::string m_profile_key;
+  const uint64_t m_file_size;
+  std::mutex m_mutex;
+  std::vector<std::pair<uint64_t, uint64_t>> m_reads;
+};
+
+// Reads ranges of a file in the background when it's opened, so that they are in the cache by
+// the time they're read. Which ranges depends on the type of file: a profile either comes from
+// the configuration, or is learned from which parts of files of the same extension have been read
+// right after they were opened, like the footer and then the head of a Parquet file.
+//
+// Directories of small files, like datasets of images, are read a window of files at a time
+// ahead of the file being opened, in listing order, since they're usually read one file after
+// another.
+class Prefetcher {
+public:
+  explicit Prefetcher(const PrefetchOptions& options);
+  // Drops queued prefetches and saves learned profiles.
+  ~Prefetcher();
+
+  // |pattern| is either an extension like ".parquet", or a prefix of paths relative to the mount
+  // point that ends with a slash, like "container/datasets/". Prefixes take precedence over
+  // extensions, and configured profiles over learned ones.
+  void add_profile(const std::string& pattern, std::vector<PrefetchRange> ranges);
+
+  // Called when |path|, relative to the mount point, has been opened. |object_name| is its path in
+  // |adaptor|. Returns where to record the reads of the file, or nullptr if they don't need to be
+  // recorded.
+  std::shared_ptr<AccessRecord> on_open(
+      const std::string& path,
+      const std::shared_ptr<BaseAdaptor>& adaptor,
+      const std::string& object_name,
+      const FileStatus& file_status);
+  // Called with every page of the listing of the directory |path|, relative to the mount point,
+  // whose path in |adaptor| is |object_name|. Starts reading its first small files.
+  void on_list(
+      const std::string& path,
+      const std::shared_ptr<BaseAdaptor>& adaptor,
+      const std::string& object_name,
+      const std::vector<DirectoryEntry>& entries);
+  // Called when a file opened with |record| is closed.
+  void on_close(AccessRecord& record);
+  // Reads |length| bytes at |offset| of an open file into the cache in the background, ahead of
+  // sequential reads of it.
+  void read_ahead(
+      const std::shared_ptr<BaseAdaptor>& adaptor,
+      const std::string& object_name,
+      const std::string& etag,
+      uint64_t offset,
+      uint64_t length);
+
+  std::string statistics_text() const;
+
+private:
+  struct LearnedProfile
+  {
+    // Number of recorded opens, and how many of them read each range.
+    uint64_t opens = 0;
+    std::map<PrefetchRange, uint64_t> hits;
+  };
+
+  // Profile for |path|, or an empty one. |learn_key| is set to the extension whose profile is
+  // learned from reads of |path|, or cleared if its reads aren't worth recording.
+  std::vector<PrefetchRange> find_profile(const std::string& path, std::string& learn_key) const;
+  // Small files of a directory that's listed or read file after file.
+  struct SmallFileDirectory
+  {
+    // Weak, so that a mount that's no longer used can go away.
+    std::weak_ptr<BaseAdaptor> adaptor;
+    std::string object_name;
+    // In listing order.
+    std::vector<DirectoryEntry> files;
+    std::unordered_map<std::string, size_t> positions;
+    // Files before |queued| have been read or skipped, and files up to |window_end| are to be
+    // read.
+    size_t queued = 0;
+    size_t window_end = 0;
+    // Small files opened before the directory is listed, and the last of them.
+    size_t opens = 0;
+    std::string last_opened;
+    bool listing = false;
+    uint64_t last_used = 0;
+  };
+
+  static std::vector<PrefetchRange> learned_ranges(const LearnedProfile& profile);
+  // Moves the window of a directory of small files past the file |name|.
+  void on_open_small_file(
+      const std::string& path,
+      const std::shared_ptr<BaseAdaptor>& adaptor,
+      const std::string& object_name,
+      const std::string& name);
+  // Directory of small files at |path|, made if it's new. Must be called with m_mutex held.
+  SmallFileDirectory& small_file_directory(
+      const std::string& path,
+      const std::shared_ptr<BaseAdaptor>& adaptor,
+      const std::string& object_name);
+  // Queues the files of |directory| up to the end of its window. Must be called with m_mutex
+  // held.
+  void queue_small_files(SmallFileDirectory& directory);
+  // Lists a directory whose files are being opened one after another, for on_list().
+  void list_small_files(
+      const std::string& path,
+      std::shared_ptr<BaseAdaptor> adaptor,
+      const std::string& object_name);
+  // Learned profiles are saved as text, one range per line. Failing to save or load isn't an
+  // error.
+  void save() const;
+  void load();
+  // Queues a prefetch, unless too many are queued already.
+  bool submit(
+      const std::shared_ptr<BaseAdaptor>& adaptor,
+      const std::string& object_name,
+      const std::string& etag,
+      uint64_t offset,
+      uint64_t length);
+  void prefetch(
+      std::shared_ptr<BaseAdaptor> adaptor,
+      const std::string& object_name,
+      const std::string& etag,
+      uint64_t offset,
+      uint64_t length);
+
+  const PrefetchOptions m_options;
+
+  mutable std::mutex m_mutex;
+  std::map<std::string, std::vector<PrefetchRange>> m_configured_profiles;
+  std::map<std::string, LearnedProfile> m_learned_profiles;
+  std::unordered_map<std::string, SmallFileDirectory> m_small_file_directories;
+  uint64_t m_small_file_clock = 0;
+
+  std::atomic<uint64_t> m_prefetches{0};
+  std::atomic<uint64_t> m_readaheads{0};
+  std::atomic<uint64_t> m_small_files{0};
+  std::atomic<uint64_t> m_small_file_listings{0};
+  std::atomic<uint64_t> m_prefetched_bytes{0};
+  std::atomic<uint64_t> m_failures{0};
+  // Prefetches dropped because too many were queued already, or memory or the service was busy.
+  std::atomic<uint64_t> m_dropped{0};
+
+  // Last, so that queued prefetches are gone before anything they use.
+  ThreadPool m_thread_pool;
+};
+
+// Null unless prefetching is configured.
+extern std::shared_ptr<Prefetcher> g_prefetcher;
@@ -0,0 +1,205 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+thread_local IoPriority t_io_priority = IoPriority::foreground_read;
+thread_local bool t_io_internal = false;
+
+const char* k_io_priority_names[k_num_io_priorities] = {
+    "foreground_read",
+    "metadata",
+    "prefetch",
+    "warm_up",
+};
+
+// Buckets hold at most one second worth of tokens, which is the burst allowed after idling.
+constexpr double k_burst_seconds = 1.0;
+} // namespace
+
+const char* io_priority_name(IoPriority priority)
+{
+  return k_io_priority_names[static_cast<size_t>(priority)];
+}
+
+bool parse_io_priority(const std::string& name, IoPriority& priority)
+{
+  for (size_t i = 0; i < k_num_io_priorities; ++i)
+  {
+    if (name == k_io_priority_names[i])
+    {
+      priority = static_cast<IoPriority>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+IoPriorityScope::IoPriorityScope(IoPriority priority, bool internal)
+    : m_previous(t_io_priority), m_previous_internal(t_io_internal)
+{
+  t_io_priority = std::max(t_io_priority, priority);
+  t_io_internal = t_io_internal || internal;
+}
+
+IoPriorityScope::~IoPriorityScope()
+{
+  t_io_priority = m_previous;
+  t_io_internal = m_previous_internal;
+}
+
+IoPriority IoPriorityScope::current() { return t_io_priority; }
+
+bool IoPriorityScope::internal() { return t_io_internal; }
+
+Scheduler::Permit::~Permit()
+{
+  if (m_scheduler)
+    m_scheduler->release();
+}
+
+Scheduler::Scheduler(const SchedulerOptions& options) : m_options(options)
+{
+  auto now = std::chrono::steady_clock::now();
+  m_requests.rate = options.requests_per_second;
+  m_requests.tokens = options.requests_per_second * k_burst_seconds;
+  m_requests.last_refill = now;
+  m_bytes.rate = options.bytes_per_second;
+  m_bytes.tokens = options.bytes_per_second * k_burst_seconds;
+  m_bytes.last_refill = now;
+}
+
+Scheduler::Permit Scheduler::admit(IoPriority priority, size_t bytes, bool internal)
+{
+  const size_t p = static_cast<size_t>(priority);
+  std::unique_lock<std::mutex> guard(m_mutex);
+  ++m_waiting[p];
+  if (internal)
+    ++m_internal_waiting[p];
+  bool delayed = false;
+  bool turned_away = false;
+  while (true)
+  {
+    if (has_more_urgent_waiters(p)
+        || (m_options.max_concurrency != 0 && m_active >= m_options.max_concurrency))
+    {
+      // Once a request waits, it's taken up its thread already, so it stays.
+      if (internal && !delayed && must_turn_away(p))
+      {
+        turned_away = true;
+        break;
+      }
+      delayed = true;
+      m_cvs[p].wait(guard);
+      continue;
+    }
+
+    // Buckets may go into debt, so that a request larger than the burst still gets through.
+    // Whoever comes next pays it off by waiting.
+    auto now = std::chrono::steady_clock::now();
+    m_requests.refill(now);
+    m_bytes.refill(now);
+    auto wait_time = std::max(m_requests.time_to_positive(), m_bytes.time_to_positive());
+    if (wait_time.count() > 0)
+    {
+      if (internal && !delayed && must_turn_away(p))
+      {
+        turned_away = true;
+        break;
+      }
+      delayed = true;
+      m_throttled_time += wait_time;
+      m_cvs[p].wait_for(guard, wait_time);
+      continue;
+    }
+    break;
+  }
+  --m_waiting[p];
+  if (internal)
+    --m_internal_waiting[p];
+  if (turned_away)
+  {
+    ++m_turned_away[p];
+    return Permit(nullptr);
+  }
+  ++m_active;
+  if (m_requests.rate > 0)
+    m_requests.tokens -= 1.0;
+  if (m_bytes.rate > 0)
+    m_bytes.tokens -= static_cast<double>(bytes);
+  ++m_admitted[p];
+  if (delayed)
+    ++m_delayed[p];
+  // Less urgent waiters were held back by this one, and may be able to go now.
+  wake_most_urgent_waiter();
+  return Permit(this);
+}
+
+std::string Scheduler::statistics_text() const
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  std::ostringstream out;
+  out << "active " << m_active << "\n";
+  out << "throttled_ms "
+      << std::chrono::duration_cast<std::chrono::milliseconds>(m_throttled_time).count() << "\n";
+  for (size_t i = 0; i < k_num_io_priorities; ++i)
+  {
+    out << k_io_priority_names[i] << " waiting " << m_waiting[i] << " admitted " << m_admitted[i]
+        << " delayed " << m_delayed[i] << " turned_away " << m_turned_away[i] << "\n";
+  }
+  return out.str();
+}
+
+bool Scheduler::has_more_urgent_waiters(size_t priority) const
+{
+  for (size_t i = 0; i < priority; ++i)
+    if (m_waiting[i] != 0)
+      return true;
+  return false;
+}
+
+bool Scheduler::must_turn_away(size_t priority) const
+{
+  // This request is counted as waiting too.
+  return priority >= static_cast<size_t>(IoPriority::prefetch)
+      && m_options.max_background_waiting != 0
+      && m_internal_waiting[priority] > m_options.max_background_waiting;
+}
+
+void Scheduler::release()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  --m_active;
+  wake_most_urgent_waiter();
+}
+
+void Scheduler::wake_most_urgent_waiter()
+{
+  // If it can't proceed, it's blocked by the same limits as everybody else.
+  for (size_t i = 0; i < k_num_io_priorities; ++i)
+  {
+    if (m_waiting[i] != 0)
+    {
+      m_cvs[i].notify_one();
+      return;
+    }
+  }
+}
+
+void Scheduler::TokenBucket::refill(std::chrono::steady_clock::time_point now)
+{
+  if (rate <= 0)
+    return;
+  double elapsed = std::chrono::duration<double>(now - last_refill).count();
+  tokens = std::min(tokens + elapsed * rate, rate * k_burst_seconds);
+  last_refill = now;
+}
+
+std::chrono::steady_clock::duration Scheduler::TokenBucket::time_to_positive() const
+{
+  if (rate <= 0 || tokens >= 0)
+    return std::chrono::steady_clock::duration::zero();
+  return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(-tokens / rate));
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Classes of requests to the storage service, from the most to the least urgent.
+enum class IoPriority
+{
+  foreground_read = 0,
+  metadata = 1,
+  prefetch = 2,
+  warm_up = 3,
+};
+
+constexpr size_t k_num_io_priorities = 4;
+
+const char* io_priority_name(IoPriority priority);
+// Returns false if |name| isn't the name of a priority.
+bool parse_io_priority(const std::string& name, IoPriority& priority);
+
+// Lowers the priority of requests issued by the current thread while in scope. Requests never
+// get a higher priority than their kind implies, so a metadata request in a foreground_read scope
+// is still a metadata request. |internal| marks work the file system does on its own, like
+// prefetching, as opposed to requests of processes.
+class IoPriorityScope {
+public:
+  explicit IoPriorityScope(IoPriority priority, bool internal = false);
+  ~IoPriorityScope();
+
+  IoPriorityScope(const IoPriorityScope&) = delete;
+  IoPriorityScope& operator=(const IoPriorityScope&) = delete;
+
+  static IoPriority current();
+  static bool internal();
+
+private:
+  IoPriority m_previous;
+  bool m_previous_internal;
+};
+
+struct SchedulerOptions
+{
+  // Zero means no limit for all of these.
+  size_t max_concurrency = 0;
+  double requests_per_second = 0.0;
+  double bytes_per_second = 0.0;
+  // Internal requests of each priority below metadata that may wait at the same time, or zero for
+  // no limit. Past it, they're turned away rather than holding up one more thread. Requests of
+  // processes always wait, however low their priority, since they can't be turned away.
+  size_t max_background_waiting = 2;
+};
+
+// Admits requests of one mount to the storage service. Requests are limited in concurrency and
+// rate, and when they have to wait they are let through in priority order.
+class Scheduler {
+public:
+  // Admission of one request. The request counts against the concurrency limit until this is
+  // destroyed.
+  class Permit {
+  public:
+    Permit(Permit&& other) noexcept : m_scheduler(other.m_scheduler)
+    {
+      other.m_scheduler = nullptr;
+    }
+    Permit& operator=(Permit&&) = delete;
+    ~Permit();
+
+    // False if the request was turned away, and mustn't be made.
+    bool admitted() const { return m_scheduler != nullptr; }
+
+  private:
+    friend class Scheduler;
+    explicit Permit(Scheduler* scheduler) : m_scheduler(scheduler) {}
+
+    Scheduler* m_scheduler;
+  };
+
+  explicit Scheduler(const SchedulerOptions& options);
+
+  // Blocks until a request of |priority| moving about |bytes| of data may start, unless it's an
+  // |internal| background request that would wait behind too many others of its priority.
+  Permit admit(IoPriority priority, size_t bytes, bool internal);
+
+  std::string statistics_text() const;
+
+private:
+  struct TokenBucket
+  {
+    double rate = 0.0;
+    double tokens = 0.0;
+    std::chrono::steady_clock::time_point last_refill;
+
+    void refill(std::chrono::steady_clock::time_point now);
+    // How long until the bucket isn't in debt anymore.
+    std::chrono::steady_clock::duration time_to_positive() const;
+  };
+
+  bool has_more_urgent_waiters(size_t priority) const;
+  // Whether an internal request of |priority| that has to wait is turned away instead. Must be
+  // called with m_mutex held and the request counted as waiting.
+  bool must_turn_away(size_t priority) const;
+  void release();
+  // Must be called with m_mutex held.
+  void wake_most_urgent_waiter();
+
+  const SchedulerOptions m_options;
+
+  mutable std::mutex m_mutex;
+  std::array<std::condition_variable, k_num_io_priorities> m_cvs;
+  std::array<size_t, k_num_io_priorities> m_waiting{};
+  // Internal requests among those waiting.
+  std::array<size_t, k_num_io_priorities> m_internal_waiting{};
+  size_t m_active = 0;
+  TokenBucket m_requests;
+  TokenBucket m_bytes;
+
+  std::array<uint64_t, k_num_io_priorities> m_admitted{};
+  std::array<uint64_t, k_num_io_priorities> m_delayed{};
+  std::array<uint64_t, k_num_io_priorities> m_turned_away{};
+  std::chrono::steady_clock::duration m_throttled_time{};
+};
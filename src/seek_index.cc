@@ -0,0 +1,673 @@
+#include "seek_index.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <new>
+
+#include <zlib.h>
+#ifdef AZFUSE_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "index_file.h"
+
+namespace {
+constexpr size_t k_input_chunk_size = 1024 * 1024;
+constexpr size_t k_discard_size = 64 * 1024;
+constexpr size_t k_window_size = 32 * 1024;
+constexpr char k_index_magic[8] = {'A', 'Z', 'F', 'S', 'I', 'D', 'X', '1'};
+
+std::string pack_window(const unsigned char* data, size_t size)
+{
+  if (size == 0)
+    return std::string();
+  uLongf packed_size = compressBound(static_cast<uLong>(size));
+  std::string packed(packed_size, '\0');
+  if (compress2(
+          reinterpret_cast<Bytef*>(&packed[0]), &packed_size, data, static_cast<uLong>(size),
+          Z_BEST_SPEED)
+      != Z_OK)
+    throw std::bad_alloc();
+  packed.resize(packed_size);
+  return packed;
+}
+
+bool unpack_window(const std::string& packed, unsigned char* data, size_t& size)
+{
+  if (packed.empty())
+  {
+    size = 0;
+    return true;
+  }
+  uLongf unpacked_size = k_window_size;
+  int ret = uncompress(
+      data, &unpacked_size, reinterpret_cast<const Bytef*>(packed.data()),
+      static_cast<uLong>(packed.size()));
+  size = unpacked_size;
+  return ret == Z_OK;
+}
+
+int build_inflate_index(const RangeReader& reader, uint64_t span, SeekIndex& index)
+{
+  const bool gzip = index.format == CompressionFormat::gzip;
+  z_stream strm;
+  std::memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, gzip ? 31 : -15) != Z_OK)
+    return -ENOMEM;
+
+  std::shared_ptr<Buffer> input = g_buffer_pool.allocate(k_input_chunk_size);
+  // Output is thrown away, except for the last 32 KiB which seek points need.
+  std::unique_ptr<unsigned char[]> window(new unsigned char[k_window_size]);
+  std::unique_ptr<unsigned char[]> ordered_window(new unsigned char[k_window_size]);
+  uint64_t input_offset = index.compressed_begin;
+  uint64_t consumed_offset = index.compressed_begin;
+  uint64_t total_out = 0;
+  uint64_t last_point = 0;
+  // Where the last complete gzip member ends, and how much output there was at that point. If
+  // what follows isn't a gzip member, it's garbage that gzip itself would ignore too.
+  uint64_t member_end = 0;
+  uint64_t member_end_out = 0;
+  bool after_member = false;
+
+  index.points.clear();
+  index.points.emplace_back();
+  index.points.back().compressed_offset = index.compressed_begin;
+
+  strm.next_out = window.get();
+  strm.avail_out = k_window_size;
+  // Inflate may have more output for a full output buffer without taking any more input.
+  bool output_pending = false;
+  int result = 0;
+  while (true)
+  {
+    if (strm.avail_in == 0 && !output_pending)
+    {
+      size_t n_wanted = static_cast<size_t>(
+          std::min<uint64_t>(k_input_chunk_size, index.compressed_end - input_offset));
+      int n = n_wanted == 0 ? 0 : reader(input->data(), n_wanted, input_offset);
+      if (n < 0)
+      {
+        result = n;
+        break;
+      }
+      if (n == 0)
+      {
+        result = -EIO;
+        break;
+      }
+      input_offset += n;
+      strm.next_in = reinterpret_cast<Bytef*>(input->data());
+      strm.avail_in = static_cast<uInt>(n);
+    }
+    if (strm.avail_out == 0)
+    {
+      strm.next_out = window.get();
+      strm.avail_out = k_window_size;
+    }
+
+    uInt avail_in = strm.avail_in;
+    uInt avail_out = strm.avail_out;
+    int ret = inflate(&strm, Z_BLOCK);
+    consumed_offset += avail_in - strm.avail_in;
+    total_out += avail_out - strm.avail_out;
+    output_pending = strm.avail_out == 0;
+    if (ret == Z_STREAM_END)
+    {
+      if (!gzip || consumed_offset == index.compressed_end)
+        break;
+      member_end = consumed_offset;
+      member_end_out = total_out;
+      after_member = true;
+      inflateReset2(&strm, 31);
+      continue;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+      result = ret == Z_MEM_ERROR ? -ENOMEM : -EIO;
+      break;
+    }
+
+    // Points can only be placed between deflate blocks, and not after the last one of a member.
+    if ((strm.data_type & 128) != 0 && (strm.data_type & 64) == 0
+        && total_out - last_point >= span)
+    {
+      SeekPoint point;
+      point.compressed_offset = consumed_offset;
+      point.uncompressed_offset = total_out;
+      point.bits = static_cast<uint8_t>(strm.data_type & 7);
+      size_t write_position = k_window_size - strm.avail_out;
+      size_t window_size = static_cast<size_t>(std::min<uint64_t>(total_out, k_window_size));
+      if (window_size == k_window_size)
+      {
+        std::memcpy(
+            ordered_window.get(), window.get() + write_position, k_window_size - write_position);
+        std::memcpy(
+            ordered_window.get() + k_window_size - write_position, window.get(), write_position);
+      }
+      else
+      {
+        std::memcpy(ordered_window.get(), window.get(), window_size);
+      }
+      point.window = pack_window(ordered_window.get(), window_size);
+      index.points.emplace_back(std::move(point));
+      last_point = total_out;
+    }
+  }
+  inflateEnd(&strm);
+
+  if (result == -EIO && after_member && total_out == member_end_out)
+  {
+    index.points.erase(
+        std::remove_if(
+            index.points.begin() + 1, index.points.end(),
+            [member_end](const SeekPoint& p) { return p.compressed_offset > member_end; }),
+        index.points.end());
+    consumed_offset = member_end;
+    result = 0;
+  }
+  if (result < 0)
+    return result;
+  index.compressed_end = consumed_offset;
+  index.uncompressed_size = total_out;
+  return 0;
+}
+
+#ifdef AZFUSE_WITH_ZSTD
+int build_zstd_index(const RangeReader& reader, uint64_t span, SeekIndex& index)
+{
+  std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+  if (!dctx)
+    return -ENOMEM;
+
+  std::shared_ptr<Buffer> input = g_buffer_pool.allocate(k_input_chunk_size);
+  std::shared_ptr<Buffer> output = g_buffer_pool.allocate(k_discard_size);
+  uint64_t input_offset = index.compressed_begin;
+  uint64_t total_out = 0;
+  uint64_t last_point = 0;
+  bool frame_done = true;
+
+  index.points.clear();
+  index.points.emplace_back();
+  index.points.back().compressed_offset = index.compressed_begin;
+
+  while (input_offset < index.compressed_end)
+  {
+    size_t n_wanted = static_cast<size_t>(
+        std::min<uint64_t>(k_input_chunk_size, index.compressed_end - input_offset));
+    int n = reader(input->data(), n_wanted, input_offset);
+    if (n < 0)
+      return n;
+    if (n == 0)
+      return -EIO;
+    ZSTD_inBuffer in = {input->data(), static_cast<size_t>(n), 0};
+    ZSTD_outBuffer out;
+    do
+    {
+      out = {output->data(), output->capacity(), 0};
+      size_t ret = ZSTD_decompressStream(dctx.get(), &out, &in);
+      if (ZSTD_isError(ret))
+        return -EIO;
+      total_out += out.pos;
+      frame_done = ret == 0;
+      uint64_t frame_end = input_offset + in.pos;
+      if (frame_done && frame_end < index.compressed_end && total_out - last_point >= span)
+      {
+        SeekPoint point;
+        point.compressed_offset = frame_end;
+        point.uncompressed_offset = total_out;
+        index.points.emplace_back(std::move(point));
+        last_point = total_out;
+      }
+    } while (in.pos < in.size || out.pos == out.size);
+    input_offset += n;
+  }
+  if (!frame_done)
+    return -EIO;
+  index.uncompressed_size = total_out;
+  return 0;
+}
+#endif
+
+class InflateDecompressor : public Decompressor {
+public:
+  InflateDecompressor(std::shared_ptr<const SeekIndex> index, RangeReader reader)
+      : Decompressor(std::move(index), std::move(reader))
+  {
+    std::memset(&m_strm, 0, sizeof(m_strm));
+  }
+
+  ~InflateDecompressor() override
+  {
+    if (m_initialized)
+      inflateEnd(&m_strm);
+  }
+
+  int start(const SeekPoint& point)
+  {
+    m_gzip = m_index->format == CompressionFormat::gzip;
+    // Only the beginning of a gzip stream has a header in front of it. All other points are in the
+    // middle of deflate data.
+    m_raw = !(m_gzip && point.compressed_offset == m_index->compressed_begin);
+    if (inflateInit2(&m_strm, m_raw ? -15 : 31) != Z_OK)
+      return -ENOMEM;
+    m_initialized = true;
+    m_input_offset = point.compressed_offset;
+    m_position = point.uncompressed_offset;
+    m_discard = g_buffer_pool.allocate(k_discard_size);
+
+    if (point.bits != 0)
+    {
+      char byte;
+      int ret = m_reader(&byte, 1, point.compressed_offset - 1);
+      if (ret < 0)
+        return ret;
+      if (ret != 1)
+        return -EIO;
+      inflatePrime(&m_strm, point.bits, static_cast<unsigned char>(byte) >> (8 - point.bits));
+    }
+    if (!point.window.empty())
+    {
+      unsigned char window[k_window_size];
+      size_t window_size;
+      if (!unpack_window(point.window, window, window_size))
+        return -EIO;
+      inflateSetDictionary(&m_strm, window, static_cast<uInt>(window_size));
+    }
+    return 0;
+  }
+
+  int read(char* buff, size_t size) override
+  {
+    size_t done = 0;
+    while (done < size && !m_finished)
+    {
+      if (m_strm.avail_in == 0 && !m_output_pending)
+      {
+        int ret = refill();
+        if (ret < 0)
+          return ret;
+      }
+      unsigned char* out = buff
+          ? reinterpret_cast<unsigned char*>(buff) + done
+          : reinterpret_cast<unsigned char*>(m_discard->data());
+      size_t out_size = buff ? size - done : std::min(size - done, m_discard->capacity());
+      m_strm.next_out = out;
+      m_strm.avail_out = static_cast<uInt>(out_size);
+      int ret = inflate(&m_strm, Z_NO_FLUSH);
+      size_t n = out_size - m_strm.avail_out;
+      done += n;
+      m_position += n;
+      // A full output buffer may mean there's more output without any more input.
+      m_output_pending = m_strm.avail_out == 0;
+      if (ret == Z_STREAM_END)
+      {
+        ret = next_member();
+        if (ret < 0)
+          return ret;
+        continue;
+      }
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return ret == Z_MEM_ERROR ? -ENOMEM : -EIO;
+    }
+    return static_cast<int>(done);
+  }
+
+private:
+  int refill()
+  {
+    int n = fetch_input();
+    if (n < 0)
+      return n;
+    // The index says there's more to decompress, so the data must have been truncated.
+    if (n == 0)
+      return -EIO;
+    m_strm.next_in = reinterpret_cast<Bytef*>(m_input->data());
+    m_strm.avail_in = static_cast<uInt>(n);
+    return 0;
+  }
+
+  int next_member()
+  {
+    if (!m_gzip)
+    {
+      m_finished = true;
+      return 0;
+    }
+    if (m_raw)
+    {
+      // Raw inflate stops right before the gzip trailer.
+      size_t trailer_size = 8;
+      while (trailer_size > 0)
+      {
+        if (m_strm.avail_in == 0)
+        {
+          int ret = refill();
+          if (ret < 0)
+            return ret;
+        }
+        uInt n = static_cast<uInt>(std::min<size_t>(trailer_size, m_strm.avail_in));
+        m_strm.next_in += n;
+        m_strm.avail_in -= n;
+        trailer_size -= n;
+      }
+    }
+    if (m_input_offset - m_strm.avail_in >= m_index->compressed_end)
+    {
+      m_finished = true;
+      return 0;
+    }
+    inflateReset2(&m_strm, 31);
+    m_raw = false;
+    return 0;
+  }
+
+  z_stream m_strm;
+  bool m_initialized = false;
+  bool m_gzip = false;
+  bool m_raw = false;
+  bool m_finished = false;
+  bool m_output_pending = false;
+  std::shared_ptr<Buffer> m_discard;
+};
+
+#ifdef AZFUSE_WITH_ZSTD
+class ZstdDecompressor : public Decompressor {
+public:
+  ZstdDecompressor(std::shared_ptr<const SeekIndex> index, RangeReader reader)
+      : Decompressor(std::move(index), std::move(reader))
+  {
+  }
+
+  ~ZstdDecompressor() override { ZSTD_freeDCtx(m_dctx); }
+
+  int start(const SeekPoint& point)
+  {
+    m_dctx = ZSTD_createDCtx();
+    if (!m_dctx)
+      return -ENOMEM;
+    m_input_offset = point.compressed_offset;
+    m_position = point.uncompressed_offset;
+    m_discard = g_buffer_pool.allocate(k_discard_size);
+    return 0;
+  }
+
+  int read(char* buff, size_t size) override
+  {
+    size_t done = 0;
+    while (done < size)
+    {
+      if (m_in.pos == m_in.size && !m_output_pending)
+      {
+        int n = fetch_input();
+        if (n < 0)
+          return n;
+        if (n == 0)
+        {
+          if (m_frame_done)
+            break;
+          return -EIO;
+        }
+        m_in = {m_input->data(), static_cast<size_t>(n), 0};
+      }
+      char* out = buff ? buff + done : m_discard->data();
+      size_t out_size = buff ? size - done : std::min(size - done, m_discard->capacity());
+      ZSTD_outBuffer output = {out, out_size, 0};
+      size_t ret = ZSTD_decompressStream(m_dctx, &output, &m_in);
+      if (ZSTD_isError(ret))
+        return -EIO;
+      done += output.pos;
+      m_position += output.pos;
+      m_frame_done = ret == 0;
+      // A full output buffer may mean there's more output without any more input.
+      m_output_pending = output.pos == output.size;
+    }
+    return static_cast<int>(done);
+  }
+
+private:
+  ZSTD_DCtx* m_dctx = nullptr;
+  ZSTD_inBuffer m_in = {nullptr, 0, 0};
+  bool m_frame_done = true;
+  bool m_output_pending = false;
+  std::shared_ptr<Buffer> m_discard;
+};
+#endif
+} // namespace
+
+bool compression_format_supported(CompressionFormat format)
+{
+  switch (format)
+  {
+    case CompressionFormat::gzip:
+    case CompressionFormat::deflate:
+      return true;
+    case CompressionFormat::zstd:
+#ifdef AZFUSE_WITH_ZSTD
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+std::string index_filename(const std::string& key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : key)
+  {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.idx", static_cast<unsigned long long>(hash));
+  return name;
+}
+
+const SeekPoint& SeekIndex::find(uint64_t offset) const
+{
+  auto ite = std::upper_bound(
+      points.begin(), points.end(), offset,
+      [](uint64_t o, const SeekPoint& p) { return o < p.uncompressed_offset; });
+  return *std::prev(ite);
+}
+
+size_t SeekIndex::memory_usage() const
+{
+  size_t usage = sizeof(*this) + points.capacity() * sizeof(SeekPoint);
+  for (const auto& p : points)
+    usage += p.window.capacity();
+  return usage;
+}
+
+bool SeekIndex::load(const std::string& filename, const std::string& key)
+{
+  std::ifstream fin(filename, std::ios::binary);
+  if (!fin.is_open())
+    return false;
+  char magic[sizeof(k_index_magic)];
+  if (!fin.read(magic, sizeof(magic)) || std::memcmp(magic, k_index_magic, sizeof(magic)) != 0)
+    return false;
+  std::string saved_key;
+  if (!read_string(fin, saved_key, key.size()) || saved_key != key)
+    return false;
+
+  uint8_t saved_format;
+  uint64_t num_points;
+  if (!read_value(fin, saved_format) || saved_format != static_cast<uint8_t>(format)
+      || !read_value(fin, compressed_begin) || !read_value(fin, compressed_end)
+      || !read_value(fin, uncompressed_size) || !read_value(fin, num_points) || num_points == 0)
+    return false;
+  points.clear();
+  for (uint64_t i = 0; i < num_points; ++i)
+  {
+    SeekPoint p;
+    if (!read_value(fin, p.compressed_offset) || !read_value(fin, p.uncompressed_offset)
+        || !read_value(fin, p.bits) || !read_string(fin, p.window, compressBound(k_window_size)))
+      return false;
+    if (!points.empty() && p.uncompressed_offset < points.back().uncompressed_offset)
+      return false;
+    points.emplace_back(std::move(p));
+  }
+  return points[0].uncompressed_offset == 0;
+}
+
+void SeekIndex::save(const std::string& filename, const std::string& key) const
+{
+  // Written aside and renamed into place, so that readers never see a partial index.
+  const std::string temp = temp_filename(filename);
+  {
+    std::ofstream fout(temp, std::ios::binary | std::ios::trunc);
+    if (!fout.is_open())
+      return;
+    fout.write(k_index_magic, sizeof(k_index_magic));
+    write_string(fout, key);
+    write_value(fout, static_cast<uint8_t>(format));
+    write_value(fout, compressed_begin);
+    write_value(fout, compressed_end);
+    write_value(fout, uncompressed_size);
+    write_value(fout, static_cast<uint64_t>(points.size()));
+    for (const auto& p : points)
+    {
+      write_value(fout, p.compressed_offset);
+      write_value(fout, p.uncompressed_offset);
+      write_value(fout, p.bits);
+      write_string(fout, p.window);
+    }
+    if (!fout.flush())
+    {
+      fout.close();
+      std::remove(temp.data());
+      return;
+    }
+  }
+  if (std::rename(temp.data(), filename.data()) != 0)
+    std::remove(temp.data());
+}
+
+int build_seek_index(const RangeReader& reader, uint64_t span, SeekIndex& index)
+{
+  switch (index.format)
+  {
+    case CompressionFormat::gzip:
+    case CompressionFormat::deflate:
+      return build_inflate_index(reader, span, index);
+    case CompressionFormat::zstd:
+#ifdef AZFUSE_WITH_ZSTD
+      return build_zstd_index(reader, span, index);
+#else
+      break;
+#endif
+  }
+  return -ENOTSUP;
+}
+
+std::unique_ptr<Decompressor> Decompressor::create(
+    std::shared_ptr<const SeekIndex> index, const SeekPoint& point, RangeReader reader)
+{
+  switch (index->format)
+  {
+    case CompressionFormat::gzip:
+    case CompressionFormat::deflate:
+    {
+      auto decompressor
+          = std::make_unique<InflateDecompressor>(std::move(index), std::move(reader));
+      if (decompressor->start(point) < 0)
+        return nullptr;
+      return decompressor;
+    }
+    case CompressionFormat::zstd:
+    {
+#ifdef AZFUSE_WITH_ZSTD
+      auto decompressor = std::make_unique<ZstdDecompressor>(std::move(index), std::move(reader));
+      if (decompressor->start(point) < 0)
+        return nullptr;
+      return decompressor;
+#else
+      break;
+#endif
+    }
+  }
+  return nullptr;
+}
+
+Decompressor::Decompressor(std::shared_ptr<const SeekIndex> index, RangeReader reader)
+    : m_index(std::move(index)), m_reader(std::move(reader)),
+      m_input(g_buffer_pool.allocate(k_input_chunk_size))
+{
+}
+
+int Decompressor::fetch_input()
+{
+  size_t n_wanted = static_cast<size_t>(
+      std::min<uint64_t>(m_input->capacity(), m_index->compressed_end - m_input_offset));
+  if (n_wanted == 0)
+    return 0;
+  int n = m_reader(m_input->data(), n_wanted, m_input_offset);
+  if (n < 0)
+    return n;
+  if (n == 0)
+    return -EIO;
+  m_input_offset += n;
+  return n;
+}
+
+int DecompressorCache::read(
+    const std::string& key,
+    const std::shared_ptr<const SeekIndex>& index,
+    const RangeReader& reader,
+    char* buff,
+    size_t size,
+    uint64_t offset)
+{
+  if (offset >= index->uncompressed_size)
+    return 0;
+
+  const SeekPoint& point = index->find(offset);
+  std::unique_ptr<Decompressor> decompressor;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto ite = m_cursors.begin(); ite != m_cursors.end(); ++ite)
+    {
+      uint64_t position = ite->decompressor->position();
+      // Carrying on is only worth it from at or after the seek point the read would start from.
+      if (ite->key == key && position <= offset && position >= point.uncompressed_offset)
+      {
+        decompressor = std::move(ite->decompressor);
+        m_cursors.erase(ite);
+        break;
+      }
+    }
+  }
+  if (!decompressor)
+  {
+    decompressor = Decompressor::create(index, point, reader);
+    if (!decompressor)
+      return -ENOMEM;
+  }
+
+  while (decompressor->position() < offset)
+  {
+    size_t n = static_cast<size_t>(
+        std::min<uint64_t>(offset - decompressor->position(), 1024 * 1024 * 1024));
+    int ret = decompressor->read(nullptr, n);
+    if (ret < 0)
+      return ret;
+    if (ret == 0)
+      return -EIO;
+  }
+  int ret = decompressor->read(buff, size);
+  if (ret < 0)
+    return ret;
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  m_cursors.emplace_front();
+  m_cursors.front().key = key;
+  m_cursors.front().decompressor = std::move(decompressor);
+  if (m_cursors.size() > m_capacity)
+    m_cursors.pop_back();
+  return ret;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "buffer_pool.h"
+
+enum class CompressionFormat : uint8_t
+{
+  // One or more concatenated gzip members.
+  gzip = 1,
+  // A raw deflate stream, like a member of a zip archive.
+  deflate = 2,
+  // One or more concatenated zstd frames.
+  zstd = 3,
+};
+
+// Whether this build can decompress |format|.
+bool compression_format_supported(CompressionFormat format);
+
+// Reads up to |size| bytes of an object at |offset|. Returns the number of bytes read, which is
+// less than |size| only at the end of the object, or a negative errno.
+using RangeReader = std::function<int(char* buff, size_t size, uint64_t offset)>;
+
+// A place in a compressed stream where decompression can start without decompressing anything
+// before it.
+struct SeekPoint
+{
+  uint64_t compressed_offset = 0;
+  uint64_t uncompressed_offset = 0;
+  // Deflate only. Number of bits of the byte before compressed_offset that belong to the block
+  // starting here.
+  uint8_t bits = 0;
+  // Deflate only. Up to 32 KiB of uncompressed data right before this point, which back references
+  // may refer to. It's kept deflated.
+  std::string window;
+};
+
+// Seek points of a compressed stream, built by decompressing it once.
+struct SeekIndex
+{
+  CompressionFormat format = CompressionFormat::gzip;
+  // The compressed stream is [compressed_begin, compressed_end) of the object. Anything after it,
+  // like trailing garbage after the last gzip member, is ignored.
+  uint64_t compressed_begin = 0;
+  uint64_t compressed_end = 0;
+  uint64_t uncompressed_size = 0;
+  // Sorted, and the first one is always at the beginning of the stream.
+  std::vector<SeekPoint> points;
+
+  // The last point at or before |offset|.
+  const SeekPoint& find(uint64_t offset) const;
+  size_t memory_usage() const;
+
+  // |key| identifies the compressed object and its version. Returns false if the file doesn't
+  // exist, is corrupt or belongs to another key.
+  bool load(const std::string& filename, const std::string& key);
+  // Failing to save isn't an error, the index is simply built again next time.
+  void save(const std::string& filename, const std::string& key) const;
+};
+
+// File name for saving the index identified by |key|. Saved indexes record their full key, so a
+// hash collision only costs a rebuild.
+std::string index_filename(const std::string& key);
+
+// Decompresses the stream [index.compressed_begin, index.compressed_end) once, placing seek
+// points about every |span| uncompressed bytes. Gzip and deflate streams can only be split at
+// block boundaries, and zstd streams only at frame boundaries, so a zstd stream written as a single
+// frame gets a single point. Fills the remaining fields of |index|. Returns 0, -EIO if the stream
+// is corrupt, or the error of |reader|.
+int build_seek_index(const RangeReader& reader, uint64_t span, SeekIndex& index);
+
+// Decompresses a stream sequentially, starting from one of its seek points.
+class Decompressor {
+public:
+  // Returns nullptr if the decompressor can't be set up.
+  static std::unique_ptr<Decompressor> create(
+      std::shared_ptr<const SeekIndex> index, const SeekPoint& point, RangeReader reader);
+  virtual ~Decompressor() = default;
+
+  // Uncompressed offset of the next byte read() returns.
+  uint64_t position() const { return m_position; }
+
+  // Decompresses up to |size| bytes into |buff|, or throws them away if |buff| is null. Returns
+  // the number of bytes, which is less than |size| only at the end of the stream, or a negative
+  // errno.
+  virtual int read(char* buff, size_t size) = 0;
+
+protected:
+  Decompressor(std::shared_ptr<const SeekIndex> index, RangeReader reader);
+
+  // Fetches the next chunk of compressed data into m_input, up to compressed_end. Returns the
+  // number of bytes, 0 at the end of the stream, or a negative errno.
+  int fetch_input();
+
+  std::shared_ptr<const SeekIndex> m_index;
+  RangeReader m_reader;
+  std::shared_ptr<Buffer> m_input;
+  // Compressed offset of the byte after what has been fetched into m_input.
+  uint64_t m_input_offset = 0;
+  uint64_t m_position = 0;
+};
+
+// Decompressors parked where the last reads stopped, most recently used first. Sequential reads
+// of a stream carry on where the previous read left off, instead of decompressing again from a
+// seek point.
+class DecompressorCache {
+public:
+  explicit DecompressorCache(size_t capacity) : m_capacity(capacity) {}
+
+  // Reads up to |size| bytes at uncompressed |offset| of the stream |index| describes. |key|
+  // identifies the stream and its version. Returns the number of bytes read, or a negative errno.
+  int read(
+      const std::string& key,
+      const std::shared_ptr<const SeekIndex>& index,
+      const RangeReader& reader,
+      char* buff,
+      size_t size,
+      uint64_t offset);
+
+private:
+  struct Cursor
+  {
+    std::string key;
+    std::unique_ptr<Decompressor> decompressor;
+  };
+
+  const size_t m_capacity;
+  std::mutex m_mutex;
+  std::list<Cursor> m_cursors;
+};
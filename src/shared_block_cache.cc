@@ -0,0 +1,468 @@
+#include "shared_block_cache.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "crc64.h"
+
+namespace {
+// "AZFSHC01". Changes with the layout of the file.
+constexpr uint64_t k_magic = 0x313043485346'5A41;
+constexpr size_t k_slots_per_shard = 64;
+constexpr size_t k_page_size = 4096;
+// Copying a block takes far less than this. A slot claimed for longer than this was left behind
+// by a process that died.
+constexpr int64_t k_stale_milliseconds = 30 * 1000;
+// Tries at getting a new file to lay out before giving up on it, about 2 seconds in all.
+constexpr int k_layout_attempts = 20;
+
+enum SlotState : uint32_t
+{
+  empty = 0,
+  writing = 1,
+  ready = 2,
+};
+
+// steady_clock is CLOCK_MONOTONIC on Linux, which is the same in every process.
+int64_t now_milliseconds()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+size_t round_up(size_t n, size_t alignment) { return (n + alignment - 1) / alignment * alignment; }
+
+size_t num_segments(size_t size)
+{
+  return (size + BlockCache::k_checksum_segment_size - 1) / BlockCache::k_checksum_segment_size;
+}
+} // namespace
+
+struct SharedBlockCache::Header
+{
+  // Written last, so that a file whose creator died halfway is laid out again.
+  uint64_t magic;
+  uint64_t file_size;
+  uint64_t block_size;
+  uint64_t num_shards;
+  uint64_t slots_per_shard;
+  uint64_t segments_per_slot;
+  uint64_t shards_offset;
+  uint64_t slots_offset;
+  uint64_t checksums_offset;
+  uint64_t data_offset;
+};
+
+struct alignas(64) SharedBlockCache::Shard
+{
+#ifdef __linux__
+  pthread_mutex_t mutex;
+#endif
+  // Ticks on every use of a slot of the shard, for its LRU.
+  uint64_t clock;
+};
+
+struct SharedBlockCache::Slot
+{
+  Digest key;
+  // Bumped whenever the slot is given to another block, so that a reader or writer that took too
+  // long can tell.
+  uint64_t generation;
+  uint64_t last_used;
+  // When a reader or writer last claimed the slot, in milliseconds of the monotonic clock.
+  int64_t claimed_time;
+  uint64_t size;
+  uint32_t state;
+  // Readers copying the block out. The slot isn't reused while there are any.
+  uint32_t readers;
+};
+
+std::shared_ptr<SharedBlockCache> SharedBlockCache::open(
+    const std::string& filename, size_t block_size, size_t capacity, std::string& error)
+{
+#ifdef __linux__
+  int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+  {
+    error = std::strerror(errno);
+    return nullptr;
+  }
+  auto fail = [fd, &error](const std::string& message) {
+    error = message;
+    close(fd);
+    return nullptr;
+  };
+  // Every process using the file holds a shared lock on it for as long as it's mapped, so that
+  // it's only laid out again, which truncates it, by a process that gets it exclusively. Anything
+  // else would make the pages of the others go away under them. The locks go away if the process
+  // dies.
+  Header header{};
+  bool valid = false;
+  bool exclusive = false;
+  for (int attempt = 0;; ++attempt)
+  {
+    if (!exclusive && flock(fd, LOCK_SH) != 0)
+      return fail(std::strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      return fail(std::strerror(errno));
+    valid = static_cast<size_t>(st.st_size) >= sizeof(header)
+        && pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header))
+        && header.magic == k_magic && header.file_size == static_cast<uint64_t>(st.st_size);
+    if (valid || exclusive)
+      break;
+    // Turning the shared lock into an exclusive one drops it first, and fails if anyone else still
+    // holds theirs, so processes starting together on a new file may have to try a few times.
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+    {
+      exclusive = true;
+      continue;
+    }
+    if (errno != EWOULDBLOCK)
+      return fail(std::strerror(errno));
+    if (attempt == k_layout_attempts)
+      return fail("the file is being used by processes that don't agree on its layout");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10 * (attempt + 1)));
+  }
+  if (valid && header.block_size != block_size)
+    return fail("the file is used with a block size of " + std::to_string(header.block_size));
+
+  if (!valid && (block_size == 0 || capacity < block_size))
+    return fail("capacity is smaller than a block");
+  if (!valid)
+  {
+    size_t num_slots = capacity / block_size;
+    header.block_size = block_size;
+    header.num_shards = (num_slots + k_slots_per_shard - 1) / k_slots_per_shard;
+    header.slots_per_shard = (num_slots + header.num_shards - 1) / header.num_shards;
+    header.segments_per_slot = num_segments(block_size);
+    const size_t total_slots = header.num_shards * header.slots_per_shard;
+    header.shards_offset = round_up(sizeof(Header), alignof(Shard));
+    header.slots_offset
+        = round_up(header.shards_offset + header.num_shards * sizeof(Shard), alignof(Slot));
+    header.checksums_offset = header.slots_offset + total_slots * sizeof(Slot);
+    header.data_offset = round_up(
+        header.checksums_offset + total_slots * header.segments_per_slot * sizeof(uint64_t),
+        k_page_size);
+    header.file_size = header.data_offset + total_slots * block_size;
+    // Truncating first zeroes whatever was there. Nobody else has it mapped.
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(header.file_size)) != 0)
+      return fail(std::strerror(errno));
+  }
+
+  void* p = mmap(nullptr, header.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return fail(std::strerror(errno));
+  char* memory = static_cast<char*>(p);
+
+  if (!valid)
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    int ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (ret == 0)
+      ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    auto* shards = reinterpret_cast<Shard*>(memory + header.shards_offset);
+    for (size_t i = 0; ret == 0 && i < header.num_shards; ++i)
+      ret = pthread_mutex_init(&shards[i].mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0)
+    {
+      munmap(memory, header.file_size);
+      return fail(std::string("no robust process-shared mutexes: ") + std::strerror(ret));
+    }
+    Header initialized = header;
+    initialized.magic = 0;
+    std::memcpy(memory, &initialized, sizeof(initialized));
+    __atomic_store_n(&reinterpret_cast<Header*>(memory)->magic, k_magic, __ATOMIC_RELEASE);
+  }
+
+  // Back to a shared lock, which is kept until the file is unmapped.
+  if (exclusive && flock(fd, LOCK_SH) != 0)
+  {
+    munmap(memory, header.file_size);
+    return fail(std::strerror(errno));
+  }
+  return std::shared_ptr<SharedBlockCache>(
+      new SharedBlockCache(filename, fd, memory, header.file_size));
+#else
+  (void)filename;
+  (void)block_size;
+  (void)capacity;
+  error = "not supported on this system";
+  return nullptr;
+#endif
+}
+
+SharedBlockCache::SharedBlockCache(std::string filename, int fd, char* memory, size_t size)
+    : m_filename(std::move(filename)), m_fd(fd), m_memory(memory), m_size(size),
+      m_header(reinterpret_cast<Header*>(memory))
+{
+}
+
+SharedBlockCache::~SharedBlockCache()
+{
+#ifdef __linux__
+  munmap(m_memory, m_size);
+  // Drops the shared lock.
+  close(m_fd);
+#endif
+}
+
+bool SharedBlockCache::get(
+    const std::string& object_key,
+    size_t block_index,
+    BlockCache::Block& block,
+    BlockCache::Checksums& checksums)
+{
+  const Digest d = digest(object_key, block_index);
+  Shard& s = shard(d);
+  if (!lock(s))
+  {
+    ++m_num_misses;
+    return false;
+  }
+  Slot* slot = nullptr;
+  Slot* shard_slots = slots(s);
+  for (size_t i = 0; i < m_header->slots_per_shard; ++i)
+  {
+    Slot& candidate = shard_slots[i];
+    if (candidate.state == ready && candidate.key.a == d.a && candidate.key.b == d.b
+        && candidate.size <= m_header->block_size)
+    {
+      slot = &candidate;
+      break;
+    }
+  }
+  if (!slot)
+  {
+    unlock(s);
+    ++m_num_misses;
+    return false;
+  }
+  ++slot->readers;
+  slot->claimed_time = now_milliseconds();
+  slot->last_used = ++s.clock;
+  const uint64_t generation = slot->generation;
+  const size_t size = static_cast<size_t>(slot->size);
+  const uint64_t* slot_checksums = this->checksums(*slot);
+  auto copied_checksums = std::make_shared<std::vector<uint64_t>>(
+      slot_checksums, slot_checksums + num_segments(size));
+  unlock(s);
+
+  // Copied without the lock, so that other readers of the shard don't wait for it.
+  std::shared_ptr<Buffer> buffer = g_buffer_pool.allocate(m_header->block_size);
+  buffer->resize(size);
+  std::memcpy(buffer->data(), data(*slot), size);
+
+  bool current = false;
+  if (lock(s))
+  {
+    current = slot->generation == generation;
+    if (current && slot->readers > 0)
+      --slot->readers;
+    unlock(s);
+  }
+  if (!current)
+  {
+    ++m_num_misses;
+    return false;
+  }
+  if (!BlockCache::verify(*buffer, copied_checksums, 0, size))
+  {
+    ++m_num_corrupt;
+    ++m_num_misses;
+    return false;
+  }
+  ++m_num_hits;
+  block = std::move(buffer);
+  checksums = std::move(copied_checksums);
+  return true;
+}
+
+void SharedBlockCache::put(
+    const std::string& object_key,
+    size_t block_index,
+    const BlockCache::Block& block,
+    const BlockCache::Checksums& checksums)
+{
+  if (block->size() > m_header->block_size)
+    return;
+  BlockCache::Checksums block_checksums = checksums;
+  if (!block_checksums || block_checksums->size() != num_segments(block->size()))
+    block_checksums = BlockCache::compute_checksums(*block);
+
+  const Digest d = digest(object_key, block_index);
+  Shard& s = shard(d);
+  if (!lock(s))
+    return;
+  Slot* shard_slots = slots(s);
+  for (size_t i = 0; i < m_header->slots_per_shard; ++i)
+  {
+    // Already there, or another process is putting it.
+    if (shard_slots[i].state != empty && shard_slots[i].key.a == d.a
+        && shard_slots[i].key.b == d.b)
+    {
+      unlock(s);
+      return;
+    }
+  }
+  Slot* slot = find_victim(s);
+  if (!slot)
+  {
+    unlock(s);
+    return;
+  }
+  slot->key = d;
+  slot->state = writing;
+  slot->readers = 0;
+  const uint64_t generation = ++slot->generation;
+  slot->claimed_time = now_milliseconds();
+  slot->size = block->size();
+  std::memcpy(
+      this->checksums(*slot), block_checksums->data(), block_checksums->size() * sizeof(uint64_t));
+  unlock(s);
+
+  std::memcpy(data(*slot), block->data(), block->size());
+
+  if (!lock(s))
+    return;
+  if (slot->generation == generation && slot->state == writing)
+  {
+    slot->state = ready;
+    slot->last_used = ++s.clock;
+    ++m_num_puts;
+  }
+  unlock(s);
+}
+
+std::string SharedBlockCache::statistics_text()
+{
+  const uint64_t num_slots = m_header->num_shards * m_header->slots_per_shard;
+  std::ostringstream out;
+  out << "file " << m_filename << "\n";
+  out << "capacity " << num_slots * m_header->block_size << "\n";
+  out << "shards " << m_header->num_shards << "\n";
+  out << "slots " << num_slots << "\n";
+  out << "hits " << m_num_hits.load() << "\n";
+  out << "misses " << m_num_misses.load() << "\n";
+  out << "puts " << m_num_puts.load() << "\n";
+  out << "corrupt " << m_num_corrupt.load() << "\n";
+  out << "stale " << m_num_stale.load() << "\n";
+  out << "recoveries " << m_num_recoveries.load() << "\n";
+  return out.str();
+}
+
+SharedBlockCache::Digest SharedBlockCache::digest(
+    const std::string& object_key, size_t block_index)
+{
+  const uint64_t index = block_index;
+  Digest d;
+  d.a = crc64(crc64(0, object_key.data(), object_key.size()), &index, sizeof(index));
+  // FNV-1a, which has nothing in common with CRC64, so that the two make a 128-bit digest.
+  d.b = 0xcbf29ce484222325ULL;
+  auto mix = [&d](const void* data, size_t size) {
+    const auto* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i)
+      d.b = (d.b ^ p[i]) * 0x100000001b3ULL;
+  };
+  mix(object_key.data(), object_key.size());
+  mix(&index, sizeof(index));
+  return d;
+}
+
+SharedBlockCache::Shard& SharedBlockCache::shard(const Digest& d)
+{
+  auto* shards = reinterpret_cast<Shard*>(m_memory + m_header->shards_offset);
+  return shards[d.b % m_header->num_shards];
+}
+
+SharedBlockCache::Slot* SharedBlockCache::slots(const Shard& shard)
+{
+  auto* shards = reinterpret_cast<const Shard*>(m_memory + m_header->shards_offset);
+  auto* all_slots = reinterpret_cast<Slot*>(m_memory + m_header->slots_offset);
+  return all_slots + (&shard - shards) * m_header->slots_per_shard;
+}
+
+uint64_t* SharedBlockCache::checksums(const Slot& slot)
+{
+  auto* all_slots = reinterpret_cast<const Slot*>(m_memory + m_header->slots_offset);
+  auto* all_checksums = reinterpret_cast<uint64_t*>(m_memory + m_header->checksums_offset);
+  return all_checksums + (&slot - all_slots) * m_header->segments_per_slot;
+}
+
+char* SharedBlockCache::data(const Slot& slot)
+{
+  auto* all_slots = reinterpret_cast<const Slot*>(m_memory + m_header->slots_offset);
+  return m_memory + m_header->data_offset + (&slot - all_slots) * m_header->block_size;
+}
+
+bool SharedBlockCache::lock(Shard& shard)
+{
+#ifdef __linux__
+  int ret = pthread_mutex_lock(&shard.mutex);
+  if (ret == EOWNERDEAD)
+  {
+    // The holder died in the middle of changing the shard, so none of it can be trusted. Readers
+    // still copying out of it see the generations change and give up.
+    Slot* shard_slots = slots(shard);
+    for (size_t i = 0; i < m_header->slots_per_shard; ++i)
+    {
+      shard_slots[i].state = empty;
+      shard_slots[i].readers = 0;
+      ++shard_slots[i].generation;
+    }
+    pthread_mutex_consistent(&shard.mutex);
+    ++m_num_recoveries;
+    ret = 0;
+  }
+  return ret == 0;
+#else
+  (void)shard;
+  return false;
+#endif
+}
+
+void SharedBlockCache::unlock(Shard& shard)
+{
+#ifdef __linux__
+  pthread_mutex_unlock(&shard.mutex);
+#else
+  (void)shard;
+#endif
+}
+
+SharedBlockCache::Slot* SharedBlockCache::find_victim(Shard& shard)
+{
+  const int64_t now = now_milliseconds();
+  Slot* shard_slots = slots(shard);
+  Slot* victim = nullptr;
+  for (size_t i = 0; i < m_header->slots_per_shard; ++i)
+  {
+    Slot& slot = shard_slots[i];
+    if (slot.state == empty)
+      return &slot;
+    bool busy = slot.state == writing || slot.readers > 0;
+    if (busy && now - slot.claimed_time < k_stale_milliseconds)
+      continue;
+    if (!victim || slot.last_used < victim->last_used)
+      victim = &slot;
+  }
+  if (victim && (victim->state == writing || victim->readers > 0))
+    ++m_num_stale;
+  return victim;
+}
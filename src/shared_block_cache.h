@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "block_cache.h"
+
+// A second tier of BlockCache in a file that every process on the host maps, usually in
+// /dev/shm, so that mounts in separate processes keep one copy of hot data and download it once.
+// Blocks are found by a 128-bit digest of their object key and index, in shards of a few dozen
+// slots, each with a process-shared robust mutex and its own LRU.
+//
+// Nothing a process does to the file can wedge the others if it dies halfway: a shard whose lock
+// holder died is emptied by the next process that locks it, and slots left claimed by a dead
+// writer or reader are taken back once they've been idle for a while. Blocks are copied in and
+// out with their CRC64s and checked on every read, so a torn or reused slot reads as a miss.
+//
+// Every process that can open the file can read everything cached in it.
+class SharedBlockCache : public BlockCache::Tier {
+public:
+  // Opens |filename|, or creates it with room for |capacity| bytes of blocks. A file that's
+  // already in use keeps its capacity, and one that isn't laid out right is only laid out again
+  // while no other process has it open. Returns nullptr with |error| set if the cache can't be
+  // used, like when the file was made with a different block size.
+  static std::shared_ptr<SharedBlockCache> open(
+      const std::string& filename, size_t block_size, size_t capacity, std::string& error);
+  ~SharedBlockCache() override;
+
+  SharedBlockCache(const SharedBlockCache&) = delete;
+  SharedBlockCache& operator=(const SharedBlockCache&) = delete;
+
+  // Copies a block out of the cache. Returns false if it isn't there or doesn't match its
+  // checksums.
+  bool get(
+      const std::string& object_key,
+      size_t block_index,
+      BlockCache::Block& block,
+      BlockCache::Checksums& checksums) override;
+  // |checksums| are computed if null. Nothing is put if every slot the block could go to is busy.
+  void put(
+      const std::string& object_key,
+      size_t block_index,
+      const BlockCache::Block& block,
+      const BlockCache::Checksums& checksums) override;
+  std::string statistics_text();
+
+private:
+  struct Header;
+  struct Shard;
+  struct Slot;
+  struct Digest
+  {
+    uint64_t a = 0;
+    uint64_t b = 0;
+  };
+
+  SharedBlockCache(std::string filename, int fd, char* memory, size_t size);
+
+  static Digest digest(const std::string& object_key, size_t block_index);
+  Shard& shard(const Digest& d);
+  Slot* slots(const Shard& shard);
+  uint64_t* checksums(const Slot& slot);
+  char* data(const Slot& slot);
+  // Returns false if the shard can't be locked. Empties the shard if its last holder died.
+  bool lock(Shard& shard);
+  void unlock(Shard& shard);
+  // Empty slot, or least recently used one nobody is reading. Must be called with the shard
+  // locked.
+  Slot* find_victim(Shard& shard);
+
+  const std::string m_filename;
+  // Open for as long as the file is mapped, to hold the shared lock on it.
+  const int m_fd;
+  char* const m_memory;
+  const size_t m_size;
+  Header* const m_header;
+
+  std::atomic<uint64_t> m_num_hits{0};
+  std::atomic<uint64_t> m_num_misses{0};
+  std::atomic<uint64_t> m_num_puts{0};
+  // Blocks that didn't match their checksums.
+  std::atomic<uint64_t> m_num_corrupt{0};
+  // Slots taken back from readers or writers that never finished.
+  std::atomic<uint64_t> m_num_stale{0};
+  // Shards emptied because the process holding their lock died.
+  std::atomic<uint64_t> m_num_recoveries{0};
+};
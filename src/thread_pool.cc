@@ -0,0 +1,50 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(size_t num_threads)
+{
+  for (size_t i = 0; i < num_threads; ++i)
+    m_threads.emplace_back([this]() { run(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_stopping = true;
+    m_tasks.clear();
+  }
+  m_cv.notify_all();
+  for (auto& t : m_threads)
+    t.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_tasks.emplace_back(std::move(task));
+  }
+  m_cv.notify_one();
+}
+
+size_t ThreadPool::queue_size() const
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  return m_tasks.size();
+}
+
+void ThreadPool::run()
+{
+  std::unique_lock<std::mutex> guard(m_mutex);
+  while (true)
+  {
+    m_cv.wait(guard, [this]() { return m_stopping || !m_tasks.empty(); });
+    if (m_stopping)
+      break;
+    std::function<void()> task = std::move(m_tasks.front());
+    m_tasks.pop_front();
+    guard.unlock();
+    task();
+    guard.lock();
+  }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads running tasks in the order they were submitted. Tasks must not throw.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t num_threads);
+  // Waits for running tasks. Tasks that haven't started yet are dropped.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void submit(std::function<void()> task);
+  // Number of tasks submitted but not started yet.
+  size_t queue_size() const;
+
+private:
+  void run();
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<std::function<void()>> m_tasks;
+  bool m_stopping = false;
+  std::vector<std::thread> m_threads;
+};
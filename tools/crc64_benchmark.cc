@@ -0,0 +1,58 @@
+// Measures the throughput of every CRC64 kernel this CPU supports, after checking it against the
+// test vectors. Usage: crc64_benchmark [buffer size in bytes] [total bytes per kernel]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "crc64.h"
+
+int main(int argc, char** argv)
+{
+  size_t buffer_size = 4 * 1024 * 1024;
+  uint64_t total_bytes = 4ULL * 1024 * 1024 * 1024;
+  if (argc >= 2)
+    buffer_size = std::strtoull(argv[1], nullptr, 10);
+  if (argc >= 3)
+    total_bytes = std::strtoull(argv[2], nullptr, 10);
+  if (buffer_size == 0)
+  {
+    std::cout << "Usage: " << argv[0] << " [buffer size] [total bytes]" << std::endl;
+    return 1;
+  }
+
+  std::vector<uint8_t> buffer(buffer_size);
+  for (size_t i = 0; i < buffer.size(); ++i)
+    buffer[i] = static_cast<uint8_t>(i * 2654435761U >> 13);
+  const uint64_t iterations = std::max<uint64_t>(1, total_bytes / buffer_size);
+
+  std::cout << "selected " << crc64_kernel_name(crc64_kernel()) << std::endl;
+  int ret = 0;
+  for (Crc64Kernel kernel : {Crc64Kernel::scalar, Crc64Kernel::pclmulqdq, Crc64Kernel::vpclmulqdq})
+  {
+    if (!crc64_kernel_supported(kernel))
+    {
+      std::cout << crc64_kernel_name(kernel) << " unsupported" << std::endl;
+      continue;
+    }
+    if (!crc64_self_test(kernel))
+    {
+      std::cout << crc64_kernel_name(kernel) << " FAILED self test" << std::endl;
+      ret = 1;
+      continue;
+    }
+    uint64_t crc = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; ++i)
+      crc = crc64(kernel, crc, buffer.data(), buffer.size());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double gib_per_second
+        = static_cast<double>(iterations * buffer_size) / elapsed.count() / (1024.0 * 1024 * 1024);
+    std::cout << crc64_kernel_name(kernel) << " " << gib_per_second << " GiB/s (crc " << std::hex
+              << crc << std::dec << ")" << std::endl;
+  }
+  return ret;
+}
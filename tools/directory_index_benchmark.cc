@@ -0,0 +1,151 @@
+// Compares DirectoryIndex with the std::vector<DirectoryEntry> listings are returned in: heap
+// bytes per entry, building, scanning every entry and looking up names.
+// Usage: directory_index_benchmark [number of entries]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "directory_index.h"
+
+namespace {
+// Every allocation is prefixed with its size, so that the heap in use can be counted exactly.
+size_t g_heap_bytes = 0;
+constexpr size_t k_header_size = alignof(std::max_align_t);
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Names and ETags as the services return them, like part-00042-1b4c...-c000.snappy.parquet and
+// 0x8DB6E5A4F3C2B1A.
+std::vector<DirectoryEntry> make_entries(size_t n)
+{
+  std::mt19937_64 rng(42);
+  std::vector<DirectoryEntry> entries(n);
+  char buffer[64];
+  for (size_t i = 0; i < n; ++i)
+  {
+    std::snprintf(
+        buffer,
+        sizeof(buffer),
+        "part-%05zu-%016llx-c000.snappy.parquet",
+        i,
+        static_cast<unsigned long long>(rng()));
+    entries[i].name = buffer;
+    std::snprintf(buffer, sizeof(buffer), "0x8DB%013llX", static_cast<unsigned long long>(rng()));
+    entries[i].status.etag = std::string(buffer, 17);
+    entries[i].status.file_size = rng() % (1ULL << 30);
+    entries[i].status.last_modified_time = std::chrono::system_clock::now();
+  }
+  std::shuffle(entries.begin(), entries.end(), rng);
+  return entries;
+}
+} // namespace
+
+void* operator new(size_t size)
+{
+  void* p = std::malloc(size + k_header_size);
+  if (!p)
+    throw std::bad_alloc();
+  *static_cast<size_t*>(p) = size;
+  g_heap_bytes += size;
+  return static_cast<char*>(p) + k_header_size;
+}
+
+void operator delete(void* p) noexcept
+{
+  if (!p)
+    return;
+  char* block = static_cast<char*>(p) - k_header_size;
+  g_heap_bytes -= *reinterpret_cast<size_t*>(block);
+  std::free(block);
+}
+
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+int main(int argc, char** argv)
+{
+  size_t n = 1000000;
+  if (argc >= 2)
+    n = std::strtoull(argv[1], nullptr, 10);
+  if (n == 0)
+  {
+    std::cout << "Usage: " << argv[0] << " [number of entries]" << std::endl;
+    return 1;
+  }
+
+  std::vector<DirectoryEntry> source = make_entries(n);
+  std::vector<std::string> probes;
+  for (size_t i = 0; i < n; i += std::max<size_t>(1, n / 1000))
+    probes.emplace_back(source[i].name);
+
+  size_t heap_before = g_heap_bytes;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<DirectoryEntry> vector;
+  for (const auto& e : source)
+    vector.emplace_back(e);
+  vector.shrink_to_fit();
+  double vector_build = seconds_since(start);
+  size_t vector_bytes = g_heap_bytes - heap_before;
+
+  heap_before = g_heap_bytes;
+  start = std::chrono::steady_clock::now();
+  DirectoryIndex index;
+  index.append(source);
+  index.sort();
+  index.shrink_to_fit();
+  double index_build = seconds_since(start);
+  size_t index_bytes = g_heap_bytes - heap_before;
+
+  uint64_t checksum = 0;
+  start = std::chrono::steady_clock::now();
+  for (const auto& e : vector)
+    checksum += e.status.file_size + e.name.size();
+  double vector_scan = seconds_since(start);
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < index.size(); ++i)
+    checksum -= index.file_size(i) + index.name(i).size();
+  double index_scan = seconds_since(start);
+
+  // The vector has no way to look a name up but to scan for it.
+  start = std::chrono::steady_clock::now();
+  for (const auto& name : probes)
+  {
+    for (const auto& e : vector)
+    {
+      if (e.name == name)
+      {
+        checksum += e.status.file_size;
+        break;
+      }
+    }
+  }
+  double vector_lookup = seconds_since(start) / static_cast<double>(probes.size());
+  start = std::chrono::steady_clock::now();
+  for (const auto& name : probes)
+    checksum -= index.file_size(index.find(name));
+  double index_lookup = seconds_since(start) / static_cast<double>(probes.size());
+
+  if (checksum != 0)
+  {
+    std::cout << "MISMATCH between vector and index" << std::endl;
+    return 1;
+  }
+  std::cout << n << " entries" << std::endl;
+  std::cout << "vector: " << static_cast<double>(vector_bytes) / static_cast<double>(n)
+            << " bytes/entry, build " << vector_build * 1e3 << " ms, scan " << vector_scan * 1e3
+            << " ms, lookup " << vector_lookup * 1e6 << " us" << std::endl;
+  std::cout << "index:  " << static_cast<double>(index_bytes) / static_cast<double>(n)
+            << " bytes/entry, build " << index_build * 1e3 << " ms, scan " << index_scan * 1e3
+            << " ms, lookup " << index_lookup * 1e6 << " us" << std::endl;
+  return 0;
+}